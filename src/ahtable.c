@@ -8,9 +8,12 @@
  */
 
 #include "ahtable.h"
+#include "arena.h"
 #include "misc.h"
 #include "murmurhash3.h"
 #include "portable_endian.h"
+#include "strsort.h"
+#include "wyhash.h"
 #include <assert.h>
 #include <string.h>
 
@@ -27,30 +30,312 @@ static size_t keylen(slot_t s) {
 }
 
 
+/* Counters of the work done by lookups, if enabled (see ahtable_counters). The
+ * increments are relaxed, as the counters order nothing. */
+#ifdef HATTRIE_COUNTERS
+static ahtable_counters_t counters;
+#ifdef HAVE_ATOMIC_BUILTINS
+#define count(field, x) __atomic_fetch_add(&counters.field, (x), __ATOMIC_RELAXED)
+#else
+#define count(field, x) __sync_fetch_and_add(&counters.field, (x))
+#endif
+#else
+#define count(field, x) ((void) 0)
+#endif
+
+
+void ahtable_counters(ahtable_counters_t* c)
+{
+#ifdef HATTRIE_COUNTERS
+    c->lookups = load_acquire(&counters.lookups);
+    c->scanned = load_acquire(&counters.scanned);
+    c->resizes = load_acquire(&counters.resizes);
+#else
+    memset(c, 0, sizeof(ahtable_counters_t));
+#endif
+}
+
+
+void ahtable_counters_reset(void)
+{
+#ifdef HATTRIE_COUNTERS
+    store_release(&counters.lookups, 0);
+    store_release(&counters.scanned, 0);
+    store_release(&counters.resizes, 0);
+#endif
+}
+
+
+/* Hash a key with the given function and seed. */
+static inline uint32_t hash_key(hattrie_hash_t hash, uint64_t seed,
+                                const char* key, size_t len)
+{
+    if (hash == HATTRIE_HASH_MURMUR3) return hash_murmur3(key, len, seed);
+    return hash_wy(key, len, seed);
+}
+
+
+static inline uint32_t table_hash(const ahtable_t* table, const char* key, size_t len)
+{
+    return hash_key(table->hash, table->seed, key, len);
+}
+
+
+/* Slot of a hash in a table of n slots, n being a power of two. */
+static inline size_t hash_slot(uint32_t h, size_t n)
+{
+    return h & (n - 1);
+}
+
+
+/* Smallest power of two that is at least n. */
+static size_t pow2_slots(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p *= 2;
+    return p;
+}
+
+
+/* Alongside every slot, a word holds one byte tag for each of the first
+ * slot_tag_count entries of the slot, in order. Tags are the hash bits above
+ * those picking the slot (for tables of up to 2^24 slots), with zero marking
+ * no entry. Comparing a key's tag to all the tags of its slot at once rules
+ * out most entries without touching them, and answers most misses without
+ * reading the slot at all. */
+#define slot_tag_count 8
+
+static uint8_t hash_tag(uint32_t h)
+{
+    uint8_t t = (uint8_t) (h >> 24);
+    return t ? t : 1;
+}
+
+
+/* Set the high bit of every byte of tags equal to t. */
+static uint64_t tag_match(uint64_t tags, uint8_t t)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t x = tags ^ (0x0101010101010101ULL * t);
+    return ~(((x & low7) + low7) | x | low7);
+}
+
+
+/* Record the tag of an entry appended to a slot. */
+static void tag_push(uint64_t* tags, uint8_t t)
+{
+    size_t k;
+    for (k = 0; k < slot_tag_count; ++k) {
+        if (((*tags >> (8 * k)) & 0xff) == 0) {
+            *tags |= (uint64_t) t << (8 * k);
+            return;
+        }
+    }
+}
+
+
+/* Compute the tags of the slot data [s, end) of a table. */
+static uint64_t slot_tags_of(const ahtable_t* table, slot_t s, slot_t end)
+{
+    uint64_t tags = 0;
+    size_t k, len;
+    for (k = 0; k < slot_tag_count && s < end; ++k) {
+        len = keylen(s);
+        s += len < 128 ? 1 : 2;
+        tag_push(&tags, hash_tag(table_hash(table, (const char*) s, len)));
+        s += len + table->vsize;
+    }
+    return tags;
+}
+
+
+/* Compute the tags of slot i from its entries. */
+static void slot_retag(ahtable_t* table, size_t i)
+{
+    table->slots[i].tags = slot_tags_of(table, table->slots[i].data,
+                                        table->slots[i].data + table->slots[i].size);
+}
+
+
+/* Read the data of slot i of a table that may be shared, such that [*s, *end)
+ * holds whole entries that stay valid for as long as the caller may see the
+ * slot's memory (see rcu.h). */
+static void slot_snapshot(const ahtable_t* table, size_t i, slot_t* s, slot_t* end)
+{
+    if (!table->shared) {
+        *s   = table->slots[i].data;
+        *end = *s + table->slots[i].size;
+        return;
+    }
+
+    uint32_t seq;
+    size_t size;
+    do {
+        seq  = load_acquire(&table->seq);
+        size = load_acquire(&table->slots[i].size);
+        *s   = load_acquire(&table->slots[i].data);
+        fence_acquire();
+    } while ((seq & 1) || seq != load_acquire(&table->seq));
+    *end = *s + size;
+}
+
+
 ahtable_t* ahtable_create()
 {
     return ahtable_create_n(ahtable_initial_size);
 }
 
 
+static void* table_alloc(const ahtable_t* table, size_t n)
+{
+    return table->alloc->alloc(table->alloc->ctx, n);
+}
+
+
+static void* table_realloc(const ahtable_t* table, void* p, size_t old_n, size_t new_n)
+{
+    return table->alloc->realloc(table->alloc->ctx, p, old_n, new_n);
+}
+
+
+static void table_free(const ahtable_t* table, void* p, size_t n)
+{
+    table->alloc->free(table->alloc->ctx, p, n);
+}
+
+
+/* Allocate n empty slots. */
+static ahslot_t* slots_create(const ahtable_t* table, size_t n)
+{
+    ahslot_t* slots = table_alloc(table, n * sizeof(ahslot_t));
+    memset(slots, 0, n * sizeof(ahslot_t));
+    return slots;
+}
+
+
 ahtable_t* ahtable_create_n(size_t n)
 {
-    ahtable_t* table = malloc_or_die(sizeof(ahtable_t));
+    return ahtable_create_with_allocator(n, NULL);
+}
+
+
+/* Create a table with exactly n slots, which ahtable_load needs to be any
+ * number until the table is rehashed. */
+static ahtable_t* table_create(size_t n, const hattrie_allocator_t* alloc)
+{
+    if (alloc == NULL) alloc = &hattrie_default_allocator;
+
+    ahtable_t* table = alloc->alloc(alloc->ctx, sizeof(ahtable_t));
     table->flag = 0;
     table->c0 = table->c1 = '\0';
+    table->gen = 0;
+    table->shared = false;
+    table->seq = 0;
+    table->hash = HATTRIE_HASH_WYHASH;
+    table->seed = 0;
+    table->vsize = sizeof(value_t);
+    table->sorted = NULL;
+    table->alloc = alloc;
 
     table->n = n;
     table->m = 0;
-    table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
-    table->slots = malloc_or_die(n * sizeof(slot_t));
-    memset(table->slots, 0, n * sizeof(slot_t));
+    table->max_load = ahtable_max_load_factor;
+    table->max_m = (size_t) (table->max_load * (double) table->n);
+    table->slots = slots_create(table, n);
 
-    table->slot_sizes = malloc_or_die(n * sizeof(size_t));
-    memset(table->slot_sizes, 0, n * sizeof(size_t));
+    table->slot_caps = table_alloc(table, n * sizeof(size_t));
+    memset(table->slot_caps, 0, n * sizeof(size_t));
 
     return table;
 }
 
+
+ahtable_t* ahtable_create_with_allocator(size_t n, const hattrie_allocator_t* alloc)
+{
+    return table_create(pow2_slots(n), alloc);
+}
+
+
+void ahtable_set_max_load(ahtable_t* table, double max_load)
+{
+    table->max_load = max_load;
+    table->max_m = (size_t) (table->max_load * (double) table->n);
+}
+
+
+int ahtable_set_value_size(ahtable_t* table, size_t vsize)
+{
+    if (table->m > 0 || vsize > sizeof(value_t)) return -1;
+    table->vsize = (uint8_t) vsize;
+    return 0;
+}
+
+
+value_t ahtable_value_load(const ahtable_t* table, const value_t* val)
+{
+    return value_load(val, table->vsize);
+}
+
+
+void ahtable_value_store(const ahtable_t* table, value_t* val, value_t x)
+{
+    value_store(val, table->vsize, x);
+}
+
+
+/* insert a key into slot s, which must have room for it */
+static slot_t ins_key(slot_t s, const char* key, size_t len, size_t vsize, value_t** val);
+
+ahtable_t* ahtable_create_from(size_t n, const char** keys, const size_t* lens,
+                               const value_t* vals, size_t m,
+                               const hattrie_allocator_t* alloc,
+                               hattrie_hash_t hash, uint64_t seed, size_t vsize)
+{
+    ahtable_t* table = ahtable_create_with_allocator(n, alloc);
+    table->hash = hash;
+    table->seed = seed;
+    table->vsize = (uint8_t) vsize;
+    n = table->n;
+
+    /* size every slot, remembering the hash of each key */
+    uint32_t* hs = malloc_or_die(m * sizeof(uint32_t));
+    size_t i, j;
+    for (j = 0; j < m; ++j) {
+        if (lens[j] > 32767) {
+            fprintf(stderr, "HAT-trie/AH-table cannot store keys longer than 32768\n");
+            exit(EXIT_FAILURE);
+        }
+
+        hs[j] = table_hash(table, keys[j], lens[j]);
+        table->slots[hash_slot(hs[j], n)].size +=
+            lens[j] + vsize + (lens[j] >= 128 ? 2 : 1);
+    }
+
+    slot_t* slots_next = malloc_or_die(n * sizeof(slot_t));
+    for (j = 0; j < n; ++j) {
+        if (table->slots[j].size > 0) {
+            table->slots[j].data = table_alloc(table, table->slots[j].size);
+            table->slot_caps[j] = table->slots[j].size;
+        }
+        slots_next[j] = table->slots[j].data;
+    }
+
+    value_t* u;
+    for (j = 0; j < m; ++j) {
+        i = hash_slot(hs[j], n);
+        slots_next[i] = ins_key(slots_next[i], keys[j], lens[j], vsize, &u);
+        tag_push(&table->slots[i].tags, hash_tag(hs[j]));
+        if (vals) value_store(u, vsize, vals[j]);
+    }
+
+    free(slots_next);
+    free(hs);
+
+    table->m = m;
+    return table;
+}
+
+
 void ahtable_save(const ahtable_t* table, FILE* fd)
 {
     if (table == NULL) return;
@@ -75,10 +360,10 @@ void ahtable_save(const ahtable_t* table, FILE* fd)
     size_t i;
     uint32_t slot_size;
     for (i = 0; i < table->n; ++i) {
-        slot_size = htobe32(table->slot_sizes[i]);
+        slot_size = htobe32(table->slots[i].size);
         fwrite(&slot_size, sizeof(uint32_t), 1, fd);
-        if(table->slot_sizes[i] > 0) {
-            fwrite(table->slots[i], sizeof(unsigned char), table->slot_sizes[i], fd);
+        if(table->slots[i].size > 0) {
+            fwrite(table->slots[i].data, sizeof(unsigned char), table->slots[i].size, fd);
         }
     }
 }
@@ -105,11 +390,12 @@ ahtable_t* ahtable_load(FILE* fd)
 {
     size_t n;
     if (!read_u64bit_to_size_t(&n, fd)) return NULL;
-    ahtable_t* table = ahtable_create_n(n);
+    ahtable_t* table = table_create(n, NULL);
 
     if (!read_u64bit_to_size_t(&table->m, fd)) return NULL;
 
     if (!read_u64bit_to_size_t(&table->max_m, fd)) return NULL;
+    if (table->n > 0) table->max_load = (double) table->max_m / (double) table->n;
 
     fread(&table->flag, sizeof(uint8_t), 1, fd);
 
@@ -120,24 +406,256 @@ ahtable_t* ahtable_load(FILE* fd)
     uint32_t slot_size;
     for (i = 0; i < table->n; ++i) {
         fread(&slot_size, sizeof(uint32_t), 1, fd);
-        table->slot_sizes[i] = be32toh(slot_size);
-        if(table->slot_sizes[i] > 0) {
-            table->slots[i] = malloc_or_die(table->slot_sizes[i]);
-            fread(table->slots[i], sizeof(unsigned char), table->slot_sizes[i], fd);
+        table->slots[i].size = be32toh(slot_size);
+        if(table->slots[i].size > 0) {
+            table->slots[i].data = table_alloc(table, table->slots[i].size);
+            table->slot_caps[i] = table->slots[i].size;
+            fread(table->slots[i].data, sizeof(unsigned char), table->slots[i].size, fd);
         }
     }
 
+    /* place and tag every key by the default hash */
+    ahtable_resize(table, table->n);
+
     return table;
 }
 
+/* fixed part of an image, before the slot offsets */
+static const size_t ahtable_image_header = 32;
+
+static size_t image_offs_size(size_t n)
+{
+    return ((n + 1) * sizeof(uint32_t) + 7) & ~(size_t) 7;
+}
+
+
+/* Bytes of every value of an image. */
+static size_t image_vsize(const unsigned char* image)
+{
+    return 8 - (size_t) image[4];
+}
+
+
+/* Bytes of slot data of a table. */
+static size_t image_datalen(const ahtable_t* table)
+{
+    size_t i, datalen = 0;
+    for (i = 0; i < table->n; ++i) datalen += table->slots[i].size;
+    return datalen;
+}
+
+
+/* Fill in the fixed part of the image of a table with n slots. */
+static void image_head(const ahtable_t* table, size_t n, unsigned char* head)
+{
+    memset(head, 0, ahtable_image_header);
+    head[0] = table->flag;
+    head[1] = table->c0;
+    head[2] = table->c1;
+    head[3] = (unsigned char) table->hash;
+    head[4] = (unsigned char) (8 - table->vsize);
+    store_le64(head + 8, n);
+    store_le64(head + 16, table->m);
+    store_le64(head + 24, table->seed);
+}
+
+
+size_t ahtable_image_write(const ahtable_t* table, FILE* fd)
+{
+    static const unsigned char zeros[8] = {0};
+
+    size_t i, datalen = image_datalen(table);
+    if (datalen > UINT32_MAX) return 0;
+
+    size_t headlen = ahtable_image_header + image_offs_size(table->n);
+    unsigned char* head = malloc_or_die(headlen);
+    memset(head, 0, headlen);
+    image_head(table, table->n, head);
+
+    unsigned char* offs = head + ahtable_image_header;
+    uint32_t off = 0;
+    for (i = 0; i < table->n; ++i) {
+        store_le32(offs + i * sizeof(uint32_t), off);
+        off += (uint32_t) table->slots[i].size;
+    }
+    store_le32(offs + table->n * sizeof(uint32_t), off);
+
+    bool ok = fwrite(head, 1, headlen, fd) == headlen;
+    free(head);
+
+    for (i = 0; ok && i < table->n; ++i) {
+        if (table->slots[i].size > 0) {
+            ok = fwrite(table->slots[i].data, 1, table->slots[i].size, fd) ==
+                    table->slots[i].size;
+        }
+    }
+
+    size_t padlen = (8 - datalen % 8) % 8;
+    if (ok && padlen > 0) ok = fwrite(zeros, 1, padlen, fd) == padlen;
+
+    return ok ? headlen + datalen + padlen : 0;
+}
+
+
+size_t ahtable_image_pack_size(const ahtable_t* table, size_t n)
+{
+    size_t datalen = image_datalen(table);
+    if (datalen > UINT32_MAX) return 0;
+    return ahtable_image_header + image_offs_size(pow2_slots(n)) + ((datalen + 7) & ~(size_t) 7);
+}
+
+
+void ahtable_image_pack(const ahtable_t* table, size_t n, unsigned char* out)
+{
+    n = pow2_slots(n);
+    memset(out, 0, ahtable_image_pack_size(table, n));
+    image_head(table, n, out);
+
+    unsigned char* offs = out + ahtable_image_header;
+    slot_t data = (slot_t) offs + image_offs_size(n);
+
+    /* size every slot, remembering the slot of each entry */
+    size_t*   next = malloc_or_die(n * sizeof(size_t));
+    uint32_t* hs   = malloc_or_die((table->m > 0 ? table->m : 1) * sizeof(uint32_t));
+    memset(next, 0, n * sizeof(size_t));
+
+    size_t i, j = 0, k, entry, off;
+    slot_t s, end;
+    for (i = 0; i < table->n; ++i) {
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            k = keylen(s);
+            entry = (k < 128 ? 1 : 2) + k + table->vsize;
+            hs[j] = (uint32_t) hash_slot(
+                        table_hash(table, (const char*) s + (k < 128 ? 1 : 2), k), n);
+            next[hs[j++]] += entry;
+            s += entry;
+        }
+    }
+
+    for (i = 0, off = 0; i < n; ++i) {
+        store_le32(offs + i * sizeof(uint32_t), (uint32_t) off);
+        k = next[i];
+        next[i] = off;
+        off += k;
+    }
+    store_le32(offs + n * sizeof(uint32_t), (uint32_t) off);
+
+    /* copy every entry into its slot */
+    for (i = 0, j = 0; i < table->n; ++i) {
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            k = keylen(s);
+            entry = (k < 128 ? 1 : 2) + k + table->vsize;
+            memcpy(data + next[hs[j]], s, entry);
+            next[hs[j++]] += entry;
+            s += entry;
+        }
+    }
+
+    free(hs);
+    free(next);
+}
+
+
+size_t ahtable_image_size(const unsigned char* image)
+{
+    size_t n = (size_t) load_le64(image + 8);
+    const unsigned char* offs = image + ahtable_image_header;
+    size_t datalen = load_le32(offs + n * sizeof(uint32_t));
+    return ahtable_image_header + image_offs_size(n) + ((datalen + 7) & ~(size_t) 7);
+}
+
+
+size_t ahtable_image_count(const unsigned char* image)
+{
+    return (size_t) load_le64(image + 16);
+}
+
+
+ahtable_t* ahtable_image_load(const unsigned char* image, size_t len)
+{
+    if (len < ahtable_image_header) return NULL;
+
+    uint64_t n = load_le64(image + 8);
+    uint64_t m = load_le64(image + 16);
+    if (n == 0 || n >= (len - ahtable_image_header) / sizeof(uint32_t)) return NULL;
+    if ((n & (n - 1)) != 0 || image[3] > HATTRIE_HASH_MURMUR3) return NULL;
+    if (image[4] > 8 || image_vsize(image) > sizeof(value_t)) return NULL;
+
+    size_t headlen = ahtable_image_header + image_offs_size(n);
+    if (headlen > len) return NULL;
+
+    const unsigned char* offs = image + ahtable_image_header;
+    slot_t data = (slot_t) image + headlen;
+    size_t datalen = len - headlen;
+
+    ahtable_t* table = ahtable_create_n(n);
+    table->flag = image[0];
+    table->c0   = image[1];
+    table->c1   = image[2];
+    table->hash = (hattrie_hash_t) image[3];
+    table->seed = load_le64(image + 24);
+    table->vsize = (uint8_t) image_vsize(image);
+
+    /* copy slots, checking that every entry lies within its slot */
+    size_t i, a, b = 0, k, count = 0;
+    slot_t s, end;
+    for (i = 0; i < n; ++i) {
+        a = load_le32(offs + i * sizeof(uint32_t));
+        if (a != b) goto fail;
+        b = load_le32(offs + (i + 1) * sizeof(uint32_t));
+        if (b < a || b > datalen) goto fail;
+
+        s   = data + a;
+        end = data + b;
+        while (s < end) {
+            if ((0x1 & *s) && end - s < 2) goto fail;
+            k = keylen(s);
+            s += k < 128 ? 1 : 2;
+            if ((size_t) (end - s) < k + table->vsize) goto fail;
+            s += k + table->vsize;
+            ++count;
+        }
+
+        if (b > a) {
+            table->slots[i].data = table_alloc(table, b - a);
+            memcpy(table->slots[i].data, data + a, b - a);
+            table->slots[i].size = table->slot_caps[i] = b - a;
+            slot_retag(table, i);
+        }
+    }
+
+    if (count != m) goto fail;
+    table->m = m;
+
+    return table;
+
+fail:
+    ahtable_free(table);
+    return NULL;
+}
+
+
+/* Drop the sorted order, before the table's keys change. */
+static void drop_sorted(ahtable_t* table)
+{
+    free(table->sorted);
+    table->sorted = NULL;
+}
+
+
 void ahtable_free(ahtable_t* table)
 {
     if (table == NULL) return;
+    drop_sorted(table);
     size_t i;
-    for (i = 0; i < table->n; ++i) free(table->slots[i]);
-    free(table->slots);
-    free(table->slot_sizes);
-    free(table);
+    for (i = 0; i < table->n; ++i) table_free(table, table->slots[i].data, table->slot_caps[i]);
+    table_free(table, table->slots, table->n * sizeof(ahslot_t));
+    table_free(table, table->slot_caps, table->n * sizeof(size_t));
+    table_free(table, table, sizeof(ahtable_t));
 }
 
 
@@ -149,44 +667,93 @@ size_t ahtable_size(const ahtable_t* table)
 
 size_t ahtable_sizeof(const ahtable_t* table)
 {
-    size_t nbytes = sizeof(ahtable_t) +
-                    table->n * (sizeof(size_t) + sizeof(slot_t));
+    size_t nbytes = sizeof(ahtable_t) + table->n * (sizeof(ahslot_t) + sizeof(size_t));
     size_t i;
     for (i = 0; i < table->n; ++i) {
-        nbytes += table->slot_sizes[i];
+        nbytes += table->slot_caps[i];
     }
+    if (table->sorted) nbytes += table->m * sizeof(slot_t);
     return nbytes;
 }
 
 
+size_t ahtable_slot_count(const ahtable_t* table, size_t i)
+{
+    size_t k = 0, n;
+    slot_t s   = table->slots[i].data;
+    slot_t end = s + table->slots[i].size;
+    while (s < end) {
+        n = keylen(s);
+        s += (n < 128 ? 1 : 2) + n + table->vsize;
+        ++k;
+    }
+    return k;
+}
+
+
+void ahtable_shrink(ahtable_t* table)
+{
+    /* readers rely on capacities never shrinking */
+    if (table->shared) return;
+
+    /* slots may move, and the order can be rebuilt when needed */
+    drop_sorted(table);
+
+    size_t i;
+    for (i = 0; i < table->n; ++i) {
+        if (table->slot_caps[i] == table->slots[i].size) continue;
+
+        if (table->slots[i].size == 0) {
+            table_free(table, table->slots[i].data, table->slot_caps[i]);
+            table->slots[i].data = NULL;
+        }
+        else {
+            table->slots[i].data = table_realloc(table, table->slots[i].data,
+                                                 table->slot_caps[i], table->slots[i].size);
+        }
+        table->slot_caps[i] = table->slots[i].size;
+    }
+}
+
+
 void ahtable_clear(ahtable_t* table)
 {
+    drop_sorted(table);
     size_t i;
-    for (i = 0; i < table->n; ++i) free(table->slots[i]);
-    table->n = ahtable_initial_size;
-    table->slots = realloc_or_die(table->slots, table->n * sizeof(slot_t));
-    memset(table->slots, 0, table->n * sizeof(slot_t));
+    for (i = 0; i < table->n; ++i) table_free(table, table->slots[i].data, table->slot_caps[i]);
+    table_free(table, table->slots, table->n * sizeof(ahslot_t));
+    table->slot_caps = table_realloc(table, table->slot_caps, table->n * sizeof(size_t),
+                                     ahtable_initial_size * sizeof(size_t));
 
-    table->slot_sizes = realloc_or_die(table->slot_sizes, table->n * sizeof(size_t));
-    memset(table->slot_sizes, 0, table->n * sizeof(size_t));
+    table->n = ahtable_initial_size;
+    table->m = 0;
+    table->max_m = (size_t) (table->max_load * (double) table->n);
+    table->slots = slots_create(table, table->n);
+    memset(table->slot_caps, 0, table->n * sizeof(size_t));
 }
 
 /** Inserts a key with value into slot s, and returns a pointer to the
   * space immediately after.
   */
-static slot_t ins_key(slot_t s, const char* key, size_t len, value_t** val)
+static slot_t ins_keylen(slot_t s, size_t len)
 {
-    // key length
     if (len < 128) {
         s[0] = (unsigned char) (len << 1);
-        s += 1;
+        return s + 1;
     }
     else {
         /* The least significant bit is set to indicate that two bytes are
          * being used to store the key length. */
         *((uint16_t*) s) = ((uint16_t) len << 1) | 0x1;
-        s += 2;
+        return s + 2;
     }
+}
+
+
+static slot_t ins_key(slot_t s, const char* key, size_t len, size_t vsize, value_t** val)
+{
+    // key length
+    s = ins_keylen(s, len);
 
     // key
     memcpy(s, key, len * sizeof(unsigned char));
@@ -194,23 +761,27 @@ static slot_t ins_key(slot_t s, const char* key, size_t len, value_t** val)
 
     // value
     *val = (value_t*) s;
-    **val = 0;
-    s += sizeof(value_t);
+    memset(s, 0, vsize);
+    s += vsize;
 
     return s;
 }
 
 
-static void ahtable_expand(ahtable_t* table)
+void ahtable_resize(ahtable_t* table, size_t new_n)
 {
     /* Resizing a table is essentially building a brand new one.
      * One little shortcut we can take on the memory allocation front is to
      * figure out how much memory each slot needs in advance.
      */
-    assert(table->n > 0);
-    size_t new_n = 2 * table->n;
-    size_t* slot_sizes = malloc_or_die(new_n * sizeof(size_t));
-    memset(slot_sizes, 0, new_n * sizeof(size_t));
+    new_n = pow2_slots(new_n);
+    if (new_n != table->n) count(resizes, 1);
+    drop_sorted(table);
+    ahslot_t* slots = slots_create(table, new_n);
+
+    /* both passes visit the keys in the same order, so every key is hashed
+     * once, by the first */
+    uint32_t* hs = malloc_or_die((table->m ? table->m : 1) * sizeof(uint32_t));
 
     const char* key;
     size_t len = 0;
@@ -218,8 +789,9 @@ static void ahtable_expand(ahtable_t* table)
     ahtable_iter_t* i = ahtable_iter_begin(table, false);
     while (!ahtable_iter_finished(i)) {
         key = ahtable_iter_key(i, &len);
-        slot_sizes[hash(key, len) % new_n] +=
-            len + sizeof(value_t) + (len >= 128 ? 2 : 1);
+        hs[m] = table_hash(table, key, len);
+        slots[hash_slot(hs[m], new_n)].size +=
+            len + table->vsize + (len >= 128 ? 2 : 1);
 
         ++m;
         ahtable_iter_next(i);
@@ -228,23 +800,20 @@ static void ahtable_expand(ahtable_t* table)
     ahtable_iter_free(i);
 
 
-    /* allocate slots */
-    slot_t* slots = malloc_or_die(new_n * sizeof(slot_t));
+    /* allocate slots, every one exactly full */
+    size_t* slot_caps  = table_alloc(table, new_n * sizeof(size_t));
+    slot_t* slots_next = malloc_or_die(new_n * sizeof(slot_t));
     size_t j;
     for (j = 0; j < new_n; ++j) {
-        if (slot_sizes[j] > 0) {
-            slots[j] = malloc_or_die(slot_sizes[j]);
-        }
-        else slots[j] = NULL;
+        slots[j].data = slots[j].size > 0 ? table_alloc(table, slots[j].size) : NULL;
+        slot_caps[j]  = slots[j].size;
+        slots_next[j] = slots[j].data;
     }
 
     /* rehash values. A few shortcuts can be taken here as well, as we know
      * there will be no collisions. Instead of the regular insertion routine,
      * we keep track of the ends of every slot and simply insert keys.
      * */
-    slot_t* slots_next = malloc_or_die(new_n * sizeof(slot_t));
-    memcpy(slots_next, slots, new_n * sizeof(slot_t));
-    size_t h;
     m = 0;
     value_t* u;
     value_t* v;
@@ -252,11 +821,12 @@ static void ahtable_expand(ahtable_t* table)
     while (!ahtable_iter_finished(i)) {
 
         key = ahtable_iter_key(i, &len);
-        h = hash(key, len) % new_n;
+        j = hash_slot(hs[m], new_n);
 
-        slots_next[h] = ins_key(slots_next[h], key, len, &u);
+        slots_next[j] = ins_key(slots_next[j], key, len, table->vsize, &u);
+        tag_push(&slots[j].tags, hash_tag(hs[m]));
         v = ahtable_iter_val(i);
-        *u = *v;
+        memcpy(u, v, table->vsize);
 
         ++m;
         ahtable_iter_next(i);
@@ -266,69 +836,389 @@ static void ahtable_expand(ahtable_t* table)
 
 
     free(slots_next);
-    for (j = 0; j < table->n; ++j) free(table->slots[j]);
-
-    free(table->slots);
+    free(hs);
+    for (j = 0; j < table->n; ++j) table_free(table, table->slots[j].data, table->slot_caps[j]);
+    table_free(table, table->slots, table->n * sizeof(ahslot_t));
     table->slots = slots;
-
-    free(table->slot_sizes);
-    table->slot_sizes = slot_sizes;
+    table_free(table, table->slot_caps, table->n * sizeof(size_t));
+    table->slot_caps = slot_caps;
 
     table->n = new_n;
-    table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
+    table->max_m = (size_t) (table->max_load * (double) table->n);
 }
 
 
-static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool insert_missing)
+/* Allocate every slot of a table at exactly the size recorded for it, setting
+ * next[i] to the start of slot i. */
+static void alloc_exact_slots(ahtable_t* table, slot_t* next)
 {
-    /* if we are at capacity, preemptively resize */
-    if (insert_missing && table->m >= table->max_m) {
-        ahtable_expand(table);
+    size_t i;
+    for (i = 0; i < table->n; ++i) {
+        if (table->slots[i].size > 0) {
+            table->slots[i].data = table_alloc(table, table->slots[i].size);
+            table->slot_caps[i] = table->slots[i].size;
+        }
+        next[i] = table->slots[i].data;
     }
+}
+
 
+/* ahtable_split, stripping the given number of bytes from the keys copied into
+ * each table. hi may be lo. */
+static void split_keys(const ahtable_t* table, unsigned char c,
+                       ahtable_t* lo, size_t lo_strip, ahtable_t* hi, size_t hi_strip)
+{
+    assert(lo->m == 0 && hi->m == 0);
+    assert(lo->vsize == table->vsize && hi->vsize == table->vsize);
+
+    /* As in ahtable_resize, the first pass sizes every slot of both tables,
+     * hashing each key once, and the second copies the entries over, in the
+     * same order. */
+    uint32_t* hs = malloc_or_die((table->m ? table->m : 1) * sizeof(uint32_t));
+
+    ahtable_t* dst;
+    size_t i, j, len, strip, m = 0;
+    slot_t s, end;
+    for (i = 0; i < table->n; ++i) {
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            len = keylen(s);
+            s += len < 128 ? 1 : 2;
+            assert(len > 0);
+
+            dst   = (unsigned char) s[0] <= c ? lo : hi;
+            strip = (unsigned char) s[0] <= c ? lo_strip : hi_strip;
+            assert(len >= strip);
+            hs[m] = table_hash(dst, (const char*) s + strip, len - strip);
+            dst->slots[hash_slot(hs[m], dst->n)].size +=
+                len - strip + table->vsize + (len - strip >= 128 ? 2 : 1);
+
+            s += len + table->vsize;
+            ++m;
+        }
+    }
+    assert(m == table->m);
 
-    uint32_t i = hash(key, len) % table->n;
+    slot_t* lo_next = malloc_or_die((lo->n + hi->n) * sizeof(slot_t));
+    slot_t* hi_next = hi == lo ? lo_next : lo_next + lo->n;
+    alloc_exact_slots(lo, lo_next);
+    if (hi != lo) alloc_exact_slots(hi, hi_next);
+
+    /* copy each key, less its stripped bytes, and its value */
+    slot_t* next;
+    for (i = 0, m = 0; i < table->n; ++i) {
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            len = keylen(s);
+            s += len < 128 ? 1 : 2;
+
+            if ((unsigned char) s[0] <= c) {
+                dst   = lo;
+                next  = lo_next;
+                strip = lo_strip;
+            }
+            else {
+                dst   = hi;
+                next  = hi_next;
+                strip = hi_strip;
+            }
+
+            j = hash_slot(hs[m], dst->n);
+            next[j] = ins_keylen(next[j], len - strip);
+            memcpy(next[j], s + strip, len - strip + table->vsize);
+            next[j] += len - strip + table->vsize;
+            tag_push(&dst->slots[j].tags, hash_tag(hs[m]));
+            ++dst->m;
+
+            s += len + table->vsize;
+            ++m;
+        }
+    }
+
+    free(lo_next);
+    free(hs);
+}
+
+
+void ahtable_split(const ahtable_t* table, unsigned char c,
+                   ahtable_t* lo, bool lo_strip, ahtable_t* hi, bool hi_strip)
+{
+    split_keys(table, c, lo, lo_strip ? 1 : 0, hi, hi_strip ? 1 : 0);
+}
+
+
+void ahtable_strip(const ahtable_t* table, size_t k, ahtable_t* dst)
+{
+    split_keys(table, 0xff, dst, k, dst, k);
+}
+
+
+size_t ahtable_common_prefix(const ahtable_t* table, size_t max, const char** prefix)
+{
+    const size_t ahead = 8;
+    const char* first = NULL;
+    size_t i, j, len, n = 0;
+    slot_t s, end;
+    for (i = 0; i < table->n && (first == NULL || n > 0); ++i) {
+        if (i + ahead < table->n) prefetch(table->slots[i + ahead].data);
+
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            len = keylen(s);
+            s += len < 128 ? 1 : 2;
+            if (first == NULL) {
+                first = (const char*) s;
+                n     = len < max ? len : max;
+            }
+            else {
+                if (len < n) n = len;
+                for (j = 0; j < n && s[j] == (unsigned char) first[j]; ++j);
+                n = j;
+            }
+            s += len + table->vsize;
+        }
+    }
+
+    if (prefix) *prefix = first;
+    return n;
+}
+
+
+void ahtable_count_first(const ahtable_t* table, unsigned int* cs)
+{
+    /* slots are separate blocks, so fetch a few ahead */
+    const size_t ahead = 8;
+    size_t i, len;
+    slot_t s, end;
+    for (i = 0; i < table->n; ++i) {
+        if (i + ahead < table->n) prefetch(table->slots[i + ahead].data);
+
+        s   = table->slots[i].data;
+        end = s + table->slots[i].size;
+        while (s < end) {
+            len = keylen(s);
+            s += len < 128 ? 1 : 2;
+            if (len > 0) cs[(unsigned char) s[0]] += 1;
+            s += len + table->vsize;
+        }
+    }
+}
+
+
+size_t ahtable_split_slot(ahtable_t* table, size_t i, unsigned char c,
+                          ahtable_t* lo, bool lo_strip, ahtable_t* hi, bool hi_strip)
+{
+    slot_t s   = table->slots[i].data;
+    slot_t end = s + table->slots[i].size;
+    ahtable_t* dst;
+    size_t len, strip, k = 0;
+    assert(lo->vsize == table->vsize && hi->vsize == table->vsize);
+    while (s < end) {
+        len = keylen(s);
+        s += len < 128 ? 1 : 2;
+
+        dst   = len == 0 || (unsigned char) s[0] <= c ? lo : hi;
+        strip = (dst == lo ? lo_strip : hi_strip) ? 1 : 0;
+        assert(len >= strip);
+        memcpy(ahtable_get(dst, (const char*) s + strip, len - strip), s + len,
+               table->vsize);
+
+        s += len + table->vsize;
+        ++k;
+    }
+
+    drop_sorted(table);
+    table_free(table, table->slots[i].data, table->slot_caps[i]);
+    table->slots[i].data      = NULL;
+    table->slots[i].size = 0;
+    table->slot_caps[i]  = 0;
+    table->slots[i].tags  = 0;
+    table->m -= k;
+    return k;
+}
+
+
+void ahtable_set_hash(ahtable_t* table, hattrie_hash_t hash, uint64_t seed)
+{
+    if (table->hash == hash && table->seed == seed) return;
+    table->hash = hash;
+    table->seed = seed;
+    if (table->m > 0) ahtable_resize(table, table->n);
+}
+
+
+/* Search the slot data [s, end) for a key, returning a pointer to the start of
+ * its entry, or NULL if it is not there. */
+static slot_t find_key(slot_t s, slot_t end, const char* key, size_t len, size_t vsize)
+{
     size_t k;
-    slot_t s;
-    value_t* val;
+    while (s < end) {
+        count(scanned, 1);
 
-    /* search the array for our key */
-    s = table->slots[i];
-    while ((size_t) (s - table->slots[i]) < table->slot_sizes[i]) {
         /* get the key length */
         k = keylen(s);
         s += k < 128 ? 1 : 2;
 
-        /* skip keys that are longer than ours */
-        if (k != len) {
-            s += k + sizeof(value_t);
-            continue;
+        /* key found. */
+        if (k == len && memcmp(s, key, len) == 0) {
+            return s - (k < 128 ? 1 : 2);
         }
 
-        /* key found. */
-        if (memcmp(s, key, len) == 0) {
-            return (value_t*) (s + len);
+        /* skip to the next key */
+        s += k + vsize;
+    }
+
+    return NULL;
+}
+
+
+/* Find a key with the given tag in slot i, returning the start of its entry,
+ * and its position among the entries of the slot in *k, or NULL. */
+static slot_t find_tagged_key(const ahtable_t* table, size_t i, uint8_t tag,
+                              const char* key, size_t len, size_t* k)
+{
+    uint64_t tags  = table->slots[i].tags;
+    uint64_t match = tag_match(tags, tag);
+    count(lookups, 1);
+
+    /* if some tags are unused, they cover every entry */
+    bool full = tag_match(tags, 0) == 0;
+    if (match == 0 && !full) return NULL;
+
+    slot_t s = table->slots[i].data;
+    size_t n;
+    for (*k = 0; *k < slot_tag_count; ++*k) {
+        if (!full && (match >> (8 * *k)) == 0) return NULL;
+
+        count(scanned, 1);
+        n = keylen(s);
+        if ((match >> (8 * *k + 7)) & 0x1 && n == len &&
+            memcmp(s + (n < 128 ? 1 : 2), key, len) == 0) {
+            return s;
         }
-        /* key not found. */
-        else {
-            s += k + sizeof(value_t);
-            continue;
+        s += (n < 128 ? 1 : 2) + n + table->vsize;
+    }
+
+    return find_key(s, table->slots[i].data + table->slots[i].size, key, len, table->vsize);
+}
+
+
+/* find_tagged_key for a reader of a shared table. The writer publishes a
+ * slot's data before its capacity, which never shrinks, so reading a slot
+ * within the capacity read first is always safe. Data past the slot's size is
+ * zeroed, and a lookup overlapping a deletion, which could see tags that do
+ * not match the data, is retried. */
+static slot_t find_shared_key(const ahtable_t* table, size_t i, uint8_t tag,
+                              const char* key, size_t len)
+{
+    uint32_t seq;
+    uint64_t tags, match;
+    bool full;
+    size_t size, cap, off, n, k;
+    slot_t s, r;
+    count(lookups, 1);
+
+    do {
+        seq   = load_acquire(&table->seq);
+        tags  = load_acquire(&table->slots[i].tags);
+        match = tag_match(tags, tag);
+        full  = tag_match(tags, 0) == 0;
+        r     = NULL;
+
+        if (match != 0 || full) {
+            size = full ? load_acquire(&table->slots[i].size) : 0;
+            cap  = load_acquire(&table->slot_caps[i]);
+            s    = load_acquire(&table->slots[i].data);
+
+            for (k = 0, off = 0; off < cap; ++k) {
+                if (k < slot_tag_count) {
+                    if (!full && (match >> (8 * k)) == 0) break;
+                }
+                else if (off >= size) break;
+
+                count(scanned, 1);
+                n = keylen(s + off);
+                if ((k >= slot_tag_count || (match >> (8 * k + 7)) & 0x1) &&
+                    n == len && memcmp(s + off + (n < 128 ? 1 : 2), key, len) == 0) {
+                    r = s + off;
+                    break;
+                }
+                off += (n < 128 ? 1 : 2) + n + table->vsize;
+            }
         }
+
+        fence_acquire();
+    } while ((seq & 1) || seq != load_acquire(&table->seq));
+
+    return r;
+}
+
+
+/* Find the entry of a key with hash h, for a lookup rather than an insertion,
+ * which in a shared table may be running concurrently with the writer. */
+static slot_t lookup_key(const ahtable_t* table, uint32_t h, const char* key, size_t len)
+{
+    size_t k;
+    size_t i = hash_slot(h, table->n);
+    if (table->shared) return find_shared_key(table, i, hash_tag(h), key, len);
+    return find_tagged_key(table, i, hash_tag(h), key, len, &k);
+}
+
+
+/* Find the key with hash h, inserting it if insert_missing is set. Hashes do
+ * not depend on the number of slots, so h survives the table resizing. */
+static value_t* get_key(ahtable_t* table, uint32_t h, const char* key, size_t len,
+                        bool insert_missing)
+{
+    /* if we are at capacity, preemptively resize */
+    if (insert_missing && table->m >= table->max_m) {
+        ahtable_resize(table, 2 * table->n);
     }
 
 
+    size_t   i = hash_slot(h, table->n);
+    uint8_t tag = hash_tag(h);
+    slot_t s;
+    size_t k;
+    value_t* val;
+
+    /* search the array for our key */
+    if (insert_missing) s = find_tagged_key(table, i, tag, key, len, &k);
+    else s = lookup_key(table, h, key, len);
+    if (s) return (value_t*) (s + (len < 128 ? 1 : 2) + len);
+
+
     if (insert_missing) {
         /* the key was not found, so we must insert it. */
-        size_t new_size = table->slot_sizes[i];
+        drop_sorted(table);
+        size_t new_size = table->slots[i].size;
         new_size += 1 + (len >= 128 ? 1 : 0);    // key length
         new_size += len * sizeof(unsigned char); // key
-        new_size += sizeof(value_t);             // value
-
-        table->slots[i] = realloc_or_die(table->slots[i], new_size);
+        new_size += table->vsize;                // value
+
+        /* grow the slot geometrically, so that filling it is linear */
+        if (new_size > table->slot_caps[i]) {
+            size_t new_cap = table->slot_caps[i] + table->slot_caps[i] / 2;
+            if (new_cap < new_size) new_cap = new_size;
+            slot_t t = table_realloc(table, table->slots[i].data,
+                                     table->slot_caps[i], new_cap);
+            if (table->shared) {
+                memset(t + table->slots[i].size, 0, new_cap - table->slots[i].size);
+            }
+            store_release(&table->slots[i].data, t);
+            store_release(&table->slot_caps[i], new_cap);
+        }
 
+        /* publish the entry before the tag and size covering it */
         ++table->m;
-        ins_key(table->slots[i] + table->slot_sizes[i], key, len, &val);
-        table->slot_sizes[i] = new_size;
+        ins_key(table->slots[i].data + table->slots[i].size, key, len, table->vsize, &val);
+        uint64_t tags = table->slots[i].tags;
+        tag_push(&tags, tag);
+        store_release(&table->slots[i].tags, tags);
+        store_release(&table->slots[i].size, new_size);
 
         return val;
     }
@@ -336,119 +1226,321 @@ static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool inse
 }
 
 
-value_t* ahtable_get(ahtable_t* table, const char* key, size_t len)
+uint32_t ahtable_hash(const ahtable_t* table, const char* key, size_t len)
+{
+    return table_hash(table, key, len);
+}
+
+
+value_t* ahtable_get_hashed(ahtable_t* table, uint32_t h, const char* key, size_t len)
 {
     if (len > 32767) {
         fprintf(stderr, "HAT-trie/AH-table cannot store keys longer than 32768\n");
         exit(EXIT_FAILURE);
     }
 
-    return get_key(table, key, len, true);
+    return get_key(table, h, key, len, true);
+}
+
+
+value_t* ahtable_tryget_hashed(ahtable_t* table, uint32_t h, const char* key, size_t len)
+{
+    return get_key(table, h, key, len, false);
+}
+
+
+value_t* ahtable_get(ahtable_t* table, const char* key, size_t len)
+{
+    return ahtable_get_hashed(table, table_hash(table, key, len), key, len);
 }
 
 
 value_t* ahtable_tryget(ahtable_t* table, const char* key, size_t len )
 {
-    return get_key(table, key, len, false);
+    return get_key(table, table_hash(table, key, len), key, len, false);
 }
 
 
-int ahtable_del(ahtable_t* table, const char* key, size_t len)
+value_t* ahtable_upsert(ahtable_t* table, const char* key, size_t len, bool* inserted)
 {
-    uint32_t i = hash(key, len) % table->n;
-    size_t k;
+    size_t m = table->m;
+    value_t* val = ahtable_get(table, key, len);
+    if (inserted) *inserted = table->m != m;
+    return val;
+}
+
+
+/* number of lookups interleaved by ahtable_tryget_batch */
+#define TRYGET_BATCH 16
+
+/* Look keys[j] up in tables[j], or in table if tables is NULL. Each group of
+ * lookups goes through three passes: hashing the keys and prefetching the
+ * slots' tags and data pointers, prefetching the slot data, and only then
+ * searching, by which time it has hopefully arrived. */
+static void tryget_batch(ahtable_t* table, ahtable_t** tables, const char** keys,
+                         const size_t* lens, size_t n, value_t** vals)
+{
+    uint32_t hs[TRYGET_BATCH];
+    ahtable_t* t;
+    size_t b, g, j, i;
     slot_t s;
 
-    /* search the array for our key */
-    s = table->slots[i];
-    while ((size_t) (s - table->slots[i]) < table->slot_sizes[i]) {
-        /* get the key length */
-        k = keylen(s);
-        s += k < 128 ? 1 : 2;
+    for (b = 0; b < n; b += g) {
+        g = n - b < TRYGET_BATCH ? n - b : TRYGET_BATCH;
 
-        /* skip keys that are longer than ours */
-        if (k != len) {
-            s += k + sizeof(value_t);
-            continue;
+        for (j = 0; j < g; ++j) {
+            t = tables ? tables[b + j] : table;
+            hs[j] = table_hash(t, keys[b + j], lens[b + j]);
+            i = hash_slot(hs[j], t->n);
+            prefetch(&t->slots[i]);
         }
 
-        /* key found. */
-        if (memcmp(s, key, len) == 0) {
-            /* move everything over, resize the array */
-            unsigned char* t = s + len + sizeof(value_t);
-            s -= k < 128 ? 1 : 2;
-            memmove(s, t, table->slot_sizes[i] - (size_t) (t - table->slots[i]));
-            table->slot_sizes[i] -= (size_t) (t - s);
-            --table->m;
-            return 0;
+        for (j = 0; j < g; ++j) {
+            t = tables ? tables[b + j] : table;
+            i = hash_slot(hs[j], t->n);
+            prefetch(t->shared ? load_acquire(&t->slots[i].data) : t->slots[i].data);
         }
-        /* key not found. */
-        else {
-            s += k + sizeof(value_t);
-            continue;
+
+        for (j = 0; j < g; ++j) {
+            t = tables ? tables[b + j] : table;
+            s = lookup_key(t, hs[j], keys[b + j], lens[b + j]);
+            vals[b + j] = s ? (value_t*) (s + (lens[b + j] < 128 ? 1 : 2) + lens[b + j])
+                            : NULL;
         }
     }
+}
 
-    // Key was not found. Do nothing.
-    return -1;
+
+void ahtable_tryget_batch(ahtable_t* table, const char** keys, const size_t* lens,
+                          size_t n, value_t** vals)
+{
+    tryget_batch(table, NULL, keys, lens, n, vals);
+}
+
+
+void ahtable_tryget_multi(ahtable_t** tables, const char** keys, const size_t* lens,
+                          size_t n, value_t** vals)
+{
+    tryget_batch(NULL, tables, keys, lens, n, vals);
 }
 
 
+/* Delete the entry [s, t), the k-th, from slot i of a shared table, by
+ * replacing the slot with a copy without it. */
+static void shared_del(ahtable_t* table, size_t i, slot_t s, slot_t t, size_t k)
+{
+    uint32_t seq = table->seq;
+    store_release(&table->seq, seq + 1);
+    fence_release();
+
+    slot_t old  = table->slots[i].data;
+    size_t cap  = table->slot_caps[i];
+    size_t a    = (size_t) (s - old);
+    size_t size = table->slots[i].size - (size_t) (t - s);
+
+    slot_t u = table_alloc(table, cap);
+    memcpy(u, old, a);
+    memcpy(u + a, t, size - a);
+    memset(u + size, 0, cap - size);
+
+    uint64_t tags = table->slots[i].tags;
+    if (k < slot_tag_count) {
+        if (tag_match(tags, 0) == 0) tags = slot_tags_of(table, u, u + size);
+        else {
+            uint64_t low = tags & (((uint64_t) 1 << (8 * k)) - 1);
+            tags = low | ((tags >> (8 * k + 8)) << (8 * k));
+        }
+    }
+
+    store_release(&table->slots[i].data, u);
+    store_release(&table->slots[i].tags, tags);
+    store_release(&table->slots[i].size, size);
+    --table->m;
+    table_free(table, old, cap);
+
+    store_release(&table->seq, seq + 2);
+}
+
 
-static int cmpkey(const void* a_, const void* b_)
+int ahtable_del(ahtable_t* table, const char* key, size_t len)
 {
-    slot_t a = *(slot_t*) a_;
-    slot_t b = *(slot_t*) b_;
+    uint32_t h = table_hash(table, key, len);
+    size_t   i = hash_slot(h, table->n);
+
+    /* search the array for our key */
+    size_t k;
+    slot_t s = find_tagged_key(table, i, hash_tag(h), key, len, &k);
+
+    // Key was not found. Do nothing.
+    if (s == NULL) return -1;
+
+    drop_sorted(table);
+    unsigned char* t = s + (len < 128 ? 1 : 2) + len + table->vsize;
+    if (table->shared) {
+        shared_del(table, i, s, t, k);
+        return 0;
+    }
+
+    /* move everything over, resize the array */
+    memmove(s, t, table->slots[i].size - (size_t) (t - table->slots[i].data));
+    table->slots[i].size -= (size_t) (t - s);
+    --table->m;
 
-    size_t ka = keylen(a), kb = keylen(b);
+    /* drop the entry's tag, retagging if an untagged entry moves up */
+    if (k < slot_tag_count) {
+        uint64_t tags = table->slots[i].tags;
+        if (tag_match(tags, 0) == 0) slot_retag(table, i);
+        else {
+            /* tags are not full, so k is not the last one */
+            uint64_t low = tags & (((uint64_t) 1 << (8 * k)) - 1);
+            table->slots[i].tags = low | ((tags >> (8 * k + 8)) << (8 * k));
+        }
+    }
+    return 0;
+}
 
-    a += ka < 128 ? 1 : 2;
-    b += kb < 128 ? 1 : 2;
 
-    int c = memcmp(a, b, ka < kb ? ka : kb);
-    return c == 0 ? (int) ka - (int) kb : c;
+value_t* ahtable_image_tryget(const unsigned char* image, const char* key, size_t len)
+{
+    size_t n = (size_t) load_le64(image + 8);
+    const unsigned char* offs = image + ahtable_image_header;
+    slot_t data = (slot_t) offs + image_offs_size(n);
+
+    uint32_t h = hash_key((hattrie_hash_t) image[3], load_le64(image + 24), key, len);
+    size_t   i = hash_slot(h, n);
+    count(lookups, 1);
+    slot_t s = find_key(data + load_le32(offs + i * sizeof(uint32_t)),
+                        data + load_le32(offs + (i + 1) * sizeof(uint32_t)),
+                        key, len, image_vsize(image));
+
+    return s ? (value_t*) (s + (len < 128 ? 1 : 2) + len) : NULL;
 }
 
 
+
 /* Sorted/unsorted iterators are kept private and exposed by passing the
 sorted flag to ahtable_iter_begin. */
 
+/* Sort m entries by key. */
+static void sort_entries(slot_t* xs, size_t m)
+{
+    strsort_key_t* keys = malloc_or_die(m * sizeof(strsort_key_t));
+    size_t j;
+    for (j = 0; j < m; ++j) {
+        keys[j].len = keylen(xs[j]);
+        keys[j].s   = xs[j] + (keys[j].len < 128 ? 1 : 2);
+    }
+
+    strsort(keys, m);
+
+    for (j = 0; j < m; ++j) xs[j] = (slot_t) keys[j].s - (keys[j].len < 128 ? 1 : 2);
+    free(keys);
+}
+
+
+/* Collect the entries of a table, in slot order, into xs, which has room for
+ * size entries, growing it as needed. Returns the number of entries. */
+static size_t collect_entries(const ahtable_t* table, slot_t** xs, size_t size)
+{
+    /* a concurrent writer may add keys while they are collected */
+    slot_t s, end;
+    size_t j, k, u;
+    for (j = 0, u = 0; j < table->n; ++j) {
+        slot_snapshot(table, j, &s, &end);
+        while (s < end) {
+            if (u == size) {
+                size = size ? 2 * size : 16;
+                *xs = realloc_or_die(*xs, size * sizeof(slot_t));
+            }
+            (*xs)[u++] = s;
+            k = keylen(s);
+            s += k < 128 ? 1 : 2;
+            s += k + table->vsize;
+        }
+    }
+    return u;
+}
+
+
+/* Sorted iterators point into the table's cached order, or into a buffer kept
+ * by the ahtable_iter_t for tables that cannot cache it, which is reused when
+ * the iterator is reset. */
 typedef struct ahtable_sorted_iter_t_
 {
-    const ahtable_t* table; // parent
+    size_t m; // number of keys
     slot_t* xs; // pointers to keys
     size_t i; // current key
 } ahtable_sorted_iter_t;
 
 
-static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table)
+static void ahtable_sorted_iter_init(ahtable_sorted_iter_t* i, const ahtable_t* table,
+                                     slot_t** buf, size_t* bufsize)
 {
-    ahtable_sorted_iter_t* i = malloc_or_die(sizeof(ahtable_sorted_iter_t));
-    i->table = table;
-    i->xs = malloc_or_die(table->m * sizeof(slot_t));
     i->i = 0;
 
-    slot_t s;
-    size_t j, k, u;
-    for (j = 0, u = 0; j < table->n; ++j) {
-        s = table->slots[j];
-        while (s < table->slots[j] + table->slot_sizes[j]) {
-            i->xs[u++] = s;
-            k = keylen(s);
-            s += k < 128 ? 1 : 2;
-            s += k + sizeof(value_t);
+    /* The order is cached in the table, as a mutable property of an otherwise
+     * unchanged table. Iterators over the same table may be set up at once
+     * from several threads, so each sorts into a buffer of its own, with
+     * malloc rather than the table's allocator, which need not be thread
+     * safe, and the first to finish publishes it. A table whose allocator
+     * releases it at once, without ahtable_free, would leak the order. */
+    if (!table->shared && table->alloc->release == NULL) {
+        ahtable_t* t = (ahtable_t*) table;
+        slot_t* xs = load_acquire(&t->sorted);
+        if (xs == NULL && t->m > 0) {
+            slot_t* none = NULL;
+            xs = malloc_or_die(t->m * sizeof(slot_t));
+            collect_entries(t, &xs, t->m);
+            sort_entries(xs, t->m);
+            if (!atomic_cas(&t->sorted, none, xs)) {
+                free(xs);
+                xs = load_acquire(&t->sorted);
+            }
         }
+        i->m  = t->m;
+        i->xs = xs;
+        return;
     }
 
-    qsort(i->xs, table->m, sizeof(slot_t), cmpkey);
+    i->m = collect_entries(table, buf, *bufsize);
+    if (i->m > *bufsize) *bufsize = i->m;
+    i->xs = *buf;
+    sort_entries(i->xs, i->m);
+}
+
 
-    return i;
+static void ahtable_image_sorted_iter_init(ahtable_sorted_iter_t* i,
+                                           const unsigned char* image,
+                                           slot_t** buf, size_t* bufsize)
+{
+    i->m = (size_t) load_le64(image + 16);
+    if (i->m > *bufsize) {
+        *bufsize = i->m;
+        *buf = realloc_or_die(*buf, *bufsize * sizeof(slot_t));
+    }
+    i->xs = *buf;
+    i->i = 0;
+
+    /* slots are contiguous in an image, so keys can be collected in one sweep */
+    size_t n = (size_t) load_le64(image + 8);
+    const unsigned char* offs = image + ahtable_image_header;
+    slot_t s   = (slot_t) offs + image_offs_size(n);
+    slot_t end = s + load_le32(offs + n * sizeof(uint32_t));
+    size_t k, u = 0, vsize = image_vsize(image);
+    while (s < end) {
+        i->xs[u++] = s;
+        k = keylen(s);
+        s += k < 128 ? 1 : 2;
+        s += k + vsize;
+    }
+
+    sort_entries(i->xs, i->m);
 }
 
 
 static bool ahtable_sorted_iter_finished(ahtable_sorted_iter_t* i)
 {
-    return i->i >= i->table->m;
+    return i->i >= i->m;
 }
 
 
@@ -459,11 +1551,27 @@ static void ahtable_sorted_iter_next(ahtable_sorted_iter_t* i)
 }
 
 
-static void ahtable_sorted_iter_free(ahtable_sorted_iter_t* i)
+/* Compare the key of entry s to the given key, bytewise as unsigned chars,
+ * as the sorted order does. */
+static int entry_cmp(slot_t s, const char* key, size_t len)
 {
-    if (i == NULL) return;
-    free(i->xs);
-    free(i);
+    size_t k = keylen(s);
+    int c = memcmp(s + (k < 128 ? 1 : 2), key, k < len ? k : len);
+    if (c != 0) return c;
+    return k < len ? -1 : (k > len ? 1 : 0);
+}
+
+
+/* Move to the first key not less than the given one, by binary search. */
+static void ahtable_sorted_iter_seek(ahtable_sorted_iter_t* i, const char* key, size_t len)
+{
+    size_t lo = 0, hi = i->m, mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (entry_cmp(i->xs[mid], key, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    i->i = lo;
 }
 
 
@@ -497,21 +1605,26 @@ typedef struct ahtable_unsorted_iter_t_
     const ahtable_t* table; // parent
     size_t i;           // slot index
     slot_t s;           // slot position
+    slot_t end;         // end of the slot
 } ahtable_unsorted_iter_t;
 
 
-static ahtable_unsorted_iter_t* ahtable_unsorted_iter_begin(const ahtable_t* table)
+/* Move to the first entry of the first nonempty slot from i->i on. */
+static void ahtable_unsorted_iter_seek(ahtable_unsorted_iter_t* i)
 {
-    ahtable_unsorted_iter_t* i = malloc_or_die(sizeof(ahtable_unsorted_iter_t));
-    i->table = table;
-
-    for (i->i = 0; i->i < i->table->n; ++i->i) {
-        i->s = table->slots[i->i];
-        if ((size_t) (i->s - table->slots[i->i]) >= table->slot_sizes[i->i]) continue;
-        break;
+    for (; i->i < i->table->n; ++i->i) {
+        slot_snapshot(i->table, i->i, &i->s, &i->end);
+        if (i->s < i->end) return;
     }
+    i->s = NULL;
+}
 
-    return i;
+
+static void ahtable_unsorted_iter_init(ahtable_unsorted_iter_t* i, const ahtable_t* table)
+{
+    i->table = table;
+    i->i = 0;
+    ahtable_unsorted_iter_seek(i);
 }
 
 
@@ -530,26 +1643,15 @@ static void ahtable_unsorted_iter_next(ahtable_unsorted_iter_t* i)
     i->s += k < 128 ? 1 : 2;
 
     /* skip to the next key */
-    i->s += k + sizeof(value_t);
-
-    if ((size_t) (i->s - i->table->slots[i->i]) >= i->table->slot_sizes[i->i]) {
-        do {
-            ++i->i;
-        } while(i->i < i->table->n &&
-                i->table->slot_sizes[i->i] == 0);
+    i->s += k + i->table->vsize;
 
-        if (i->i < i->table->n) i->s = i->table->slots[i->i];
-        else i->s = NULL;
+    if (i->s >= i->end) {
+        ++i->i;
+        ahtable_unsorted_iter_seek(i);
     }
 }
 
 
-static void ahtable_unsorted_iter_free(ahtable_unsorted_iter_t* i)
-{
-    free(i);
-}
-
-
 static const char* ahtable_unsorted_iter_key(ahtable_unsorted_iter_t* i, size_t* len)
 {
     if (ahtable_unsorted_iter_finished(i)) return NULL;
@@ -591,58 +1693,156 @@ static value_t* ahtable_unsorted_iter_val(ahtable_unsorted_iter_t* i)
 }
 
 
+/* Unsorted iteration over an image is a plain sweep over the slot data. */
+
+typedef struct ahtable_image_iter_t_
+{
+    slot_t s;     // current key
+    slot_t end;   // end of the slot data
+    size_t vsize; // bytes of every value
+} ahtable_image_iter_t;
+
+
+static void ahtable_image_unsorted_iter_init(ahtable_image_iter_t* i,
+                                             const unsigned char* image)
+{
+    size_t n = (size_t) load_le64(image + 8);
+    const unsigned char* offs = image + ahtable_image_header;
+    i->s   = (slot_t) offs + image_offs_size(n);
+    i->end = i->s + load_le32(offs + n * sizeof(uint32_t));
+    i->vsize = image_vsize(image);
+}
+
+
+static bool ahtable_image_iter_finished(ahtable_image_iter_t* i)
+{
+    return i->s >= i->end;
+}
+
+
+static void ahtable_image_iter_next(ahtable_image_iter_t* i)
+{
+    if (ahtable_image_iter_finished(i)) return;
+
+    size_t k = keylen(i->s);
+    i->s += k < 128 ? 1 : 2;
+    i->s += k + i->vsize;
+}
+
+
+static const char* ahtable_image_iter_key(ahtable_image_iter_t* i, size_t* len)
+{
+    if (ahtable_image_iter_finished(i)) return NULL;
+
+    size_t k = keylen(i->s);
+    if (len) *len = k;
+    return (const char*) (i->s + (k < 128 ? 1 : 2));
+}
+
+
+static value_t* ahtable_image_iter_val(ahtable_image_iter_t* i)
+{
+    if (ahtable_image_iter_finished(i)) return NULL;
+
+    size_t k = keylen(i->s);
+    return (value_t*) (i->s + (k < 128 ? 1 : 2) + k);
+}
+
+
 struct ahtable_iter_t_
 {
     bool sorted;
+    bool image; // unsorted iteration over an image
     union {
-        ahtable_unsorted_iter_t* unsorted;
-        ahtable_sorted_iter_t* sorted;
+        ahtable_unsorted_iter_t unsorted;
+        ahtable_sorted_iter_t sorted;
+        ahtable_image_iter_t image;
     } i;
+
+    /* sorting space for tables without a cached order */
+    slot_t* buf;
+    size_t  bufsize;
 };
 
 
 ahtable_iter_t* ahtable_iter_begin(const ahtable_t* table, bool sorted) {
     ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
-    i->sorted = sorted;
-    if (sorted) i->i.sorted   = ahtable_sorted_iter_begin(table);
-    else        i->i.unsorted = ahtable_unsorted_iter_begin(table);
+    i->buf     = NULL;
+    i->bufsize = 0;
+    ahtable_iter_reset(i, table, sorted);
     return i;
 }
 
 
+ahtable_iter_t* ahtable_image_iter_begin(const unsigned char* image, bool sorted) {
+    ahtable_iter_t* i = malloc_or_die(sizeof(ahtable_iter_t));
+    i->buf     = NULL;
+    i->bufsize = 0;
+    ahtable_image_iter_reset(i, image, sorted);
+    return i;
+}
+
+
+void ahtable_iter_reset(ahtable_iter_t* i, const ahtable_t* table, bool sorted)
+{
+    i->sorted = sorted;
+    i->image  = false;
+    if (sorted) ahtable_sorted_iter_init(&i->i.sorted, table, &i->buf, &i->bufsize);
+    else        ahtable_unsorted_iter_init(&i->i.unsorted, table);
+}
+
+
+void ahtable_image_iter_reset(ahtable_iter_t* i, const unsigned char* image, bool sorted)
+{
+    i->sorted = sorted;
+    i->image  = !sorted;
+    if (sorted) ahtable_image_sorted_iter_init(&i->i.sorted, image, &i->buf, &i->bufsize);
+    else        ahtable_image_unsorted_iter_init(&i->i.image, image);
+}
+
+
 void ahtable_iter_next(ahtable_iter_t* i)
 {
-    if (i->sorted) ahtable_sorted_iter_next(i->i.sorted);
-    else           ahtable_unsorted_iter_next(i->i.unsorted);
+    if (i->sorted)     ahtable_sorted_iter_next(&i->i.sorted);
+    else if (i->image) ahtable_image_iter_next(&i->i.image);
+    else               ahtable_unsorted_iter_next(&i->i.unsorted);
 }
 
 
 bool ahtable_iter_finished(ahtable_iter_t* i)
 {
-    if (i->sorted) return ahtable_sorted_iter_finished(i->i.sorted);
-    else           return ahtable_unsorted_iter_finished(i->i.unsorted);
+    if (i->sorted)     return ahtable_sorted_iter_finished(&i->i.sorted);
+    else if (i->image) return ahtable_image_iter_finished(&i->i.image);
+    else               return ahtable_unsorted_iter_finished(&i->i.unsorted);
+}
+
+
+void ahtable_iter_seek(ahtable_iter_t* i, const char* key, size_t len)
+{
+    if (i->sorted) ahtable_sorted_iter_seek(&i->i.sorted, key, len);
 }
 
 
 void ahtable_iter_free(ahtable_iter_t* i)
 {
     if (i == NULL) return;
-    if (i->sorted) ahtable_sorted_iter_free(i->i.sorted);
-    else           ahtable_unsorted_iter_free(i->i.unsorted);
+    free(i->buf);
     free(i);
 }
 
 
 const char* ahtable_iter_key(ahtable_iter_t* i, size_t* len)
 {
-    if (i->sorted) return ahtable_sorted_iter_key(i->i.sorted, len);
-    else           return ahtable_unsorted_iter_key(i->i.unsorted, len);
+    if (i->sorted)     return ahtable_sorted_iter_key(&i->i.sorted, len);
+    else if (i->image) return ahtable_image_iter_key(&i->i.image, len);
+    else               return ahtable_unsorted_iter_key(&i->i.unsorted, len);
 }
 
 
 value_t* ahtable_iter_val(ahtable_iter_t* i)
 {
-    if (i->sorted) return ahtable_sorted_iter_val(i->i.sorted);
-    else           return ahtable_unsorted_iter_val(i->i.unsorted);
+    if (i->sorted)     return ahtable_sorted_iter_val(&i->i.sorted);
+    else if (i->image) return ahtable_image_iter_val(&i->i.image);
+    else               return ahtable_unsorted_iter_val(&i->i.unsorted);
 }
 
@@ -20,8 +20,8 @@
  * variable number of key/value pairs. Each key is preceded by its length--
  * one byte for lengths < 128 bytes, and TWO bytes for longer keys. The least
  * significant bit of the first byte indicates, if set, that the size is two
- * bytes. The slot number where a key/value pair goes is determined by finding
- * the murmurhashed integer value of its key, modulus the number of slots.
+ * bytes. The slot number where a key/value pair goes is given by the low bits
+ * of the hash of its key, the number of slots always being a power of two.
  * The number of slots expands in a stepwise fashion when the number of
  # key/value pairs reaches an arbitrarily large number.
  *
@@ -53,19 +53,58 @@ extern "C" {
 
 typedef unsigned char* slot_t;
 
+/* What a lookup reads of a slot, but for its entries: the hash tags of the
+ * first of them (see ahtable.c), the pointer to them and the bytes they take,
+ * kept together so that finding a slot's entries touches one place in memory
+ * rather than one in each of several arrays. */
+typedef struct ahslot_t_
+{
+    uint64_t tags;
+    slot_t   data;
+    uint32_t size;
+} ahslot_t;
+
 typedef struct ahtable_t_
 {
     /* these fields are reserved for hattrie to fiddle with */
     uint8_t flag;
     unsigned char c0;
     unsigned char c1;
+    uint64_t gen;
+
+    /* Set if lookups and iteration may run concurrently with one writer (see
+     * hattrie_opts_t). The writer then publishes every slot's data before its
+     * size and tags, never shrinks a slot's capacity, and deletes by copying
+     * the slot, bumping seq around the copy so that readers overlapping it
+     * retry. The table must not be resized or shrunk while shared. */
+    bool     shared;
+    uint32_t seq;
+
+    /* hash function and seed keys are placed with */
+    hattrie_hash_t hash;
+    uint64_t       seed;
+
+    /* bytes of value stored after every key, at most sizeof(value_t) (see
+     * ahtable_set_value_size) */
+    uint8_t vsize;
 
     size_t n;        // number of slots
     size_t m;        // number of key/value pairs stored
     size_t max_m;    // number of stored keys before we resize
+    double max_load; // keys per slot before we resize
+
+    ahslot_t* slots;     // n slots
+    size_t*   slot_caps; // bytes allocated for each slot
 
-    size_t*  slot_sizes;
-    slot_t*  slots;
+    /* The m entries in sorted order, built by the first sorted iteration and
+     * dropped whenever a key is added or removed, or NULL. Allocated with
+     * malloc, and published with a compare-and-swap, since sorted iterators
+     * over an unchanged table may be set up from several threads. Not kept
+     * for shared tables, whose keys change under their readers, nor if the
+     * allocator has a release function, which would not free it. */
+    slot_t* sorted;
+
+    const hattrie_allocator_t* alloc; // memory for the table and its slots
 } ahtable_t;
 
 extern const double ahtable_max_load_factor;
@@ -75,6 +114,77 @@ ahtable_t* ahtable_create   (void);         // Create an empty hash table.
 ahtable_t* ahtable_create_n (size_t n);     // Create an empty hash table, with
                                             //  n slots reserved.
 
+/* Tables are created with n rounded up to a power of two slots, hashing keys
+ * with wyhash and seed 0. */
+
+/* Create an empty table with n slots, allocating all its memory, including
+ * the table itself, with the given allocator. The allocator must outlive the
+ * table. NULL selects hattrie_default_allocator. */
+ahtable_t* ahtable_create_with_allocator (size_t n, const hattrie_allocator_t* alloc);
+
+/* Set the number of keys per slot the table may hold before it resizes. */
+void ahtable_set_max_load (ahtable_t*, double max_load);
+
+/* Store values of vsize bytes, at most sizeof(value_t), rather than whole
+ * value_t's, in the empty table. Returns 0, or -1 if the table is not empty or
+ * vsize is too large.
+ *
+ * Pointers to the values of a narrow table address vsize bytes, holding the
+ * low bytes of the value least significant first, which may only be read and
+ * written as such, e.g. by ahtable_value_load and ahtable_value_store. With
+ * vsize 0 the table is a set: the pointers only tell that a key is there, and
+ * must not be read or written through. */
+int ahtable_set_value_size (ahtable_t*, size_t vsize);
+
+/* Read or write the value at a pointer into a table, of its value size. */
+value_t ahtable_value_load  (const ahtable_t*, const value_t* val);
+void    ahtable_value_store (const ahtable_t*, value_t* val, value_t x);
+
+/* Rehash the table into n slots, rounded up to a power of two. */
+void ahtable_resize (ahtable_t*, size_t n);
+
+/* Add the number of keys of a table starting with each byte c to cs[c], an
+ * array of 256 counts. Empty keys are not counted. */
+void ahtable_count_first (const ahtable_t*, unsigned int* cs);
+
+/* Copy every key of a table, none of which may be empty, into two empty
+ * tables: lo taking the keys whose first byte is at most c, and hi the rest.
+ * Keys copied into a table whose strip flag is set lose their first byte. The
+ * slots of both tables are allocated once, at their exact size. */
+void ahtable_split (const ahtable_t*, unsigned char c,
+                    ahtable_t* lo, bool lo_strip, ahtable_t* hi, bool hi_strip);
+
+/* Copy every key of a table into the empty table dst, less its first k bytes,
+ * which every key must have, sizing the slots exactly as ahtable_split. */
+void ahtable_strip (const ahtable_t*, size_t k, ahtable_t* dst);
+
+/* Length of the longest prefix every key of a table starts with, at most max,
+ * or 0 if the table is empty. *prefix, unless prefix is NULL, is set to a key
+ * starting with it, valid until the table is modified. */
+size_t ahtable_common_prefix (const ahtable_t*, size_t max, const char** prefix);
+
+/* ahtable_split for the keys of slot i alone, which are removed from the
+ * table and inserted into lo and hi as by ahtable_get. The empty key goes to
+ * lo, which then must not strip. lo and hi may be the same table, and need not
+ * be empty. Returns the number of keys moved. The table must not be shared. */
+size_t ahtable_split_slot (ahtable_t*, size_t i, unsigned char c,
+                           ahtable_t* lo, bool lo_strip, ahtable_t* hi, bool hi_strip);
+
+/* Switch the table to the given hash function and seed, rehashing its keys. */
+void ahtable_set_hash (ahtable_t*, hattrie_hash_t hash, uint64_t seed);
+
+/* Create a table with n slots holding the m given keys, which must be
+ * distinct, with the given values (or zeros if vals is NULL) of vsize bytes,
+ * hashed with the given function and seed. Every slot is allocated once at its
+ * exact size. */
+ahtable_t* ahtable_create_from (size_t n, const char** keys, const size_t* lens,
+                                const value_t* vals, size_t m,
+                                const hattrie_allocator_t* alloc,
+                                hattrie_hash_t hash, uint64_t seed, size_t vsize);
+
+/* The saved format does not record the hash function, so ahtable_load rehashes
+ * every key with the default one, nor the value size, so only tables storing
+ * whole value_t's may be saved this way. */
 ahtable_t* ahtable_load     (FILE* fd);               // Load a hash table from a file handle.
 void       ahtable_save     (const ahtable_t* T, FILE* fd); // Save a hash table to a file handle.
 
@@ -82,6 +192,10 @@ void       ahtable_free   (ahtable_t*);       // Free all memory used by a table
 void       ahtable_clear  (ahtable_t*);       // Remove all entries.
 size_t     ahtable_size   (const ahtable_t*); // Number of stored keys.
 size_t     ahtable_sizeof (const ahtable_t*); // Memory used by the table in bytes.
+void       ahtable_shrink (ahtable_t*);       // Release unused slot capacity.
+
+/* Number of keys stored in slot i. */
+size_t ahtable_slot_count (const ahtable_t*, size_t i);
 
 
 /** Find the given key in the table, inserting it if it does not exist, and
@@ -97,6 +211,30 @@ value_t* ahtable_get (ahtable_t*, const char* key, size_t len);
 /* Find a given key in the table, return a NULL pointer if it does not exist. */
 value_t* ahtable_tryget (ahtable_t*, const char* key, size_t len);
 
+/* ahtable_get, also setting *inserted, unless inserted is NULL, to whether the
+ * key was new. */
+value_t* ahtable_upsert (ahtable_t*, const char* key, size_t len, bool* inserted);
+
+/* The hash of a key, as placed by the given table. It only depends on the
+ * table's hash function and seed (see ahtable_set_hash), so it is valid for
+ * every table sharing them, across resizes. */
+uint32_t ahtable_hash (const ahtable_t*, const char* key, size_t len);
+
+/* ahtable_get and ahtable_tryget for a key whose hash h, by ahtable_hash, the
+ * caller already has. */
+value_t* ahtable_get_hashed    (ahtable_t*, uint32_t h, const char* key, size_t len);
+value_t* ahtable_tryget_hashed (ahtable_t*, uint32_t h, const char* key, size_t len);
+
+
+/* Look up n keys at once, setting vals[j] to what ahtable_tryget would return
+ * for keys[j]. The lookups are interleaved, prefetching each key's slot before
+ * any is searched, so that their cache misses overlap. */
+void ahtable_tryget_batch (ahtable_t*, const char** keys, const size_t* lens,
+                           size_t n, value_t** vals);
+
+/* ahtable_tryget_batch, looking keys[j] up in tables[j]. */
+void ahtable_tryget_multi (ahtable_t** tables, const char** keys, const size_t* lens,
+                           size_t n, value_t** vals);
 
 int ahtable_del(ahtable_t*, const char* key, size_t len);
 
@@ -110,6 +248,74 @@ void            ahtable_iter_free      (ahtable_iter_t*);
 const char*     ahtable_iter_key       (ahtable_iter_t*, size_t* len);
 value_t*        ahtable_iter_val       (ahtable_iter_t*);
 
+/* Restart an iterator on a table, reusing its memory, so that iterating over
+ * many tables allocates nothing once the iterator has grown. */
+void            ahtable_iter_reset     (ahtable_iter_t*, const ahtable_t*, bool sorted);
+
+/* Move a sorted iterator to the first key not less than the given one,
+ * comparing bytes as unsigned chars. Unsorted iterators are left alone. */
+void            ahtable_iter_seek      (ahtable_iter_t*, const char* key, size_t len);
+
+
+/* Counts of the work done by every table in the process, kept only if the
+ * library is configured with --enable-counters, and always zero otherwise. */
+typedef struct ahtable_counters_t_
+{
+    uint64_t lookups; // slots searched for a key
+    uint64_t scanned; // entries looked at while searching them
+    uint64_t resizes; // tables rehashed into a different number of slots
+} ahtable_counters_t;
+
+void ahtable_counters       (ahtable_counters_t*);
+void ahtable_counters_reset (void);
+
+
+/* Images are a flat, read-only serialization of a table that can be queried in
+ * place, e.g. from a memory mapped file. All slots are stored back to back
+ * behind an array of offsets:
+ *
+ *   flag:u8 c0:u8 c1:u8 hash:u8 vpad:u8 pad:u8[3] n:u64 m:u64 seed:u64
+ *   offs:u32[n + 1] (padded to 8)
+ *   slot data
+ *
+ * Slot i occupies bytes [offs[i], offs[i + 1]) of the slot data, and uses the
+ * same key/value encoding as the table itself, with values of 8 - vpad bytes.
+ * Integers are little-endian.
+ */
+
+/* Write the image of a table, returning the number of bytes written, which is
+ * always a multiple of 8, or 0 on failure. */
+size_t ahtable_image_write (const ahtable_t*, FILE* fd);
+
+/* Size in bytes of the image of a table with its keys rehashed into n slots,
+ * rounded up to a power of two, or 0 if its keys do not fit an image. */
+size_t ahtable_image_pack_size (const ahtable_t*, size_t n);
+
+/* Write the image of a table with its keys rehashed into n slots, rounded up
+ * to a power of two, to out, which must have room for ahtable_image_pack_size
+ * bytes. An image is searched without tags, so fewer slots than the table's
+ * own make a smaller image that takes longer to search. */
+void ahtable_image_pack (const ahtable_t*, size_t n, unsigned char* out);
+
+/* Size in bytes of the image stored at the given address. */
+size_t ahtable_image_size (const unsigned char* image);
+
+/* Number of keys in the image stored at the given address. */
+size_t ahtable_image_count (const unsigned char* image);
+
+/* Build an ordinary table from an image of at most len bytes, returning NULL
+ * if the image is malformed. */
+ahtable_t* ahtable_image_load (const unsigned char* image, size_t len);
+
+/* Find a key in an image, returning NULL if does not exist. */
+value_t* ahtable_image_tryget (const unsigned char* image, const char* key, size_t len);
+
+/* Iterate over the keys of an image. The returned iterator is used with the
+ * ordinary ahtable_iter_* functions. */
+ahtable_iter_t* ahtable_image_iter_begin (const unsigned char* image, bool sorted);
+void            ahtable_image_iter_reset (ahtable_iter_t*, const unsigned char* image,
+                                          bool sorted);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,282 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See arena.h for a description of the allocators.
+ *
+ */
+
+#include "arena.h"
+#include "misc.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+static void* default_alloc(void* ctx, size_t n)
+{
+    (void) ctx;
+    return malloc_or_die(n);
+}
+
+
+static void* default_realloc(void* ctx, void* p, size_t old_n, size_t new_n)
+{
+    (void) ctx;
+    (void) old_n;
+    return realloc_or_die(p, new_n);
+}
+
+
+static void default_free(void* ctx, void* p, size_t n)
+{
+    (void) ctx;
+    (void) n;
+    free(p);
+}
+
+
+const hattrie_allocator_t hattrie_default_allocator =
+{
+    default_alloc, default_realloc, default_free, NULL, NULL
+};
+
+
+/* Size classes are 16, 24, 32, 48, 64, ... up to arena_max_block. Larger
+ * blocks are allocated with malloc, but still tracked by the arena. */
+#define ARENA_NUM_CLASSES 29
+static const size_t arena_max_block  = 1 << 18;
+static const size_t arena_chunk_size = 1 << 20;
+
+/* chunk and large block headers, keeping 16 byte alignment */
+typedef struct arena_chunk_t_
+{
+    struct arena_chunk_t_* next;
+    size_t pad;
+} arena_chunk_t;
+
+typedef struct arena_large_t_
+{
+    struct arena_large_t_* prev;
+    struct arena_large_t_* next;
+} arena_large_t;
+
+
+struct hattrie_arena_t_
+{
+    arena_chunk_t* chunks;
+    arena_large_t* large;
+
+    /* unused space at the end of the newest chunk */
+    unsigned char* top;
+    size_t avail;
+
+    /* freed blocks of each class, linked through their first word */
+    void* free_lists[ARENA_NUM_CLASSES];
+
+    size_t nbytes; // obtained from malloc
+};
+
+
+static size_t arena_class(size_t n)
+{
+    if (n <= 16) return 0;
+
+    /* find j, such that 2^j < n <= 2^(j + 1) */
+    size_t j = 4;
+    while (((size_t) 1 << (j + 1)) < n) ++j;
+
+    size_t p = (size_t) 1 << j;
+    return n <= p + p / 2 ? 2 * (j - 4) + 1 : 2 * (j - 3);
+}
+
+
+static size_t arena_class_size(size_t c)
+{
+    size_t p = (size_t) 16 << (c / 2);
+    return c % 2 ? p + p / 2 : p;
+}
+
+
+hattrie_arena_t* hattrie_arena_create()
+{
+    hattrie_arena_t* A = malloc_or_die(sizeof(hattrie_arena_t));
+    A->chunks = NULL;
+    A->large  = NULL;
+    A->top    = NULL;
+    A->avail  = 0;
+    A->nbytes = 0;
+    memset(A->free_lists, 0, sizeof(A->free_lists));
+    return A;
+}
+
+
+static void arena_release(void* ctx)
+{
+    hattrie_arena_t* A = ctx;
+
+    arena_chunk_t* chunk;
+    while (A->chunks) {
+        chunk = A->chunks->next;
+        free(A->chunks);
+        A->chunks = chunk;
+    }
+
+    arena_large_t* large;
+    while (A->large) {
+        large = A->large->next;
+        free(A->large);
+        A->large = large;
+    }
+
+    A->top    = NULL;
+    A->avail  = 0;
+    A->nbytes = 0;
+    memset(A->free_lists, 0, sizeof(A->free_lists));
+}
+
+
+void hattrie_arena_free(hattrie_arena_t* A)
+{
+    if (A == NULL) return;
+    arena_release(A);
+    free(A);
+}
+
+
+size_t hattrie_arena_sizeof(const hattrie_arena_t* A)
+{
+    return sizeof(hattrie_arena_t) + A->nbytes;
+}
+
+
+static void arena_push(hattrie_arena_t* A, void* p, size_t c)
+{
+    *(void**) p = A->free_lists[c];
+    A->free_lists[c] = p;
+}
+
+
+/* Start a new chunk, handing what is left of the old one to the free lists. */
+static void arena_grow(hattrie_arena_t* A)
+{
+    size_t c = ARENA_NUM_CLASSES;
+    while (c-- > 0) {
+        while (A->avail >= arena_class_size(c)) {
+            arena_push(A, A->top, c);
+            A->top   += arena_class_size(c);
+            A->avail -= arena_class_size(c);
+        }
+    }
+
+    arena_chunk_t* chunk = malloc_or_die(arena_chunk_size);
+    chunk->next = A->chunks;
+    A->chunks = chunk;
+    A->top    = (unsigned char*) (chunk + 1);
+    A->avail  = arena_chunk_size - sizeof(arena_chunk_t);
+    A->nbytes += arena_chunk_size;
+}
+
+
+static void* arena_alloc(void* ctx, size_t n)
+{
+    hattrie_arena_t* A = ctx;
+
+    if (n > arena_max_block) {
+        arena_large_t* large = malloc_or_die(sizeof(arena_large_t) + n);
+        large->prev = NULL;
+        large->next = A->large;
+        if (A->large) A->large->prev = large;
+        A->large = large;
+        A->nbytes += sizeof(arena_large_t) + n;
+        return large + 1;
+    }
+
+    size_t c = arena_class(n);
+    void* p = A->free_lists[c];
+    if (p) {
+        A->free_lists[c] = *(void**) p;
+        return p;
+    }
+
+    size_t size = arena_class_size(c);
+    if (A->avail < size) arena_grow(A);
+
+    p = A->top;
+    A->top   += size;
+    A->avail -= size;
+    return p;
+}
+
+
+static void arena_unlink(hattrie_arena_t* A, arena_large_t* large)
+{
+    if (large->prev) large->prev->next = large->next;
+    else A->large = large->next;
+    if (large->next) large->next->prev = large->prev;
+}
+
+
+/* A block freed with a size smaller than it was allocated with ends up on the
+ * free list of a smaller class, which is wasteful but still safe. */
+static void arena_free(void* ctx, void* p, size_t n)
+{
+    hattrie_arena_t* A = ctx;
+    if (p == NULL) return;
+
+    if (n > arena_max_block) {
+        arena_large_t* large = (arena_large_t*) p - 1;
+        arena_unlink(A, large);
+        A->nbytes -= sizeof(arena_large_t) + n;
+        free(large);
+    }
+    else arena_push(A, p, arena_class(n));
+}
+
+
+static void* arena_realloc(void* ctx, void* p, size_t old_n, size_t new_n)
+{
+    hattrie_arena_t* A = ctx;
+
+    if (p == NULL) return arena_alloc(ctx, new_n);
+
+    if (new_n == 0) {
+        arena_free(ctx, p, old_n);
+        return NULL;
+    }
+
+    /* the block still fits its class */
+    if (old_n <= arena_max_block && new_n <= arena_max_block &&
+        arena_class(old_n) == arena_class(new_n)) {
+        return p;
+    }
+
+    if (old_n > arena_max_block && new_n > arena_max_block) {
+        arena_large_t* large = (arena_large_t*) p - 1;
+        arena_unlink(A, large);
+        large = realloc_or_die(large, sizeof(arena_large_t) + new_n);
+        large->prev = NULL;
+        large->next = A->large;
+        if (A->large) A->large->prev = large;
+        A->large = large;
+        A->nbytes += new_n - old_n;
+        return large + 1;
+    }
+
+    void* q = arena_alloc(ctx, new_n);
+    memcpy(q, p, old_n < new_n ? old_n : new_n);
+    arena_free(ctx, p, old_n);
+    return q;
+}
+
+
+hattrie_allocator_t hattrie_arena_allocator(hattrie_arena_t* A)
+{
+    hattrie_allocator_t alloc;
+    alloc.alloc   = arena_alloc;
+    alloc.realloc = arena_realloc;
+    alloc.free    = arena_free;
+    alloc.release = arena_release;
+    alloc.ctx     = A;
+    return alloc;
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Allocators for hattrie_allocator_t.
+ *
+ * The default allocator is a thin wrapper around malloc. The arena allocator
+ * carves blocks out of large chunks instead. Block sizes are rounded up to
+ * size classes growing by factors of 1.5 and 2 in turn, so a slot that is
+ * reallocated on every insertion is only moved when it outgrows its class,
+ * giving it geometric capacity growth. Freed blocks are kept on per class free
+ * lists, and everything is released at once by freeing the chunks.
+ *
+ */
+
+#ifndef HATTRIE_ARENA_H
+#define HATTRIE_ARENA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "common.h"
+
+/* malloc, realloc and free, exiting if memory runs out */
+extern const hattrie_allocator_t hattrie_default_allocator;
+
+typedef struct hattrie_arena_t_ hattrie_arena_t;
+
+hattrie_arena_t*    hattrie_arena_create    (void);              // Create an empty arena.
+void                hattrie_arena_free      (hattrie_arena_t*);  // Free an arena and all its memory.
+size_t              hattrie_arena_sizeof    (const hattrie_arena_t*); // Bytes obtained from malloc.
+hattrie_allocator_t hattrie_arena_allocator (hattrie_arena_t*);  // Allocator using the arena.
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,9 +14,38 @@
 
 #include "pstdint.h"
 
+#include <stddef.h>
+
 // an unsigned int that is guaranteed to be the same size as a pointer
 typedef uintptr_t value_t;
 
+/* Hash functions a table can place keys with. Either takes a seed, which makes
+ * it hard to pick keys that collide without knowing it. */
+typedef enum
+{
+    HATTRIE_HASH_WYHASH  = 0, // wyhash, the default
+    HATTRIE_HASH_MURMUR3 = 1  // MurmurHash3, the only hash of earlier versions
+} hattrie_hash_t;
+
+/* Allocator used for the nodes, tables and slots of a trie. The size of a
+ * block is passed back when it is reallocated or freed, so implementations need
+ * not keep headers. Allocation failures are not reported: functions must
+ * return valid memory or not return at all.
+ */
+typedef struct hattrie_allocator_t_
+{
+    void* (*alloc)   (void* ctx, size_t n);
+    void* (*realloc) (void* ctx, void* p, size_t old_n, size_t new_n);
+    void  (*free)    (void* ctx, void* p, size_t n);
+
+    /* Optional. Free every block at once, leaving the allocator usable for new
+     * allocations. If set, the trie is freed or cleared in one call rather than
+     * by walking it, so the allocator must not be shared with other tries. */
+    void  (*release) (void* ctx);
+
+    void* ctx;
+} hattrie_allocator_t;
+
 #endif
 
 
@@ -7,14 +7,26 @@
 
 #include "hat-trie.h"
 #include "ahtable.h"
+#include "arena.h"
 #include "misc.h"
 #include "pstdint.h"
+#include "rcu.h"
+#include "wyhash.h"
 #include <assert.h>
 #include <string.h>
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#define HATTRIE_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #define HT_UNUSED(x) x=x
 
-/* maximum number of keys that may be stored in a bucket before it is burst */
+/* default maximum number of keys that may be stored in a bucket before it is
+ * burst */
 static const size_t MAX_BUCKET_SIZE = 16384;
 #define NODE_MAXCHAR 0xff // 0x7f for 7-bit ASCII
 #define NODE_CHILDS (NODE_MAXCHAR+1)
@@ -24,6 +36,13 @@ static const uint8_t NODE_TYPE_PURE_BUCKET   = 0x2;
 static const uint8_t NODE_TYPE_HYBRID_BUCKET = 0x4;
 static const uint8_t NODE_HAS_VAL            = 0x8;
 
+/* by default, sparse trie nodes hold at most this many runs before becoming
+ * dense */
+#define NODE_SPARSE_MAX 128
+
+/* longest prefix a trie node can hold */
+#define NODE_PREFIX_MAX 0xffff
+
 
 struct trie_node_t_;
 
@@ -37,26 +56,490 @@ typedef union node_ptr_
 } node_ptr;
 
 
+/* A trie node maps each character to either a trie_node_t or a ahtable_t. The
+ * first byte of the child must be examined to determine which.
+ *
+ * Consecutive characters mapping to the same child (a hybrid bucket) form a
+ * run. A sparse node stores each run's child once, in xs[cap], and the index
+ * of the run covering every character in idx[NODE_CHILDS], which precedes it.
+ * Once a node has more than T->node_fanout runs it becomes dense, holding
+ * xs[NODE_CHILDS] indexed by character. Either layout follows the prefix.
+ *
+ * A node may hold a prefix, of plen bytes following the header (padded to 8),
+ * that the rest of a key must start with after the character leading to the
+ * node, and that is consumed before the node's own value and children. It
+ * stands for a chain of trie nodes each with no value and a single child.
+ */
 typedef struct trie_node_t_
 {
-    uint8_t flag;
+    uint8_t  flag;
+    bool     dense;
+    uint16_t nruns; // number of distinct runs
+    uint16_t cap;   // runs there is room for, in a sparse node
+    uint16_t plen;  // length of the prefix
 
     /* the value for the key that is consumed on a trie node */
     value_t val;
 
-    /* Map a character to either a trie_node_t or a ahtable_t. The first byte
-     * must be examined to determine which. */
-    node_ptr xs[NODE_CHILDS];
+    /* keys of the node and everything under it, if the trie keeps counts */
+    size_t count;
 
 } trie_node_t;
 
+/* A bucket being moved, a few slots at a time, into the buckets that replaced
+ * it in the trie, lo taking the keys whose first byte is at most c and hi the
+ * others. A resized bucket is replaced by a single one, both lo and hi. Keys
+ * not moved yet are still looked up in src. */
+typedef struct migration_t_
+{
+    ahtable_t* src; // NULL when no bucket is being moved
+    ahtable_t* lo;
+    ahtable_t* hi;
+    unsigned char c;
+    size_t pos;     // slots of src moved so far
+} migration_t;
+
+/* A key found by hattrie_tryget, with a copy of it, from malloc, the high half
+ * of its 64-bit hash and the pointer to its value, which is NULL for an empty
+ * way. A value in a bucket stays where it is until an entry of the bucket is
+ * added or removed, which bumps the bucket's gen, so the way holds while gen
+ * is still the bucket's. Values of trie nodes and images have no bucket. */
+typedef struct cache_way_t_
+{
+    uint32_t h;
+    uint32_t len;
+    char*    key;
+    value_t* val;
+    const ahtable_t* b;
+    uint64_t gen;
+} cache_way_t;
+
+/* A line of the lookup cache, holding the keys found most recently whose
+ * hashes share its index, first to last. Lines filled before the current
+ * epoch of their trie are empty, their buckets possibly freed. A line is
+ * CACHE_LINE bytes on 64-bit machines, and the lines are aligned to that. */
+#define CACHE_WAYS 3
+#define CACHE_LINE 128
+
+typedef struct cache_line_t_
+{
+    uint64_t    epoch;
+    cache_way_t ways[CACHE_WAYS];
+} cache_line_t;
+
 struct hattrie_t_
 {
     node_ptr root; // root node
     size_t m;      // number of stored keys
+
+    /* Read-only image the trie is served from (see hattrie_mmap_open), or NULL
+     * for an ordinary trie. The root then points into the image. */
+    const unsigned char* image;
+    size_t image_len;
+    bool   image_mapped; // munmap rather than free the image
+
+    /* memory for trie nodes and buckets */
+    hattrie_allocator_t alloc;
+
+    /* If the trie is read concurrently, the domain frees are deferred to, in
+     * which case alloc is its allocator. See hattrie_opts_t. */
+    rcu_domain_t* rcu;
+
+    /* tuning, see hattrie_opts_t */
+    size_t burst_size;   // keys in a bucket before it is burst
+    size_t bucket_slots; // slots of a new bucket
+    double load_factor;  // keys per slot before a bucket grows
+    size_t node_fanout;  // runs of a sparse trie node
+    hattrie_hash_t hash; // hash function and seed of the buckets
+    uint64_t       seed;
+    size_t vsize;        // bytes of value stored with each key
+    bool   counts;       // keep the counts of trie nodes
+
+    /* keys moved per modification while splitting or resizing a bucket
+     * incrementally, or 0 (see hattrie_opts_t) */
+    size_t      step;
+    migration_t mig;
+
+    /* events since the trie was created, see hattrie_stats */
+    size_t nsplits;     // buckets split
+    size_t nexpansions; // buckets growing their slot arrays
+
+    /* Lookup cache of cache_n lines, a power of two, or NULL (see
+     * hattrie_set_cache). Adding or removing an entry of a bucket only bumps
+     * the bucket's gen. Any other change to the trie that may move values,
+     * or free a bucket, starts a new epoch, emptying every line at once. */
+    cache_line_t* cache;
+    void*    cache_mem;    // allocation the lines are aligned within
+    size_t   cache_n;
+    uint64_t cache_epoch;
+    size_t   cache_hits;   // lookups answered by the cache
+    size_t   cache_misses; // lookups that went down the trie
 };
 
 
+/* Forget every value the lookup cache points to, before they move. */
+static inline void cache_invalidate(hattrie_t* T)
+{
+    ++T->cache_epoch;
+}
+
+
+/* Forget the values of bucket b the lookup cache points to, before they move
+ * within it. */
+static inline void cache_touch(ahtable_t* b)
+{
+    ++b->gen;
+}
+
+
+/* Whether a way of the lookup cache holds the given key, still in place. */
+static inline bool cache_way_match(const cache_way_t* way, uint32_t h,
+                                   const char* key, size_t len)
+{
+    return way->val && way->h == h && way->len == len &&
+           (way->b == NULL || way->b->gen == way->gen) &&
+           memcmp(way->key, key, len) == 0;
+}
+
+
+/* Empty a line of the lookup cache, starting the given epoch. */
+static void cache_line_clear(cache_line_t* line, uint64_t epoch)
+{
+    size_t w;
+    for (w = 0; w < CACHE_WAYS; ++w) free(line->ways[w].key);
+    memset(line, 0, sizeof(cache_line_t));
+    line->epoch = epoch;
+}
+
+
+/* Free the lookup cache, and the keys it copied. */
+static void cache_free(hattrie_t* T)
+{
+    size_t j;
+    for (j = 0; j < T->cache_n; ++j) cache_line_clear(&T->cache[j], 0);
+    free(T->cache_mem);
+    T->cache     = NULL;
+    T->cache_mem = NULL;
+    T->cache_n   = 0;
+}
+
+
+
+static inline size_t trie_prefix_size(size_t plen)
+{
+    return (plen + 7) & ~(size_t) 7;
+}
+
+
+static size_t trie_node_size(const trie_node_t* node)
+{
+    size_t size = sizeof(trie_node_t) + trie_prefix_size(node->plen);
+    if (node->dense) return size + NODE_CHILDS * sizeof(node_ptr);
+    return size + NODE_CHILDS + node->cap * sizeof(node_ptr);
+}
+
+
+static inline char* trie_prefix(const trie_node_t* node)
+{
+    return (char*) (node + 1);
+}
+
+
+static inline unsigned char* trie_idx(const trie_node_t* node)
+{
+    return (unsigned char*) trie_prefix(node) + trie_prefix_size(node->plen);
+}
+
+
+static inline node_ptr* trie_xs(const trie_node_t* node)
+{
+    if (node->dense) return (node_ptr*) trie_idx(node);
+    return (node_ptr*) (trie_idx(node) + NODE_CHILDS);
+}
+
+
+/* Whether the rest of a key, of len bytes, starts with the node's prefix. */
+static inline bool trie_prefix_match(const trie_node_t* node, const char* key, size_t len)
+{
+    return len >= node->plen && memcmp(key, trie_prefix(node), node->plen) == 0;
+}
+
+
+/* The child pointer for the given character. */
+static inline node_ptr* trie_child_ref(const trie_node_t* node, unsigned char c)
+{
+    if (node->dense) return trie_xs(node) + c;
+    return trie_xs(node) + trie_idx(node)[c];
+}
+
+
+/* Child pointers, and the root, are replaced by the writer while concurrent
+ * readers may be following them. A trie node is only published once filled
+ * in, and is not modified in place afterwards if the trie is concurrent, but
+ * for single pointers to children. */
+static inline node_ptr node_load(const node_ptr* x)
+{
+    node_ptr node;
+    node.t = load_acquire(&x->t);
+    return node;
+}
+
+
+static inline void node_store(node_ptr* x, node_ptr node)
+{
+    store_release(&x->t, node.t);
+}
+
+
+static inline node_ptr trie_child(const trie_node_t* node, unsigned char c)
+{
+    return node_load(trie_child_ref(node, c));
+}
+
+
+/* Whether characters a and b map to the same run. A dense node's pointers can
+ * be stored to while readers compare them, so they are loaded as children are;
+ * a sparse node's indexes are not modified in place. */
+static inline bool trie_same_run(const trie_node_t* node, unsigned int a, unsigned int b)
+{
+    if (node->dense) {
+        const node_ptr* xs = trie_xs(node);
+        return node_load(xs + a).t == node_load(xs + b).t;
+    }
+    return trie_idx(node)[a] == trie_idx(node)[b];
+}
+
+
+/* First and last characters of the run covering c. */
+static unsigned int trie_run_first(const trie_node_t* node, unsigned int c)
+{
+    while (c > 0 && trie_same_run(node, c - 1, c)) --c;
+    return c;
+}
+
+
+static unsigned int trie_run_last(const trie_node_t* node, unsigned int c)
+{
+    while (c < NODE_MAXCHAR && trie_same_run(node, c + 1, c)) ++c;
+    return c;
+}
+
+
+/* Allocate a trie node, with the given prefix, which may be NULL if plen is
+ * 0. */
+static trie_node_t* alloc_node(hattrie_t* T, bool dense, size_t cap,
+                               const char* prefix, size_t plen)
+{
+    trie_node_t header;
+    header.dense = dense;
+    header.cap   = (uint16_t) cap;
+    header.plen  = (uint16_t) plen;
+
+    trie_node_t* node = T->alloc.alloc(T->alloc.ctx, trie_node_size(&header));
+    node->flag  = NODE_TYPE_TRIE;
+    node->dense = dense;
+    node->nruns = 1;
+    node->cap   = (uint16_t) cap;
+    node->plen  = (uint16_t) plen;
+    node->val   = 0;
+    node->count = 0;
+    if (plen > 0) memcpy(trie_prefix(node), prefix, plen);
+    return node;
+}
+
+
+static void free_node(hattrie_t* T, trie_node_t* node)
+{
+    cache_invalidate(T);
+    T->alloc.free(T->alloc.ctx, node, trie_node_size(node));
+}
+
+
+/* Create a new trie node with all pointers pointing to the given child (which
+ * can be NULL), and the given prefix. */
+static trie_node_t* alloc_trie_node(hattrie_t* T, node_ptr child,
+                                    const char* prefix, size_t plen)
+{
+    trie_node_t* node = alloc_node(T, false, 1, prefix, plen);
+    memset(trie_idx(node), 0, NODE_CHILDS);
+    trie_xs(node)[0] = child;
+    return node;
+}
+
+
+/* Create a dense trie node with all pointers pointing to child. */
+static trie_node_t* alloc_dense_node(hattrie_t* T, node_ptr child)
+{
+    trie_node_t* node = alloc_node(T, true, 0, NULL, 0);
+    node_ptr* xs = trie_xs(node);
+    size_t i;
+    for (i = 0; i < NODE_CHILDS; ++i) xs[i] = child;
+    return node;
+}
+
+
+/* Copy a node into a new one, dense or sparse with the given capacity, which
+ * must fit all its runs, holding the last plen bytes of the node's prefix. The
+ * old node is freed. */
+static trie_node_t* trie_node_move_tail(hattrie_t* T, trie_node_t* node, bool dense,
+                                        size_t cap, size_t plen)
+{
+    trie_node_t* new_node = alloc_node(T, dense, cap,
+                                       trie_prefix(node) + node->plen - plen, plen);
+    new_node->flag  = node->flag;
+    new_node->nruns = node->nruns;
+    new_node->val   = node->val;
+    new_node->count = node->count;
+
+    unsigned char* idx = trie_idx(new_node);
+    node_ptr*      xs  = trie_xs(new_node);
+    node_ptr child;
+    unsigned int c, last;
+    size_t r = 0;
+    for (c = 0; c < NODE_CHILDS; ++r) {
+        last  = trie_run_last(node, c);
+        child = trie_child(node, (unsigned char) c);
+        if (!dense) xs[r] = child;
+        for (; c <= last; ++c) {
+            if (dense) xs[c]  = child;
+            else       idx[c] = (unsigned char) r;
+        }
+    }
+
+    free_node(T, node);
+    return new_node;
+}
+
+
+/* trie_node_move, keeping the whole prefix. */
+static trie_node_t* trie_node_move(hattrie_t* T, trie_node_t* node, bool dense, size_t cap)
+{
+    return trie_node_move_tail(T, node, dense, cap, node->plen);
+}
+
+
+/* Split the run [c0, c1] of the node pointed to by ref into [c0, j] mapping to
+ * left and [j + 1, c1] mapping to right. The node may be moved to make room,
+ * or copied if the trie is concurrent, in which case *ref is updated. */
+static void trie_split_run(hattrie_t* T, node_ptr* ref, unsigned int c0,
+                           unsigned int j, unsigned int c1,
+                           node_ptr left, node_ptr right)
+{
+    trie_node_t* node = ref->t;
+    unsigned int c;
+
+    if (!node->dense && node->nruns == node->cap) {
+        if (node->cap < T->node_fanout) {
+            size_t cap = 2 * (size_t) node->cap;
+            node = trie_node_move(T, node, false,
+                                  cap < T->node_fanout ? cap : T->node_fanout);
+        }
+        else node = trie_node_move(T, node, true, 0);
+    }
+    else if (T->rcu) node = trie_node_move(T, node, node->dense, node->cap);
+
+    node_ptr* xs = trie_xs(node);
+    if (node->dense) {
+        for (c = c0; c <= j; ++c) xs[c] = left;
+        for (; c <= c1; ++c)      xs[c] = right;
+    }
+    else {
+        /* runs after the split one move up by one */
+        unsigned char* idx = trie_idx(node);
+        size_t r = idx[c0];
+        memmove(xs + r + 1, xs + r, (node->nruns - r) * sizeof(node_ptr));
+        xs[r]     = left;
+        xs[r + 1] = right;
+        for (c = j + 1; c < NODE_CHILDS; ++c) ++idx[c];
+    }
+    ++node->nruns;
+
+    if (node != ref->t) {
+        node_ptr moved;
+        moved.t = node;
+        node_store(ref, moved);
+    }
+}
+
+
+/* Turn a dense node into a sparse one if it has few enough runs. */
+static trie_node_t* trie_node_compact(hattrie_t* T, trie_node_t* node)
+{
+    unsigned int c;
+    size_t nruns = 0;
+    for (c = 0; c < NODE_CHILDS; c = trie_run_last(node, c) + 1) ++nruns;
+
+    node->nruns = (uint16_t) nruns;
+    if (nruns > T->node_fanout) return node;
+    return trie_node_move(T, node, false, nruns);
+}
+
+
+/* Join the runs [c0, j] and [j + 1, c1] of the node pointed to by ref into one
+ * mapping to child, the reverse of trie_split_run. The node may be moved to a
+ * smaller one, or copied if the trie is concurrent, in which case *ref is
+ * updated. */
+static void trie_merge_run(hattrie_t* T, node_ptr* ref, unsigned int c0,
+                           unsigned int j, unsigned int c1, node_ptr child)
+{
+    trie_node_t* node = ref->t;
+    if (T->rcu) node = trie_node_move(T, node, node->dense, node->cap);
+    node_ptr* xs = trie_xs(node);
+    unsigned int c;
+
+    if (node->dense) {
+        for (c = c0; c <= c1; ++c) xs[c] = child;
+    }
+    else {
+        /* runs after the joined ones move down by one */
+        unsigned char* idx = trie_idx(node);
+        size_t r = idx[c0];
+        xs[r] = child;
+        memmove(xs + r + 1, xs + r + 2, (node->nruns - r - 2) * sizeof(node_ptr));
+        for (c = j + 1; c < NODE_CHILDS; ++c) --idx[c];
+    }
+    --node->nruns;
+
+    /* give back room the node no longer needs */
+    if (node->dense) {
+        if (2 * (size_t) node->nruns <= T->node_fanout) {
+            node = trie_node_compact(T, node);
+        }
+    }
+    else if (node->cap > 1 && 4 * (size_t) node->nruns <= node->cap) {
+        node = trie_node_move(T, node, false, node->cap / 2);
+    }
+
+    if (node != ref->t) {
+        node_ptr moved;
+        moved.t = node;
+        node_store(ref, moved);
+    }
+}
+
+
+/* Point the run [c0, c1] of the node pointed to by ref to child, copying the
+ * node if it is dense and the trie concurrent, in which case *ref is updated. */
+static void trie_set_run(hattrie_t* T, node_ptr* ref, unsigned int c0,
+                         unsigned int c1, node_ptr child)
+{
+    trie_node_t* node = ref->t;
+    unsigned int c;
+
+    if (!node->dense) {
+        node_store(trie_xs(node) + trie_idx(node)[c0], child);
+        return;
+    }
+
+    if (T->rcu) node = trie_node_move(T, node, true, 0);
+    for (c = c0; c <= c1; ++c) trie_xs(node)[c] = child;
+    if (node != ref->t) {
+        node_ptr moved;
+        moved.t = node;
+        node_store(ref, moved);
+    }
+}
+
 
 size_t hattrie_size(const hattrie_t* T)
 {
@@ -67,11 +550,10 @@ size_t hattrie_size(const hattrie_t* T)
 static size_t node_sizeof(node_ptr node)
 {
     if (*node.flag & NODE_TYPE_TRIE) {
-        size_t nbytes = sizeof(trie_node_t);
-        size_t i;
-        nbytes += node_sizeof(node.t->xs[0]);
-        for (i = 1; i < NODE_CHILDS; ++i) {
-            if (node.t->xs[i].t != node.t->xs[i-1].t) nbytes += node_sizeof(node.t->xs[i]);
+        size_t nbytes = trie_node_size(node.t);
+        unsigned int c;
+        for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+            nbytes += node_sizeof(trie_child(node.t, (unsigned char) c));
         }
         return nbytes;
     }
@@ -81,41 +563,188 @@ static size_t node_sizeof(node_ptr node)
 }
 
 
+/* Memory of the lookup cache, and the keys it copied. */
+static size_t cache_sizeof(const hattrie_t* T)
+{
+    if (T->cache == NULL) return 0;
+
+    size_t nbytes = T->cache_n * sizeof(cache_line_t) + CACHE_LINE - 1;
+    size_t j, w;
+    for (j = 0; j < T->cache_n; ++j) {
+        for (w = 0; w < CACHE_WAYS; ++w) {
+            if (T->cache[j].ways[w].key) nbytes += T->cache[j].ways[w].len + 1;
+        }
+    }
+    return nbytes;
+}
+
+
 size_t hattrie_sizeof(const hattrie_t* T)
 {
-    return sizeof(hattrie_t) + node_sizeof(T->root);
+    if (T->image) return sizeof(hattrie_t) + cache_sizeof(T) + T->image_len;
+    return sizeof(hattrie_t) + cache_sizeof(T) + node_sizeof(T->root) +
+           (T->mig.src ? ahtable_sizeof(T->mig.src) : 0);
 }
 
 
-/* Create a new trie node with all pointers pointing to the given child (which
- * can be NULL). */
-static trie_node_t* alloc_trie_node(hattrie_t* T, node_ptr child)
+static void node_shrink(node_ptr node)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        unsigned int c;
+        for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+            node_shrink(trie_child(node.t, (unsigned char) c));
+        }
+    }
+    else {
+        ahtable_shrink(node.b);
+    }
+}
+
+
+/* Bin of a histogram of sizes: 0 for 0, and floor(log2(x)) + 1 otherwise, the
+ * last bin taking everything larger. */
+static size_t stats_bin(size_t x)
 {
-    trie_node_t* node = malloc_or_die(sizeof(trie_node_t));
-    node->flag = NODE_TYPE_TRIE;
-    node->val  = 0;
+    size_t bin = 0;
+    while (x) {
+        ++bin;
+        x >>= 1;
+    }
+    return bin < HATTRIE_STATS_BINS ? bin : HATTRIE_STATS_BINS - 1;
+}
 
-    /* pass T to allow custom allocator for trie. */
-    HT_UNUSED(T); /* unused now */
 
-    size_t i;
-    for (i = 0; i < NODE_CHILDS; ++i) node->xs[i] = child;
-    return node;
+/* Add a table to the statistics. */
+static void bucket_stats(hattrie_stats_t* stats, const ahtable_t* b)
+{
+    size_t i, k, spare = 0;
+    for (i = 0; i < b->n; ++i) {
+        stats->slot_bytes[stats_bin(b->slots[i].size)] += 1;
+        spare += b->slot_caps[i] - b->slots[i].size;
+
+        k = ahtable_slot_count(b, i);
+        if (k == 0) stats->empty_slots += 1;
+        if (k > stats->max_chain) stats->max_chain = k;
+    }
+
+    stats->buckets += 1;
+    if (b->flag & NODE_TYPE_PURE_BUCKET) stats->pure_buckets += 1;
+    else                                 stats->hybrid_buckets += 1;
+    stats->bucket_keys[stats_bin(b->m)] += 1;
+    stats->slots     += b->n;
+    stats->avg_chain += (double) b->m; // summed, until divided by hattrie_stats
+    stats->allocated += ahtable_sizeof(b);
+    stats->used      += ahtable_sizeof(b) - spare;
+}
+
+
+/* Add a node, below depth trie nodes, and everything under it to the
+ * statistics. */
+static void node_stats(hattrie_stats_t* stats, node_ptr node, size_t depth)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        stats->nodes += 1;
+        if (node.t->dense) stats->dense_nodes += 1;
+        if (node.t->plen > 0) {
+            stats->prefixed_nodes += 1;
+            stats->prefix_bytes   += node.t->plen;
+        }
+        stats->allocated += trie_node_size(node.t);
+        stats->used      += trie_node_size(node.t) -
+                            (node.t->dense ? 0 : (size_t) (node.t->cap - node.t->nruns) *
+                                                 sizeof(node_ptr));
+
+        unsigned int c;
+        for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+            node_stats(stats, trie_child(node.t, (unsigned char) c), depth + 1);
+        }
+    }
+    else {
+        bucket_stats(stats, node.b);
+        stats->depths[depth < HATTRIE_STATS_DEPTHS ? depth : HATTRIE_STATS_DEPTHS - 1] += 1;
+        if (depth > stats->max_depth) stats->max_depth = depth;
+    }
+}
+
+
+int hattrie_stats(const hattrie_t* T, hattrie_stats_t* stats)
+{
+    memset(stats, 0, sizeof(hattrie_stats_t));
+    stats->keys         = T->m;
+    stats->cache_hits   = T->cache_hits;
+    stats->cache_misses = T->cache_misses;
+    if (T->image) return -1;
+
+    node_stats(stats, T->root, 0);
+    stats->splits     = T->nsplits;
+    stats->expansions = T->nexpansions;
+    stats->allocated += sizeof(hattrie_t) + cache_sizeof(T);
+    stats->used      += sizeof(hattrie_t) + cache_sizeof(T);
+    if (T->mig.src) {
+        stats->allocated += ahtable_sizeof(T->mig.src);
+        stats->used      += ahtable_sizeof(T->mig.src);
+    }
+
+    size_t nonempty = stats->slots - stats->empty_slots;
+    stats->avg_chain = nonempty ? stats->avg_chain / (double) nonempty : 0.0;
+
+    ahtable_counters_t counters;
+    ahtable_counters(&counters);
+    stats->slot_lookups = counters.lookups;
+    stats->slot_scanned = counters.scanned;
+    return 0;
+}
+
+
+static void migration_finish(hattrie_t* T);
+
+void hattrie_shrink(hattrie_t* T)
+{
+    if (T->image) return;
+    migration_finish(T);
+    cache_invalidate(T);
+    node_shrink(T->root);
 }
 
-/* iterate trie nodes until string is consumed or bucket is found */
-static node_ptr hattrie_consume(node_ptr *p, const char **k, size_t *l, unsigned brk)
+
+static node_ptr trie_split_prefix(hattrie_t* T, node_ptr* x, size_t k);
+
+/* iterate trie nodes until string is consumed or bucket is found. ref is left
+ * pointing to where the parent is referenced from. A key leaving the prefix of
+ * a trie node splits the prefix where it does if T is given, and is not found
+ * otherwise, a NULL node being returned. */
+static node_ptr hattrie_consume(hattrie_t* T, node_ptr *p, node_ptr **ref,
+                                const char **k, size_t *l)
 {
-    node_ptr node = p->t->xs[(unsigned char) **k];
-    while (*node.flag & NODE_TYPE_TRIE && *l > brk) {
+    node_ptr* x = trie_child_ref(p->t, (unsigned char) **k);
+    node_ptr  node = node_load(x);
+    size_t    i;
+    while (*node.flag & NODE_TYPE_TRIE) {
         ++*k;
         --*l;
+
+        if (node.t->plen > 0) {
+            if (!trie_prefix_match(node.t, *k, *l)) {
+                if (T == NULL) {
+                    node.flag = NULL;
+                    return node;
+                }
+                for (i = 0; i < *l && (*k)[i] == trie_prefix(node.t)[i]; ++i);
+                node = trie_split_prefix(T, x, i);
+            }
+            *k += node.t->plen;
+            *l -= node.t->plen;
+        }
+
+        /* the key ends on this trie node */
+        if (*l == 0) break;
+
+        *ref = x;
         *p   = node;
-        node = node.t->xs[(unsigned char) **k];
+        x    = trie_child_ref(p->t, (unsigned char) **k);
+        node = node_load(x);
     }
 
-    /* copy and writeback variables if it's faster */
-
     assert(*p->flag & NODE_TYPE_TRIE);
     return node;
 }
@@ -142,15 +771,21 @@ static inline int hattrie_clrval(hattrie_t *T, node_ptr n)
     return -1;
 }
 
-/* find node in trie */
-static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len)
+/* find node in trie, setting *ref, unless ref is NULL, to the reference to its
+ * parent */
+static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len,
+                             node_ptr** ref)
 {
-    node_ptr parent = T->root;
+    node_ptr parent = node_load(&T->root);
+    node_ptr* r = &T->root;
     assert(*parent.flag & NODE_TYPE_TRIE);
 
+    if (ref) *ref = r;
     if (*len == 0) return parent;
 
-    node_ptr node = hattrie_consume(&parent, key, len, 1);
+    node_ptr node = hattrie_consume(NULL, &parent, &r, key, len);
+    if (ref) *ref = r;
+    if (node.flag == NULL) return node;
 
     /* if the trie node consumes value, use it */
     if (*node.flag & NODE_TYPE_TRIE) {
@@ -170,86 +805,543 @@ static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len)
     return node;
 }
 
-hattrie_t* hattrie_create()
+/* Allocate a trie without a root, with the given options (or the defaults if
+ * NULL). */
+static hattrie_t* hattrie_alloc(const hattrie_opts_t* opts)
 {
     hattrie_t* T = malloc_or_die(sizeof(hattrie_t));
+    T->root.t = NULL;
     T->m = 0;
+    T->image = NULL;
+    T->image_len = 0;
+    T->image_mapped = false;
+    T->rcu = NULL;
+    T->nsplits     = 0;
+    T->nexpansions = 0;
+    T->step        = 0;
+    T->mig.src     = NULL;
+    T->cache       = NULL;
+    T->cache_mem   = NULL;
+    T->cache_n     = 0;
+    T->cache_epoch = 1;
+    T->cache_hits  = 0;
+    T->cache_misses = 0;
+
+    T->alloc        = hattrie_default_allocator;
+    T->burst_size   = MAX_BUCKET_SIZE;
+    T->bucket_slots = ahtable_initial_size;
+    T->load_factor  = ahtable_max_load_factor;
+    T->node_fanout  = NODE_SPARSE_MAX;
+    T->hash         = HATTRIE_HASH_WYHASH;
+    T->seed         = 0;
+    T->vsize        = sizeof(value_t);
+    T->counts       = false;
+    if (opts) {
+        if (opts->alloc)        T->alloc        = *opts->alloc;
+        if (opts->burst_size)   T->burst_size   = opts->burst_size;
+        if (opts->bucket_slots) T->bucket_slots = opts->bucket_slots;
+        if (opts->load_factor)  T->load_factor  = opts->load_factor;
+        if (opts->node_fanout)  T->node_fanout  = opts->node_fanout;
+        T->hash = opts->hash;
+        T->seed = opts->hash_seed;
+        T->step = opts->incremental_step;
+        if (opts->value_size == HATTRIE_VALUE_SET) T->vsize = 0;
+        else if (opts->value_size)                 T->vsize = opts->value_size;
+        T->counts = opts->counts;
+    }
+    if (T->node_fanout > NODE_CHILDS) T->node_fanout = NODE_CHILDS;
 
-    node_ptr node;
-    node.b = ahtable_create();
-    node.b->flag = NODE_TYPE_HYBRID_BUCKET;
-    node.b->c0 = 0x00;
-    node.b->c1 = NODE_MAXCHAR;
-    T->root.t = alloc_trie_node(T, node);
-
+    if (opts && opts->concurrent) {
+        /* readers could not follow keys moving between buckets */
+        T->step  = 0;
+        T->rcu   = rcu_create(&T->alloc);
+        T->alloc = rcu_allocator(T->rcu);
+    }
     return T;
 }
 
 
-static void hattrie_free_node(node_ptr node)
+/* Number of slots for a new bucket that will hold m keys. */
+static size_t bucket_slots(const hattrie_t* T, size_t m)
 {
-    if (*node.flag & NODE_TYPE_TRIE) {
-        size_t i;
-        for (i = 0; i < NODE_CHILDS; ++i) {
-            if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) continue;
-
-            /* XXX: recursion might not be the best choice here. It is possible
-             * to build a very deep trie. */
-            if (node.t->xs[i].t) hattrie_free_node(node.t->xs[i]);
-        }
-        free(node.t);
-    }
-    else {
-        ahtable_free(node.b);
-    }
+    size_t num_slots;
+    for (num_slots = T->bucket_slots;
+            (double) m > T->load_factor * (double) num_slots;
+            num_slots *= 2);
+    return num_slots;
 }
 
 
-void hattrie_free(hattrie_t* T)
+/* Free a bucket of the trie, which the lookup cache may point into. */
+static void bucket_free(hattrie_t* T, ahtable_t* b)
 {
-    hattrie_free_node(T->root);
-    free(T);
+    cache_invalidate(T);
+    ahtable_free(b);
 }
 
 
-void hattrie_clear(hattrie_t* T)
+/* Create an empty bucket with n slots. */
+static ahtable_t* bucket_create_n(hattrie_t* T, size_t n)
 {
-    hattrie_free_node(T->root);
-    node_ptr node;
-    node.b = ahtable_create();
-    node.b->flag = NODE_TYPE_HYBRID_BUCKET;
-    node.b->c0 = 0x00;
-    node.b->c1 = 0xff;
-    T->root.t = alloc_trie_node(T, node);
+    ahtable_t* b = ahtable_create_with_allocator(n, &T->alloc);
+    ahtable_set_max_load(b, T->load_factor);
+    ahtable_set_hash(b, T->hash, T->seed);
+    ahtable_set_value_size(b, T->vsize);
+    b->shared = T->rcu != NULL;
+    return b;
 }
 
 
-/* Perform one split operation on the given node with the given parent.
- */
-static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
+/* Create an empty bucket with room for m keys. */
+static ahtable_t* bucket_create(hattrie_t* T, size_t m)
 {
-    /* only buckets may be split */
-    assert(*node.flag & NODE_TYPE_PURE_BUCKET ||
-           *node.flag & NODE_TYPE_HYBRID_BUCKET);
-
-    assert(*parent.flag & NODE_TYPE_TRIE);
-
-    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-        /* turn the pure bucket into a hybrid bucket */
-        parent.t->xs[node.b->c0].t = alloc_trie_node(T, node);
+    return bucket_create_n(T, bucket_slots(T, m));
+}
 
-        /* if the bucket had an empty key, move it to the new trie node */
-        value_t* val = ahtable_tryget(node.b, NULL, 0);
-        if (val) {
-            parent.t->xs[node.b->c0].t->val     = *val;
-            parent.t->xs[node.b->c0].t->flag |= NODE_HAS_VAL;
-            *val = 0;
-            ahtable_del(node.b, NULL, 0);
-        }
 
-        node.b->c0   = 0x00;
-        node.b->c1   = NODE_MAXCHAR;
-        node.b->flag = NODE_TYPE_HYBRID_BUCKET;
+/* Copy bucket b, its range and keys, into a new bucket with n slots. */
+static ahtable_t* bucket_clone(hattrie_t* T, ahtable_t* b, size_t n)
+{
+    ahtable_t* u = bucket_create_n(T, n);
+    u->flag = b->flag;
+    u->c0   = b->c0;
+    u->c1   = b->c1;
+
+    size_t len;
+    const char* key;
+    ahtable_iter_t* i = ahtable_iter_begin(b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        memcpy(ahtable_get(u, key, len), ahtable_iter_val(i), T->vsize);
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+    return u;
+}
+
+
+/* Resize bucket b, a child of the node pointed to by ref, to n slots. Buckets
+ * of a concurrent trie are replaced by a resized copy instead, which is
+ * returned. */
+static ahtable_t* bucket_resize(hattrie_t* T, node_ptr* ref, ahtable_t* b, size_t n)
+{
+    cache_invalidate(T);
+    if (!b->shared) {
+        ahtable_resize(b, n);
+        return b;
+    }
+
+    node_ptr u;
+    u.b = bucket_clone(T, b, n);
+    trie_set_run(T, ref, b->c0, b->c1, u);
+    bucket_free(T, b);
+    return u.b;
+}
+
+
+/* Buckets emptied by deletion shrink their slot arrays down to this many slots,
+ * keeping between 4 and 8 slots per key, and grow back by doubling in
+ * hattrie_get once they hold 2 keys per slot. */
+#define BUCKET_MIN_SLOTS 8
+
+static size_t bucket_shrunk_slots(size_t n, size_t m)
+{
+    while (n > BUCKET_MIN_SLOTS && n >= 8 * m) n /= 2;
+    return n;
+}
+
+
+/* Shrink a bucket's slots if deletions left them mostly empty, returning the
+ * bucket (see bucket_resize). */
+static ahtable_t* bucket_shrink(hattrie_t* T, node_ptr* ref, ahtable_t* b)
+{
+    if (b->n > BUCKET_MIN_SLOTS && 16 * b->m < b->n) {
+        b = bucket_resize(T, ref, b, bucket_shrunk_slots(b->n, b->m));
+    }
+    return b;
+}
+
+
+/* Grow a shrunk bucket back before inserting into it, returning the bucket (see
+ * bucket_resize). A shared bucket cannot resize itself once full, so it is
+ * grown here as well. */
+static ahtable_t* bucket_grow(hattrie_t* T, node_ptr* ref, ahtable_t* b)
+{
+    if (b->n < T->bucket_slots && b->m >= 2 * b->n) {
+        b = bucket_resize(T, ref, b,
+                          2 * b->n < T->bucket_slots ? 2 * b->n : T->bucket_slots);
+    }
+    else if (b->shared && b->m >= b->max_m) {
+        b = bucket_resize(T, ref, b, 2 * b->n);
+    }
+    return b;
+}
+
+
+/* Split the prefix of the trie node pointed to by x before its k-th byte, for a
+ * key leaving it there. A new node holding the first k bytes takes the node's
+ * place, leading through the next byte to the node, left with the rest of the
+ * prefix, and through the other characters to empty buckets. Returns the new
+ * node. */
+static node_ptr trie_split_prefix(hattrie_t* T, node_ptr* x, size_t k)
+{
+    trie_node_t* node = x->t;
+    assert(k < node->plen);
+    unsigned char c = (unsigned char) trie_prefix(node)[k];
+    size_t nruns = 1 + (c > 0) + (c < NODE_MAXCHAR);
+
+    node_ptr top;
+    top.t = alloc_node(T, false, nruns, trie_prefix(node), k);
+    top.t->nruns = (uint16_t) nruns;
+    top.t->count = node->count;
+
+    unsigned char* idx = trie_idx(top.t);
+    node_ptr*      xs  = trie_xs(top.t);
+    size_t r = 0;
+    if (c > 0) {
+        xs[r].b = bucket_create_n(T, BUCKET_MIN_SLOTS);
+        xs[r].b->c0 = 0;
+        xs[r].b->c1 = c - 1;
+        memset(idx, (int) r, c);
+        ++r;
+    }
+    xs[r].t = trie_node_move_tail(T, node, node->dense, node->cap, node->plen - k - 1);
+    idx[c] = (unsigned char) r;
+    ++r;
+    if (c < NODE_MAXCHAR) {
+        xs[r].b = bucket_create_n(T, BUCKET_MIN_SLOTS);
+        xs[r].b->c0 = c + 1;
+        xs[r].b->c1 = NODE_MAXCHAR;
+        memset(idx + c + 1, (int) r, NODE_MAXCHAR - c);
+    }
+
+    for (r = 0; r < nruns; ++r) {
+        if (*xs[r].flag & NODE_TYPE_TRIE) continue;
+        xs[r].b->flag = xs[r].b->c0 == xs[r].b->c1 ?
+                           NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+    }
+
+    node_store(x, top);
+    return top;
+}
+
+
+/* Incremental splits and resizes.
+ *
+ * With T->step set, a bucket that is split or resized is replaced in the trie
+ * right away by empty buckets, and its keys are moved over a few slots at a
+ * time by every following hattrie_get and hattrie_del. Until then, a key
+ * missing from one of the new buckets may still be in the old one. One move is
+ * in progress at a time: anything modifying the trie that needs it in its
+ * final shape, such as another split or deleting keys merging buckets, finishes
+ * it first. Iterating, saving and counting keys cannot modify the trie, and
+ * would miss the keys left in the old bucket, so they fail until
+ * hattrie_finish_moves has been called.
+ */
+
+/* Move at least max keys of the bucket being moved, or all of them, freeing
+ * the bucket once it is empty. */
+static void migration_step(hattrie_t* T, size_t max)
+{
+    migration_t* mig = &T->mig;
+    if (mig->src == NULL) return;
+
+    size_t moved = 0;
+    cache_touch(mig->src);
+    cache_touch(mig->lo);
+    cache_touch(mig->hi);
+    while (moved < max && mig->pos < mig->src->n) {
+        moved += ahtable_split_slot(mig->src, mig->pos++, mig->c,
+                                    mig->lo, mig->lo->flag & NODE_TYPE_PURE_BUCKET &&
+                                             !(mig->src->flag & NODE_TYPE_PURE_BUCKET),
+                                    mig->hi, mig->hi->flag & NODE_TYPE_PURE_BUCKET &&
+                                             !(mig->src->flag & NODE_TYPE_PURE_BUCKET));
+    }
+
+    if (mig->pos == mig->src->n) {
+        bucket_free(T, mig->src);
+        mig->src = NULL;
+    }
+}
+
+
+static void migration_finish(hattrie_t* T)
+{
+    migration_step(T, (size_t) -1);
+}
+
+
+void hattrie_finish_moves(hattrie_t* T)
+{
+    migration_finish(T);
+}
+
+
+/* Start moving bucket src into lo and hi. */
+static void migration_start(hattrie_t* T, ahtable_t* src, unsigned char c,
+                            ahtable_t* lo, ahtable_t* hi)
+{
+    migration_finish(T);
+    T->mig.src = src;
+    T->mig.lo  = lo;
+    T->mig.hi  = hi;
+    T->mig.c   = c;
+    T->mig.pos = 0;
+}
+
+
+/* Whether keys of bucket b may still be in the bucket being moved. */
+static inline bool migration_into(const hattrie_t* T, const ahtable_t* b)
+{
+    return T->mig.src != NULL && (b == T->mig.lo || b == T->mig.hi);
+}
+
+
+/* Find a key missing from bucket b in the bucket being moved into it, if any.
+ * The key is as looked up in b, so for a pure bucket it follows the character
+ * leading to b. */
+static value_t* migration_tryget(const hattrie_t* T, const ahtable_t* b,
+                                 const char* key, size_t len)
+{
+    const migration_t* mig = &T->mig;
+    if (!migration_into(T, b)) return NULL;
+
+    if (b->flag & NODE_TYPE_PURE_BUCKET)        { --key; ++len; }
+    if (mig->src->flag & NODE_TYPE_PURE_BUCKET) { ++key; --len; }
+    return ahtable_tryget(mig->src, key, len);
+}
+
+
+/* Delete a key missing from bucket b from the bucket being moved into it, as
+ * migration_tryget. Returns 0 if successful or -1 if not found. */
+static int migration_del(hattrie_t* T, const ahtable_t* b, const char* key, size_t len)
+{
+    migration_t* mig = &T->mig;
+    if (!migration_into(T, b)) return -1;
+
+    if (b->flag & NODE_TYPE_PURE_BUCKET)        { --key; ++len; }
+    if (mig->src->flag & NODE_TYPE_PURE_BUCKET) { ++key; --len; }
+    return ahtable_del(mig->src, key, len);
+}
+
+
+/* Replace bucket b, a child of the node pointed to by ref, by an empty one with
+ * twice the slots, into which its keys are moved incrementally. Returns the new
+ * bucket. */
+static ahtable_t* migration_resize(hattrie_t* T, node_ptr* ref, ahtable_t* b)
+{
+    node_ptr u;
+    u.b = bucket_create_n(T, 2 * b->n);
+    u.b->flag = b->flag;
+    u.b->c0   = b->c0;
+    u.b->c1   = b->c1;
+    trie_set_run(T, ref, b->c0, b->c1, u);
+    migration_start(T, b, NODE_MAXCHAR, u.b, u.b);
+    return u.b;
+}
+
+
+/* Give T a root node holding a single empty bucket. */
+static void hattrie_init_root(hattrie_t* T)
+{
+    node_ptr node;
+    node.b = bucket_create(T, 0);
+    node.b->flag = NODE_TYPE_HYBRID_BUCKET;
+    node.b->c0 = 0x00;
+    node.b->c1 = NODE_MAXCHAR;
+
+    node_ptr root;
+    root.t = alloc_trie_node(T, node, NULL, 0);
+    node_store(&T->root, root);
+}
+
+
+hattrie_t* hattrie_create()
+{
+    return hattrie_create_with_allocator(NULL);
+}
+
+
+hattrie_t* hattrie_create_with_allocator(const hattrie_allocator_t* alloc)
+{
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.alloc = alloc;
+    return hattrie_create_ex(&opts);
+}
+
+
+hattrie_t* hattrie_create_ex(const hattrie_opts_t* opts)
+{
+    if (opts && opts->value_size != HATTRIE_VALUE_SET &&
+        opts->value_size > sizeof(value_t)) {
+        return NULL;
+    }
+
+    hattrie_t* T = hattrie_alloc(opts);
+    hattrie_init_root(T);
+    if (opts && opts->cache_keys) hattrie_set_cache(T, opts->cache_keys);
+    return T;
+}
+
+
+hattrie_reader_t* hattrie_reader_register(hattrie_t* T)
+{
+    return T->rcu ? rcu_reader_register(T->rcu) : NULL;
+}
+
+
+void hattrie_reader_unregister(hattrie_reader_t* r)
+{
+    rcu_reader_unregister(r);
+}
+
+
+void hattrie_read_lock(hattrie_reader_t* r)
+{
+    rcu_read_lock(r);
+}
+
+
+void hattrie_read_unlock(hattrie_reader_t* r)
+{
+    rcu_read_unlock(r);
+}
+
+
+void hattrie_synchronize(hattrie_t* T)
+{
+    if (T->rcu) rcu_synchronize(T->rcu);
+}
+
+
+static void hattrie_free_node(hattrie_t* T, node_ptr node)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        unsigned int c;
+        node_ptr child;
+        for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+            /* XXX: recursion might not be the best choice here. It is possible
+             * to build a very deep trie. */
+            child = trie_child(node.t, (unsigned char) c);
+            if (child.t) hattrie_free_node(T, child);
+        }
+        free_node(T, node.t);
+    }
+    else {
+        bucket_free(T, node.b);
+    }
+}
+
+
+static void hattrie_release_image(hattrie_t* T)
+{
+#ifdef HATTRIE_USE_MMAP
+    if (T->image_mapped) munmap((void*) T->image, T->image_len);
+    else free((void*) T->image);
+#else
+    free((void*) T->image);
+#endif
+    T->image = NULL;
+    T->image_len = 0;
+    T->image_mapped = false;
+}
+
+
+/* Free every node of the trie, all at once if the allocator allows it. */
+static void hattrie_free_nodes(hattrie_t* T)
+{
+    if (T->image) hattrie_release_image(T);
+    else if (T->alloc.release) T->alloc.release(T->alloc.ctx);
+    else {
+        hattrie_free_node(T, T->root);
+        if (T->mig.src) bucket_free(T, T->mig.src);
+    }
+    T->root.t  = NULL;
+    T->mig.src = NULL;
+    cache_invalidate(T);
+}
+
+
+void hattrie_free(hattrie_t* T)
+{
+    if (T->rcu) {
+        hattrie_free_node(T, T->root);
+        rcu_free(T->rcu);
+    }
+    else hattrie_free_nodes(T);
+    cache_free(T);
+    free(T);
+}
+
+
+void hattrie_clear(hattrie_t* T)
+{
+    T->m = 0;
+    if (T->rcu) {
+        /* readers may still be in the old nodes */
+        node_ptr old = T->root;
+        hattrie_init_root(T);
+        hattrie_free_node(T, old);
+        return;
+    }
+
+    hattrie_free_nodes(T);
+    hattrie_init_root(T);
+}
+
+
+/* Perform one split operation on the given node with the parent referenced by
+ * ref, which is updated if the parent has to be moved.
+ */
+static void hattrie_split(hattrie_t* T, node_ptr* ref, node_ptr node)
+{
+    node_ptr parent = *ref;
+
+    /* only buckets may be split */
+    assert(*node.flag & NODE_TYPE_PURE_BUCKET ||
+           *node.flag & NODE_TYPE_HYBRID_BUCKET);
+
+    assert(*parent.flag & NODE_TYPE_TRIE);
+    ++T->nsplits;
+    cache_invalidate(T);
+
+    /* the bucket may be one still being filled by a move */
+    migration_finish(T);
+
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        /* Turn the pure bucket into a hybrid bucket, or a copy if readers may
+         * still be looking it up as a pure one. If all its keys start alike,
+         * the new trie node takes that prefix, the copy holding their rest. */
+        unsigned char c = node.b->c0;
+        node_ptr bucket = node;
+        const char* prefix;
+        size_t plen = ahtable_common_prefix(node.b, NODE_PREFIX_MAX, &prefix);
+        if (plen > 0) {
+            bucket.b = bucket_create_n(T, node.b->n);
+            ahtable_strip(node.b, plen, bucket.b);
+        }
+        else if (T->rcu) bucket.b = bucket_clone(T, node.b, node.b->n);
+        trie_node_t* child = alloc_trie_node(T, bucket, prefix, plen);
+        child->count = ahtable_size(bucket.b);
+
+        /* if the bucket had an empty key, move it to the new trie node */
+        value_t* val = ahtable_tryget(bucket.b, "", 0);
+        if (val) {
+            memcpy(&child->val, val, T->vsize);
+            child->flag |= NODE_HAS_VAL;
+            memset(val, 0, T->vsize);
+            ahtable_del(bucket.b, "", 0);
+        }
+
+        bucket.b->c0   = 0x00;
+        bucket.b->c1   = NODE_MAXCHAR;
+        bucket.b->flag = NODE_TYPE_HYBRID_BUCKET;
+
+        node_ptr x;
+        x.t = child;
+        node_store(trie_child_ref(parent.t, c), x);
+        if (bucket.b != node.b) bucket_free(T, node.b);
 
         return;
     }
@@ -259,17 +1351,7 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
     /* count the number of occourances of every leading character */
     unsigned int cs[NODE_CHILDS]; // occurance count for leading chars
     memset(cs, 0, NODE_CHILDS * sizeof(unsigned int));
-    size_t len;
-    const char* key;
-
-    ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        assert(len > 0);
-        cs[(unsigned char) key[0]] += 1;
-        ahtable_iter_next(i);
-    }
-    ahtable_iter_free(i);
+    ahtable_count_first(node.b, cs);
 
     /* choose a split point */
     unsigned int left_m, right_m, all_m;
@@ -292,325 +1374,2590 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
     /* now split into two node cooresponding to ranges [0, j] and
      * [j + 1, NODE_MAXCHAR], respectively. */
 
-
-    /* create new left and right nodes */
-
-    /* TODO: Add a special case if either node is a hybrid bucket containing all
-     * the keys. In such a case, do not build a new table, just use the old one.
-     * */
-    size_t num_slots;
-
-
-    for (num_slots = ahtable_initial_size;
-            (double) left_m > ahtable_max_load_factor * (double) num_slots;
-            num_slots *= 2);
-
     node_ptr left, right;
-    left.b  = ahtable_create_n(num_slots);
+    left.b  = bucket_create(T, left_m);
     left.b->c0   = node.b->c0;
     left.b->c1   = j;
     left.b->flag = left.b->c0 == left.b->c1 ?
                       NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
 
+    /* If every key goes right, into a hybrid bucket, the bucket is kept and
+     * only its range narrowed, unless readers of a concurrent trie may be
+     * looking at the range. */
+    if (left_m == 0 && j + 1 < node.b->c1 && T->rcu == NULL) {
+        node.b->c0 = j + 1;
+        trie_split_run(T, ref, left.b->c0, j, node.b->c1, left, node);
+        return;
+    }
 
-    for (num_slots = ahtable_initial_size;
-            (double) right_m > ahtable_max_load_factor * (double) num_slots;
-            num_slots *= 2);
-
-    right.b = ahtable_create_n(num_slots);
+    right.b = bucket_create(T, right_m);
     right.b->c0   = j + 1;
     right.b->c1   = node.b->c1;
     right.b->flag = right.b->c0 == right.b->c1 ?
                       NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
 
+    /* move the keys over later, a few at a time */
+    if (T->step) {
+        unsigned char c0 = node.b->c0, c1 = node.b->c1;
+        migration_start(T, node.b, j, left.b, right.b);
+        trie_split_run(T, ref, c0, j, c1, left, right);
+        return;
+    }
+
+    /* distribute keys to the new left or right node, in one pass into slots
+     * of their exact size */
+    ahtable_split(node.b, j, left.b, *left.flag & NODE_TYPE_PURE_BUCKET,
+                  right.b, *right.flag & NODE_TYPE_PURE_BUCKET);
+
+    /* update the parent's pointer, once the new nodes are filled */
+    trie_split_run(T, ref, node.b->c0, j, node.b->c1, left, right);
+    bucket_free(T, node.b);
+}
+
+/* Add one to, or take one from, the count of every trie node on the path of a
+ * key in the trie. */
+static void trie_count_path(hattrie_t* T, const char* key, size_t len, bool add)
+{
+    trie_node_t* node = T->root.t;
+    node_ptr child;
+    size_t i = 0;
+    while (true) {
+        if (add) ++node->count;
+        else     --node->count;
+        if (i == len) return;
+
+        child = trie_child(node, (unsigned char) key[i]);
+        if (!(*child.flag & NODE_TYPE_TRIE)) return;
+        node = child.t;
+        i += 1 + node->plen;
+    }
+}
+
 
-    /* update the parent's pointer */
+/* Set the count of every trie node under and including node, returning the
+ * number of keys there. */
+static size_t trie_recount(node_ptr node)
+{
+    if (!(*node.flag & NODE_TYPE_TRIE)) return ahtable_size(node.b);
 
+    size_t count = node.t->flag & NODE_HAS_VAL ? 1 : 0;
     unsigned int c;
-    for (c = node.b->c0; c <= j; ++c) parent.t->xs[c] = left;
-    for (; c <= node.b->c1; ++c)      parent.t->xs[c] = right;
+    for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+        count += trie_recount(trie_child(node.t, (unsigned char) c));
+    }
+    node.t->count = count;
+    return count;
+}
+
+
+/* hattrie_get, without counting the key. */
+static value_t* trie_get(hattrie_t* T, const char* key, size_t len)
+{
+    /* images are read-only */
+    if (T->image) return NULL;
+    if (T->rcu) rcu_tick(T->rcu);
+    migration_step(T, T->step);
+
+    node_ptr parent = T->root;
+    node_ptr* ref = &T->root;
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    if (len == 0) return &parent.t->val;
+
+    /* consume all trie nodes, now parent must be trie and child anything */
+    node_ptr node = hattrie_consume(T, &parent, &ref, &key, &len);
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    /* if the key has been consumed on a trie node, use its value */
+    if (len == 0) {
+        if (*node.flag & NODE_TYPE_TRIE) {
+            return hattrie_useval(T, node);
+        }
+        else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
+            return hattrie_useval(T, parent);
+        }
+    }
+
+
+    /* preemptively split the bucket if it is full */
+    while (ahtable_size(node.b) >= T->burst_size) {
+        hattrie_split(T, ref, node);
+
+        /* after the split, the node pointer is invalidated, so we search from
+         * the parent again. */
+        parent = *ref;
+        node = hattrie_consume(T, &parent, &ref, &key, &len);
+
+        /* if the key has been consumed on a trie node, use its value */
+        if (len == 0) {
+            if (*node.flag & NODE_TYPE_TRIE) {
+                return hattrie_useval(T, node);
+            }
+            else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
+                return hattrie_useval(T, parent);
+            }
+        }
+    }
+
+    assert(*node.flag & NODE_TYPE_PURE_BUCKET || *node.flag & NODE_TYPE_HYBRID_BUCKET);
+
+    assert(len > 0);
+    size_t n_old = node.b->n;
+    node.b = bucket_grow(T, ref, node.b);
+    if (T->step && node.b->m >= node.b->max_m) node.b = migration_resize(T, ref, node.b);
+    size_t m_old = node.b->m;
+    value_t* val;
+
+    /* a key not moved yet stays where it is until it is */
+    if (migration_into(T, node.b)) {
+        val = *node.flag & NODE_TYPE_PURE_BUCKET ?
+              ahtable_tryget(node.b, key + 1, len - 1) : ahtable_tryget(node.b, key, len);
+        if (val == NULL) {
+            val = *node.flag & NODE_TYPE_PURE_BUCKET ?
+                  migration_tryget(T, node.b, key + 1, len - 1) :
+                  migration_tryget(T, node.b, key, len);
+        }
+        if (val) return val;
+    }
+
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        val = ahtable_get(node.b, key + 1, len - 1);
+    }
+    else {
+        val = ahtable_get(node.b, key, len);
+    }
+    T->m += (node.b->m - m_old);
+    if (node.b->n > n_old) ++T->nexpansions;
+
+    /* the slot may have moved to make room for the key */
+    if (node.b->m != m_old) cache_touch(node.b);
+
+    return val;
+}
+
+
+value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
+{
+    size_t m = T->m;
+    value_t* val = trie_get(T, key, len);
+    if (T->counts && T->m != m) trie_count_path(T, key, len, true);
+    return val;
+}
+
+
+value_t* hattrie_upsert(hattrie_t* T, const char* key, size_t len, bool* inserted)
+{
+    size_t m = T->m;
+    value_t* val = hattrie_get(T, key, len);
+    if (inserted) *inserted = T->m != m;
+    return val;
+}
+
+
+static value_t* image_tryget(const hattrie_t* T, const char* key, size_t len);
+
+/* hattrie_tryget, without the cache, setting *b to the bucket the value is in,
+ * or NULL if it is in a trie node or an image. */
+static value_t* trie_tryget(hattrie_t* T, const char* key, size_t len, const ahtable_t** b)
+{
+    *b = NULL;
+    if (T->image) return image_tryget(T, key, len);
+
+    /* find node for given key */
+    node_ptr node = hattrie_find(T, &key, &len, NULL);
+    if (node.flag == NULL) {
+        return NULL;
+    }
+
+    /* if the trie node consumes value, use it */
+    if (*node.flag & NODE_TYPE_TRIE) {
+        return &node.t->val;
+    }
+
+    *b = node.b;
+    value_t* val = ahtable_tryget(node.b, key, len);
+    if (val == NULL && T->mig.src) {
+        val = migration_tryget(T, node.b, key, len);
+        *b  = T->mig.src;
+    }
+    return val;
+}
+
+
+value_t* hattrie_tryget(hattrie_t* T, const char* key, size_t len)
+{
+    const ahtable_t* b;
+    if (T->cache == NULL) return trie_tryget(T, key, len, &b);
+
+    uint64_t h  = hash_wy64(key, len, T->seed);
+    uint32_t hh = (uint32_t) (h >> 32);
+    cache_line_t* line = &T->cache[h & (T->cache_n - 1)];
+    size_t w;
+    if (line->epoch == T->cache_epoch) {
+        for (w = 0; w < CACHE_WAYS; ++w) {
+            if (cache_way_match(&line->ways[w], hh, key, len)) {
+                ++T->cache_hits;
+                return line->ways[w].val;
+            }
+        }
+    }
+    else cache_line_clear(line, T->cache_epoch);
+
+    ++T->cache_misses;
+    value_t* val = trie_tryget(T, key, len, &b);
+    if (val == NULL || len > UINT32_MAX) return val;
+
+    /* a key found is cached first in its line, in place of an empty way or one
+     * whose bucket changed, or else of the last one, whose copy it reuses */
+    cache_way_t* way;
+    size_t v = CACHE_WAYS - 1;
+    for (w = 0; w < CACHE_WAYS; ++w) {
+        way = &line->ways[w];
+        if (way->val == NULL || (way->b && way->b->gen != way->gen)) {
+            v = w;
+            break;
+        }
+    }
+    char* copy = realloc_or_die(line->ways[v].key, len + 1);
+    memcpy(copy, key, len);
+    memmove(line->ways + 1, line->ways, v * sizeof(cache_way_t));
+
+    way = &line->ways[0];
+    way->h   = hh;
+    way->len = (uint32_t) len;
+    way->key = copy;
+    way->val = val;
+    way->b   = b;
+    way->gen = b ? b->gen : 0;
+    return val;
+}
+
+
+int hattrie_set_cache(hattrie_t* T, size_t n)
+{
+    if (T->rcu) return -1;
+
+    cache_free(T);
+    T->cache_hits   = 0;
+    T->cache_misses = 0;
+    if (n == 0) return 0;
+
+    size_t lines = 1;
+    while (lines * CACHE_WAYS < n) lines *= 2;
+    size_t size = lines * sizeof(cache_line_t);
+    T->cache_mem = malloc_or_die(size + CACHE_LINE - 1);
+    T->cache = (cache_line_t*) (((uintptr_t) T->cache_mem + CACHE_LINE - 1) &
+                                ~(uintptr_t) (CACHE_LINE - 1));
+    memset(T->cache, 0, size);
+    T->cache_n = lines;
+    return 0;
+}
+
+
+size_t hattrie_value_size(const hattrie_t* T)
+{
+    return T->vsize;
+}
+
+
+value_t hattrie_value_load(const hattrie_t* T, const value_t* val)
+{
+    return value_load(val, T->vsize);
+}
+
+
+void hattrie_value_store(const hattrie_t* T, value_t* val, value_t x)
+{
+    value_store(val, T->vsize, x);
+}
+
+
+/* number of lookups hattrie_tryget_batch interleaves */
+#define TRYGET_BATCH 16
+
+/* Look up a group of at most TRYGET_BATCH keys, following hattrie_find for
+ * each. Every round moves each key still in the trie down one node, and
+ * prefetches the node it will read next, so that the misses of a round
+ * overlap rather than follow one another. Keys reaching buckets are then
+ * searched together by ahtable_tryget_multi. */
+static void tryget_group(hattrie_t* T, const char** keys, const size_t* lens,
+                         size_t g, value_t** vals)
+{
+    node_ptr    ps[TRYGET_BATCH]; // current trie node of each key
+    const char* ks[TRYGET_BATCH]; // rest of each key
+    size_t      ls[TRYGET_BATCH];
+    size_t      as[TRYGET_BATCH]; // keys still in the trie
+    ahtable_t*  bs[TRYGET_BATCH]; // buckets reached, with the keys' rest
+    const char* bks[TRYGET_BATCH];
+    size_t      bls[TRYGET_BATCH] = { 0 };
+    size_t      bjs[TRYGET_BATCH];
+    size_t na = 0, nb = 0, j, a, b;
+    node_ptr node;
+
+    node_ptr root = node_load(&T->root);
+    for (j = 0; j < g; ++j) {
+        vals[j] = NULL;
+        if (lens[j] == 0) vals[j] = &root.t->val;
+        else {
+            ps[j] = root;
+            ks[j] = keys[j];
+            ls[j] = lens[j];
+            as[na++] = j;
+        }
+    }
+
+    while (na > 0) {
+        for (a = 0, b = 0; a < na; ++a) {
+            j = as[a];
+            node = trie_child(ps[j].t, (unsigned char) *ks[j]);
+
+            if (*node.flag & NODE_TYPE_TRIE) {
+                ++ks[j];
+                --ls[j];
+
+                /* the key leaves the node's prefix */
+                if (!trie_prefix_match(node.t, ks[j], ls[j])) continue;
+                ks[j] += node.t->plen;
+                ls[j] -= node.t->plen;
+
+                /* the key ends on a trie node */
+                if (ls[j] == 0) {
+                    if (node.t->flag & NODE_HAS_VAL) vals[j] = &node.t->val;
+                    continue;
+                }
+
+                /* one more trie node to go through: fetch its header, and the
+                 * index entry of a sparse node */
+                ps[j] = node;
+                prefetch(node.t);
+                prefetch(trie_idx(node.t) + (unsigned char) *ks[j]);
+                as[b++] = j;
+            }
+
+            else {
+                /* pure bucket holds only key suffixes, skip current char */
+                if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+                    ++ks[j];
+                    --ls[j];
+                }
+                bs[nb]  = node.b;
+                bks[nb] = ks[j];
+                bls[nb] = ls[j];
+                bjs[nb] = j;
+                ++nb;
+            }
+        }
+        na = b;
+    }
+
+    value_t* found[TRYGET_BATCH];
+    ahtable_tryget_multi(bs, bks, bls, nb, found);
+    for (b = 0; b < nb; ++b) {
+        if (found[b] == NULL && T->mig.src) {
+            found[b] = migration_tryget(T, bs[b], bks[b], bls[b]);
+        }
+        vals[bjs[b]] = found[b];
+    }
+}
+
+
+void hattrie_tryget_batch(hattrie_t* T, const char** keys, const size_t* lens,
+                          size_t n, value_t** vals)
+{
+    size_t j, g;
+    if (T->image) {
+        for (j = 0; j < n; ++j) vals[j] = image_tryget(T, keys[j], lens[j]);
+        return;
+    }
+
+    for (j = 0; j < n; j += g) {
+        g = n - j < TRYGET_BATCH ? n - j : TRYGET_BATCH;
+        tryget_group(T, keys + j, lens + j, g, vals + j);
+    }
+}
+
+
+void hattrie_get_batch(hattrie_t* T, const char** keys, const size_t* lens,
+                       size_t n, value_t** vals)
+{
+    /* Inserting a key may move the values of others, so the missing keys are
+     * inserted first and every key is looked up again afterwards. */
+    size_t j;
+    bool inserted = false;
+    hattrie_tryget_batch(T, keys, lens, n, vals);
+    for (j = 0; j < n; ++j) {
+        if (vals[j] == NULL && hattrie_get(T, keys[j], lens[j]) != NULL) {
+            inserted = true;
+        }
+    }
+    if (inserted) hattrie_tryget_batch(T, keys, lens, n, vals);
+}
+
+
+/* Copy the keys of bucket b into u, prefixed with plen bytes of prefix and
+ * the character a pure bucket leaves out. */
+static void bucket_copy(ahtable_t* u, ahtable_t* b, const char* prefix, size_t plen,
+                        char** buf, size_t* bufsize)
+{
+    size_t len, skip = plen + (b->flag & NODE_TYPE_PURE_BUCKET ? 1 : 0);
+    const char* key;
+    ahtable_iter_t* i = ahtable_iter_begin(b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        if (skip > 0) {
+            if (*bufsize < skip + len) {
+                *bufsize = 2 * (skip + len);
+                *buf = realloc_or_die(*buf, *bufsize);
+            }
+            if (plen > 0) memcpy(*buf, prefix, plen);
+            if (skip > plen) (*buf)[plen] = (char) b->c0;
+            memcpy(*buf + skip, key, len);
+            memcpy(ahtable_get(u, *buf, skip + len), ahtable_iter_val(i), u->vsize);
+        }
+        else memcpy(ahtable_get(u, key, len), ahtable_iter_val(i), u->vsize);
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+}
+
+
+/* Merge the bucket under character c of the node pointed to by ref with
+ * neighbouring buckets, while together they hold at most low keys. This is the
+ * reverse of splitting a hybrid bucket. */
+static void trie_merge_buckets(hattrie_t* T, node_ptr* ref, unsigned char c, size_t low)
+{
+    char*  buf = NULL;
+    size_t bufsize = 0;
+    node_ptr left, right, merged;
+    unsigned int c0, j, c1;
+
+    while (true) {
+        trie_node_t* node = ref->t;
+        c0 = trie_run_first(node, c);
+        c1 = trie_run_last(node, c);
+
+        /* pick a neighbour that is a bucket small enough to join */
+        if (c0 > 0 && !(*trie_child(node, c0 - 1).flag & NODE_TYPE_TRIE) &&
+            ahtable_size(trie_child(node, c0 - 1).b) +
+            ahtable_size(trie_child(node, c).b) <= low) {
+            j  = c0 - 1;
+            c0 = trie_run_first(node, j);
+        }
+        else if (c1 < NODE_MAXCHAR && !(*trie_child(node, c1 + 1).flag & NODE_TYPE_TRIE) &&
+                 ahtable_size(trie_child(node, c1 + 1).b) +
+                 ahtable_size(trie_child(node, c).b) <= low) {
+            j  = c1;
+            c1 = trie_run_last(node, c1 + 1);
+        }
+        else break;
+
+        left  = trie_child(node, c0);
+        right = trie_child(node, c1);
+
+        merged.b = bucket_create_n(
+                       T, bucket_shrunk_slots(T->bucket_slots, left.b->m + right.b->m));
+        merged.b->flag = NODE_TYPE_HYBRID_BUCKET;
+        merged.b->c0   = (unsigned char) c0;
+        merged.b->c1   = (unsigned char) c1;
+        bucket_copy(merged.b, left.b,  NULL, 0, &buf, &bufsize);
+        bucket_copy(merged.b, right.b, NULL, 0, &buf, &bufsize);
+
+        trie_merge_run(T, ref, c0, j, c1, merged);
+        bucket_free(T, left.b);
+        bucket_free(T, right.b);
+    }
+
+    free(buf);
+}
+
+
+/* If the node pointed to by ref, reached through character c, holds nothing
+ * but one bucket, which together with its value has at most low keys, turn the
+ * bucket into a pure bucket taking the node's place, its keys copied behind the
+ * node's prefix if it has one. This is the reverse of splitting a pure bucket.
+ * Returns true if the node was folded. */
+static bool trie_fold(hattrie_t* T, node_ptr* ref, unsigned char c, size_t low)
+{
+    trie_node_t* node = ref->t;
+    if (node->nruns != 1) return false;
+
+    node_ptr child = trie_child(node, 0);
+    assert(*child.flag & NODE_TYPE_HYBRID_BUCKET);
+    if (ahtable_size(child.b) + (node->flag & NODE_HAS_VAL ? 1 : 0) > low) {
+        return false;
+    }
+
+    /* readers may still be looking the bucket up as a hybrid one */
+    ahtable_t* old = child.b;
+    if (node->plen > 0) {
+        char*  buf = NULL;
+        size_t bufsize = 0;
+        child.b = bucket_create_n(T, old->n);
+        bucket_copy(child.b, old, trie_prefix(node), node->plen, &buf, &bufsize);
+        free(buf);
+    }
+    else if (T->rcu) child.b = bucket_clone(T, old, old->n);
+
+    /* the key ending on the node becomes the bucket's key for its prefix */
+    if (node->flag & NODE_HAS_VAL) {
+        memcpy(ahtable_get(child.b, trie_prefix(node), node->plen), &node->val, T->vsize);
+    }
+
+    child.b->flag = NODE_TYPE_PURE_BUCKET;
+    child.b->c0   = c;
+    child.b->c1   = c;
+    node_store(ref, child);
+    if (child.b != old) bucket_free(T, old);
+    free_node(T, node);
+    return true;
+}
+
+
+/* Give back the structure a deletion along the path of key made unnecessary,
+ * merging buckets that became small and folding trie nodes left with a single
+ * bucket into their parent, as far up as possible. */
+static void hattrie_coalesce(hattrie_t* T, const char* key, size_t len)
+{
+    /* keep well below the burst size, so that merged buckets are not split
+     * again right away */
+    size_t low = T->burst_size / 4;
+    node_ptr* ref;
+    node_ptr* x;
+    unsigned char c;
+    size_t i;
+
+    /* buckets being filled by a move cannot be merged */
+    migration_finish(T);
+
+    do {
+        /* find the deepest trie node on the path */
+        ref = &T->root;
+        c   = 0;
+        for (i = 0; i < len; ++i) {
+            x = trie_child_ref(ref->t, (unsigned char) key[i]);
+            if (!(*x->flag & NODE_TYPE_TRIE)) break;
+            c   = (unsigned char) key[i];
+            ref = x;
+            i  += ref->t->plen;
+        }
+
+        if (i < len) trie_merge_buckets(T, ref, (unsigned char) key[i], low);
+    } while (ref != &T->root && trie_fold(T, ref, c, low));
+}
+
+
+int hattrie_del(hattrie_t* T, const char* key, size_t len)
+{
+    if (T->image) return -1;
+    if (T->rcu) rcu_tick(T->rcu);
+    migration_step(T, T->step);
+
+    node_ptr parent = T->root;
+    HT_UNUSED(parent);
+    assert(*parent.flag & NODE_TYPE_TRIE);
+
+    /* find node for deletion */
+    const char* k = key;
+    size_t      l = len;
+    node_ptr*   ref;
+    node_ptr node = hattrie_find(T, &k, &l, &ref);
+    if (node.flag == NULL) {
+        return -1;
+    }
+
+    /* if consumed on a trie node, clear the value */
+    if (*node.flag & NODE_TYPE_TRIE) {
+        if (hattrie_clrval(T, node) != 0) return -1;
+        cache_invalidate(T);
+        if (T->counts) trie_count_path(T, key, len, false);
+        hattrie_coalesce(T, key, len);
+        return 0;
+    }
+
+    /* remove from bucket, or the one being moved into it, which moves the
+     * entries after it in its slot */
+    if (ahtable_del(node.b, k, l) != 0 && migration_del(T, node.b, k, l) != 0) return -1;
+    --T->m;
+    cache_touch(node.b);
+    if (T->mig.src) cache_touch(T->mig.src);
+    if (T->counts) trie_count_path(T, key, len, false);
+
+    /* give back memory once the bucket is small */
+    node.b = bucket_shrink(T, ref, node.b);
+    if (ahtable_size(node.b) <= T->burst_size / 4) hattrie_coalesce(T, key, len);
+
+    return 0;
+}
+
+
+/* Merging.
+ *
+ * Two tries are walked together from their roots. Where both have a trie node
+ * for the same characters their prefixes are split to the part they share, and
+ * the nodes are merged in turn. Where both have a bucket for the same run the
+ * buckets are merged directly, the smaller into the larger, the larger being
+ * moved into dst if it is src's. A subtree of src under characters dst has
+ * only an empty bucket for is moved in whole, as is one that outgrows a pure
+ * bucket of dst, whose keys are inserted into it instead. Anything else is
+ * inserted into dst key by key. If src is the larger trie, the tries trade
+ * their nodes first, so that it is dst's keys that are moved, which makes a
+ * merge cost about as much as the smaller trie takes to insert.
+ *
+ * Nodes are only moved between tries sharing an allocator that frees them one
+ * by one, and neither of which is concurrent. Buckets keep a pointer to the
+ * allocator in their trie, which moving them updates.
+ */
+
+static size_t hattrie_node_count(const hattrie_t* T, node_ptr node);
+
+typedef struct merger_t_
+{
+    hattrie_t* T; // dst
+    hattrie_t* S; // src
+    hattrie_merge_fn fn;
+    void* ctx;
+    bool move;    // nodes of src may be moved into dst
+    bool direct;  // keys may be inserted into buckets of dst directly
+    bool flip;    // the tries traded their nodes
+
+    char*  path;  // key leading to the nodes being merged
+    size_t path_size;
+} merger_t;
+
+
+static void merge_reserve(merger_t* m, size_t len)
+{
+    if (m->path_size >= len) return;
+    while (m->path_size < len) m->path_size = m->path_size ? 2 * m->path_size : 64;
+    m->path = realloc_or_die(m->path, m->path_size);
+}
+
+
+/* Combine the value v of a key, of dst if from_dst is set, else of src, into
+ * the value val of the key in the trie it is merged into. */
+static void merge_value(const merger_t* m, value_t* val, bool inserted, value_t v,
+                        bool from_dst)
+{
+    value_t x = value_load(val, m->T->vsize);
+    if (m->flip) from_dst = !from_dst;
+    if (inserted) x = v;
+    else if (from_dst) x = m->fn ? m->fn(v, x, m->ctx) : x;
+    else               x = m->fn ? m->fn(x, v, m->ctx) : v;
+    value_store(val, m->T->vsize, x);
+}
+
+
+/* Value of a key stored at val, in a node of dst if from_dst is set, else of
+ * src. Tries only trade nodes if their values are the same size. */
+static value_t merge_load(const merger_t* m, const value_t* val, bool from_dst)
+{
+    return value_load(val, from_dst ? m->T->vsize : m->S->vsize);
+}
+
+
+/* Insert a key, the first len bytes of the path followed by klen bytes of key,
+ * into dst. */
+static void merge_key(merger_t* m, size_t len, const char* key, size_t klen,
+                      value_t v, bool from_dst)
+{
+    merge_reserve(m, len + klen);
+    if (klen > 0) memcpy(m->path + len, key, klen);
+
+    bool inserted;
+    value_t* val = hattrie_upsert(m->T, m->path, len + klen, &inserted);
+    merge_value(m, val, inserted, v, from_dst);
+}
+
+
+/* Insert every key of a node into dst, the node being reached through the
+ * first len bytes of the path and character c, if it is a trie node. */
+static void merge_insert(merger_t* m, node_ptr node, unsigned char c, size_t len,
+                         bool from_dst)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        size_t plen = node.t->plen;
+        merge_reserve(m, len + 1 + plen);
+        m->path[len] = (char) c;
+        if (plen > 0) memcpy(m->path + len + 1, trie_prefix(node.t), plen);
+        len += 1 + plen;
+        if (node.t->flag & NODE_HAS_VAL) {
+            merge_key(m, len, NULL, 0, merge_load(m, &node.t->val, from_dst), from_dst);
+        }
+
+        unsigned int d, last;
+        for (d = 0; d < NODE_CHILDS; d = last + 1) {
+            last = trie_run_last(node.t, d);
+            merge_insert(m, trie_child(node.t, (unsigned char) d), (unsigned char) d,
+                         len, from_dst);
+        }
+        return;
+    }
+
+    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+        merge_reserve(m, len + 1);
+        m->path[len++] = (char) node.b->c0;
+    }
+
+    size_t klen;
+    const char* key;
+    ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &klen);
+        merge_key(m, len, key, klen, merge_load(m, ahtable_iter_val(i), from_dst), from_dst);
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+}
+
+
+/* Insert the keys of table b into table u of dst, b holding keys of dst if
+ * from_dst is set. */
+static void merge_table(merger_t* m, ahtable_t* u, ahtable_t* b, bool from_dst)
+{
+    size_t len, u_m;
+    const char* key;
+    value_t* val;
+    ahtable_iter_t* i = ahtable_iter_begin(b, false);
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        u_m = u->m;
+        val = ahtable_get(u, key, len);
+        merge_value(m, val, u->m != u_m, merge_load(m, ahtable_iter_val(i), from_dst),
+                    from_dst);
+        m->T->m += u->m - u_m;
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+}
+
+
+/* Point the run [c0, c1] of a trie node of src to x. */
+static void merge_detach(trie_node_t* node, unsigned int c0, unsigned int c1, node_ptr x)
+{
+    if (!node->dense) {
+        trie_xs(node)[trie_idx(node)[c0]] = x;
+        return;
+    }
+    for (; c0 <= c1; ++c0) trie_xs(node)[c0] = x;
+}
+
+
+/* Free the child of src covering [c0, c1], once its keys are in dst. Readers
+ * of a concurrent src may still be following it, so it is left for
+ * hattrie_clear. */
+static void merge_drop(merger_t* m, trie_node_t* node, unsigned int c0, unsigned int c1)
+{
+    if (m->S->rcu) return;
+
+    node_ptr none;
+    none.t = NULL;
+    hattrie_free_node(m->S, trie_child(node, (unsigned char) c0));
+    merge_detach(node, c0, c1, none);
+}
+
+
+/* Let the buckets of a subtree moved into T allocate from it. */
+static void merge_adopt(hattrie_t* T, node_ptr node)
+{
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        node.b->alloc = &T->alloc;
+        return;
+    }
+
+    unsigned int c;
+    for (c = 0; c < NODE_CHILDS; c = trie_run_last(node.t, c) + 1) {
+        merge_adopt(T, trie_child(node.t, (unsigned char) c));
+    }
+}
+
+
+/* Point character c of the node pointed to by ref, whose run covering it maps
+ * to an empty bucket, to child, the bucket keeping the characters before c and
+ * a new one taking those after it. */
+static void trie_place(hattrie_t* T, node_ptr* ref, unsigned char c, node_ptr child)
+{
+    node_ptr b = trie_child(ref->t, c);
+    unsigned int c0 = b.b->c0, c1 = b.b->c1;
+    assert(ahtable_size(b.b) == 0);
+
+    if (c0 == c1) {
+        trie_set_run(T, ref, c, c, child);
+        bucket_free(T, b.b);
+        return;
+    }
+
+    node_ptr rest;
+    rest.b = NULL;
+    if (c == c0) {
+        b.b->c0 = c + 1;
+        trie_split_run(T, ref, c, c, c1, child, b);
+    }
+    else {
+        b.b->c1 = c - 1;
+        trie_split_run(T, ref, c0, c - 1, c1, b, child);
+        if (c < c1) {
+            rest.b = bucket_create_n(T, BUCKET_MIN_SLOTS);
+            rest.b->c0   = c + 1;
+            rest.b->c1   = c1;
+            rest.b->flag = rest.b->c0 == rest.b->c1 ?
+                              NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+            trie_split_run(T, ref, c, c, c1, child, rest);
+        }
+    }
+
+    b.b->flag = b.b->c0 == b.b->c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+}
+
+
+/* Split the buckets of [c0, c1] of the node pointed to by ref, and those split
+ * off them, until none holds more than the burst size. */
+static void hattrie_burst(hattrie_t* T, node_ptr* ref, unsigned int c0, unsigned int c1)
+{
+    unsigned int c = c0;
+    node_ptr child;
+    while (c <= c1) {
+        child = trie_child(ref->t, (unsigned char) c);
+        if (*child.flag & NODE_TYPE_TRIE) {
+            hattrie_burst(T, trie_child_ref(ref->t, (unsigned char) c), 0, NODE_MAXCHAR);
+            ++c;
+        }
+        else if (ahtable_size(child.b) >= T->burst_size) hattrie_split(T, ref, child);
+        else c = trie_run_last(ref->t, c) + 1;
+    }
+}
+
+
+static void merge_node(merger_t* m, node_ptr* dref, trie_node_t* S, size_t len);
+
+/* Merge the trie node under character c of the src node S into dst, whose
+ * node pointed to by dref is reached through the same len bytes. */
+static void merge_trie(merger_t* m, node_ptr* dref, trie_node_t* S, unsigned char c,
+                       size_t len)
+{
+    node_ptr* x    = trie_child_ref(dref->t, c);
+    node_ptr* sref = trie_child_ref(S, c);
+    node_ptr  dc   = node_load(x);
+    node_ptr  sc   = *sref;
+    node_ptr  none;
+    none.t = NULL;
+
+    if (*dc.flag & NODE_TYPE_TRIE) {
+        size_t k = 0;
+        while (k < dc.t->plen && k < sc.t->plen &&
+               trie_prefix(dc.t)[k] == trie_prefix(sc.t)[k]) ++k;
+        if (k < dc.t->plen) trie_split_prefix(m->T, x, k);
+        if (k < sc.t->plen) sc = trie_split_prefix(m->S, sref, k);
+
+        merge_reserve(m, len + 1 + k);
+        m->path[len] = (char) c;
+        if (k > 0) memcpy(m->path + len + 1, trie_prefix(sc.t), k);
+        merge_node(m, x, sc.t, len + 1 + k);
+        return;
+    }
+
+    /* take the subtree in place of an empty bucket */
+    if (m->move && ahtable_size(dc.b) == 0) {
+        merge_adopt(m->T, sc);
+        m->T->m += hattrie_node_count(m->S, sc);
+        merge_detach(S, c, c, none);
+        trie_place(m->T, dref, c, sc);
+        return;
+    }
+
+    /* or of a smaller pure bucket, whose keys then go into it */
+    if (m->move && dc.b->c0 == dc.b->c1) {
+        size_t count = hattrie_node_count(m->S, sc);
+        if (ahtable_size(dc.b) < count) {
+            merge_adopt(m->T, sc);
+            m->T->m += count - ahtable_size(dc.b);
+            merge_detach(S, c, c, none);
+            trie_set_run(m->T, dref, c, c, sc);
+            merge_insert(m, dc, c, len, true);
+            bucket_free(m->T, dc.b);
+            return;
+        }
+    }
+
+    merge_insert(m, sc, c, len, false);
+    merge_drop(m, S, c, c);
+}
+
+
+/* Merge the bucket covering [c0, c1] of the src node S into dst. */
+static void merge_bucket(merger_t* m, node_ptr* dref, trie_node_t* S, unsigned int c0,
+                         unsigned int c1, size_t len)
+{
+    node_ptr sb = trie_child(S, (unsigned char) c0);
+    if (ahtable_size(sb.b) == 0) return;
+
+    node_ptr db = trie_child(dref->t, (unsigned char) c0);
+    if (!m->direct || *db.flag & NODE_TYPE_TRIE || db.b->c0 != c0 || db.b->c1 != c1 ||
+        db.b->flag != sb.b->flag) {
+        merge_insert(m, sb, (unsigned char) c0, len, false);
+        merge_drop(m, S, c0, c1);
+        return;
+    }
+
+    if (m->move && ahtable_size(db.b) < ahtable_size(sb.b)) {
+        /* swap the buckets, and merge dst's into src's */
+        sb.b->alloc = &m->T->alloc;
+        db.b->alloc = &m->S->alloc;
+        m->T->m += sb.b->m - db.b->m;
+        trie_set_run(m->T, dref, c0, c1, sb);
+        merge_detach(S, c0, c1, db);
+        merge_table(m, sb.b, db.b, true);
+    }
+    else merge_table(m, db.b, sb.b, false);
+
+    hattrie_burst(m->T, dref, c0, c1);
+}
+
+
+/* Merge the src node S into the dst node pointed to by dref, both reached
+ * through the first len bytes of the path. */
+static void merge_node(merger_t* m, node_ptr* dref, trie_node_t* S, size_t len)
+{
+    if (S->flag & NODE_HAS_VAL) {
+        bool had = dref->t->flag & NODE_HAS_VAL;
+        merge_value(m, hattrie_useval(m->T, *dref), !had, merge_load(m, &S->val, false),
+                    false);
+    }
+
+    unsigned int c, last;
+    for (c = 0; c < NODE_CHILDS; c = last + 1) {
+        last = trie_run_last(S, c);
+        if (*trie_child(S, (unsigned char) c).flag & NODE_TYPE_TRIE) {
+            merge_trie(m, dref, S, (unsigned char) c, len);
+        }
+        else merge_bucket(m, dref, S, c, last, len);
+    }
+}
+
+
+int hattrie_merge(hattrie_t* dst, hattrie_t* src, hattrie_merge_fn fn, void* ctx)
+{
+    if (dst->image || src->image || dst == src) return -1;
+    migration_finish(dst);
+    migration_finish(src);
+
+    merger_t m;
+    m.T   = dst;
+    m.S   = src;
+    m.fn  = fn;
+    m.ctx = ctx;
+    m.move = dst->rcu == NULL && src->rcu == NULL &&
+             src->alloc.release == NULL && dst->vsize == src->vsize &&
+             dst->alloc.alloc   == src->alloc.alloc &&
+             dst->alloc.realloc == src->alloc.realloc &&
+             dst->alloc.free    == src->alloc.free &&
+             dst->alloc.ctx     == src->alloc.ctx;
+    m.direct    = dst->rcu == NULL;
+    m.flip      = m.move && dst->m < src->m;
+    m.path      = NULL;
+    m.path_size = 0;
+
+    if (m.flip) {
+        node_ptr root = dst->root;
+        dst->root = src->root;
+        src->root = root;
+        size_t count = dst->m;
+        dst->m = src->m;
+        src->m = count;
+        merge_adopt(dst, dst->root);
+        merge_adopt(src, src->root);
+    }
+
+    /* split buckets outgrowing dst right away */
+    size_t step = dst->step;
+    dst->step = 0;
+    merge_node(&m, &dst->root, src->root.t, 0);
+    dst->step = step;
+
+    free(m.path);
+    cache_invalidate(dst);
+    if (dst->counts) {
+        migration_finish(dst);
+        trie_recount(dst->root);
+    }
+    hattrie_clear(src);
+    return 0;
+}
+
+
+/* Bulk loading.
+ *
+ * With keys arriving in sorted order the shape of the trie can be decided as
+ * they come. Only the trie nodes on the path to the last key (the spine) are
+ * open, and of those only the deepest has keys buffered: the pending bucket,
+ * covering characters from c0 on, and the current group of keys sharing the
+ * next character. When a group would overflow the pending bucket, the bucket is
+ * built, and when a group alone outgrows a bucket, it becomes a new trie node
+ * at the bottom of the spine. Each bucket is built once, at its exact size.
+ */
+
+typedef struct builder_entry_t_
+{
+    size_t  off; // position of the key in the byte buffer
+    size_t  len;
+    value_t val;
+} builder_entry_t;
+
+
+struct hattrie_builder_t_
+{
+    hattrie_t* T;
+
+    /* open trie nodes from the root down; path[d] leads from spine[d] to
+     * spine[d + 1] */
+    trie_node_t**  spine;
+    unsigned char* path;
+    size_t depth;
+    size_t spine_size;
+
+    /* Characters of the deepest node before c0 have been assigned. Buffered
+     * entries [0, nb) are the pending bucket, [nb, ng) the current group and
+     * [ng, ne) still to be placed. */
+    unsigned int c0;
+    size_t nb, ng, ne;
+    builder_entry_t* entries;
+    size_t entries_size;
+
+    char*  bytes;
+    size_t nbytes;
+    size_t bytes_size;
+
+    /* last key added, to check the order */
+    char*  prev;
+    size_t prev_len;
+    size_t prev_size;
+    bool   has_prev;
+
+    /* scratch space to build buckets */
+    const char** keys;
+    size_t*      lens;
+    value_t*     vals;
+    size_t       scratch_size;
+};
+
+
+hattrie_builder_t* hattrie_builder_create()
+{
+    hattrie_builder_t* b = malloc_or_die(sizeof(hattrie_builder_t));
+
+    node_ptr none;
+    none.t = NULL;
+    b->T = hattrie_alloc(NULL);
+    b->T->root.t = alloc_dense_node(b->T, none);
+
+    b->spine_size = 16;
+    b->spine    = malloc_or_die(b->spine_size * sizeof(trie_node_t*));
+    b->path     = malloc_or_die(b->spine_size * sizeof(unsigned char));
+    b->spine[0] = b->T->root.t;
+    b->depth    = 0;
+
+    b->c0 = 0;
+    b->nb = b->ng = b->ne = 0;
+    b->entries_size = 1024;
+    b->entries = malloc_or_die(b->entries_size * sizeof(builder_entry_t));
+
+    b->nbytes = 0;
+    b->bytes_size = 1 << 16;
+    b->bytes = malloc_or_die(b->bytes_size);
+
+    b->prev_len  = 0;
+    b->prev_size = 16;
+    b->prev      = malloc_or_die(b->prev_size);
+    b->has_prev  = false;
+
+    b->scratch_size = 0;
+    b->keys = NULL;
+    b->lens = NULL;
+    b->vals = NULL;
+
+    return b;
+}
+
+
+static unsigned char builder_char(const hattrie_builder_t* b, size_t e)
+{
+    return (unsigned char) b->bytes[b->entries[e].off + b->depth];
+}
+
+
+/* Build the pending bucket, covering characters [c0, c1] of the deepest node. */
+static void builder_flush(hattrie_builder_t* b, unsigned int c1)
+{
+    if (b->c0 > c1) return;
+
+    size_t j, nb = b->nb;
+    if (b->scratch_size < nb) {
+        b->scratch_size = nb;
+        b->keys = realloc_or_die(b->keys, nb * sizeof(const char*));
+        b->lens = realloc_or_die(b->lens, nb * sizeof(size_t));
+        b->vals = realloc_or_die(b->vals, nb * sizeof(value_t));
+    }
+
+    /* a pure bucket leaves out the character leading to it */
+    size_t skip = b->c0 == c1 ? b->depth + 1 : b->depth;
+    for (j = 0; j < nb; ++j) {
+        b->keys[j] = b->bytes + b->entries[j].off + skip;
+        b->lens[j] = b->entries[j].len - skip;
+        b->vals[j] = b->entries[j].val;
+    }
+
+    node_ptr node;
+    node.b = ahtable_create_from(bucket_slots(b->T, nb), b->keys, b->lens, b->vals, nb,
+                                 &b->T->alloc, b->T->hash, b->T->seed, b->T->vsize);
+    ahtable_set_max_load(node.b, b->T->load_factor);
+    node.b->c0   = (unsigned char) b->c0;
+    node.b->c1   = (unsigned char) c1;
+    node.b->flag = b->c0 == c1 ? NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
+
+    node_ptr* xs = trie_xs(b->spine[b->depth]);
+    unsigned int c;
+    for (c = b->c0; c <= c1; ++c) xs[c] = node;
+    b->T->m += nb;
+
+    /* drop the bucket's entries from the buffers */
+    size_t base = nb < b->ne ? b->entries[nb].off : b->nbytes;
+    memmove(b->bytes, b->bytes + base, b->nbytes - base);
+    b->nbytes -= base;
+    for (j = nb; j < b->ne; ++j) {
+        b->entries[j - nb] = b->entries[j];
+        b->entries[j - nb].off -= base;
+    }
+    b->ne -= nb;
+    b->ng -= nb;
+    b->nb  = 0;
+    b->c0  = c1 + 1;
+}
+
+
+/* Add the current group to the pending bucket, building the bucket first if
+ * both no longer fit together. */
+static void builder_close_group(hattrie_builder_t* b)
+{
+    if (b->nb > 0 && b->ng > b->T->burst_size) {
+        builder_flush(b, builder_char(b, b->nb) - 1);
+    }
+    b->nb = b->ng;
+}
+
+
+static void builder_place(hattrie_builder_t* b);
+
+/* Turn the current group into a trie node at the bottom of the spine, and
+ * place its keys again one level down. */
+static void builder_push(hattrie_builder_t* b)
+{
+    unsigned char c = builder_char(b, b->nb);
+    if (b->c0 < c) builder_flush(b, c - 1);
+
+    if (b->depth + 1 >= b->spine_size) {
+        b->spine_size *= 2;
+        b->spine = realloc_or_die(b->spine, b->spine_size * sizeof(trie_node_t*));
+        b->path  = realloc_or_die(b->path,  b->spine_size * sizeof(unsigned char));
+    }
+
+    node_ptr none;
+    none.t = NULL;
+    b->path[b->depth] = c;
+    b->spine[++b->depth] = alloc_dense_node(b->T, none);
+    b->c0 = 0;
+    b->nb = b->ng = 0;
+
+    /* the smallest key may end on the new node */
+    if (b->entries[0].len == b->depth) {
+        b->spine[b->depth]->flag |= NODE_HAS_VAL;
+        value_store(&b->spine[b->depth]->val, b->T->vsize, b->entries[0].val);
+        ++b->T->m;
+        memmove(b->entries, b->entries + 1, (b->ne - 1) * sizeof(builder_entry_t));
+        --b->ne;
+    }
+
+    while (b->ng < b->ne) builder_place(b);
+}
+
+
+/* Place the next buffered entry under the deepest node. */
+static void builder_place(hattrie_builder_t* b)
+{
+    if (b->ng > b->nb && builder_char(b, b->ng) != builder_char(b, b->nb)) {
+        builder_close_group(b);
+    }
+
+    ++b->ng;
+    if (b->ng - b->nb > b->T->burst_size) builder_push(b);
+}
+
+
+/* Finish the deepest node and attach it to its parent. Open nodes are dense,
+ * and only made sparse once all their children are known. */
+static void builder_pop(hattrie_builder_t* b)
+{
+    if (b->ng > b->nb) builder_close_group(b);
+    builder_flush(b, NODE_MAXCHAR);
+
+    trie_node_t* node = trie_node_compact(b->T, b->spine[b->depth]);
+    if (b->depth == 0) {
+        b->spine[0] = b->T->root.t = node;
+        return;
+    }
+
+    --b->depth;
+    trie_xs(b->spine[b->depth])[b->path[b->depth]].t = node;
+    b->c0 = b->path[b->depth] + 1;
+}
+
+
+int hattrie_builder_add(hattrie_builder_t* b, const char* key, size_t len, value_t val)
+{
+    if (len > 32767) {
+        fprintf(stderr, "HAT-trie/AH-table cannot store keys longer than 32768\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* keys must come in strictly increasing order */
+    if (b->has_prev) {
+        int c = memcmp(b->prev, key, b->prev_len < len ? b->prev_len : len);
+        if (c > 0 || (c == 0 && b->prev_len >= len)) return -1;
+    }
+
+    if (b->prev_size < len) {
+        while (b->prev_size < len) b->prev_size *= 2;
+        b->prev = realloc_or_die(b->prev, b->prev_size);
+    }
+    memcpy(b->prev, key, len);
+    b->prev_len = len;
+    b->has_prev = true;
+
+    /* finish the open nodes the key does not belong under */
+    size_t k = 0;
+    while (k < b->depth && k < len && (unsigned char) key[k] == b->path[k]) ++k;
+    while (b->depth > k) builder_pop(b);
+
+    if (len == b->depth) {
+        /* as hattrie_get does, the empty key is kept on the root uncounted */
+        trie_node_t* node = b->spine[b->depth];
+        if (b->depth > 0) {
+            node->flag |= NODE_HAS_VAL;
+            ++b->T->m;
+        }
+        value_store(&node->val, b->T->vsize, val);
+        return 0;
+    }
+
+    if (b->ne == b->entries_size) {
+        b->entries_size *= 2;
+        b->entries = realloc_or_die(b->entries, b->entries_size * sizeof(builder_entry_t));
+    }
+
+    if (b->nbytes + len > b->bytes_size) {
+        while (b->nbytes + len > b->bytes_size) b->bytes_size *= 2;
+        b->bytes = realloc_or_die(b->bytes, b->bytes_size);
+    }
+
+    builder_entry_t* e = &b->entries[b->ne++];
+    e->off = b->nbytes;
+    e->len = len;
+    e->val = val;
+    memcpy(b->bytes + b->nbytes, key, len);
+    b->nbytes += len;
+
+    builder_place(b);
+    return 0;
+}
+
+
+hattrie_t* hattrie_builder_finish(hattrie_builder_t* b)
+{
+    while (b->depth > 0) builder_pop(b);
+    builder_pop(b);
+
+    hattrie_t* T = b->T;
+    free(b->spine);
+    free(b->path);
+    free(b->entries);
+    free(b->bytes);
+    free(b->prev);
+    free(b->keys);
+    free(b->lens);
+    free(b->vals);
+    free(b);
+
+    return T;
+}
+
+
+hattrie_t* hattrie_build_sorted(const char** keys, const size_t* lens,
+                                const value_t* vals, size_t n)
+{
+    hattrie_builder_t* b = hattrie_builder_create();
+
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (hattrie_builder_add(b, keys[i], lens[i], vals ? vals[i] : 0) != 0) {
+            hattrie_free(hattrie_builder_finish(b));
+            return NULL;
+        }
+    }
+
+    return hattrie_builder_finish(b);
+}
+
+
+/* Images.
+ *
+ * hattrie_save writes the trie as a flat image that can be queried in place.
+ * Records are written children first, so every child lies before its parent,
+ * and are aligned to 8 bytes. Integers are little-endian, offsets are from the
+ * start of the image.
+ *
+ *   image:      magic:u8[8] records... trailer
+ *   trie node:  flag:u8 pad:u8 nruns:u16 plen:u16 pad:u16 val:u64
+ *               prefix:u8[plen] (padded to 8)
+ *               ends:u8[nruns] (padded to 8) children:u64[nruns]
+ *   bucket:     see ahtable_image_write
+ *   trailer:    magic:u8[8] version:u32 hash:u8 vpad:u8 pad:u16 m:u64 root:u64
+ *               seed:u64
+ *
+ * A trie node stores each run of characters pointing to the same child once.
+ * Run r covers characters (ends[r - 1], ends[r]], the last run ends at
+ * NODE_MAXCHAR. Buckets record their own hash function and seed, the trailer
+ * those of the trie, for buckets created once it is loaded. Values take 8 - vpad
+ * bytes in buckets, and the low bytes of val in trie nodes. Images of version
+ * 2, written before trie nodes had prefixes, are read as well.
+ *
+ * hattrie_freeze writes the image to memory instead, rehashing buckets into
+ * FROZEN_LOAD keys per slot, and serves the trie from it.
+ */
+
+static const char     image_magic[8]    = "HATTRIE";
+static const uint32_t image_version     = 3;
+static const size_t   image_trailer_len = 40;
+
+
+static size_t image_ends_size(size_t nruns)
+{
+    return (nruns + 7) & ~(size_t) 7;
+}
+
+
+/* Prefix and run ends of an image trie node. */
+static inline const char* image_prefix(const unsigned char* node, size_t* plen)
+{
+    *plen = load_le16(node + 4);
+    return (const char*) node + 16;
+}
+
+
+static inline const unsigned char* image_ends(const unsigned char* node)
+{
+    return node + 16 + trie_prefix_size(load_le16(node + 4));
+}
+
+
+/* keys per slot of the buckets of a frozen trie */
+#define FROZEN_LOAD 2
+
+typedef struct image_writer_t_
+{
+    FILE*    fd;  // NULL when writing to buf
+    uint64_t off; // bytes written so far
+    bool     ok;
+
+    /* the image of a frozen trie, of which size bytes are allocated */
+    unsigned char* buf;
+    size_t size;
+} image_writer_t;
+
+
+/* Room for the next n bytes of an image written to memory. */
+static unsigned char* image_reserve(image_writer_t* w, size_t n)
+{
+    if (w->size < w->off + n) {
+        while (w->size < w->off + n) w->size = w->size ? 2 * w->size : 1 << 16;
+        w->buf = realloc_or_die(w->buf, w->size);
+    }
+    return w->buf + w->off;
+}
+
+
+static void image_write(image_writer_t* w, const void* data, size_t n)
+{
+    if (w->fd == NULL) memcpy(image_reserve(w, n), data, n);
+    else if (w->ok && fwrite(data, 1, n, w->fd) != n) w->ok = false;
+    w->off += n;
+}
+
+
+/* Write a node and everything under it, returning the node's offset. */
+static uint64_t image_write_node(image_writer_t* w, node_ptr node)
+{
+    uint64_t off;
+
+    if (!w->ok) return 0;
+
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        off = w->off;
+        size_t nbytes, n = ahtable_size(node.b) / FROZEN_LOAD;
+        if (w->fd) nbytes = ahtable_image_write(node.b, w->fd);
+        else {
+            nbytes = ahtable_image_pack_size(node.b, n);
+            if (nbytes > 0) ahtable_image_pack(node.b, n, image_reserve(w, nbytes));
+        }
+        if (nbytes == 0) w->ok = false;
+        w->off += nbytes;
+        return off;
+    }
+
+    size_t r, nruns = node.t->nruns, plen = node.t->plen;
+    unsigned int c;
+
+    size_t reclen = 16 + trie_prefix_size(plen) + image_ends_size(nruns) +
+                    nruns * sizeof(uint64_t);
+    unsigned char* rec = malloc_or_die(reclen);
+    memset(rec, 0, reclen);
+    rec[0] = node.t->flag;
+    store_le16(rec + 2, (uint16_t) nruns);
+    store_le16(rec + 4, (uint16_t) plen);
+    store_le64(rec + 8, node.t->val);
+    if (plen > 0) memcpy(rec + 16, trie_prefix(node.t), plen);
+
+    unsigned char* ends     = rec + 16 + trie_prefix_size(plen);
+    unsigned char* children = ends + image_ends_size(nruns);
+    for (c = 0, r = 0; c < NODE_CHILDS; c = ends[r++] + 1u) {
+        ends[r] = (unsigned char) trie_run_last(node.t, c);
+        store_le64(children + r * sizeof(uint64_t),
+                   image_write_node(w, trie_child(node.t, (unsigned char) c)));
+    }
+
+    off = w->off;
+    image_write(w, rec, reclen);
+    free(rec);
+
+    return off;
+}
+
+
+/* Write the image of a trie, returning the offset of its root. */
+static uint64_t image_write_trie(image_writer_t* w, const hattrie_t* T)
+{
+    image_write(w, image_magic, sizeof(image_magic));
+    uint64_t root = image_write_node(w, T->root);
+
+    unsigned char trailer[40];
+    memset(trailer, 0, sizeof(trailer));
+    memcpy(trailer, image_magic, sizeof(image_magic));
+    store_le32(trailer + 8, image_version);
+    trailer[12] = (unsigned char) T->hash;
+    trailer[13] = (unsigned char) (8 - T->vsize);
+    store_le64(trailer + 16, T->m);
+    store_le64(trailer + 24, root);
+    store_le64(trailer + 32, T->seed);
+    image_write(w, trailer, sizeof(trailer));
+
+    return root;
+}
+
+
+int hattrie_save(const hattrie_t* T, FILE* fd)
+{
+    if (T->image) {
+        return fwrite(T->image, 1, T->image_len, fd) == T->image_len ? 0 : -1;
+    }
+
+    /* keys still to be moved are in no bucket of the trie */
+    if (T->mig.src) return -1;
+
+    image_writer_t w;
+    w.fd   = fd;
+    w.off  = 0;
+    w.ok   = true;
+    w.buf  = NULL;
+    w.size = 0;
+    image_write_trie(&w, T);
+
+    return w.ok ? 0 : -1;
+}
+
+
+int hattrie_freeze(hattrie_t* T)
+{
+    if (T->image) return 0;
+    if (T->rcu) return -1;
+    migration_finish(T);
+
+    image_writer_t w;
+    w.fd   = NULL;
+    w.off  = 0;
+    w.ok   = true;
+    w.buf  = NULL;
+    w.size = 0;
+    uint64_t root = image_write_trie(&w, T);
+    if (!w.ok) {
+        free(w.buf);
+        return -1;
+    }
+
+    hattrie_free_nodes(T);
+    T->image        = realloc_or_die(w.buf, w.off);
+    T->image_len    = w.off;
+    T->image_mapped = false;
+    T->root.flag    = (uint8_t*) T->image + root;
+    return 0;
+}
+
+
+/* Check the header and trailer of an image. */
+static bool image_check(const unsigned char* image, size_t len)
+{
+    if (len < sizeof(image_magic) + image_trailer_len || len % 8 != 0) return false;
+
+    const unsigned char* trailer = image + len - image_trailer_len;
+    if (memcmp(image, image_magic, sizeof(image_magic)) != 0 ||
+        memcmp(trailer, image_magic, sizeof(image_magic)) != 0 ||
+        load_le32(trailer + 8) < 2 || load_le32(trailer + 8) > image_version ||
+        trailer[12] > HATTRIE_HASH_MURMUR3 || trailer[13] > 8 ||
+        (size_t) (8 - trailer[13]) > sizeof(value_t) || load_le16(trailer + 14) != 0) {
+        return false;
+    }
+
+    uint64_t root = load_le64(trailer + 24);
+    return root >= sizeof(image_magic) && root < len - image_trailer_len &&
+           root % 8 == 0 && (image[root] & NODE_TYPE_TRIE);
+}
+
+
+/* Read everything remaining in a file handle. */
+static unsigned char* image_read(FILE* fd, size_t* len)
+{
+    size_t size = 1 << 16, k;
+    unsigned char* image = malloc_or_die(size);
+
+    *len = 0;
+    while ((k = fread(image + *len, 1, size - *len, fd)) > 0) {
+        *len += k;
+        if (*len == size) {
+            size *= 2;
+            image = realloc_or_die(image, size);
+        }
+    }
+
+    if (ferror(fd)) {
+        free(image);
+        return NULL;
+    }
+
+    return image;
+}
+
+
+/* Rebuild the node at the given offset, which must lie before end and cover
+ * characters [c0, c1] of its parent. Returns false if the image is malformed. */
+static bool image_load_node(hattrie_t* T, const unsigned char* image, uint64_t end,
+                            uint64_t off, unsigned int c0, unsigned int c1,
+                            node_ptr* node)
+{
+    if (off < sizeof(image_magic) || off >= end || off % 8 != 0) return false;
+    const unsigned char* rec = image + off;
+
+    if (!(*rec & NODE_TYPE_TRIE)) {
+        node->b = ahtable_image_load(rec, end - off);
+        if (node->b == NULL) return false;
+
+        if ((node->b->flag != NODE_TYPE_PURE_BUCKET &&
+             node->b->flag != NODE_TYPE_HYBRID_BUCKET) ||
+            (node->b->flag == NODE_TYPE_PURE_BUCKET && c0 != c1) ||
+            node->b->c0 != c0 || node->b->c1 != c1 || node->b->vsize != T->vsize) {
+            bucket_free(T, node->b);
+            return false;
+        }
+        return true;
+    }
+
+    /* a trie node is always its parent's child for one character */
+    if (c0 != c1 || end - off < 16) return false;
+
+    size_t nruns = load_le16(rec + 2), plen;
+    const char* prefix = image_prefix(rec, &plen);
+    if (nruns == 0 || nruns > NODE_CHILDS ||
+        end - off < 16 + trie_prefix_size(plen) + image_ends_size(nruns) +
+                    nruns * sizeof(uint64_t)) {
+        return false;
+    }
+
+    const unsigned char* ends     = image_ends(rec);
+    const unsigned char* children = ends + image_ends_size(nruns);
+    if (ends[nruns - 1] != NODE_MAXCHAR) return false;
+
+    /* load the children first, to build the node at its final size */
+    node_ptr* children_ptrs = malloc_or_die(nruns * sizeof(node_ptr));
+    size_t r;
+    unsigned int first = 0;
+    for (r = 0; r < nruns; ++r) {
+        if (ends[r] < first ||
+            !image_load_node(T, image, off, load_le64(children + r * sizeof(uint64_t)),
+                             first, ends[r], &children_ptrs[r])) {
+            while (r-- > 0) hattrie_free_node(T, children_ptrs[r]);
+            free(children_ptrs);
+            return false;
+        }
+        first = ends[r] + 1;
+    }
+
+    bool dense = nruns > T->node_fanout;
+    node->t = alloc_node(T, dense, dense ? 0 : nruns, prefix, plen);
+    node->t->flag  = rec[0];
+    node->t->val   = (value_t) load_le64(rec + 8);
+    node->t->nruns = (uint16_t) nruns;
+
+    unsigned char* idx = trie_idx(node->t);
+    node_ptr*      xs  = trie_xs(node->t);
+    unsigned int c;
+    for (c = 0, r = 0; c < NODE_CHILDS; ++c) {
+        if (c > ends[r]) ++r;
+        if (dense) xs[c]  = children_ptrs[r];
+        else       idx[c] = (unsigned char) r;
+    }
+    if (!dense) memcpy(xs, children_ptrs, nruns * sizeof(node_ptr));
+    free(children_ptrs);
+
+    return true;
+}
+
+
+hattrie_t* hattrie_load(FILE* fd)
+{
+    size_t len;
+    unsigned char* image = image_read(fd, &len);
+    if (image == NULL) return NULL;
+
+    if (!image_check(image, len)) {
+        free(image);
+        return NULL;
+    }
+
+    const unsigned char* trailer = image + len - image_trailer_len;
+    hattrie_t* T = hattrie_alloc(NULL);
+    T->m     = (size_t) load_le64(trailer + 16);
+    T->hash  = (hattrie_hash_t) trailer[12];
+    T->vsize = 8 - (size_t) trailer[13];
+    T->seed  = load_le64(trailer + 32);
+
+    if (!image_load_node(T, image, len - image_trailer_len, load_le64(trailer + 24),
+                         0, 0, &T->root)) {
+        free(T);
+        T = NULL;
+    }
+
+    free(image);
+    return T;
+}
+
+
+hattrie_t* hattrie_mmap_open(const char* path)
+{
+    unsigned char* image;
+    size_t len;
+    bool mapped;
+
+#ifdef HATTRIE_USE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    len = (size_t) st.st_size;
+    image = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return NULL;
+    mapped = true;
+#else
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL) return NULL;
+    image = image_read(fd, &len);
+    fclose(fd);
+    if (image == NULL) return NULL;
+    mapped = false;
+#endif
+
+    hattrie_t* T = hattrie_alloc(NULL);
+    T->image = image;
+    T->image_len = len;
+    T->image_mapped = mapped;
+
+    if (!image_check(image, len)) {
+        hattrie_release_image(T);
+        free(T);
+        return NULL;
+    }
+
+    const unsigned char* trailer = image + len - image_trailer_len;
+    T->m     = (size_t) load_le64(trailer + 16);
+    T->hash  = (hattrie_hash_t) trailer[12];
+    T->vsize = 8 - (size_t) trailer[13];
+    T->seed  = load_le64(trailer + 32);
+    T->root.flag = (uint8_t*) image + load_le64(trailer + 24);
+
+    return T;
+}
+
+
+/* Find the child of an image trie node for the given character. */
+static const unsigned char* image_child(const hattrie_t* T,
+                                        const unsigned char* node, unsigned char c)
+{
+    size_t nruns = load_le16(node + 2);
+    const unsigned char* ends = image_ends(node);
+
+    /* find the first run ending at or after c */
+    size_t lo = 0, hi = nruns - 1, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ends[mid] < c) lo = mid + 1;
+        else               hi = mid;
+    }
+
+    return T->image + load_le64(ends + image_ends_size(nruns) + lo * sizeof(uint64_t));
+}
+
+
+/* Child of a trie node for the given character. */
+static node_ptr hattrie_child(const hattrie_t* T, node_ptr node, unsigned char c)
+{
+    if (T->image) {
+        node.flag = (uint8_t*) image_child(T, node.flag, c);
+        return node;
+    }
+    return trie_child(node.t, c);
+}
+
+
+/* hattrie_tryget for an image, following hattrie_find */
+static value_t* image_tryget(const hattrie_t* T, const char* key, size_t len)
+{
+    const unsigned char* node = T->root.flag;
+    const char* prefix;
+    size_t plen;
+    if (len == 0) return (value_t*) (node + 8);
+
+    node = image_child(T, node, (unsigned char) *key);
+    while (*node & NODE_TYPE_TRIE) {
+        ++key;
+        --len;
+        prefix = image_prefix(node, &plen);
+        if (len < plen || memcmp(key, prefix, plen) != 0) return NULL;
+        key += plen;
+        len -= plen;
+
+        /* if the trie node consumes value, use it */
+        if (len == 0) return *node & NODE_HAS_VAL ? (value_t*) (node + 8) : NULL;
+
+        node = image_child(T, node, (unsigned char) *key);
+    }
+
+    /* pure bucket holds only key suffixes, skip current char */
+    if (*node & NODE_TYPE_PURE_BUCKET) {
+        ++key;
+        --len;
+    }
+
+    return ahtable_image_tryget(node, key, len);
+}
+
+
+/* Value of a trie node, of the trie or its image. */
+static value_t* hattrie_node_val(const hattrie_t* T, node_ptr node)
+{
+    if (T->image) return (value_t*) (node.flag + 8);
+    return &node.t->val;
+}
+
+
+/* Prefix of a trie node, of the trie or its image. */
+static const char* hattrie_node_prefix(const hattrie_t* T, node_ptr node, size_t* plen)
+{
+    if (T->image) return image_prefix(node.flag, plen);
+    *plen = node.t->plen;
+    return trie_prefix(node.t);
+}
+
+
+/* Look a key up in a bucket, of the trie or its image. */
+static value_t* hattrie_bucket_tryget(const hattrie_t* T, node_ptr node,
+                                      const char* key, size_t len)
+{
+    if (T->image) return ahtable_image_tryget(node.flag, key, len);
+    value_t* val = ahtable_tryget(node.b, key, len);
+    if (val == NULL && T->mig.src) val = migration_tryget(T, node.b, key, len);
+    return val;
+}
+
+
+value_t* hattrie_longest_prefix(hattrie_t* T, const char* key, size_t len,
+                                size_t* matchlen)
+{
+    value_t* best = NULL;
+    size_t   best_len = 0;
+    size_t   depth = 0, skip, l, plen;
+    value_t* val;
+    const char* prefix;
+
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    if (*node.flag & NODE_HAS_VAL) best = hattrie_node_val(T, node);
+
+    /* every trie node passed through ends a prefix of the key */
+    while (depth < len) {
+        node = hattrie_child(T, node, (unsigned char) key[depth]);
+        if (!(*node.flag & NODE_TYPE_TRIE)) break;
+
+        /* nothing longer matches if the key leaves the node's prefix */
+        ++depth;
+        prefix = hattrie_node_prefix(T, node, &plen);
+        if (len - depth < plen || memcmp(key + depth, prefix, plen) != 0) {
+            node.flag = NULL;
+            break;
+        }
+
+        depth += plen;
+        if (*node.flag & NODE_HAS_VAL) {
+            best     = hattrie_node_val(T, node);
+            best_len = depth;
+        }
+    }
+
+    /* The bucket holds keys beginning with key[0, depth], less the character
+     * leading to it if pure. Any longer match is among them, so only the
+     * remaining prefix lengths are probed, longest first. */
+    if (depth < len && node.flag != NULL) {
+        skip = *node.flag & NODE_TYPE_PURE_BUCKET ? depth + 1 : depth;
+        for (l = len; l > depth; --l) {
+            val = hattrie_bucket_tryget(T, node, key + skip, l - skip);
+            if (val) {
+                best     = val;
+                best_len = l;
+                break;
+            }
+        }
+    }
+
+    if (matchlen && best) *matchlen = best_len;
+    return best;
+}
+
+
+/* plan for iteration:
+ * This is tricky, as we have no parent pointers currently, and I would like to
+ * avoid adding them. That means maintaining a stack
+ *
+ */
+
+typedef struct hattrie_node_stack_t_
+{
+    unsigned char   c; // first character of the run leading to the node
+    size_t level;
+
+    node_ptr node;
+} hattrie_node_stack_t;
+
+
+struct hattrie_iter_t_
+{
+    char* key;
+    size_t keysize; // space reserved for the key
+    size_t level;
+
+    /* keep track of keys stored in trie nodes */
+    bool    has_nil_key;
+    value_t nil_val;
+
+    const hattrie_t* T;
+    bool sorted;
+
+    /* i is the bucket being iterated over, or NULL. It is always bucket,
+     * which is reset for every bucket rather than allocated again. */
+    ahtable_iter_t* i;
+    ahtable_iter_t* bucket;
+
+    /* nodes still to visit, the next one last */
+    hattrie_node_stack_t* stack;
+    size_t depth;
+    size_t stack_size;
+
+    /* when iterating over a prefix that ends inside a bucket, only keys of
+     * that bucket starting with the rest of the prefix are visited */
+    bool   filtered;
+    char*  prefix;
+    size_t prefix_len;
+    size_t prefix_size;
+
+    /* sorted iteration stops before the first key not less than end */
+    bool   has_end;
+    char*  end;
+    size_t end_len;
+    size_t end_size;
+};
+
+
+static void hattrie_iter_push(hattrie_iter_t* i, node_ptr node, size_t level,
+                              unsigned char c)
+{
+    if (i->depth == i->stack_size) {
+        i->stack_size = i->stack_size ? 2 * i->stack_size : 64;
+        i->stack = realloc_or_die(i->stack, i->stack_size * sizeof(hattrie_node_stack_t));
+    }
+
+    hattrie_node_stack_t* x = &i->stack[i->depth++];
+    x->node  = node;
+    x->level = level;
+    x->c     = c;
+}
+
+
+/* Start iterating over the keys of a bucket, or of a bucket image. */
+static void hattrie_iter_bucket(hattrie_iter_t* i, node_ptr node)
+{
+    if (i->T->image) {
+        if (i->bucket) ahtable_image_iter_reset(i->bucket, node.flag, i->sorted);
+        else i->bucket = ahtable_image_iter_begin(node.flag, i->sorted);
+    }
+    else {
+        if (i->bucket) ahtable_iter_reset(i->bucket, node.b, i->sorted);
+        else i->bucket = ahtable_iter_begin(node.b, i->sorted);
+    }
+    i->i = i->bucket;
+}
+
+
+static void hattrie_iter_pushchar(hattrie_iter_t* i, size_t level, char c)
+{
+    if (i->keysize < level) {
+        i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+
+    if (level > 0) {
+        i->key[level - 1] = c;
+    }
+
+    i->level = level;
+}
+
+
+/* Follow the character pushed last with the prefix of the trie node it leads
+ * to. */
+static void hattrie_iter_pushprefix(hattrie_iter_t* i, const char* prefix, size_t plen)
+{
+    if (plen == 0) return;
+
+    if (i->keysize < i->level + plen + 1) {
+        while (i->keysize < i->level + plen + 1) i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+
+    memcpy(i->key + i->level, prefix, plen);
+    i->level += plen;
+}
+
+
+/* skip bucket keys that do not start with the prefix being iterated over */
+static void hattrie_iter_filter(hattrie_iter_t* i)
+{
+    if (!i->filtered) return;
+
+    const char* key;
+    size_t len;
+    while (!ahtable_iter_finished(i->i)) {
+        key = ahtable_iter_key(i->i, &len);
+        if (i->prefix_len == 0) break;
+        if (len >= i->prefix_len && memcmp(key, i->prefix, i->prefix_len) == 0) break;
+        ahtable_iter_next(i->i);
+    }
+}
+
+
+/* hattrie_iter_nextnode for a node popped from the stack of an image */
+static void hattrie_iter_nextnode_image(hattrie_iter_t* i, const unsigned char* node,
+                                        size_t level, unsigned char c)
+{
+    if (*node & NODE_TYPE_TRIE) {
+        size_t plen;
+        const char* prefix = image_prefix(node, &plen);
+        hattrie_iter_pushchar(i, level, c);
+        hattrie_iter_pushprefix(i, prefix, plen);
+        level = i->level;
+
+        if (*node & NODE_HAS_VAL) {
+            i->has_nil_key = true;
+            memcpy(&i->nil_val, node + 8, sizeof(value_t));
+        }
+
+        /* push all child nodes from right to left */
+        size_t nruns = load_le16(node + 2);
+        const unsigned char* ends     = image_ends(node);
+        const unsigned char* children = ends + image_ends_size(nruns);
+        node_ptr child;
+        while (nruns-- > 0) {
+            child.flag = (uint8_t*) i->T->image +
+                         load_le64(children + nruns * sizeof(uint64_t));
+            hattrie_iter_push(i, child, level + 1, nruns > 0 ? ends[nruns - 1] + 1 : 0);
+        }
+    }
+    else {
+        if (*node & NODE_TYPE_PURE_BUCKET) {
+            hattrie_iter_pushchar(i, level, c);
+        }
+        else {
+            i->level = level - 1;
+        }
+
+        node_ptr bucket;
+        bucket.flag = (uint8_t*) node;
+        hattrie_iter_bucket(i, bucket);
+        hattrie_iter_filter(i);
+    }
+}
+
+
+static void hattrie_iter_nextnode(hattrie_iter_t* i)
+{
+    if (i->depth == 0) return;
+
+    /* pop the stack */
+    node_ptr node;
+    unsigned char   c;
+    size_t level;
+
+    --i->depth;
+    node  = i->stack[i->depth].node;
+    c     = i->stack[i->depth].c;
+    level = i->stack[i->depth].level;
+
+    if (i->T->image) {
+        hattrie_iter_nextnode_image(i, node.flag, level, c);
+        return;
+    }
+
+    if (*node.flag & NODE_TYPE_TRIE) {
+        hattrie_iter_pushchar(i, level, c);
+        hattrie_iter_pushprefix(i, trie_prefix(node.t), node.t->plen);
+        level = i->level;
+
+        if(node.t->flag & NODE_HAS_VAL) {
+            i->has_nil_key = true;
+            i->nil_val = node.t->val;
+        }
+
+        /* push all child nodes from right to left, once per run */
+        int j, first;
+        for (j = NODE_MAXCHAR; j >= 0; j = first - 1) {
+            first = (int) trie_run_first(node.t, j);
+            hattrie_iter_push(i, trie_child(node.t, (unsigned char) j),
+                              level + 1, (unsigned char) first);
+        }
+    }
+    else {
+        if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+            hattrie_iter_pushchar(i, level, c);
+        }
+        else {
+            i->level = level - 1;
+        }
+
+        hattrie_iter_bucket(i, node);
+        hattrie_iter_filter(i);
+    }
+}
+
+
+hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
+{
+    return hattrie_iter_with_prefix(T, sorted, NULL, 0);
+}
+
+
+/* Allocate an iterator on T, to be positioned by hattrie_iter_reset or
+ * hattrie_iter_seek. */
+static hattrie_iter_t* hattrie_iter_alloc(const hattrie_t* T)
+{
+    hattrie_iter_t* i = malloc_or_die(sizeof(hattrie_iter_t));
+    i->T = T;
+    i->keysize = 16;
+    i->key = malloc_or_die(i->keysize * sizeof(char));
+    i->bucket      = NULL;
+    i->stack       = NULL;
+    i->stack_size  = 0;
+    i->prefix      = NULL;
+    i->prefix_size = 0;
+    i->has_end     = false;
+    i->end         = NULL;
+    i->end_size    = 0;
+    return i;
+}
+
+
+hattrie_iter_t* hattrie_iter_with_prefix(const hattrie_t* T, bool sorted,
+                                         const char* prefix, size_t len)
+{
+    if (T->mig.src) return NULL;
+
+    hattrie_iter_t* i = hattrie_iter_alloc(T);
+    hattrie_iter_reset(i, T, sorted, prefix, len);
+    return i;
+}
+
+
+/* Empty an iterator, to be positioned on T with keys of up to len bytes
+ * leading to the first node visited. */
+static void hattrie_iter_clear(hattrie_iter_t* i, const hattrie_t* T, bool sorted,
+                               size_t len)
+{
+    i->T = T;
+    i->sorted = sorted;
+    i->i = NULL;
+    if (i->keysize < len + 1) {
+        while (i->keysize < len + 1) i->keysize *= 2;
+        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
+    }
+    i->level   = 0;
+    i->has_nil_key = false;
+    i->nil_val     = 0;
+    i->filtered    = false;
+    i->prefix_len  = 0;
+    i->depth       = 0;
+}
+
+
+/* Stop if the current key is past the end bound. */
+static void hattrie_iter_check_end(hattrie_iter_t* i)
+{
+    if (!i->has_end || hattrie_iter_finished(i)) return;
+
+    /* compare the key with the bound a part at a time, rather than copying it
+     * together */
+    const char* prefix;
+    const char* suffix;
+    size_t plen, slen;
+    if (!hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen)) return;
+    int c = memcmp(prefix, i->end, plen < i->end_len ? plen : i->end_len);
+    if (c == 0 && plen < i->end_len) {
+        c = memcmp(suffix, i->end + plen,
+                   slen < i->end_len - plen ? slen : i->end_len - plen);
+    }
+    if (c > 0 || (c == 0 && plen + slen >= i->end_len)) {
+        i->i = NULL;
+        i->has_nil_key = false;
+        i->depth = 0;
+    }
+}
 
 
+/* Whether every key of a node on the stack, each starting with the first
+ * level - 1 bytes of the key and a character not less than c, is past the end
+ * bound. */
+static bool hattrie_iter_past_end(const hattrie_iter_t* i, size_t level, unsigned char c)
+{
+    if (!i->has_end || level == 0) return false;
+
+    size_t k = level - 1 < i->end_len ? level - 1 : i->end_len;
+    int cmp = memcmp(i->key, i->end, k);
+    if (cmp != 0) return cmp > 0;
+    if (level - 1 >= i->end_len) return true;
+    if (c != (unsigned char) i->end[level - 1]) return c > (unsigned char) i->end[level - 1];
+    return level == i->end_len;
+}
 
-    /* distribute keys to the new left or right node */
-    value_t* u;
-    value_t* v;
-    i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        u   = ahtable_iter_val(i);
-        assert(len > 0);
 
-        /* left */
-        if ((unsigned char) key[0] <= j) {
-            if (*left.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(left.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(left.b, key, len);
-            }
-            *v = *u;
-        }
+/* Move on from finished buckets and nodes until a key is found. Nodes past the
+ * end bound are not visited at all, so a bounded iterator never touches a
+ * bucket outside its range. */
+static void hattrie_iter_settle(hattrie_iter_t* i)
+{
+    hattrie_node_stack_t* top;
+    while (((i->i == NULL || ahtable_iter_finished(i->i)) && !i->has_nil_key) &&
+           i->depth > 0) {
 
-        /* right */
-        else {
-            if (*right.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(right.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(right.b, key, len);
-            }
-            *v = *u;
+        i->i = NULL;
+        top = &i->stack[i->depth - 1];
+        if (hattrie_iter_past_end(i, top->level, top->c)) {
+            i->depth = 0;
+            break;
         }
+        hattrie_iter_nextnode(i);
+    }
 
-        ahtable_iter_next(i);
+    if (i->i != NULL && ahtable_iter_finished(i->i)) {
+        i->i = NULL;
     }
 
-    ahtable_iter_free(i);
-    ahtable_free(node.b);
+    hattrie_iter_check_end(i);
 }
 
-value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
-{
-    node_ptr parent = T->root;
-    assert(*parent.flag & NODE_TYPE_TRIE);
-
-    if (len == 0) return &parent.t->val;
 
-    /* consume all trie nodes, now parent must be trie and child anything */
-    node_ptr node = hattrie_consume(&parent, &key, &len, 0);
-    assert(*parent.flag & NODE_TYPE_TRIE);
+void hattrie_iter_reset(hattrie_iter_t* i, const hattrie_t* T, bool sorted,
+                        const char* prefix, size_t len)
+{
+    hattrie_iter_clear(i, T, sorted, len);
+    i->has_end = false;
+    if (T->mig.src) {
+        hattrie_iter_settle(i);
+        return;
+    }
 
-    /* if the key has been consumed on a trie node, use its value */
-    if (len == 0) {
-        if (*node.flag & NODE_TYPE_TRIE) {
-            return hattrie_useval(T, node);
+    /* consume trie nodes while the prefix lasts, entering the last one at
+     * level enter */
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    size_t level = 0, enter = 0, plen, k;
+    const char* node_prefix;
+    while (level < len && *node.flag & NODE_TYPE_TRIE) {
+        node = hattrie_child(T, node, (unsigned char) prefix[level]);
+        enter = ++level;
+        if (!(*node.flag & NODE_TYPE_TRIE)) break;
+
+        /* no key has the prefix if it leaves the node's, while all of the
+         * node's keys do if it ends inside it */
+        node_prefix = hattrie_node_prefix(T, node, &plen);
+        k = len - level < plen ? len - level : plen;
+        if (memcmp(prefix + level, node_prefix, k) != 0) {
+            hattrie_iter_settle(i);
+            return;
         }
-        else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
-            return hattrie_useval(T, parent);
+        level += k;
+    }
+
+    if (level > 0) memcpy(i->key, prefix, level);
+
+    /* The prefix ends inside a bucket. A pure bucket holds suffixes following
+     * the consumed characters, a hybrid one also the last consumed character. */
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        size_t skip = *node.flag & NODE_TYPE_PURE_BUCKET ? level : level - 1;
+        i->filtered   = true;
+        i->prefix_len = len - skip;
+        if (i->prefix_len > 0) {
+            if (i->prefix_size < i->prefix_len) {
+                i->prefix_size = i->prefix_len;
+                i->prefix = realloc_or_die(i->prefix, i->prefix_size);
+            }
+            memcpy(i->prefix, prefix + skip, i->prefix_len);
         }
     }
 
+    hattrie_iter_push(i, node, enter,
+                      enter > 0 ? (unsigned char) prefix[enter - 1] : '\0');
 
-    /* preemptively split the bucket if it is full */
-    while (ahtable_size(node.b) >= MAX_BUCKET_SIZE) {
-        hattrie_split(T, parent, node);
+    hattrie_iter_settle(i);
+}
 
-        /* after the split, the node pointer is invalidated, so we search from
-         * the parent again. */
-        node = hattrie_consume(&parent, &key, &len, 0);
 
-        /* if the key has been consumed on a trie node, use its value */
-        if (len == 0) {
-            if (*node.flag & NODE_TYPE_TRIE) {
-                return hattrie_useval(T, node);
-            }
-            else if (*node.flag & NODE_TYPE_HYBRID_BUCKET) {
-                return hattrie_useval(T, parent);
-            }
+/* Push the children of a trie node for the characters after the run of c, the
+ * subtrees sorting after any key continuing with c. */
+static void hattrie_iter_push_after(hattrie_iter_t* i, node_ptr node, size_t level,
+                                    unsigned char c)
+{
+    if (i->T->image) {
+        size_t nruns = load_le16(node.flag + 2);
+        const unsigned char* ends     = image_ends(node.flag);
+        const unsigned char* children = ends + image_ends_size(nruns);
+        node_ptr child;
+        size_t r = 0;
+        while (ends[r] < c) ++r;
+        while (nruns-- > r + 1) {
+            child.flag = (uint8_t*) i->T->image +
+                         load_le64(children + nruns * sizeof(uint64_t));
+            hattrie_iter_push(i, child, level + 1, ends[nruns - 1] + 1);
         }
+        return;
     }
 
-    assert(*node.flag & NODE_TYPE_PURE_BUCKET || *node.flag & NODE_TYPE_HYBRID_BUCKET);
-
-    assert(len > 0);
-    size_t m_old = node.b->m;
-    value_t* val;
-    if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-        val = ahtable_get(node.b, key + 1, len - 1);
+    int j, first, last = (int) trie_run_last(node.t, c);
+    for (j = NODE_MAXCHAR; j > last; j = first - 1) {
+        first = (int) trie_run_first(node.t, j);
+        hattrie_iter_push(i, trie_child(node.t, (unsigned char) j),
+                          level + 1, (unsigned char) first);
     }
-    else {
-        val = ahtable_get(node.b, key, len);
-    }
-    T->m += (node.b->m - m_old);
-
-    return val;
 }
 
 
-value_t* hattrie_tryget(hattrie_t* T, const char* key, size_t len)
+/* hattrie_iter_seek, keeping the end bound. */
+static void hattrie_iter_seek_bounded(hattrie_iter_t* i, const char* key, size_t len)
 {
-    /* find node for given key */
-    node_ptr node = hattrie_find(T, &key, &len);
-    if (node.flag == NULL) {
-        return NULL;
+    hattrie_iter_clear(i, i->T, true, len);
+    if (i->T->mig.src) {
+        hattrie_iter_settle(i);
+        return;
     }
+    if (len > 0) memcpy(i->key, key, len);
+
+    /* Walk down the key. Along the way, the keys of trie nodes are shorter
+     * than it, so they come before it, as do the subtrees of characters less
+     * than the key's at each level, while those of greater characters come
+     * after it and are pushed. */
+    const hattrie_t* T = i->T;
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    node_ptr child;
+    size_t level = 0, enter = 0, plen, k;
+    const char* prefix;
+    unsigned char c;
+    int cmp;
+    while (true) {
+        /* the whole subtree of a node the key ends on follows it */
+        if (level == len) {
+            hattrie_iter_push(i, node, enter,
+                              enter > 0 ? (unsigned char) key[enter - 1] : '\0');
+            break;
+        }
 
-    /* if the trie node consumes value, use it */
-    if (*node.flag & NODE_TYPE_TRIE) {
-        return &node.t->val;
+        c = (unsigned char) key[level];
+        hattrie_iter_push_after(i, node, level, c);
+        child = hattrie_child(T, node, c);
+        if (*child.flag & NODE_TYPE_TRIE) {
+            /* The subtree of a child whose prefix the key leaves, or ends
+             * inside, comes either all before or all after it. */
+            enter = ++level;
+            prefix = hattrie_node_prefix(T, child, &plen);
+            k = len - level < plen ? len - level : plen;
+            cmp = memcmp(key + level, prefix, k);
+            if (cmp != 0 || k < plen) {
+                if (cmp <= 0) hattrie_iter_push(i, child, enter, c);
+                break;
+            }
+
+            node = child;
+            level += plen;
+            continue;
+        }
+
+        /* search the bucket for the rest of the key, past the character leading
+         * to it for a pure bucket */
+        if (*child.flag & NODE_TYPE_PURE_BUCKET) ++level;
+        i->level = level;
+        hattrie_iter_bucket(i, child);
+        ahtable_iter_seek(i->i, key + level, len - level);
+        break;
     }
 
-    return ahtable_tryget(node.b, key, len);
+    hattrie_iter_settle(i);
 }
 
 
-int hattrie_del(hattrie_t* T, const char* key, size_t len)
+void hattrie_iter_seek(hattrie_iter_t* i, const char* key, size_t len)
 {
-    node_ptr parent = T->root;
-    HT_UNUSED(parent);
-    assert(*parent.flag & NODE_TYPE_TRIE);
+    i->has_end = false;
+    hattrie_iter_seek_bounded(i, key, len);
+}
 
-    /* find node for deletion */
-    node_ptr node = hattrie_find(T, &key, &len);
-    if (node.flag == NULL) {
-        return -1;
-    }
 
-    /* if consumed on a trie node, clear the value */
-    if (*node.flag & NODE_TYPE_TRIE) {
-        return hattrie_clrval(T, node);
+/* Keep the end bound, or remove it if end is NULL. */
+static void hattrie_iter_store_end(hattrie_iter_t* i, const char* end, size_t len)
+{
+    i->has_end = end != NULL;
+    if (end == NULL) return;
+
+    if (i->end_size < len) {
+        i->end_size = len;
+        i->end = realloc_or_die(i->end, i->end_size);
     }
+    if (len > 0) memcpy(i->end, end, len);
+    i->end_len = len;
+}
+
+
+void hattrie_iter_set_end(hattrie_iter_t* i, const char* end, size_t len)
+{
+    hattrie_iter_store_end(i, end, len);
+    hattrie_iter_check_end(i);
+}
 
-    /* remove from bucket */
-    size_t m_old = ahtable_size(node.b);
-    int ret =  ahtable_del(node.b, key, len);
-    T->m -= (m_old - ahtable_size(node.b));
 
-    /* merge empty buckets */
-    /*! \todo */
+hattrie_iter_t* hattrie_iter_range(const hattrie_t* T, const char* start, size_t start_len,
+                                   const char* end, size_t end_len)
+{
+    if (T->mig.src) return NULL;
 
-    return ret;
+    hattrie_iter_t* i = hattrie_iter_alloc(T);
+    hattrie_iter_store_end(i, end, end_len);
+    hattrie_iter_seek_bounded(i, start, start_len);
+    return i;
 }
 
 
-/* plan for iteration:
- * This is tricky, as we have no parent pointers currently, and I would like to
- * avoid adding them. That means maintaining a stack
+/* Splitting iteration.
  *
+ * The trie is cut into units, each a subtree or a bucket reached through one
+ * run of the node above it, and bounded below by the path to the node and the
+ * first character of the run. Subtrees holding more than a share of the keys
+ * are opened into the units under them. Consecutive units are then grouped
+ * into ranges of about equal size, one range ending where the next one's first
+ * unit begins. Keys ending on opened trie nodes are not counted, but fall into
+ * a range all the same.
  */
 
-typedef struct hattrie_node_stack_t_
+typedef struct split_unit_t_
 {
-    unsigned char   c;
-    size_t level;
-
-    node_ptr node;
-    struct hattrie_node_stack_t_* next;
-
-} hattrie_node_stack_t;
+    size_t off;   // bound, at bounds + off
+    size_t len;
+    size_t count; // keys of the unit
+} split_unit_t;
 
 
-struct hattrie_iter_t_
+typedef struct splitter_t_
 {
-    char* key;
-    size_t keysize; // space reserved for the key
-    size_t level;
+    const hattrie_t* T;
+    size_t share; // subtrees holding more keys are opened
 
-    /* keep track of keys stored in trie nodes */
-    bool    has_nil_key;
-    value_t nil_val;
+    char*  path;  // path to the node being opened
+    size_t path_size;
 
-    const hattrie_t* T;
-    bool sorted;
-    ahtable_iter_t* i;
-    hattrie_node_stack_t* stack;
-};
+    split_unit_t* units;
+    size_t nunits, units_size;
+    char*  bounds;
+    size_t bounds_len, bounds_size;
+} splitter_t;
 
 
-static void hattrie_iter_pushchar(hattrie_iter_t* i, size_t level, char c)
+/* Child for the run starting at c of a trie node, of the trie or its image,
+ * setting *last to the run's last character. */
+static node_ptr hattrie_run(const hattrie_t* T, node_ptr node, unsigned int c,
+                            unsigned int* last)
 {
-    if (i->keysize < level) {
-        i->keysize *= 2;
-        i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
-    }
-
-    if (level > 0) {
-        i->key[level - 1] = c;
+    if (T->image) {
+        size_t nruns = load_le16(node.flag + 2), r = 0;
+        const unsigned char* ends = image_ends(node.flag);
+        while (ends[r] < c) ++r;
+        *last = ends[r];
+        node.flag = (uint8_t*) T->image +
+                    load_le64(ends + image_ends_size(nruns) + r * sizeof(uint64_t));
+        return node;
     }
 
-    i->level = level;
+    *last = trie_run_last(node.t, c);
+    return trie_child(node.t, (unsigned char) c);
 }
 
 
-static void hattrie_iter_nextnode(hattrie_iter_t* i)
+/* Number of keys of a node and everything under it, walking the node unless
+ * the trie keeps counts. */
+static size_t hattrie_node_count(const hattrie_t* T, node_ptr node)
 {
-    if (i->stack == NULL) return;
+    if (!(*node.flag & NODE_TYPE_TRIE)) {
+        return T->image ? ahtable_image_count(node.flag) : ahtable_size(node.b);
+    }
+    if (T->counts && !T->image) return node.t->count;
 
-    /* pop the stack */
-    node_ptr node;
-    hattrie_node_stack_t* next;
-    unsigned char   c;
-    size_t level;
+    size_t count = *node.flag & NODE_HAS_VAL ? 1 : 0;
+    unsigned int c, last;
+    for (c = 0; c < NODE_CHILDS; c = last + 1) {
+        count += hattrie_node_count(T, hattrie_run(T, node, c, &last));
+    }
+    return count;
+}
 
-    node  = i->stack->node;
-    next  = i->stack->next;
-    c     = i->stack->c;
-    level = i->stack->level;
 
-    free(i->stack);
-    i->stack = next;
+static void split_reserve(char** buf, size_t* size, size_t len)
+{
+    if (*size >= len) return;
+    while (*size < len) *size = *size ? 2 * *size : 64;
+    *buf = realloc_or_die(*buf, *size);
+}
 
-    if (*node.flag & NODE_TYPE_TRIE) {
-        hattrie_iter_pushchar(i, level, c);
 
-        if(node.t->flag & NODE_HAS_VAL) {
-            i->has_nil_key = true;
-            i->nil_val = node.t->val;
-        }
+/* Add the first len bytes of the path as the bound of a unit. */
+static void split_unit(splitter_t* s, size_t len, size_t count)
+{
+    if (s->nunits == s->units_size) {
+        s->units_size = s->units_size ? 2 * s->units_size : 64;
+        s->units = realloc_or_die(s->units, s->units_size * sizeof(split_unit_t));
+    }
 
-        /* push all child nodes from right to left */
-        int j;
-        for (j = NODE_MAXCHAR; j >= 0; --j) {
+    split_reserve(&s->bounds, &s->bounds_size, s->bounds_len + len);
+    memcpy(s->bounds + s->bounds_len, s->path, len);
 
-            /* skip repeated pointers to hybrid bucket */
-            if (j < NODE_MAXCHAR && node.t->xs[j].t == node.t->xs[j + 1].t) continue;
+    split_unit_t* u = &s->units[s->nunits++];
+    u->off   = s->bounds_len;
+    u->len   = len;
+    u->count = count;
+    s->bounds_len += len;
+}
 
-            // push stack
-            next = i->stack;
-            i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
-            i->stack->node  = node.t->xs[j];
-            i->stack->next  = next;
-            i->stack->level = level + 1;
-            i->stack->c     = (unsigned char) j;
-        }
-    }
-    else {
-        if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-            hattrie_iter_pushchar(i, level, c);
-        }
-        else {
-            i->level = level - 1;
-        }
 
-        i->i = ahtable_iter_begin(node.b, i->sorted);
+/* Cut the children of a trie node, reached through the first len bytes of the
+ * path, into units. */
+static void split_node(splitter_t* s, node_ptr node, size_t len)
+{
+    node_ptr child;
+    unsigned int c, last;
+    size_t count, plen;
+    const char* prefix;
+    for (c = 0; c < NODE_CHILDS; c = last + 1) {
+        child = hattrie_run(s->T, node, c, &last);
+        count = hattrie_node_count(s->T, child);
+
+        split_reserve(&s->path, &s->path_size, len + 1);
+        s->path[len] = (char) c;
+        if (*child.flag & NODE_TYPE_TRIE && count > s->share) {
+            prefix = hattrie_node_prefix(s->T, child, &plen);
+            split_reserve(&s->path, &s->path_size, len + 1 + plen);
+            memcpy(s->path + len + 1, prefix, plen);
+            split_node(s, child, len + 1 + plen);
+        }
+        else split_unit(s, len + 1, count);
     }
 }
 
 
-hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
+hattrie_iter_t** hattrie_iter_split(const hattrie_t* T, size_t n, size_t* count)
 {
-    hattrie_iter_t* i = malloc_or_die(sizeof(hattrie_iter_t));
-    i->T = T;
-    i->sorted = sorted;
-    i->i = NULL;
-    i->keysize = 16;
-    i->key = malloc_or_die(i->keysize * sizeof(char));
-    i->level   = 0;
-    i->has_nil_key = false;
-    i->nil_val     = 0;
-
-    i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
-    i->stack->next   = NULL;
-    i->stack->node   = T->root;
-    i->stack->c      = '\0';
-    i->stack->level  = 0;
-
-
-    while (((i->i == NULL || ahtable_iter_finished(i->i)) && !i->has_nil_key) &&
-           i->stack != NULL ) {
+    if (T->mig.src) {
+        *count = 0;
+        return NULL;
+    }
 
-        ahtable_iter_free(i->i);
-        i->i = NULL;
-        hattrie_iter_nextnode(i);
+    splitter_t s;
+    memset(&s, 0, sizeof(s));
+    s.T = T;
+
+    /* units of at most a quarter of a range each */
+    if (n == 0) n = 1;
+    s.share = T->m / (4 * n);
+    node_ptr root = T->image ? T->root : node_load(&T->root);
+    if (n > 1) split_node(&s, root, 0);
+
+    /* cut ranges once the units so far hold the next share of the keys */
+    size_t* cuts = malloc_or_die(n * sizeof(size_t)); // first units of ranges
+    size_t ncuts = 1, u, total = 0, seen = 0;
+    for (u = 0; u < s.nunits; ++u) total += s.units[u].count;
+    cuts[0] = 0;
+    for (u = 0; u < s.nunits && ncuts < n; ++u) {
+        if (seen > 0 && seen * n >= ncuts * total && cuts[ncuts - 1] < u) {
+            cuts[ncuts++] = u;
+        }
+        seen += s.units[u].count;
     }
 
-    if (i->i != NULL && ahtable_iter_finished(i->i)) {
-        ahtable_iter_free(i->i);
-        i->i = NULL;
+    hattrie_iter_t** is = malloc_or_die(ncuts * sizeof(hattrie_iter_t*));
+    split_unit_t* start;
+    split_unit_t* end;
+    for (u = 0; u < ncuts; ++u) {
+        start = u > 0 ? &s.units[cuts[u]] : NULL;
+        end   = u + 1 < ncuts ? &s.units[cuts[u + 1]] : NULL;
+        is[u] = hattrie_iter_alloc(T);
+        if (end) hattrie_iter_store_end(is[u], s.bounds + end->off, end->len);
+        if (start) hattrie_iter_seek_bounded(is[u], s.bounds + start->off, start->len);
+        else       hattrie_iter_seek_bounded(is[u], "", 0);
     }
 
-    return i;
+    free(cuts);
+    free(s.units);
+    free(s.bounds);
+    free(s.path);
+
+    *count = ncuts;
+    return is;
 }
 
 
@@ -620,6 +3967,7 @@ void hattrie_iter_next(hattrie_iter_t* i)
 
     if (i->i != NULL && !ahtable_iter_finished(i->i)) {
         ahtable_iter_next(i->i);
+        hattrie_iter_filter(i);
     }
     else if (i->has_nil_key) {
         i->has_nil_key = false;
@@ -627,39 +3975,23 @@ void hattrie_iter_next(hattrie_iter_t* i)
         hattrie_iter_nextnode(i);
     }
 
-    while (((i->i == NULL || ahtable_iter_finished(i->i)) && !i->has_nil_key) &&
-           i->stack != NULL ) {
-
-        ahtable_iter_free(i->i);
-        i->i = NULL;
-        hattrie_iter_nextnode(i);
-    }
-
-    if (i->i != NULL && ahtable_iter_finished(i->i)) {
-        ahtable_iter_free(i->i);
-        i->i = NULL;
-    }
+    hattrie_iter_settle(i);
 }
 
 
 bool hattrie_iter_finished(hattrie_iter_t* i)
 {
-    return i->stack == NULL && i->i == NULL && !i->has_nil_key;
+    return i->depth == 0 && i->i == NULL && !i->has_nil_key;
 }
 
 
 void hattrie_iter_free(hattrie_iter_t* i)
 {
     if (i == NULL) return;
-    if (i->i) ahtable_iter_free(i->i);
-
-    hattrie_node_stack_t* next;
-    while (i->stack) {
-        next = i->stack->next;
-        free(i->stack);
-        i->stack = next;
-    }
-
+    ahtable_iter_free(i->bucket);
+    free(i->stack);
+    free(i->prefix);
+    free(i->end);
     free(i->key);
     free(i);
 }
@@ -683,7 +4015,7 @@ const char* hattrie_iter_key(hattrie_iter_t* i, size_t* len)
         i->key = realloc_or_die(i->key, i->keysize * sizeof(char));
     }
 
-    memcpy(i->key + i->level, subkey, sublen);
+    if (sublen > 0) memcpy(i->key + i->level, subkey, sublen);
     i->key[i->level + sublen] = '\0';
 
     if (len) *len = i->level + sublen;
@@ -691,6 +4023,24 @@ const char* hattrie_iter_key(hattrie_iter_t* i, size_t* len)
 }
 
 
+bool hattrie_iter_key_parts(hattrie_iter_t* i, const char** prefix, size_t* prefix_len,
+                            const char** suffix, size_t* suffix_len)
+{
+    if (hattrie_iter_finished(i)) return false;
+
+    /* the characters of the trie nodes above are kept in key as they are
+     * pushed, and only the bucket's part is copied by hattrie_iter_key */
+    *prefix     = i->key;
+    *prefix_len = i->level;
+    if (i->has_nil_key) {
+        *suffix     = "";
+        *suffix_len = 0;
+    }
+    else *suffix = ahtable_iter_key(i->i, suffix_len);
+    return true;
+}
+
+
 value_t* hattrie_iter_val(hattrie_iter_t* i)
 {
     if (i->has_nil_key) return &i->nil_val;
@@ -709,3 +4059,169 @@ bool hattrie_iter_equal(const hattrie_iter_t* a,
            a->sorted == b->sorted &&
            a->i      == b->i;
 }
+
+
+int hattrie_walk(const hattrie_t* T, bool sorted, hattrie_walk_fn fn, void* ctx)
+{
+    const char* prefix;
+    const char* suffix;
+    size_t plen, slen;
+    int r = 0;
+    hattrie_iter_t* i = hattrie_iter_begin(T, sorted);
+    if (i == NULL) return -1;
+    while (r == 0 && hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen)) {
+        r = fn(prefix, plen, suffix, slen, hattrie_iter_val(i), ctx);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+    return r;
+}
+
+
+/* Counting and ranking.
+ *
+ * Going down the path of a key, the keys before it in sorted order are those
+ * of the nodes ending on the way, and of the runs before the ones taken, which
+ * the counts of trie nodes give without visiting them. Only the bucket the path
+ * ends in is scanned.
+ */
+
+/* Number of keys of a bucket, of the trie or its image, that are less than the
+ * given key if less is set, or start with it otherwise. */
+static size_t bucket_count(const hattrie_t* T, node_ptr node, const char* key,
+                           size_t len, bool less)
+{
+    ahtable_iter_t* i = T->image ? ahtable_image_iter_begin(node.flag, false)
+                                 : ahtable_iter_begin(node.b, false);
+    size_t count = 0, klen;
+    const char* k;
+    int c;
+    while (!ahtable_iter_finished(i)) {
+        k = ahtable_iter_key(i, &klen);
+        c = memcmp(k, key, klen < len ? klen : len);
+        if (less) count += c < 0 || (c == 0 && klen < len);
+        else      count += c == 0 && klen >= len;
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+    return count;
+}
+
+
+size_t hattrie_count_prefix(const hattrie_t* T, const char* prefix, size_t len)
+{
+    if (T->mig.src) return (size_t) -1;
+
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    const char* p;
+    size_t plen, k;
+    while (len > 0) {
+        node = hattrie_child(T, node, (unsigned char) *prefix);
+        if (!(*node.flag & NODE_TYPE_TRIE)) {
+            if (*node.flag & NODE_TYPE_PURE_BUCKET) {
+                ++prefix;
+                --len;
+            }
+            return bucket_count(T, node, prefix, len, false);
+        }
+        ++prefix;
+        --len;
+
+        /* the prefix may end within the node's */
+        p = hattrie_node_prefix(T, node, &plen);
+        k = len < plen ? len : plen;
+        if (memcmp(prefix, p, k) != 0) return 0;
+        prefix += k;
+        len    -= k;
+    }
+
+    return hattrie_node_count(T, node);
+}
+
+
+size_t hattrie_rank(const hattrie_t* T, const char* key, size_t len)
+{
+    if (T->mig.src) return (size_t) -1;
+
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    node_ptr child;
+    unsigned int c, last;
+    const char* p;
+    size_t plen, k, rank = 0;
+    int cmp;
+    while (len > 0) {
+        /* the node's key, a prefix of this one, and the runs before the key's */
+        if (*node.flag & NODE_HAS_VAL) ++rank;
+        for (c = 0; ; c = last + 1) {
+            child = hattrie_run(T, node, c, &last);
+            if (last >= (unsigned char) *key) break;
+            rank += hattrie_node_count(T, child);
+        }
+
+        if (!(*child.flag & NODE_TYPE_TRIE)) {
+            if (*child.flag & NODE_TYPE_PURE_BUCKET) {
+                ++key;
+                --len;
+            }
+            return rank + bucket_count(T, child, key, len, true);
+        }
+        ++key;
+        --len;
+
+        /* a key leaving the node's prefix is before or after all its keys */
+        p = hattrie_node_prefix(T, child, &plen);
+        k = len < plen ? len : plen;
+        cmp = memcmp(key, p, k);
+        if (cmp > 0) return rank + hattrie_node_count(T, child);
+        if (cmp < 0 || len < plen) return rank;
+        key += plen;
+        len -= plen;
+        node = child;
+    }
+
+    return rank;
+}
+
+
+hattrie_iter_t* hattrie_select(const hattrie_t* T, size_t i)
+{
+    if (i >= T->m || T->mig.src) return NULL;
+
+    size_t len = 0, size = 64, count, plen;
+    char* path = malloc_or_die(size);
+    node_ptr node = T->image ? T->root : node_load(&T->root);
+    node_ptr child;
+    unsigned int c, last;
+    const char* p;
+    while (true) {
+        if (*node.flag & NODE_HAS_VAL) {
+            if (i == 0) break;
+            --i;
+        }
+
+        /* find the run holding the key */
+        for (c = 0; ; c = last + 1) {
+            child = hattrie_run(T, node, c, &last);
+            count = hattrie_node_count(T, child);
+            if (i < count) break;
+            i -= count;
+        }
+
+        /* a bucket's first key is the first not less than its first
+         * character */
+        split_reserve(&path, &size, len + 1);
+        path[len++] = (char) c;
+        if (!(*child.flag & NODE_TYPE_TRIE)) break;
+
+        p = hattrie_node_prefix(T, child, &plen);
+        split_reserve(&path, &size, len + plen);
+        memcpy(path + len, p, plen);
+        len += plen;
+        node = child;
+    }
+
+    hattrie_iter_t* it = hattrie_iter_range(T, path, len, NULL, 0);
+    while (i-- > 0) hattrie_iter_next(it);
+    free(path);
+    return it;
+}
@@ -25,6 +25,7 @@ extern "C" {
 #include "common.h"
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 typedef struct hattrie_t_ hattrie_t;
 
@@ -33,6 +34,116 @@ void       hattrie_free   (hattrie_t*);       // Free all memory used by a trie.
 void       hattrie_clear  (hattrie_t*);       // Remove all entries.
 size_t     hattrie_size   (const hattrie_t*); // Number of stored keys.
 size_t     hattrie_sizeof (const hattrie_t*); // Memory used in structure in bytes.
+void       hattrie_shrink (hattrie_t*);       // Release unused bucket capacity.
+
+/** Finish moving the keys of any bucket split or resized incrementally (see
+ * hattrie_opts_t.incremental_step). Iteration, hattrie_save and counting keys
+ * take a const trie, so they cannot finish a move themselves, and fail while
+ * one is pending: call this after the last hattrie_get or hattrie_del before
+ * them. Does nothing for other tries. */
+void       hattrie_finish_moves (hattrie_t*);
+
+/** Create an empty hat-trie whose nodes and buckets are allocated with the
+ * given allocator (copied, so only its ctx must outlive the trie). If the
+ * allocator has a release function, hattrie_free and hattrie_clear call it
+ * instead of freeing nodes one by one, so such an allocator must not be
+ * shared with anything else. See arena.h. */
+hattrie_t* hattrie_create_with_allocator (const hattrie_allocator_t*);
+
+
+/** Tuning parameters for a trie. A zero field selects its default. */
+typedef struct hattrie_opts_t_
+{
+    /* number of keys a bucket may hold before it is burst (16384) */
+    size_t burst_size;
+
+    /* number of slots of a new bucket (4096). Small buckets with few slots
+     * stay in cache, large ones spread the slot arrays over more keys. */
+    size_t bucket_slots;
+
+    /* keys per slot before a bucket doubles its slots (effectively never) */
+    double load_factor;
+
+    /* distinct children a trie node stores compactly before switching to a
+     * full 256-way array, at most 256 (128) */
+    size_t node_fanout;
+
+    /* allocator for nodes and buckets, as for hattrie_create_with_allocator
+     * (hattrie_default_allocator) */
+    const hattrie_allocator_t* alloc;
+
+    /* allow lookups and iteration from other threads while one thread
+     * modifies the trie (false). See hattrie_reader_register. */
+    bool concurrent;
+
+    /* hash function of the buckets (HATTRIE_HASH_WYHASH), and its seed (0).
+     * A random seed keeps keys from being picked to collide. */
+    hattrie_hash_t hash;
+    uint64_t       hash_seed;
+
+    /* split and resize buckets incrementally, moving at least this many keys
+     * per hattrie_get and hattrie_del until done, rather than all at once (0).
+     * This bounds the latency of the insertion that bursts a bucket, at the
+     * cost of a second lookup for keys missing from a bucket being filled,
+     * and of calling hattrie_finish_moves before iterating, saving or
+     * counting keys. Ignored for concurrent tries. */
+    size_t incremental_step;
+
+    /* bytes of value stored with every key, at most sizeof(value_t), or
+     * HATTRIE_VALUE_SET to store none (sizeof(value_t)). See
+     * hattrie_value_size. */
+    size_t value_size;
+
+    /* keys whose values hattrie_tryget remembers, as for hattrie_set_cache
+     * (0, none). Ignored for concurrent tries. */
+    size_t cache_keys;
+
+    /* keep the number of keys under every trie node (false), at the cost of
+     * going down the path of every key inserted or deleted a second time. See
+     * hattrie_rank. */
+    bool counts;
+} hattrie_opts_t;
+
+/* value_size of a trie used as a set of keys */
+#define HATTRIE_VALUE_SET ((size_t) -1)
+
+/** Create an empty hat-trie with the given options, or the defaults if opts
+ * is NULL, or NULL if the value size is too large. Options are not stored by
+ * hattrie_save, so loaded tries use the defaults, but for the hash function
+ * and seed, and the value size, which are. */
+hattrie_t* hattrie_create_ex (const hattrie_opts_t* opts);
+
+
+/** Concurrent reading.
+ *
+ * A trie created with the concurrent option may be modified by one thread at a
+ * time while any number of threads look keys up or iterate, without locks.
+ * Each reading thread registers once, and brackets every hattrie_tryget and
+ * the whole life of every iterator with hattrie_read_lock and
+ * hattrie_read_unlock. Pointers to values are only valid inside the critical
+ * section they were obtained in.
+ *
+ * The writer never modifies a published node or slot in place but for
+ * appending keys, and defers freeing memory until no reader can be using it.
+ * Keys inserted by hattrie_get are visible before the writer assigns their
+ * values through the returned pointer, so readers may see them with value 0,
+ * and values themselves are written and read with no ordering. hattrie_shrink
+ * leaves buckets of such a trie alone, and hattrie_free and hattrie_clear must
+ * not run while readers are in critical sections.
+ */
+typedef struct hattrie_reader_t_ hattrie_reader_t;
+
+/* Register the calling thread as a reader, returning NULL if the trie was not
+ * created concurrent. */
+hattrie_reader_t* hattrie_reader_register   (hattrie_t*);
+void              hattrie_reader_unregister (hattrie_reader_t*);
+void              hattrie_read_lock         (hattrie_reader_t*);
+void              hattrie_read_unlock       (hattrie_reader_t*);
+
+/* Called by the writer: wait for readers to leave their critical sections and
+ * free all memory retired so far. Freeing otherwise happens in batches during
+ * hattrie_get and hattrie_del. */
+void hattrie_synchronize (hattrie_t*);
 
 
 /** Find the given key in the trie, inserting it if it does not exist, and
@@ -44,17 +155,210 @@ size_t     hattrie_sizeof (const hattrie_t*); // Memory used in structure in byt
  */
 value_t* hattrie_get (hattrie_t*, const char* key, size_t len);
 
+/** hattrie_get, also setting *inserted, unless inserted is NULL, to whether the
+ * key was new, which saves looking the key up first with hattrie_tryget. The
+ * empty key, whose value always exists, is never reported as inserted. */
+value_t* hattrie_upsert (hattrie_t*, const char* key, size_t len, bool* inserted);
+
 
 /** Find a given key in the table, returning a NULL pointer if it does not
  * exist. */
 value_t* hattrie_tryget (hattrie_t*, const char* key, size_t len);
 
+
+/** Give hattrie_tryget a cache of the values of about n recently found keys,
+ * replacing any it had, or remove it if n is 0. A repeated lookup then hashes
+ * the key once, reads one 128-byte line and compares the key with a copy kept
+ * there, rather than walking the trie and scanning a slot, which pays off when
+ * few keys get most lookups. Inserting a new key or deleting one forgets the
+ * keys of its bucket, whose values it may move, and splitting, resizing or
+ * merging buckets empties the cache. The cache is modified by lookups, so a
+ * trie with one must not be looked up from several threads at once. Returns 0
+ * if successful or -1 for a concurrent trie. */
+int hattrie_set_cache (hattrie_t*, size_t n);
+
+
+/** Value sizes.
+ *
+ * A trie storing values of fewer bytes than a value_t saves those bytes for
+ * every key. The pointers to values it returns then address only that many
+ * bytes, holding the low bytes of the value least significant first, and are
+ * read and written with hattrie_value_load and hattrie_value_store rather than
+ * dereferenced. With value size 0 a trie is a set: pointers to values only tell
+ * that a key is there, and must not be read or written through.
+ */
+
+/* Bytes of value stored with every key. */
+size_t hattrie_value_size (const hattrie_t*);
+
+/* Read or write the value at a pointer returned by the trie, keeping only
+ * the low bytes of x that the value size holds. */
+value_t hattrie_value_load  (const hattrie_t*, const value_t* val);
+void    hattrie_value_store (const hattrie_t*, value_t* val, value_t x);
+
+/** Look up n keys at once, setting vals[j] to what hattrie_tryget would return
+ * for keys[j]. The lookups are interleaved, prefetching the next node of every
+ * key before following any, which is faster than looking keys up one by one
+ * once the trie no longer fits in cache. */
+void hattrie_tryget_batch (hattrie_t*, const char** keys, const size_t* lens,
+                           size_t n, value_t** vals);
+
+/** hattrie_get for n keys at once, inserting any that do not exist. Every
+ * pointer set in vals is valid until the trie is next modified. */
+void hattrie_get_batch (hattrie_t*, const char** keys, const size_t* lens,
+                        size_t n, value_t** vals);
+
+/** Find the longest key in the trie that is a prefix of the given key,
+ * returning a pointer to its value, and setting *matchlen, unless matchlen is
+ * NULL, to its length. Returns NULL if no key is a prefix of it. The trie is
+ * walked once, and only one bucket is searched. */
+value_t* hattrie_longest_prefix (hattrie_t*, const char* key, size_t len,
+                                 size_t* matchlen);
+
 /** Delete a given key from trie. Returns 0 if successful or -1 if not found.
  */
 int hattrie_del(hattrie_t* T, const char* key, size_t len);
 
+/** Combine the values of a key found in both tries merged by hattrie_merge,
+ * returning the value it keeps. */
+typedef value_t (*hattrie_merge_fn) (value_t dst, value_t src, void* ctx);
+
+/** Move every key of src into dst, combining the values of keys found in both
+ * with fn, or taking src's if fn is NULL, and leave src empty.
+ *
+ * The tries are merged node by node rather than key by key: buckets covering
+ * the same characters are merged directly, and subtrees of src are moved into
+ * dst whole where dst has few keys under them, if both tries use the same
+ * allocator and neither is concurrent. Neither trie may be used by another
+ * thread meanwhile, but merges of distinct pairs of tries may run in parallel.
+ * Returns 0 if successful or -1 if either trie is an image, or they are the
+ * same trie. */
+int hattrie_merge (hattrie_t* dst, hattrie_t* src, hattrie_merge_fn fn, void* ctx);
+
+
+/** Statistics of the shape of a trie, for finding out why it is slow or large.
+ * Histograms of sizes have a bin for 0, then bin i for sizes in
+ * [2^(i-1), 2^i), the last bin also counting anything larger. */
+#define HATTRIE_STATS_DEPTHS 32
+#define HATTRIE_STATS_BINS   32
+
+typedef struct hattrie_stats_t_
+{
+    size_t keys; // hattrie_size
+
+    /* trie nodes */
+    size_t nodes;          // trie nodes, including the root
+    size_t dense_nodes;    // of which hold a full 256-way array of children
+    size_t prefixed_nodes; // of which hold a prefix, compressing a path
+    size_t prefix_bytes;   // in those prefixes
+    size_t max_depth;      // most trie nodes above a bucket
+    size_t depths[HATTRIE_STATS_DEPTHS]; // buckets below each number of trie nodes
+
+    /* buckets */
+    size_t buckets;
+    size_t pure_buckets;
+    size_t hybrid_buckets;
+    size_t bucket_keys[HATTRIE_STATS_BINS]; // histogram of keys per bucket
+    size_t slot_bytes[HATTRIE_STATS_BINS];  // histogram of bytes used per slot
+    size_t slots;       // slots of all buckets
+    size_t empty_slots;
+    double avg_chain;   // keys per non-empty slot
+    size_t max_chain;   // most keys in one slot
+
+    /* since the trie was created */
+    size_t splits;     // buckets split on insertion
+    size_t expansions; // buckets growing their slots on insertion
+
+    /* memory, allocated being hattrie_sizeof, and used excluding the spare
+     * capacity of slots and sparse trie nodes */
+    size_t allocated;
+    size_t used;
+
+    /* slots searched and entries looked at by every lookup in the process, if
+     * configured with --enable-counters (see ahtable_counters) */
+    uint64_t slot_lookups;
+    uint64_t slot_scanned;
+
+    /* lookups by hattrie_tryget answered by the cache, and not, since it was
+     * set (see hattrie_set_cache) */
+    size_t cache_hits;
+    size_t cache_misses;
+} hattrie_stats_t;
+
+/** Fill in the statistics of a trie, walking every node. Returns 0 if
+ * successful or -1 for a trie opened by hattrie_mmap_open or frozen, filling
+ * in only keys and the cache counters. */
+int hattrie_stats (const hattrie_t*, hattrie_stats_t* stats);
+
+
+/** Build a trie from n keys in sorted order, as sorted iteration returns them
+ * (bytewise, a key before its extensions), with the given values, or zeros if
+ * vals is NULL.
+ *
+ * The layout of the trie is decided in one pass over the keys, and every
+ * bucket is built once at its exact size, so no bucket is ever split. Returns
+ * NULL if the keys are not sorted or not distinct.
+ */
+hattrie_t* hattrie_build_sorted (const char** keys, const size_t* lens,
+                                 const value_t* vals, size_t n);
+
+/** Streaming version of hattrie_build_sorted. Keys are added one at a time,
+ * and only the keys of the buckets still being filled are kept in memory. */
+typedef struct hattrie_builder_t_ hattrie_builder_t;
+
+hattrie_builder_t* hattrie_builder_create (void);
+
+/* Add the next key. Returns 0 if successful or -1, leaving the builder
+ * unchanged, if the key is not greater than the one added before. */
+int hattrie_builder_add (hattrie_builder_t*, const char* key, size_t len, value_t val);
+
+/* Free the builder, returning the trie holding every key added. */
+hattrie_t* hattrie_builder_finish (hattrie_builder_t*);
+
+
+/** Write the trie, nodes and buckets, to a file handle as a flat image.
+ *
+ * The image can be read back with hattrie_load, or queried in place with
+ * hattrie_mmap_open. Returns 0 if successful or -1 on a write error, or if
+ * keys are still being moved (see hattrie_finish_moves).
+ */
+int hattrie_save (const hattrie_t*, FILE* fd);
+
+/** Load a trie written by hattrie_save. Returns NULL if the image is
+ * malformed or cannot be read. */
+hattrie_t* hattrie_load (FILE* fd);
+
+/** Open a file written by hattrie_save as a read-only trie, without
+ * deserializing it.
+ *
+ * The file is memory mapped where possible, so opening takes constant time and
+ * the pages are shared by every process that maps the same file. Only
+ * hattrie_size, hattrie_sizeof, hattrie_tryget, hattrie_tryget_batch,
+ * hattrie_longest_prefix, hattrie_count_prefix, hattrie_rank, hattrie_select,
+ * hattrie_save and iteration may be used on the result; values must not be
+ * modified through the returned pointers. hattrie_get returns NULL and
+ * hattrie_del -1. hattrie_clear turns it into an ordinary empty trie. The
+ * file's contents are trusted beyond a check of its header and trailer.
+ * Returns NULL if the file cannot be opened.
+ */
+hattrie_t* hattrie_mmap_open (const char* path);
+
+/** Turn a trie into a read-only one, served from its image held in memory as
+ * if opened by hattrie_mmap_open, for tries that are only queried once built.
+ *
+ * Every bucket becomes a single block of slots behind an array of offsets,
+ * rehashed into about one slot for every two keys, and every trie node a list
+ * of runs, which takes a fraction of the memory of the trie. hattrie_save
+ * writes the image as it is. Returns 0 if successful, or if the trie already
+ * is read-only, or -1 if it is concurrent, for readers may be in its nodes, or
+ * a bucket is too large for an image. */
+int hattrie_freeze (hattrie_t*);
+
 typedef struct hattrie_iter_t_ hattrie_iter_t;
 
+/* Starting an iterator on a trie still moving keys incrementally returns NULL,
+ * as does hattrie_iter_range, while hattrie_iter_reset and hattrie_iter_seek
+ * leave it finished (see hattrie_finish_moves). */
 hattrie_iter_t* hattrie_iter_begin     (const hattrie_t*, bool sorted);
 void            hattrie_iter_next      (hattrie_iter_t*);
 bool            hattrie_iter_finished  (hattrie_iter_t*);
@@ -62,10 +366,92 @@ void            hattrie_iter_free      (hattrie_iter_t*);
 const char*     hattrie_iter_key       (hattrie_iter_t*, size_t* len);
 value_t*        hattrie_iter_val       (hattrie_iter_t*);
 
+/* Iterate over only the keys starting with the given prefix, visiting only the
+ * subtree that owns it. */
+hattrie_iter_t* hattrie_iter_with_prefix (const hattrie_t*, bool sorted,
+                                          const char* prefix, size_t len);
+
+/* Restart an iterator over the keys of a trie starting with the given prefix,
+ * or all of them if len is 0, as hattrie_iter_with_prefix. The iterator's
+ * memory is reused, so a loop scanning with one iterator allocates nothing
+ * once the iterator has grown to the trie's depth and, for sorted iteration
+ * over tables that do not cache their order, bucket sizes. */
+void            hattrie_iter_reset     (hattrie_iter_t*, const hattrie_t*, bool sorted,
+                                        const char* prefix, size_t len);
+
+/* Restart an iterator at the first key not less than the given one, in sorted
+ * order, which the iterator switches to, comparing bytes as unsigned chars.
+ * Only the trie nodes along the key and one bucket are visited. */
+void            hattrie_iter_seek      (hattrie_iter_t*, const char* key, size_t len);
+
+/* Finish a sorted iterator before the first key not less than end, or remove
+ * the bound if end is NULL. The bound holds until the iterator is restarted by
+ * hattrie_iter_seek or hattrie_iter_reset. */
+void            hattrie_iter_set_end   (hattrie_iter_t*, const char* end, size_t len);
+
+/* Sorted iterator over the keys in [start, end), end being NULL for no bound. */
+hattrie_iter_t* hattrie_iter_range     (const hattrie_t*, const char* start, size_t start_len,
+                                        const char* end, size_t end_len);
+
+/* Split sorted iteration over a trie into at most n iterators over ranges of
+ * keys that follow one another, each holding about as many keys, for visiting
+ * them in parallel. Iterating over them in turn visits every key in sorted
+ * order. The trie is cut between subtrees and buckets, so a small or shallow
+ * trie may give fewer ranges. No iterator looks at a bucket of another's
+ * range, and buckets are sorted into memory from malloc rather than from the
+ * trie's allocator, so each may be used from a thread of its own, even with an
+ * allocator that is not thread safe, such as an arena. Stores the number of
+ * iterators in *count, and returns them in an array to be freed with free,
+ * once each is freed. The trie must not be modified while they are in use.
+ * Returns NULL, with *count 0, if keys are still being moved, as
+ * hattrie_iter_begin. */
+hattrie_iter_t** hattrie_iter_split    (const hattrie_t*, size_t n, size_t* count);
+
 /* Return true if two iterators are equal. */
 bool            hattrie_iter_equal     (const hattrie_iter_t* a,
                                         const hattrie_iter_t* b);
 
+/* The current key without copying it, as the characters leading through the
+ * trie to it, followed by the rest, stored in a bucket. Both parts are valid
+ * until the iterator moves. Returns false if the iterator is finished. */
+bool            hattrie_iter_key_parts (hattrie_iter_t*, const char** prefix, size_t* prefix_len,
+                                        const char** suffix, size_t* suffix_len);
+
+/** Call fn for every key, in sorted order if sorted is set, passing the key in
+ * two parts as hattrie_iter_key_parts, its value, and ctx. The walk stops at
+ * the first call returning nonzero, whose result is returned, or returns 0.
+ * Returns -1 without calling fn if keys are still being moved. The trie must
+ * not be modified during the walk. */
+typedef int (*hattrie_walk_fn) (const char* prefix, size_t prefix_len,
+                                const char* suffix, size_t suffix_len,
+                                value_t* val, void* ctx);
+
+int hattrie_walk (const hattrie_t*, bool sorted, hattrie_walk_fn fn, void* ctx);
+
+
+/** Counting and ranking keys in sorted order, as sorted iteration visits them.
+ *
+ * With the counts option, each of these goes down the trie once and scans a
+ * single bucket, taking time in the depth of the trie and the size of
+ * buckets, however many keys they count. Otherwise, and for images, they also
+ * walk every subtree they count the keys of. As iteration, they may not be
+ * called by readers of a concurrent trie. While keys are still being moved
+ * (see hattrie_finish_moves), the counts return (size_t) -1 and
+ * hattrie_select NULL.
+ */
+
+/* Number of keys starting with the given prefix, all of them if len is 0. */
+size_t hattrie_count_prefix (const hattrie_t*, const char* prefix, size_t len);
+
+/* Number of keys less than the given one, which need not be in the trie. */
+size_t hattrie_rank (const hattrie_t*, const char* key, size_t len);
+
+/* Sorted iterator starting at the key of rank i, the first key being of rank
+ * 0, or NULL if the trie has no more than i keys. A page of the keys starting
+ * with a prefix starts at the rank of the prefix plus the page's offset, and
+ * ends after hattrie_count_prefix of them. */
+hattrie_iter_t* hattrie_select (const hattrie_t*, size_t i);
+
 #ifdef __cplusplus
 }
 #endif
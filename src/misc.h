@@ -12,11 +12,107 @@
 #define LINESET_MISC_H
 
 #include <stdio.h>
+#include <string.h>
+#include "pstdint.h"
+#include "portable_endian.h"
+#include "common.h"
 
 void* malloc_or_die(size_t);
 void* realloc_or_die(void*, size_t);
 FILE* fopen_or_die(const char*, const char*);
 
+/* Unaligned little-endian loads and stores, used to read and write the
+ * on-disk images in place. */
+static inline uint16_t load_le16(const void* p)
+{
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+    return le16toh(x);
+}
+
+static inline uint32_t load_le32(const void* p)
+{
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return le32toh(x);
+}
+
+static inline uint64_t load_le64(const void* p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return le64toh(x);
+}
+
+static inline void store_le16(void* p, uint16_t x)
+{
+    x = htole16(x);
+    memcpy(p, &x, sizeof(x));
+}
+
+static inline void store_le32(void* p, uint32_t x)
+{
+    x = htole32(x);
+    memcpy(p, &x, sizeof(x));
+}
+
+static inline void store_le64(void* p, uint64_t x)
+{
+    x = htole64(x);
+    memcpy(p, &x, sizeof(x));
+}
+
+/* Values of w bytes, holding the low bytes of a value_t least significant
+ * first, or the whole value_t as it is if w is its size (see
+ * ahtable_set_value_size). */
+static inline value_t value_load(const void* p, size_t w)
+{
+    value_t x = 0;
+    if (w == sizeof(value_t)) memcpy(&x, p, sizeof(x));
+    else while (w-- > 0) x = (x << 8) | ((const unsigned char*) p)[w];
+    return x;
+}
+
+static inline void value_store(void* p, size_t w, value_t x)
+{
+    size_t k;
+    if (w == sizeof(value_t)) memcpy(p, &x, sizeof(x));
+    else for (k = 0; k < w; ++k, x >>= 8) ((unsigned char*) p)[k] = (unsigned char) x;
+}
+
+/* Hint that the memory at p is about to be read, so that independent lookups
+ * can wait on their cache misses together. */
+#ifdef __GNUC__
+#define prefetch(p) __builtin_prefetch((p))
+#else
+#define prefetch(p) ((void) (p))
+#endif
+
+/* Ordered loads and stores of words shared with concurrent readers (see
+ * rcu.h). A load_acquire that sees the value of a store_release also sees
+ * everything written before it. */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, x) __atomic_store_n((p), (x), __ATOMIC_RELEASE)
+#define fence_acquire()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fence_release()     __atomic_thread_fence(__ATOMIC_RELEASE)
+#define fence_full()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define atomic_add(p, x)    __atomic_add_fetch((p), (x), __ATOMIC_SEQ_CST)
+#define atomic_cas(p, a, b) __atomic_compare_exchange_n((p), &(a), (b), false, \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#else
+#define load_acquire(p) \
+    ({ __typeof__(*(p)) v_ = *(volatile __typeof__(*(p))*) (p); \
+       __sync_synchronize(); v_; })
+#define store_release(p, x) \
+    do { __sync_synchronize(); *(volatile __typeof__(*(p))*) (p) = (x); } while (0)
+#define fence_acquire()     __sync_synchronize()
+#define fence_release()     __sync_synchronize()
+#define fence_full()        __sync_synchronize()
+#define atomic_add(p, x)    __sync_add_and_fetch((p), (x))
+#define atomic_cas(p, a, b) __sync_bool_compare_and_swap((p), (a), (b))
+#endif
+
 #endif
 
 
@@ -21,12 +21,12 @@ static inline uint32_t rotl32(uint32_t x, int8_t r)
 }
 
 
-uint32_t hash(const char* data, size_t len_)
+uint32_t hash_murmur3(const char* data, size_t len_, uint64_t seed)
 {
     const int len = (int) len_;
     const int nblocks = len / 4;
 
-    uint32_t h1 = 0xc062fb4a;
+    uint32_t h1 = 0xc062fb4a ^ (uint32_t) (seed ^ (seed >> 32));
 
     uint32_t c1 = 0xcc9e2d51;
     uint32_t c2 = 0x1b873593;
@@ -6,7 +6,7 @@
 
 #include "pstdint.h"
 
-uint32_t hash(const char* data, size_t len);
+uint32_t hash_murmur3(const char* data, size_t len, uint64_t seed);
 
 #endif
 
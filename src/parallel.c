@@ -0,0 +1,74 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See parallel.h for a description of parallel iteration.
+ *
+ */
+
+#include "parallel.h"
+#include "misc.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+
+typedef struct hattrie_part_t_
+{
+    hattrie_iter_t* i;
+    size_t part;
+    hattrie_part_fn fn;
+    void* ctx;
+} hattrie_part_t;
+
+
+static void* part_run(void* arg)
+{
+    hattrie_part_t* p = arg;
+    p->fn(p->i, p->part, p->ctx);
+    return NULL;
+}
+
+
+size_t hattrie_parallel_for(const hattrie_t* T, size_t nthreads, hattrie_part_fn fn, void* ctx)
+{
+    size_t n, j;
+    hattrie_iter_t** is = hattrie_iter_split(T, nthreads, &n);
+    if (is == NULL) return 0;
+
+    hattrie_part_t* parts = malloc_or_die(n * sizeof(hattrie_part_t));
+    for (j = 0; j < n; ++j) {
+        parts[j].i    = is[j];
+        parts[j].part = j;
+        parts[j].fn   = fn;
+        parts[j].ctx  = ctx;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    /* run the first range on this thread, and any range a thread could not be
+     * started for after it */
+    pthread_t* threads = malloc_or_die(n * sizeof(pthread_t));
+    bool*      started = malloc_or_die(n * sizeof(bool));
+    started[0] = false;
+    for (j = 1; j < n; ++j) {
+        started[j] = pthread_create(&threads[j], NULL, part_run, &parts[j]) == 0;
+    }
+    for (j = 0; j < n; ++j) {
+        if (!started[j]) part_run(&parts[j]);
+    }
+    for (j = 1; j < n; ++j) {
+        if (started[j]) pthread_join(threads[j], NULL);
+    }
+    free(threads);
+    free(started);
+#else
+    for (j = 0; j < n; ++j) part_run(&parts[j]);
+#endif
+
+    for (j = 0; j < n; ++j) hattrie_iter_free(is[j]);
+    free(is);
+    free(parts);
+    return n;
+}
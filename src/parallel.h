@@ -0,0 +1,40 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Visiting the keys of a trie from many threads at once.
+ *
+ * The trie is split into ranges of keys with hattrie_iter_split, and each
+ * range is handed to a thread of its own, with an iterator visiting its keys
+ * in sorted order. Ranges are numbered in key order, so results gathered per
+ * range may be combined in order afterwards.
+ *
+ */
+
+#ifndef HATTRIE_PARALLEL_H
+#define HATTRIE_PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "hat-trie.h"
+
+/* Called once for every range, with an iterator positioned at its first key,
+ * which the function may advance but not free. */
+typedef void (*hattrie_part_fn) (hattrie_iter_t* i, size_t part, void* ctx);
+
+/* Split the keys of a trie into at most nthreads ranges, calling fn for every
+ * range on a thread of its own, and return once all are done. Returns the
+ * number of ranges, or 0 without calling fn if keys are still being moved (see
+ * hattrie_finish_moves). Values of a trie in memory may be set through the
+ * iterators, but the trie must not be otherwise modified until it returns. */
+size_t hattrie_parallel_for (const hattrie_t*, size_t nthreads, hattrie_part_fn fn, void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See rcu.h for a description of deferred freeing.
+ *
+ */
+
+#include "rcu.h"
+#include "misc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+/* how many blocks are retired between attempts to free them */
+static const size_t rcu_batch = 64;
+
+
+typedef struct rcu_retired_t_
+{
+    void*    p;
+    size_t   n;
+    uint64_t epoch; // epoch the block was retired in
+} rcu_retired_t;
+
+
+struct hattrie_reader_t_
+{
+    uint64_t epoch;  // epoch the reader entered its critical section in, or 0
+    int      in_use; // registered
+    rcu_domain_t* d;
+    struct hattrie_reader_t_* next;
+};
+
+
+struct rcu_domain_t_
+{
+    hattrie_allocator_t inner;
+
+    uint64_t epoch; // current epoch, starting at 1
+
+    /* every reader ever registered, unregistered ones being reused */
+    rcu_reader_t* readers;
+
+    /* blocks waiting to be freed, in the order retired. Only the writer
+     * touches these. */
+    rcu_retired_t* retired;
+    size_t nretired;
+    size_t size;
+    size_t pending;      // bytes retired
+    size_t next_reclaim; // nretired at which to try freeing
+};
+
+
+static void retire(rcu_domain_t* d, void* p, size_t n)
+{
+    if (p == NULL) return;
+
+    if (d->nretired == d->size) {
+        d->size = d->size ? 2 * d->size : rcu_batch;
+        d->retired = realloc_or_die(d->retired, d->size * sizeof(rcu_retired_t));
+    }
+
+    d->retired[d->nretired].p     = p;
+    d->retired[d->nretired].n     = n;
+    d->retired[d->nretired].epoch = load_acquire(&d->epoch);
+    ++d->nretired;
+    d->pending += n;
+}
+
+
+static void* rcu_alloc_block(void* ctx, size_t n)
+{
+    rcu_domain_t* d = ctx;
+    return d->inner.alloc(d->inner.ctx, n);
+}
+
+
+static void* rcu_realloc_block(void* ctx, void* p, size_t old_n, size_t new_n)
+{
+    /* readers may still be looking at the old block, so it is never resized in
+     * place */
+    rcu_domain_t* d = ctx;
+    void* q = d->inner.alloc(d->inner.ctx, new_n);
+    if (p) {
+        memcpy(q, p, old_n < new_n ? old_n : new_n);
+        retire(d, p, old_n);
+    }
+    return q;
+}
+
+
+static void rcu_free_block(void* ctx, void* p, size_t n)
+{
+    retire(ctx, p, n);
+}
+
+
+rcu_domain_t* rcu_create(const hattrie_allocator_t* inner)
+{
+    rcu_domain_t* d = malloc_or_die(sizeof(rcu_domain_t));
+    d->inner        = *inner;
+    d->epoch        = 1;
+    d->readers      = NULL;
+    d->retired      = NULL;
+    d->nretired     = 0;
+    d->size         = 0;
+    d->pending      = 0;
+    d->next_reclaim = rcu_batch;
+    return d;
+}
+
+
+void rcu_free(rcu_domain_t* d)
+{
+    if (d == NULL) return;
+
+    size_t i;
+    if (d->inner.release) d->inner.release(d->inner.ctx);
+    else {
+        for (i = 0; i < d->nretired; ++i) {
+            d->inner.free(d->inner.ctx, d->retired[i].p, d->retired[i].n);
+        }
+    }
+    free(d->retired);
+
+    rcu_reader_t* r = d->readers;
+    rcu_reader_t* next;
+    while (r) {
+        next = r->next;
+        free(r);
+        r = next;
+    }
+
+    free(d);
+}
+
+
+hattrie_allocator_t rcu_allocator(rcu_domain_t* d)
+{
+    hattrie_allocator_t alloc;
+    alloc.alloc   = rcu_alloc_block;
+    alloc.realloc = rcu_realloc_block;
+    alloc.free    = rcu_free_block;
+    alloc.release = NULL;
+    alloc.ctx     = d;
+    return alloc;
+}
+
+
+void rcu_reclaim(rcu_domain_t* d)
+{
+    /* Blocks retired before the epoch is advanced are unreachable for readers
+     * entering after it. Any reader that entered before and is still inside
+     * pins everything retired since it entered. */
+    uint64_t min = atomic_add(&d->epoch, 1);
+    fence_full();
+
+    uint64_t e;
+    rcu_reader_t* r;
+    for (r = load_acquire(&d->readers); r; r = r->next) {
+        e = load_acquire(&r->epoch);
+        if (e != 0 && e < min) min = e;
+    }
+
+    size_t i, j;
+    for (i = 0, j = 0; i < d->nretired; ++i) {
+        if (d->retired[i].epoch < min) {
+            d->inner.free(d->inner.ctx, d->retired[i].p, d->retired[i].n);
+            d->pending -= d->retired[i].n;
+        }
+        else d->retired[j++] = d->retired[i];
+    }
+    d->nretired = j;
+
+    /* with readers lagging behind, back off rather than rescanning on every
+     * retirement */
+    d->next_reclaim = 2 * d->nretired + rcu_batch;
+}
+
+
+void rcu_tick(rcu_domain_t* d)
+{
+    if (d->nretired >= d->next_reclaim) rcu_reclaim(d);
+}
+
+
+void rcu_synchronize(rcu_domain_t* d)
+{
+    while (true) {
+        rcu_reclaim(d);
+        if (d->nretired == 0) break;
+#ifdef HAVE_SCHED_H
+        sched_yield();
+#endif
+    }
+}
+
+
+size_t rcu_pending(const rcu_domain_t* d)
+{
+    return d->pending;
+}
+
+
+rcu_reader_t* rcu_reader_register(rcu_domain_t* d)
+{
+    rcu_reader_t* r;
+    int expected;
+    for (r = load_acquire(&d->readers); r; r = r->next) {
+        expected = 0;
+        if (atomic_cas(&r->in_use, expected, 1)) return r;
+    }
+
+    r = malloc_or_die(sizeof(rcu_reader_t));
+    r->epoch  = 0;
+    r->in_use = 1;
+    r->d      = d;
+
+    rcu_reader_t* head;
+    do {
+        head = load_acquire(&d->readers);
+        r->next = head;
+    } while (!atomic_cas(&d->readers, head, r));
+
+    return r;
+}
+
+
+void rcu_reader_unregister(rcu_reader_t* r)
+{
+    if (r == NULL) return;
+    store_release(&r->epoch, 0);
+    store_release(&r->in_use, 0);
+}
+
+
+void rcu_read_lock(rcu_reader_t* r)
+{
+    store_release(&r->epoch, load_acquire(&r->d->epoch));
+    fence_full();
+}
+
+
+void rcu_read_unlock(rcu_reader_t* r)
+{
+    store_release(&r->epoch, 0);
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Deferred freeing for tries read concurrently with a writer.
+ *
+ * A single writer modifies the trie while any number of readers query it
+ * without locks. Readers announce themselves by entering a read-side critical
+ * section, recording a global epoch. Memory the writer frees is not given back
+ * right away, but retired with the current epoch, and only freed once every
+ * reader that could still hold a pointer to it has left its critical section.
+ *
+ * The domain wraps the trie's allocator, so that every free and realloc in the
+ * trie and its tables is deferred without those having to know.
+ *
+ */
+
+#ifndef HATTRIE_RCU_H
+#define HATTRIE_RCU_H
+
+#include "common.h"
+#include "pstdint.h"
+#include <stdbool.h>
+
+typedef struct rcu_domain_t_ rcu_domain_t;
+typedef struct hattrie_reader_t_ rcu_reader_t;
+
+/* Create a domain deferring frees to the given allocator, which is copied. */
+rcu_domain_t* rcu_create (const hattrie_allocator_t* inner);
+
+/* Free a domain, and everything retired to it, or released if the inner
+ * allocator can release. There must be no readers left in critical sections. */
+void rcu_free (rcu_domain_t*);
+
+/* Allocator allocating from the inner one, but retiring instead of freeing. */
+hattrie_allocator_t rcu_allocator (rcu_domain_t*);
+
+/* The writer retires blocks while they may still be reachable, so freeing is
+ * only attempted between modifications, once every retired block has been
+ * unlinked. */
+
+/* Free whatever no reader can be using any more, without waiting. */
+void rcu_reclaim (rcu_domain_t*);
+
+/* rcu_reclaim, if enough blocks were retired since it last ran. */
+void rcu_tick (rcu_domain_t*);
+
+/* Wait for every reader to leave the critical section it is in, and free
+ * everything retired so far. */
+void rcu_synchronize (rcu_domain_t*);
+
+/* Bytes retired and not yet freed. */
+size_t rcu_pending (const rcu_domain_t*);
+
+/* Readers are registered once per thread, and may be unregistered and reused.
+ * Registering is safe from any thread. */
+rcu_reader_t* rcu_reader_register   (rcu_domain_t*);
+void          rcu_reader_unregister (rcu_reader_t*);
+void          rcu_read_lock         (rcu_reader_t*);
+void          rcu_read_unlock       (rcu_reader_t*);
+
+#endif
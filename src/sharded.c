@@ -0,0 +1,330 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See sharded.h for a description of sharded tries.
+ *
+ */
+
+#include "sharded.h"
+#include "misc.h"
+#include <limits.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+
+typedef struct hattrie_shard_t_
+{
+    hattrie_t* T;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    size_t size; // scratch for hattrie_sharded_sizeof
+} hattrie_shard_t;
+
+
+struct hattrie_sharded_t_
+{
+    size_t nshards;
+    hattrie_shard_t* shards;
+};
+
+
+hattrie_sharded_t* hattrie_sharded_create(size_t nshards, const hattrie_opts_t* opts)
+{
+    if (nshards == 0 || nshards > 256) return NULL;
+    if (opts && opts->alloc && opts->alloc->release) return NULL;
+    if (opts && opts->value_size != HATTRIE_VALUE_SET &&
+        opts->value_size > sizeof(value_t)) {
+        return NULL;
+    }
+
+    hattrie_sharded_t* S = malloc_or_die(sizeof(hattrie_sharded_t));
+    S->nshards = nshards;
+    S->shards  = malloc_or_die(nshards * sizeof(hattrie_shard_t));
+
+    size_t i;
+    for (i = 0; i < nshards; ++i) {
+        S->shards[i].T = hattrie_create_ex(opts);
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_init(&S->shards[i].lock, NULL);
+#endif
+    }
+
+    return S;
+}
+
+
+void hattrie_sharded_free(hattrie_sharded_t* S)
+{
+    if (S == NULL) return;
+
+    size_t i;
+    for (i = 0; i < S->nshards; ++i) {
+        hattrie_free(S->shards[i].T);
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_destroy(&S->shards[i].lock);
+#endif
+    }
+
+    free(S->shards);
+    free(S);
+}
+
+
+size_t hattrie_sharded_count(const hattrie_sharded_t* S)
+{
+    return S->nshards;
+}
+
+
+hattrie_t* hattrie_sharded_trie(hattrie_sharded_t* S, size_t shard)
+{
+    return S->shards[shard].T;
+}
+
+
+size_t hattrie_sharded_shard(const hattrie_sharded_t* S, const char* key, size_t len)
+{
+    return len == 0 ? 0 : (unsigned char) key[0] % S->nshards;
+}
+
+
+void hattrie_sharded_lock(hattrie_sharded_t* S, size_t shard)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&S->shards[shard].lock);
+#else
+    (void) S;
+    (void) shard;
+#endif
+}
+
+
+void hattrie_sharded_unlock(hattrie_sharded_t* S, size_t shard)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&S->shards[shard].lock);
+#else
+    (void) S;
+    (void) shard;
+#endif
+}
+
+
+size_t hattrie_sharded_size(hattrie_sharded_t* S)
+{
+    size_t i, m = 0;
+    for (i = 0; i < S->nshards; ++i) {
+        hattrie_sharded_lock(S, i);
+        m += hattrie_size(S->shards[i].T);
+        hattrie_sharded_unlock(S, i);
+    }
+    return m;
+}
+
+
+static void* shard_sizeof(void* arg)
+{
+    hattrie_shard_t* shard = arg;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&shard->lock);
+#endif
+    shard->size = hattrie_sizeof(shard->T);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&shard->lock);
+#endif
+    return NULL;
+}
+
+
+size_t hattrie_sharded_sizeof(hattrie_sharded_t* S)
+{
+    size_t i;
+#ifdef HAVE_PTHREAD_H
+    /* walk the shards on threads of their own, measuring any shard a thread
+     * could not be started for on this one */
+    pthread_t* threads = malloc_or_die(S->nshards * sizeof(pthread_t));
+    bool*      started = malloc_or_die(S->nshards * sizeof(bool));
+    for (i = 0; i < S->nshards; ++i) {
+        started[i] = pthread_create(&threads[i], NULL, shard_sizeof, &S->shards[i]) == 0;
+        if (!started[i]) shard_sizeof(&S->shards[i]);
+    }
+    for (i = 0; i < S->nshards; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(started);
+#else
+    for (i = 0; i < S->nshards; ++i) shard_sizeof(&S->shards[i]);
+#endif
+
+    size_t size = sizeof(hattrie_sharded_t) + S->nshards * sizeof(hattrie_shard_t);
+    for (i = 0; i < S->nshards; ++i) size += S->shards[i].size;
+    return size;
+}
+
+
+value_t hattrie_sharded_add(hattrie_sharded_t* S, const char* key, size_t len, value_t delta)
+{
+    size_t shard = hattrie_sharded_shard(S, key, len);
+    hattrie_sharded_lock(S, shard);
+    hattrie_t* T = S->shards[shard].T;
+    value_t* val = hattrie_get(T, key, len);
+    hattrie_value_store(T, val, hattrie_value_load(T, val) + delta);
+    value_t  x   = hattrie_value_load(T, val);
+    hattrie_sharded_unlock(S, shard);
+    return x;
+}
+
+
+void hattrie_sharded_set(hattrie_sharded_t* S, const char* key, size_t len, value_t val)
+{
+    size_t shard = hattrie_sharded_shard(S, key, len);
+    hattrie_sharded_lock(S, shard);
+    hattrie_t* T = S->shards[shard].T;
+    hattrie_value_store(T, hattrie_get(T, key, len), val);
+    hattrie_sharded_unlock(S, shard);
+}
+
+
+bool hattrie_sharded_tryget(hattrie_sharded_t* S, const char* key, size_t len, value_t* val)
+{
+    size_t shard = hattrie_sharded_shard(S, key, len);
+    hattrie_sharded_lock(S, shard);
+    hattrie_t* T = S->shards[shard].T;
+    value_t* u = hattrie_tryget(T, key, len);
+    if (u) *val = hattrie_value_load(T, u);
+    hattrie_sharded_unlock(S, shard);
+    return u != NULL;
+}
+
+
+int hattrie_sharded_del(hattrie_sharded_t* S, const char* key, size_t len)
+{
+    size_t shard = hattrie_sharded_shard(S, key, len);
+    hattrie_sharded_lock(S, shard);
+    int r = hattrie_del(S->shards[shard].T, key, len);
+    hattrie_sharded_unlock(S, shard);
+    return r;
+}
+
+
+/* Iteration.
+ *
+ * Every first byte belongs to one shard, so merging the sorted iterators of the
+ * shards only takes comparing the first bytes of their next keys, and a shard
+ * stays current for as long as its keys share a first byte.
+ */
+
+struct hattrie_sharded_iter_t_
+{
+    hattrie_sharded_t* S;
+    bool sorted;
+    hattrie_iter_t** is; // one per shard
+    size_t cur;          // shard of the next key, nshards when finished
+};
+
+
+/* Order of the next key of a shard: -1 for the empty key, its first byte,
+ * or INT_MAX when the shard is done. */
+static int shard_lead(hattrie_iter_t* i)
+{
+    if (hattrie_iter_finished(i)) return INT_MAX;
+    size_t len;
+    const char* key = hattrie_iter_key(i, &len);
+    return len == 0 ? -1 : (unsigned char) key[0];
+}
+
+
+/* Pick the shard holding the next key. */
+static void hattrie_sharded_iter_pick(hattrie_sharded_iter_t* i)
+{
+    size_t j;
+    if (!i->sorted) {
+        while (i->cur < i->S->nshards && hattrie_iter_finished(i->is[i->cur])) ++i->cur;
+        return;
+    }
+
+    int lead, min = INT_MAX;
+    i->cur = i->S->nshards;
+    for (j = 0; j < i->S->nshards; ++j) {
+        lead = shard_lead(i->is[j]);
+        if (lead < min) {
+            min    = lead;
+            i->cur = j;
+        }
+    }
+}
+
+
+hattrie_sharded_iter_t* hattrie_sharded_iter_begin(hattrie_sharded_t* S, bool sorted)
+{
+    hattrie_sharded_iter_t* i = malloc_or_die(sizeof(hattrie_sharded_iter_t));
+    i->S      = S;
+    i->sorted = sorted;
+    i->is     = malloc_or_die(S->nshards * sizeof(hattrie_iter_t*));
+    i->cur    = 0;
+
+    /* iterators would miss the keys a shard is still moving */
+    size_t j;
+    for (j = 0; j < S->nshards; ++j) {
+        hattrie_sharded_lock(S, j);
+        hattrie_finish_moves(S->shards[j].T);
+        hattrie_sharded_unlock(S, j);
+        i->is[j] = hattrie_iter_begin(S->shards[j].T, sorted);
+    }
+    hattrie_sharded_iter_pick(i);
+
+    return i;
+}
+
+
+void hattrie_sharded_iter_next(hattrie_sharded_iter_t* i)
+{
+    if (hattrie_sharded_iter_finished(i)) return;
+
+    hattrie_iter_t* u = i->is[i->cur];
+    int lead = shard_lead(u);
+    hattrie_iter_next(u);
+
+    /* unsorted, or more keys with the same first byte */
+    if (!i->sorted && !hattrie_iter_finished(u)) return;
+    if (i->sorted && lead >= 0 && shard_lead(u) == lead) return;
+
+    hattrie_sharded_iter_pick(i);
+}
+
+
+bool hattrie_sharded_iter_finished(hattrie_sharded_iter_t* i)
+{
+    return i->cur >= i->S->nshards;
+}
+
+
+void hattrie_sharded_iter_free(hattrie_sharded_iter_t* i)
+{
+    if (i == NULL) return;
+
+    size_t j;
+    for (j = 0; j < i->S->nshards; ++j) hattrie_iter_free(i->is[j]);
+    free(i->is);
+    free(i);
+}
+
+
+const char* hattrie_sharded_iter_key(hattrie_sharded_iter_t* i, size_t* len)
+{
+    if (hattrie_sharded_iter_finished(i)) return NULL;
+    return hattrie_iter_key(i->is[i->cur], len);
+}
+
+
+value_t* hattrie_sharded_iter_val(hattrie_sharded_iter_t* i)
+{
+    if (hattrie_sharded_iter_finished(i)) return NULL;
+    return hattrie_iter_val(i->is[i->cur]);
+}
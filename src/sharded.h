@@ -0,0 +1,80 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * A set of tries, shards, partitioning keys on their first byte, for inserting
+ * from many threads at once.
+ *
+ * The root of a trie already dispatches on the first byte, so each shard is an
+ * ordinary trie holding the keys whose first byte maps to it, byte c going to
+ * shard c % nshards (the empty key to shard 0). Every shard has its own lock,
+ * taken by the hattrie_sharded_* lookup functions. Alternatively, a thread may
+ * own a shard, routing keys to owners with hattrie_sharded_shard and using
+ * the shard's trie directly, without locking.
+ *
+ */
+
+#ifndef HATTRIE_SHARDED_H
+#define HATTRIE_SHARDED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "hat-trie.h"
+
+typedef struct hattrie_sharded_t_ hattrie_sharded_t;
+
+/* Create nshards (at most 256) empty tries with the given options, or the
+ * defaults if opts is NULL. Returns NULL if nshards is 0, the value size is
+ * too large, or the allocator has a release function, which cannot be shared
+ * between tries. */
+hattrie_sharded_t* hattrie_sharded_create (size_t nshards, const hattrie_opts_t* opts);
+
+void   hattrie_sharded_free   (hattrie_sharded_t*);
+size_t hattrie_sharded_size   (hattrie_sharded_t*); // Number of stored keys.
+size_t hattrie_sharded_sizeof (hattrie_sharded_t*); // Memory used in bytes, measured per shard in parallel.
+
+size_t     hattrie_sharded_count (const hattrie_sharded_t*);           // Number of shards.
+hattrie_t* hattrie_sharded_trie  (hattrie_sharded_t*, size_t shard);   // Trie of a shard.
+
+/* Shard owning the given key. */
+size_t hattrie_sharded_shard (const hattrie_sharded_t*, const char* key, size_t len);
+
+/* Take or release the lock of a shard, around direct use of its trie. */
+void hattrie_sharded_lock   (hattrie_sharded_t*, size_t shard);
+void hattrie_sharded_unlock (hattrie_sharded_t*, size_t shard);
+
+/* Add delta to the value of a key, inserting it with value 0 first if it does
+ * not exist, and return the new value. */
+value_t hattrie_sharded_add (hattrie_sharded_t*, const char* key, size_t len, value_t delta);
+
+/* Set the value of a key, inserting it if it does not exist. */
+void hattrie_sharded_set (hattrie_sharded_t*, const char* key, size_t len, value_t val);
+
+/* Copy the value of a key to *val. Returns false if it does not exist. */
+bool hattrie_sharded_tryget (hattrie_sharded_t*, const char* key, size_t len, value_t* val);
+
+/* Delete a key. Returns 0 if successful or -1 if not found. */
+int hattrie_sharded_del (hattrie_sharded_t*, const char* key, size_t len);
+
+
+/* Iterate over the keys of every shard, in sorted order across shards if
+ * sorted is set, finishing any keys a shard is still moving incrementally
+ * first. No shard may be modified while an iterator is in use. */
+typedef struct hattrie_sharded_iter_t_ hattrie_sharded_iter_t;
+
+hattrie_sharded_iter_t* hattrie_sharded_iter_begin    (hattrie_sharded_t*, bool sorted);
+void                    hattrie_sharded_iter_next     (hattrie_sharded_iter_t*);
+bool                    hattrie_sharded_iter_finished (hattrie_sharded_iter_t*);
+void                    hattrie_sharded_iter_free     (hattrie_sharded_iter_t*);
+const char*             hattrie_sharded_iter_key      (hattrie_sharded_iter_t*, size_t* len);
+value_t*                hattrie_sharded_iter_val      (hattrie_sharded_iter_t*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ * See strsort.h for a description of the sort.
+ *
+ */
+
+#include "strsort.h"
+#include "misc.h"
+#include <stdlib.h>
+
+/* groups smaller than this are insertion sorted */
+static const size_t strsort_cutoff = 32;
+
+
+/* Compare two strings known to agree on their first d bytes. */
+static inline int strsort_cmp(const strsort_key_t* a, const strsort_key_t* b, size_t d)
+{
+    size_t len = a->len < b->len ? a->len : b->len;
+    int c = memcmp(a->s + d, b->s + d, len - d);
+    if (c != 0) return c;
+    return a->len < b->len ? -1 : a->len > b->len;
+}
+
+
+static void strsort_insertion(strsort_key_t* xs, size_t n, size_t d)
+{
+    size_t i, j;
+    strsort_key_t x;
+    for (i = 1; i < n; ++i) {
+        x = xs[i];
+        for (j = i; j > 0 && strsort_cmp(&x, &xs[j - 1], d) < 0; --j) {
+            xs[j] = xs[j - 1];
+        }
+        xs[j] = x;
+    }
+}
+
+
+/* Bucket of a string at depth d: 0 if it ends before d, or 1 + its byte. */
+static inline size_t strsort_bucket(const strsort_key_t* x, size_t d)
+{
+    return d < x->len ? 1 + (size_t) x->s[d] : 0;
+}
+
+
+/* Sort n strings agreeing on their first d bytes, using tmp for n entries. The
+ * largest bucket is sorted by looping rather than recursion, so that the
+ * recursion is at most log2(n) deep. */
+static void strsort_msd(strsort_key_t* xs, strsort_key_t* tmp, size_t n, size_t d)
+{
+    size_t counts[257];
+    size_t offs[257];
+    size_t i, b, big;
+
+    while (n >= strsort_cutoff) {
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < n; ++i) ++counts[strsort_bucket(&xs[i], d)];
+
+        /* strings that all share the next byte need no moving */
+        b = strsort_bucket(&xs[0], d);
+        if (counts[b] == n) {
+            if (b == 0) return;
+            ++d;
+            continue;
+        }
+
+        offs[0] = 0;
+        for (b = 1; b < 257; ++b) offs[b] = offs[b - 1] + counts[b - 1];
+        for (i = 0; i < n; ++i) tmp[offs[strsort_bucket(&xs[i], d)]++] = xs[i];
+        memcpy(xs, tmp, n * sizeof(strsort_key_t));
+
+        /* strings ending at d are equal and come first; sort the others */
+        big = 1;
+        for (b = 1; b < 257; ++b) {
+            if (counts[b] > counts[big]) big = b;
+        }
+        for (b = 1; b < 257; ++b) {
+            if (b != big && counts[b] > 1) {
+                strsort_msd(xs + offs[b] - counts[b], tmp, counts[b], d + 1);
+            }
+        }
+
+        xs += offs[big] - counts[big];
+        n   = counts[big];
+        ++d;
+    }
+
+    strsort_insertion(xs, n, d);
+}
+
+
+void strsort(strsort_key_t* xs, size_t n)
+{
+    if (n < 2) return;
+    strsort_key_t* tmp = malloc_or_die(n * sizeof(strsort_key_t));
+    strsort_msd(xs, tmp, n, 0);
+    free(tmp);
+}
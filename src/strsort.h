@@ -0,0 +1,30 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Sorting byte strings.
+ *
+ * Strings are sorted with a most significant digit first radix sort,
+ * distributing them on one byte at a time, which reads each byte of the
+ * distinguishing prefixes about once instead of comparing whole strings
+ * O(log n) times over. Small groups are finished by insertion sort.
+ *
+ */
+
+#ifndef HATTRIE_STRSORT_H
+#define HATTRIE_STRSORT_H
+
+#include <stddef.h>
+
+typedef struct strsort_key_t_
+{
+    const unsigned char* s;
+    size_t len;
+} strsort_key_t;
+
+/* Sort n strings bytewise, a string before its extensions. */
+void strsort (strsort_key_t* xs, size_t n);
+
+#endif
@@ -0,0 +1,13 @@
+
+#ifndef WYHASH_H
+#define WYHASH_H
+
+#include <stdlib.h>
+
+#include "pstdint.h"
+
+uint32_t hash_wy   (const char* data, size_t len, uint64_t seed);
+uint64_t hash_wy64 (const char* data, size_t len, uint64_t seed);
+
+#endif
+
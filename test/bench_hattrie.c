@@ -0,0 +1,636 @@
+/*
+ * This file is part of hat-trie.
+ *
+ * Copyright (c) 2011 by Daniel C. Jones <dcjones@cs.washington.edu>
+ *
+ *
+ * Benchmarks of the trie against str_map, a plain chained hash table, as a
+ * baseline.
+ *
+ *   bench_hattrie [-n keys] [-l lookups] [-r rounds] [-s seed] [file ...]
+ *
+ * Each file is read as a dataset of keys, one per line, duplicates dropped.
+ * With no files, three synthetic datasets are generated instead: short URLs,
+ * IDs sharing long prefixes, and uniformly random printable strings. For every
+ * dataset and structure the benchmark measures
+ *
+ *   - insert throughput, inserting every key into an empty structure,
+ *   - throughput and latency percentiles of lookups of keys drawn from a Zipf
+ *     distribution, and of lookups of absent keys resembling present ones,
+ *   - delete churn, deleting a tenth of the keys and inserting them again,
+ *   - scans in unsorted and sorted order,
+ *   - memory used per key.
+ *
+ * All times are taken from the monotonic clock.
+ */
+
+#include "../src/hat-trie.h"
+#include "str_map.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Timing. */
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+
+/* Cost of reading the clock, subtracted from the per lookup timings. */
+static uint64_t timer_overhead(void)
+{
+    uint64_t t0, t1, min = UINT64_MAX;
+    size_t i;
+    for (i = 0; i < 1000; ++i) {
+        t0 = now_ns();
+        t1 = now_ns();
+        if (t1 - t0 < min) min = t1 - t0;
+    }
+    return min;
+}
+
+
+/* Results are summed into this, so lookups and scans can't be optimized out. */
+static volatile value_t sink;
+
+
+/* Random numbers (xorshift64*), reproducible across platforms. */
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static size_t rng_below(size_t n)
+{
+    return (size_t) (rng() % n);
+}
+
+
+/* Datasets. */
+
+typedef struct
+{
+    const char* name;
+    char**  keys;
+    size_t* lens;
+    size_t  n;
+    size_t  size; // keys allocated
+    str_map* seen; // for dropping duplicates
+} dataset_t;
+
+
+static void dataset_init(dataset_t* D, const char* name)
+{
+    D->name = name;
+    D->keys = NULL;
+    D->lens = NULL;
+    D->n    = 0;
+    D->size = 0;
+    D->seen = str_map_create();
+}
+
+
+static void dataset_add(dataset_t* D, const char* key, size_t len)
+{
+    if (str_map_get(D->seen, key, len)) return;
+
+    if (D->n == D->size) {
+        D->size = D->size ? 2 * D->size : 1024;
+        D->keys = realloc(D->keys, D->size * sizeof(char*));
+        D->lens = realloc(D->lens, D->size * sizeof(size_t));
+        if (D->keys == NULL || D->lens == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    D->keys[D->n] = malloc(len ? len : 1);
+    memcpy(D->keys[D->n], key, len);
+    D->lens[D->n] = len;
+    ++D->n;
+    str_map_set(D->seen, key, len, D->n);
+}
+
+
+static bool dataset_has(const dataset_t* D, const char* key, size_t len)
+{
+    return str_map_get(D->seen, key, len) != 0;
+}
+
+
+static void dataset_free(dataset_t* D)
+{
+    size_t i;
+    for (i = 0; i < D->n; ++i) free(D->keys[i]);
+    free(D->keys);
+    free(D->lens);
+    str_map_destroy(D->seen);
+}
+
+
+static bool dataset_read(dataset_t* D, const char* path, size_t max_n)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return false;
+
+    dataset_init(D, path);
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while (D->n < max_n && (len = getline(&line, &size, f)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) --len;
+        if (len > 0) dataset_add(D, line, (size_t) len);
+    }
+
+    free(line);
+    fclose(f);
+    return true;
+}
+
+
+static const char* words[] = {
+    "news", "blog", "shop", "docs", "api", "static", "images", "video",
+    "search", "user", "account", "cart", "product", "category", "article",
+    "tag", "help", "about", "login", "feed", "comments", "archive", "media",
+    "download", "wiki", "forum", "post", "item", "review", "index", "v1", "v2"
+};
+
+static const size_t nwords = sizeof(words) / sizeof(words[0]);
+
+
+/* Short URLs: a few thousand hosts, of which some are much more common, and a
+ * couple of path components. */
+static void dataset_urls(dataset_t* D, size_t n)
+{
+    dataset_init(D, "urls");
+
+    char key[256];
+    size_t len;
+    uint64_t host;
+    while (D->n < n) {
+        host = rng_below(1 + rng_below(5000));
+        len = (size_t) snprintf(key, sizeof(key), "http://%s%llu.%s/%s/%s/%llu",
+                                words[host % nwords], (unsigned long long) host,
+                                host % 3 ? "com" : "org",
+                                words[rng_below(nwords)], words[rng_below(nwords)],
+                                (unsigned long long) rng_below(100000));
+        dataset_add(D, key, len);
+    }
+}
+
+
+/* IDs all sharing one of a few long prefixes, followed by a counter. */
+static void dataset_ids(dataset_t* D, size_t n)
+{
+    dataset_init(D, "ids");
+
+    char key[128];
+    size_t len;
+    uint64_t i = 0;
+    while (D->n < n) {
+        len = (size_t) snprintf(key, sizeof(key), "org.example.tenant%02u:%s:%012llu",
+                                (unsigned) rng_below(16), words[rng_below(4)],
+                                (unsigned long long) (i++ * 7919 % 1000000007));
+        dataset_add(D, key, len);
+    }
+}
+
+
+/* Uniformly random printable strings, between 8 and 64 bytes long. */
+static void dataset_random(dataset_t* D, size_t n)
+{
+    dataset_init(D, "random");
+
+    char key[64];
+    size_t i, len;
+    while (D->n < n) {
+        len = 8 + rng_below(57);
+        for (i = 0; i < len; ++i) key[i] = '\x20' + rng_below('\x7e' - '\x20' + 1);
+        dataset_add(D, key, len);
+    }
+}
+
+
+/* Workloads. */
+
+/* Indexes of keys drawn from a Zipf distribution with exponent s, the key of
+ * rank r being perm[r]. */
+static size_t* zipf_sample(size_t n, size_t m, double s)
+{
+    double* cdf = malloc(n * sizeof(double));
+    size_t* perm = malloc(n * sizeof(size_t));
+    size_t* xs = malloc(m * sizeof(size_t));
+
+    size_t i, j, lo, hi;
+    double total = 0.0;
+    for (i = 0; i < n; ++i) {
+        total += 1.0 / pow((double) (i + 1), s);
+        cdf[i] = total;
+    }
+
+    for (i = 0; i < n; ++i) perm[i] = i;
+    for (i = n - 1; i > 0; --i) {
+        j = rng_below(i + 1);
+        lo = perm[i]; perm[i] = perm[j]; perm[j] = lo;
+    }
+
+    double u;
+    for (i = 0; i < m; ++i) {
+        u = (double) (rng() >> 11) / 9007199254740992.0 * total;
+        lo = 0;
+        hi = n - 1;
+        while (lo < hi) {
+            j = lo + (hi - lo) / 2;
+            if (cdf[j] < u) lo = j + 1;
+            else            hi = j;
+        }
+        xs[i] = perm[lo];
+    }
+
+    free(cdf);
+    free(perm);
+    return xs;
+}
+
+
+/* Absent keys, each a present key with one byte changed or one appended. */
+static void dataset_misses(const dataset_t* D, dataset_t* M, size_t m)
+{
+    dataset_init(M, "misses");
+
+    char key[1024];
+    size_t i, len;
+    size_t tries = 0;
+    while (M->n < m && tries++ < 16 * m) {
+        i = rng_below(D->n);
+        len = D->lens[i];
+        if (len >= sizeof(key)) continue;
+        memcpy(key, D->keys[i], len);
+        if (len == 0 || rng() % 2) key[len++] = 'a' + rng_below(26);
+        else                       key[rng_below(len)] ^= 1 + rng_below(31);
+        if (!dataset_has(D, key, len)) dataset_add(M, key, len);
+    }
+}
+
+
+/* The structures being compared, behind the same interface. */
+typedef struct
+{
+    const char* name;
+    void*   (*create)  (void);
+    void    (*destroy) (void*);
+    void    (*set)     (void*, const char* key, size_t len, value_t val);
+    value_t (*get)     (void*, const char* key, size_t len); // 0 if absent
+    void    (*del)     (void*, const char* key, size_t len);
+    size_t  (*scan)    (void*, bool sorted);                 // keys visited
+    size_t  (*bytes)   (void*);
+} backend_t;
+
+
+static void* trie_create(void)
+{
+    return hattrie_create();
+}
+
+static void trie_destroy(void* T)
+{
+    hattrie_free(T);
+}
+
+static void trie_set(void* T, const char* key, size_t len, value_t val)
+{
+    *hattrie_get(T, key, len) = val;
+}
+
+static value_t trie_get(void* T, const char* key, size_t len)
+{
+    value_t* u = hattrie_tryget(T, key, len);
+    return u ? *u : 0;
+}
+
+static void trie_del(void* T, const char* key, size_t len)
+{
+    hattrie_del(T, key, len);
+}
+
+static size_t trie_scan(void* T, bool sorted)
+{
+    size_t n = 0, plen, slen;
+    const char* prefix;
+    const char* suffix;
+    value_t sum = 0;
+    hattrie_iter_t* i;
+    for (i = hattrie_iter_begin(T, sorted); !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+        hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen);
+        sum += *hattrie_iter_val(i) + plen + slen;
+        ++n;
+    }
+    hattrie_iter_free(i);
+    sink += sum;
+    return n;
+}
+
+static size_t trie_bytes(void* T)
+{
+    return hattrie_sizeof(T);
+}
+
+
+static void* map_create(void)
+{
+    return str_map_create();
+}
+
+static void map_destroy(void* T)
+{
+    str_map_destroy(T);
+}
+
+static void map_set(void* T, const char* key, size_t len, value_t val)
+{
+    str_map_set(T, key, len, val);
+}
+
+static value_t map_get(void* T, const char* key, size_t len)
+{
+    return str_map_get(T, key, len);
+}
+
+static void map_del(void* T, const char* key, size_t len)
+{
+    str_map_del(T, key, len);
+}
+
+static int map_pair_cmp(const void* a_, const void* b_)
+{
+    const str_map_pair* a = *(const str_map_pair* const*) a_;
+    const str_map_pair* b = *(const str_map_pair* const*) b_;
+    int c = memcmp(a->key, b->key, a->keylen < b->keylen ? a->keylen : b->keylen);
+    return c == 0 ? (a->keylen < b->keylen ? -1 : a->keylen > b->keylen) : c;
+}
+
+/* Sorted scans of a hash table have to collect and sort every pair. */
+static size_t map_scan(void* T_, bool sorted)
+{
+    str_map* T = T_;
+    str_map_pair** ps = sorted ? malloc(T->m * sizeof(str_map_pair*)) : NULL;
+    str_map_pair* u;
+    size_t i, n = 0;
+    value_t sum = 0;
+    for (i = 0; i < T->n; ++i) {
+        for (u = T->A[i]; u; u = u->next) {
+            if (sorted) ps[n] = u;
+            else        sum += u->value + u->keylen;
+            ++n;
+        }
+    }
+
+    if (sorted) {
+        qsort(ps, n, sizeof(str_map_pair*), map_pair_cmp);
+        for (i = 0; i < n; ++i) sum += ps[i]->value + ps[i]->keylen;
+        free(ps);
+    }
+
+    sink += sum;
+    return n;
+}
+
+/* Not counting the allocator's own overhead, as hattrie_sizeof does not. */
+static size_t map_bytes(void* T_)
+{
+    str_map* T = T_;
+    str_map_pair* u;
+    size_t i, size = sizeof(str_map) + T->n * sizeof(str_map_pair*);
+    for (i = 0; i < T->n; ++i) {
+        for (u = T->A[i]; u; u = u->next) size += sizeof(str_map_pair) + u->keylen;
+    }
+    return size;
+}
+
+
+static const backend_t backends[] = {
+    {"hattrie", trie_create, trie_destroy, trie_set, trie_get, trie_del, trie_scan, trie_bytes},
+    {"str_map", map_create,  map_destroy,  map_set,  map_get,  map_del,  map_scan,  map_bytes}
+};
+
+static const size_t nbackends = sizeof(backends) / sizeof(backends[0]);
+
+
+static void report(const backend_t* B, const char* what, size_t ops, uint64_t ns)
+{
+    printf("  %-8s %-16s %12.2f Mops/s %10.1f ns/op\n", B->name, what,
+           ns ? (double) ops * 1e3 / (double) ns : 0.0,
+           ops ? (double) ns / (double) ops : 0.0);
+}
+
+
+static int cmp_u64(const void* a_, const void* b_)
+{
+    uint64_t a = *(const uint64_t*) a_;
+    uint64_t b = *(const uint64_t*) b_;
+    return a < b ? -1 : a > b;
+}
+
+
+/* Look up m keys, first all at once for throughput, then timing each lookup
+ * for its latency percentiles. Returns how many were found. */
+static size_t bench_lookups(const backend_t* B, void* T, const char* what,
+                            char** keys, size_t* lens, const size_t* xs, size_t m,
+                            uint64_t overhead)
+{
+    size_t i, found = 0;
+    value_t sum = 0, u;
+    uint64_t t0, t1;
+
+    t0 = now_ns();
+    for (i = 0; i < m; ++i) {
+        u = B->get(T, keys[xs[i]], lens[xs[i]]);
+        sum += u;
+        found += u != 0;
+    }
+    report(B, what, m, now_ns() - t0);
+
+    uint64_t* lat = malloc(m * sizeof(uint64_t));
+    for (i = 0; i < m; ++i) {
+        t0 = now_ns();
+        sum += B->get(T, keys[xs[i]], lens[xs[i]]);
+        t1 = now_ns();
+        lat[i] = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+    }
+    qsort(lat, m, sizeof(uint64_t), cmp_u64);
+    printf("  %-8s %-16s p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu ns\n",
+           B->name, "", (unsigned long long) lat[m / 2], (unsigned long long) lat[m * 9 / 10],
+           (unsigned long long) lat[m * 99 / 100], (unsigned long long) lat[m * 999 / 1000],
+           (unsigned long long) lat[m - 1]);
+    free(lat);
+
+    sink += sum;
+    return found;
+}
+
+
+static bool bench_backend(const backend_t* B, const dataset_t* D, const dataset_t* M,
+                          const size_t* hits, size_t nlookups, size_t rounds,
+                          uint64_t overhead)
+{
+    bool ok = true;
+    size_t i, r, n = D->n;
+    uint64_t t0;
+    void* T = B->create();
+
+    /* insert */
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) B->set(T, D->keys[i], D->lens[i], i + 1);
+    report(B, "insert", n, now_ns() - t0);
+
+    /* lookups */
+    if (bench_lookups(B, T, "lookup hit", D->keys, D->lens, hits, nlookups, overhead) != nlookups) {
+        fprintf(stderr, "[error] %s: present key not found\n", B->name);
+        ok = false;
+    }
+
+    size_t* seq = malloc(M->n * sizeof(size_t));
+    for (i = 0; i < M->n; ++i) seq[i] = i;
+    if (M->n && bench_lookups(B, T, "lookup miss", M->keys, M->lens, seq, M->n, overhead) != 0) {
+        fprintf(stderr, "[error] %s: absent key found\n", B->name);
+        ok = false;
+    }
+    free(seq);
+
+    /* delete churn, each round deleting and reinserting a different tenth */
+    size_t k = n / 10 ? n / 10 : n, j, ops = 0;
+    t0 = now_ns();
+    for (r = 0; r < rounds; ++r) {
+        j = (r * k) % n;
+        for (i = 0; i < k; ++i) B->del(T, D->keys[(j + i) % n], D->lens[(j + i) % n]);
+        for (i = 0; i < k; ++i) B->set(T, D->keys[(j + i) % n], D->lens[(j + i) % n], (j + i) % n + 1);
+        ops += 2 * k;
+    }
+    report(B, "delete churn", ops, now_ns() - t0);
+
+    /* scans */
+    t0 = now_ns();
+    ok = B->scan(T, false) == n && ok;
+    report(B, "scan unsorted", n, now_ns() - t0);
+
+    t0 = now_ns();
+    ok = B->scan(T, true) == n && ok;
+    report(B, "scan sorted", n, now_ns() - t0);
+
+    t0 = now_ns();
+    ok = B->scan(T, true) == n && ok;
+    report(B, "scan sorted again", n, now_ns() - t0);
+
+    if (!ok) fprintf(stderr, "[error] %s: wrong number of keys\n", B->name);
+
+    /* memory */
+    size_t bytes = B->bytes(T);
+    printf("  %-8s %-16s %12.1f bytes/key %9.1f MB\n", B->name, "memory",
+           n ? (double) bytes / (double) n : 0.0, (double) bytes / 1048576.0);
+
+    B->destroy(T);
+    return ok;
+}
+
+
+static bool bench_dataset(const dataset_t* D, size_t nlookups, size_t rounds, uint64_t overhead)
+{
+    if (D->n == 0) {
+        printf("%s: no keys\n\n", D->name);
+        return true;
+    }
+
+    size_t i, total = 0;
+    for (i = 0; i < D->n; ++i) total += D->lens[i];
+
+    dataset_t M;
+    dataset_misses(D, &M, nlookups);
+    size_t* hits = zipf_sample(D->n, nlookups, 0.99);
+
+    printf("%s: %zu keys, %.1f bytes on average, %zu lookups, %zu misses\n",
+           D->name, D->n, (double) total / (double) D->n, nlookups, M.n);
+
+    bool ok = true;
+    for (i = 0; i < nbackends; ++i) {
+        ok = bench_backend(&backends[i], D, &M, hits, nlookups, rounds, overhead) && ok;
+    }
+    printf("\n");
+
+    free(hits);
+    dataset_free(&M);
+    return ok;
+}
+
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n keys] [-l lookups] [-r rounds] [-s seed] [file ...]\n"
+            "Benchmark hat-tries against a hash table on the keys in each file, one\n"
+            "per line, or on synthetic keys if no files are given.\n"
+            "  -n  at most this many keys per dataset (default 1000000)\n"
+            "  -l  lookups of present and of absent keys (default 1000000)\n"
+            "  -r  rounds of delete churn (default 10)\n"
+            "  -s  random seed\n", prog);
+}
+
+
+int main(int argc, char* argv[])
+{
+    size_t n = 1000000, nlookups = 1000000, rounds = 10;
+    int c;
+    while ((c = getopt(argc, argv, "n:l:r:s:h")) != -1) {
+        switch (c) {
+            case 'n': n        = strtoul(optarg, NULL, 10); break;
+            case 'l': nlookups = strtoul(optarg, NULL, 10); break;
+            case 'r': rounds   = strtoul(optarg, NULL, 10); break;
+            case 's': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+            case 'h': usage(argv[0]); return EXIT_SUCCESS;
+            default:  usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (nlookups == 0) nlookups = 1;
+
+    uint64_t overhead = timer_overhead();
+    printf("timer overhead %llu ns, subtracted from latencies\n\n",
+           (unsigned long long) overhead);
+
+    bool ok = true;
+    dataset_t D;
+    int k;
+    if (optind < argc) {
+        for (k = optind; k < argc; ++k) {
+            if (!dataset_read(&D, argv[k], n)) {
+                fprintf(stderr, "Unable to read %s.\n", argv[k]);
+                return EXIT_FAILURE;
+            }
+            ok = bench_dataset(&D, nlookups, rounds, overhead) && ok;
+            dataset_free(&D);
+        }
+    }
+    else {
+        void (*generators[])(dataset_t*, size_t) = {dataset_urls, dataset_ids, dataset_random};
+        for (k = 0; k < 3; ++k) {
+            generators[k](&D, n);
+            ok = bench_dataset(&D, nlookups, rounds, overhead) && ok;
+            dataset_free(&D);
+        }
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
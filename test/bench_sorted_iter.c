@@ -2,7 +2,9 @@
 /* A quick test of the degree to which ordered iteration is slower than unordered. */
 
 #include "../src/hat-trie.h"
+#include "../src/strsort.h"
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 
@@ -15,6 +17,99 @@ void randstr(char* x, size_t len)
     }
 }
 
+
+/* qsort comparison of whole strings, as buckets were once sorted */
+static int cmpkey(const void* a_, const void* b_)
+{
+    const strsort_key_t* a = a_;
+    const strsort_key_t* b = b_;
+    int c = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+    return c == 0 ? (a->len < b->len ? -1 : a->len > b->len) : c;
+}
+
+
+/* Byte d of a string, or -1 past its end. */
+static inline int mkq_char(const strsort_key_t* x, size_t d)
+{
+    return d < x->len ? x->s[d] : -1;
+}
+
+
+static inline void mkq_swap(strsort_key_t* xs, size_t a, size_t b)
+{
+    strsort_key_t t = xs[a];
+    xs[a] = xs[b];
+    xs[b] = t;
+}
+
+
+/* Multikey quicksort (Bentley and Sedgewick), for comparison with the radix
+ * sort, of n strings agreeing on their first d bytes. */
+static void mkqsort(strsort_key_t* xs, size_t n, size_t d)
+{
+    while (n > 1) {
+        mkq_swap(xs, 0, (size_t) rand() % n);
+        int v = mkq_char(&xs[0], d);
+
+        /* partition into less than, equal to and greater than v */
+        size_t lt = 0, i = 1, gt = n;
+        int c;
+        while (i < gt) {
+            c = mkq_char(&xs[i], d);
+            if (c < v)      mkq_swap(xs, lt++, i++);
+            else if (c > v) mkq_swap(xs, i, --gt);
+            else            ++i;
+        }
+
+        mkqsort(xs, lt, d);
+        mkqsort(xs + gt, n - gt, d);
+
+        /* strings equal on byte d continue with the next byte */
+        if (v < 0) return;
+        xs += lt;
+        n   = gt - lt;
+        ++d;
+    }
+}
+
+
+static double seconds(clock_t t0)
+{
+    return (double) (clock() - t0) / (double) CLOCKS_PER_SEC;
+}
+
+
+/* Time sorting the keys in bucket sized groups, as sorted iteration does. */
+static void bench_sorts(strsort_key_t* keys, size_t n)
+{
+    const size_t group = 16384;
+    strsort_key_t* xs = malloc(n * sizeof(strsort_key_t));
+    clock_t t0;
+    size_t i;
+
+    fprintf(stderr, "sorting groups of %zu keys:\n", group);
+
+    memcpy(xs, keys, n * sizeof(strsort_key_t));
+    t0 = clock();
+    for (i = 0; i < n; i += group) {
+        qsort(xs + i, i + group < n ? group : n - i, sizeof(strsort_key_t), cmpkey);
+    }
+    fprintf(stderr, "  qsort              %0.2f seconds\n", seconds(t0));
+
+    memcpy(xs, keys, n * sizeof(strsort_key_t));
+    t0 = clock();
+    for (i = 0; i < n; i += group) mkqsort(xs + i, i + group < n ? group : n - i, 0);
+    fprintf(stderr, "  multikey quicksort %0.2f seconds\n", seconds(t0));
+
+    memcpy(xs, keys, n * sizeof(strsort_key_t));
+    t0 = clock();
+    for (i = 0; i < n; i += group) strsort(xs + i, i + group < n ? group : n - i);
+    fprintf(stderr, "  radix sort         %0.2f seconds\n", seconds(t0));
+
+    free(xs);
+}
+
+
 int main()
 {
     hattrie_t* T = hattrie_create();
@@ -23,15 +118,20 @@ int main()
     const size_t m_high = 500; // maximum length of each string
     char x[501];
 
+    strsort_key_t* keys = malloc(n * sizeof(strsort_key_t));
     size_t i, m;
     for (i = 0; i < n; ++i) {
         m = m_low + rand() % (m_high - m_low);
         randstr(x, m);
         *hattrie_get(T, x, m) = 1;
+
+        keys[i].s   = malloc(m);
+        keys[i].len = m;
+        memcpy((unsigned char*) keys[i].s, x, m);
     }
 
     hattrie_iter_t* it;
-    clock_t t0, t;
+    clock_t t0;
     const size_t repetitions = 100;
     size_t r;
 
@@ -45,11 +145,20 @@ int main()
         }
         hattrie_iter_free(it);
     }
-    t = clock();
-    fprintf(stderr, "finished. (%0.2f seconds)\n", (double) (t - t0) / (double) CLOCKS_PER_SEC);
+    fprintf(stderr, "finished. (%0.2f seconds)\n", seconds(t0));
+
 
+    /* iterate in sorted order, the first time sorting every bucket */
+    fprintf(stderr, "iterating in order, first time ... ");
+    t0 = clock();
+    it = hattrie_iter_begin(T, true);
+    while (!hattrie_iter_finished(it)) {
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    fprintf(stderr, "finished. (%0.2f seconds)\n", seconds(t0));
 
-    /* iterate in sorted order */
+    /* iterate in sorted order again, with the order of every bucket cached */
     fprintf(stderr, "iterating in order ... ");
     t0 = clock();
     for (r = 0; r < repetitions; ++r) {
@@ -59,10 +168,12 @@ int main()
         }
         hattrie_iter_free(it);
     }
-    t = clock();
-    fprintf(stderr, "finished. (%0.2f seconds)\n", (double) (t - t0) / (double) CLOCKS_PER_SEC);
+    fprintf(stderr, "finished. (%0.2f seconds)\n", seconds(t0));
 
+    bench_sorts(keys, n);
 
+    for (i = 0; i < n; ++i) free((unsigned char*) keys[i].s);
+    free(keys);
     hattrie_free(T);
 
     return 0;
@@ -205,6 +205,57 @@ void test_ahtable_sorted_iteration()
     fprintf(stderr, "done.\n");
 }
 
+/* count the keys of a sorted iteration, returning the first one */
+static size_t sorted_count(const char** first, size_t* first_len)
+{
+    size_t count = 0, len;
+    const char* key;
+    ahtable_iter_t* i = ahtable_iter_begin(T, true);
+    *first = NULL;
+    while (!ahtable_iter_finished(i)) {
+        key = ahtable_iter_key(i, &len);
+        if (count++ == 0) {
+            *first     = key;
+            *first_len = len;
+        }
+        ahtable_iter_next(i);
+    }
+    ahtable_iter_free(i);
+    return count;
+}
+
+
+void test_ahtable_sorted_cache()
+{
+    fprintf(stderr, "iterating in order while modifying ... \n");
+
+    const char* first;
+    size_t len;
+    size_t m = ahtable_size(T);
+    if (sorted_count(&first, &len) != m || sorted_count(&first, &len) != m) {
+        fprintf(stderr, "[error] sorted iteration missed keys\n");
+    }
+
+    /* the cached order must see a new first key, and forget it again */
+    *ahtable_get(T, "\x01", 1) = 1;
+    if (sorted_count(&first, &len) != m + 1 || len != 1 || first[0] != '\x01') {
+        fprintf(stderr, "[error] sorted iteration missed an inserted key\n");
+    }
+
+    ahtable_del(T, "\x01", 1);
+    if (sorted_count(&first, &len) != m || (len == 1 && first[0] == '\x01')) {
+        fprintf(stderr, "[error] sorted iteration found a deleted key\n");
+    }
+
+    ahtable_shrink(T);
+    if (sorted_count(&first, &len) != m) {
+        fprintf(stderr, "[error] sorted iteration missed keys after shrinking\n");
+    }
+
+    fprintf(stderr, "done.\n");
+}
+
+
 void test_ahtable_save_load()
 {
     fprintf(stderr, "saving ahtable ... \n");
@@ -252,6 +303,194 @@ void test_ahtable_save_load()
 }
 
 
+void test_ahtable_shrink()
+{
+    fprintf(stderr, "shrinking ahtable ... \n");
+
+    size_t i;
+    for (i = 0; i < n / 2; ++i) {
+        ahtable_del(T, xs[i], strlen(xs[i]));
+        str_map_del(M, xs[i], strlen(xs[i]));
+    }
+
+    size_t before = ahtable_sizeof(T);
+    ahtable_shrink(T);
+    size_t after = ahtable_sizeof(T);
+    fprintf(stderr, "sizeof: %zu, after shrinking: %zu\n", before, after);
+
+    if (after >= before) {
+        fprintf(stderr, "[error] shrinking did not release any memory\n");
+    }
+
+    value_t* u;
+    value_t  v;
+    for (i = 0; i < n; ++i) {
+        u = ahtable_tryget(T, xs[i], strlen(xs[i]));
+        v = str_map_get(M, xs[i], strlen(xs[i]));
+        if ((u ? *u : 0) != v) {
+            fprintf(stderr, "[error] shrinking changed the table\n");
+        }
+    }
+
+    /* shrunk slots can still grow */
+    for (i = 0; i < n / 2; ++i) *ahtable_get(T, xs[i], strlen(xs[i])) = i + 1;
+    for (i = 0; i < n / 2; ++i) {
+        u = ahtable_tryget(T, xs[i], strlen(xs[i]));
+        if (u == NULL || *u != i + 1) {
+            fprintf(stderr, "[error] key missing after reinserting\n");
+        }
+    }
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_ahtable_batch()
+{
+    fprintf(stderr, "batched lookups in ahtable ... \n");
+
+    const size_t b = 1000;
+    const char** keys = malloc(b * sizeof(char*));
+    size_t* lens = malloc(b * sizeof(size_t));
+    value_t** vals = malloc(b * sizeof(value_t*));
+    size_t j;
+    for (j = 0; j < b; ++j) {
+        keys[j] = xs[rand() % n];
+        lens[j] = strlen(keys[j]);
+        if (j % 5 == 0) lens[j] /= 2; // most likely missing
+    }
+
+    ahtable_tryget_batch(T, keys, lens, b, vals);
+    for (j = 0; j < b; ++j) {
+        if (vals[j] != ahtable_tryget(T, keys[j], lens[j])) {
+            fprintf(stderr, "[error] batched lookup disagrees\n");
+        }
+    }
+
+    /* switching hashes keeps every key */
+    ahtable_set_hash(T, HATTRIE_HASH_MURMUR3, 42);
+    value_t* u;
+    for (j = 0; j < b; ++j) {
+        u = ahtable_tryget(T, keys[j], lens[j]);
+        if ((u ? *u : 0) != str_map_get(M, keys[j], lens[j])) {
+            fprintf(stderr, "[error] rehashed table disagrees\n");
+        }
+    }
+
+    free(keys);
+    free(lens);
+    free(vals);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_ahtable_upsert_hashed()
+{
+    fprintf(stderr, "upserting and hashed lookups in ahtable ... \n");
+
+    /* a second table with the same hash takes the same hashes */
+    ahtable_t* U = ahtable_create_n(16);
+    ahtable_set_max_load(U, 4.0);
+
+    size_t j, len;
+    uint32_t h;
+    bool inserted;
+    value_t* u;
+    for (j = 0; j < k; ++j) {
+        len = strlen(xs[j % n]);
+        h = ahtable_hash(T, xs[j % n], len);
+
+        u = ahtable_tryget_hashed(T, h, xs[j % n], len);
+        if (u != ahtable_tryget(T, xs[j % n], len)) {
+            fprintf(stderr, "[error] hashed lookup disagrees\n");
+        }
+
+        u = ahtable_upsert(U, xs[j % n], len, &inserted);
+        if (inserted != (j < n) || (inserted && *u != 0)) {
+            fprintf(stderr, "[error] upsert misreported an insertion\n");
+        }
+        *u += 1;
+        if (*ahtable_get_hashed(U, h, xs[j % n], len) != j / n + 1) {
+            fprintf(stderr, "[error] hashed insertion found the wrong value\n");
+        }
+    }
+
+    if (ahtable_size(U) != n) {
+        fprintf(stderr, "[error] upserted table has the wrong size\n");
+    }
+    ahtable_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_ahtable_value_size()
+{
+    fprintf(stderr, "storing 4 byte values in ahtable ... \n");
+
+    ahtable_t* U = ahtable_create_n(16);
+    if (ahtable_set_value_size(U, sizeof(value_t) + 1) != -1 ||
+        ahtable_set_value_size(U, 4) != 0) {
+        fprintf(stderr, "[error] wrong result setting the value size\n");
+    }
+
+    /* values keep their low 4 bytes, through every resize */
+    size_t j;
+    for (j = 0; j < n; ++j) {
+        ahtable_value_store(U, ahtable_get(U, xs[j], strlen(xs[j])),
+                            (value_t) j * 2654435761u);
+    }
+    if (ahtable_set_value_size(U, 8) != -1) {
+        fprintf(stderr, "[error] changed the value size of a nonempty table\n");
+    }
+    for (j = 0; j < n; j += 2) ahtable_del(U, xs[j], strlen(xs[j]));
+
+    size_t count = 0;
+    ahtable_iter_t* i = ahtable_iter_begin(U, true);
+    for (; !ahtable_iter_finished(i); ahtable_iter_next(i)) ++count;
+    ahtable_iter_free(i);
+    if (count != ahtable_size(U)) {
+        fprintf(stderr, "[error] iterated %zu keys of a table of 4 byte values\n", count);
+    }
+
+    size_t size = ahtable_image_pack_size(U, U->n);
+    unsigned char* image = malloc(size);
+    ahtable_image_pack(U, U->n, image);
+    ahtable_t* V = ahtable_image_load(image, size);
+    if (V == NULL || V->vsize != 4) {
+        fprintf(stderr, "[error] failed to load an image of 4 byte values\n");
+    }
+
+    value_t* u;
+    uint32_t x;
+    for (j = 0; j < n; ++j) {
+        x = (uint32_t) ((value_t) j * 2654435761u);
+        u = ahtable_tryget(U, xs[j], strlen(xs[j]));
+        if ((u == NULL) != (j % 2 == 0) || (u && ahtable_value_load(U, u) != x)) {
+            fprintf(stderr, "[error] wrong 4 byte value for key %zu\n", j);
+            break;
+        }
+        u = ahtable_image_tryget(image, xs[j], strlen(xs[j]));
+        if ((u == NULL) != (j % 2 == 0) || (u && ahtable_value_load(U, u) != x)) {
+            fprintf(stderr, "[error] wrong 4 byte value for key %zu in image\n", j);
+            break;
+        }
+        u = V ? ahtable_tryget(V, xs[j], strlen(xs[j])) : NULL;
+        if (V && ((u == NULL) != (j % 2 == 0) || (u && ahtable_value_load(V, u) != x))) {
+            fprintf(stderr, "[error] wrong 4 byte value for key %zu in loaded image\n", j);
+            break;
+        }
+    }
+
+    ahtable_free(V);
+    free(image);
+    ahtable_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
 int main()
 {
     setup();
@@ -264,10 +503,34 @@ int main()
     test_ahtable_sorted_iteration();
     teardown();
 
+    setup();
+    test_ahtable_insert();
+    test_ahtable_sorted_cache();
+    teardown();
+
     setup();
     test_ahtable_insert();
     test_ahtable_save_load();
     teardown();
 
+    setup();
+    test_ahtable_insert();
+    test_ahtable_shrink();
+    teardown();
+
+    setup();
+    test_ahtable_insert();
+    test_ahtable_batch();
+    teardown();
+
+    setup();
+    test_ahtable_insert();
+    test_ahtable_upsert_hashed();
+    teardown();
+
+    setup();
+    test_ahtable_value_size();
+    teardown();
+
     return 0;
 }
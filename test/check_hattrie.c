@@ -2,9 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdbool.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "str_map.h"
 #include "../src/hat-trie.h"
+#include "../src/arena.h"
+#include "../src/parallel.h"
+#include "../src/sharded.h"
 
 /* Simple random string generation. */
 void randstr(char* x, size_t len)
@@ -229,41 +237,2802 @@ void test_hattrie_sorted_iteration()
 }
 
 
-void test_trie_non_ascii()
+typedef struct walk_state_t_
 {
-    fprintf(stderr, "checking non-ascii... \n");
+    hattrie_iter_t* i; // iterating alongside the walk
+    size_t count;
+    size_t stop;       // keys to visit before stopping
+} walk_state_t;
+
+
+static int walk_check(const char* prefix, size_t prefix_len,
+                      const char* suffix, size_t suffix_len, value_t* val, void* ctx)
+{
+    walk_state_t* w = ctx;
+    size_t len;
+    const char* key = hattrie_iter_key(w->i, &len);
+    if (len != prefix_len + suffix_len || memcmp(key, prefix, prefix_len) != 0 ||
+        memcmp(key + prefix_len, suffix, suffix_len) != 0 || val != hattrie_iter_val(w->i)) {
+        fprintf(stderr, "[error] walk visited the wrong key\n");
+    }
+    hattrie_iter_next(w->i);
+    return ++w->count == w->stop ? 7 : 0;
+}
+
+
+void test_hattrie_key_parts()
+{
+    fprintf(stderr, "iterating over keys in parts ... \n");
+
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+
+    const char* prefix;
+    const char* suffix;
+    const char* key;
+    size_t plen, slen, len, x, count;
+    hattrie_t* tries[] = { T, V };
+    hattrie_iter_t* i;
+    for (x = 0; x < 4; ++x) {
+        count = 0;
+        i = hattrie_iter_begin(tries[x / 2], x % 2 == 0);
+        while (hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen)) {
+            ++count;
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+        if (count != hattrie_size(T)) {
+            fprintf(stderr, "[error] iterated over %zu keys in parts, should be %zu\n",
+                    count, hattrie_size(T));
+        }
+    }
+
+    /* the parts make up the key */
+    char* copy = malloc(m_high + 1);
+    i = hattrie_iter_begin(T, true);
+    while (hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen)) {
+        memcpy(copy, prefix, plen);
+        memcpy(copy + plen, suffix, slen);
+        key = hattrie_iter_key(i, &len);
+        if (len != plen + slen || memcmp(key, copy, len) != 0 ||
+            *hattrie_iter_val(i) != str_map_get(M, copy, len)) {
+            fprintf(stderr, "[error] key parts do not make up the key\n");
+        }
+        hattrie_iter_next(i);
+    }
+    if (hattrie_iter_key_parts(i, &prefix, &plen, &suffix, &slen)) {
+        fprintf(stderr, "[error] finished iterator returned key parts\n");
+    }
+    hattrie_iter_free(i);
+    free(copy);
+
+    /* walks visit the keys an iterator does, and stop when told to */
+    walk_state_t w;
+    for (x = 0; x < 4; ++x) {
+        w.i     = hattrie_iter_begin(tries[x / 2], x % 2 == 0);
+        w.count = 0;
+        w.stop  = 0;
+        if (hattrie_walk(tries[x / 2], x % 2 == 0, walk_check, &w) != 0 ||
+            w.count != hattrie_size(T) || !hattrie_iter_finished(w.i)) {
+            fprintf(stderr, "[error] walk visited %zu keys, should be %zu\n",
+                    w.count, hattrie_size(T));
+        }
+        hattrie_iter_free(w.i);
+    }
+
+    w.i     = hattrie_iter_begin(T, true);
+    w.count = 0;
+    w.stop  = 100;
+    if (hattrie_walk(T, true, walk_check, &w) != 7 || w.count != 100) {
+        fprintf(stderr, "[error] walk did not stop\n");
+    }
+    hattrie_iter_free(w.i);
+
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Check that the ranges of split iterators follow one another, making up
+ * sorted iteration over the whole trie. */
+void split_check(const hattrie_t* U, const char* name)
+{
+    const size_t ns[] = { 1, 2, 3, 7, 64, 1000 };
+    size_t x, j, parts, len, ulen;
+    hattrie_iter_t** is;
+    hattrie_iter_t* i;
+    const char* key;
+    const char* ukey;
+    for (x = 0; x < sizeof(ns) / sizeof(ns[0]); ++x) {
+        is = hattrie_iter_split(U, ns[x], &parts);
+        if (parts == 0 || parts > ns[x]) {
+            fprintf(stderr, "[error] split %s trie into %zu ranges, asked for %zu\n",
+                    name, parts, ns[x]);
+        }
+
+        i = hattrie_iter_begin(U, true);
+        for (j = 0; j < parts; ++j) {
+            while (!hattrie_iter_finished(is[j])) {
+                key  = hattrie_iter_key(is[j], &len);
+                ukey = hattrie_iter_key(i, &ulen);
+                if (hattrie_iter_finished(i) || len != ulen || memcmp(key, ukey, len) != 0 ||
+                    *hattrie_iter_val(is[j]) != *hattrie_iter_val(i)) {
+                    fprintf(stderr, "[error] range %zu of %zu of %s trie out of order\n",
+                            j, parts, name);
+                    break;
+                }
+                hattrie_iter_next(is[j]);
+                hattrie_iter_next(i);
+            }
+            hattrie_iter_free(is[j]);
+        }
+        if (!hattrie_iter_finished(i)) {
+            fprintf(stderr, "[error] %zu ranges of %s trie missed keys\n", parts, name);
+        }
+        hattrie_iter_free(i);
+        free(is);
+    }
+}
+
+
+typedef struct parallel_state_t_
+{
+    size_t count[8];
+    value_t sum[8];
+    char* first[8]; // first and last keys of the ranges
+    char* last[8];
+    size_t first_len[8], last_len[8];
+} parallel_state_t;
+
+
+void parallel_part(hattrie_iter_t* i, size_t part, void* ctx)
+{
+    parallel_state_t* p = ctx;
+    const char* key;
+    size_t len;
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        if (p->count[part]++ == 0) {
+            p->first[part] = malloc(len + 1);
+            memcpy(p->first[part], key, len);
+            p->first_len[part] = len;
+        }
+        p->sum[part] += *hattrie_iter_val(i);
+        if (hattrie_iter_next(i), hattrie_iter_finished(i)) {
+            p->last[part] = malloc(len + 1);
+            memcpy(p->last[part], key, len);
+            p->last_len[part] = len;
+        }
+    }
+}
+
+
+int keycmp(const char* a, size_t alen, const char* b, size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    return c != 0 ? c : (alen > blen) - (alen < blen);
+}
+
+
+void test_hattrie_iter_split()
+{
+    fprintf(stderr, "splitting iteration over hattrie ... \n");
+
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+
+    /* small buckets, with prefixes shared by many keys */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 64;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    char key[64];
+    size_t j;
+    for (j = 0; j < d; ++j) {
+        snprintf(key, sizeof(key), "http://example.com/%zu/%zu", j % 7, j);
+        *hattrie_get(U, key, strlen(key)) = j;
+    }
+    *hattrie_get(U, "", 0) = 1;
+    *hattrie_get(U, "http://example.com/", 19) = 2;
+
+    split_check(T, "random");
+    split_check(V, "mapped");
+    split_check(U, "prefixed");
+
+    hattrie_t* empty = hattrie_create();
+    split_check(empty, "empty");
+    hattrie_free(empty);
+
+    /* in an arena, which is not thread safe, so threads must not allocate
+     * from it when they sort their buckets */
+    hattrie_arena_t* A = hattrie_arena_create();
+    hattrie_allocator_t alloc = hattrie_arena_allocator(A);
+    hattrie_t* W = hattrie_create_with_allocator(&alloc);
+    size_t len;
+    const char* k0;
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(i)) {
+        k0 = hattrie_iter_key(i, &len);
+        *hattrie_get(W, k0, len) = *hattrie_iter_val(i);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    /* every range is visited once, in order */
+    parallel_state_t p;
+    size_t parts, count = 0, k;
+    value_t sum = 0, total = 0;
+    hattrie_t* tries[] = { T, U, W };
+    for (j = 0; j < 3; ++j) {
+        memset(&p, 0, sizeof(p));
+        parts = hattrie_parallel_for(tries[j], 8, parallel_part, &p);
+
+        count = 0;
+        sum   = 0;
+        for (k = 0; k < parts; ++k) {
+            count += p.count[k];
+            sum   += p.sum[k];
+            if (p.count[k] == 0) {
+                fprintf(stderr, "[error] empty range in parallel iteration\n");
+                continue;
+            }
+            if (k > 0 && p.count[k - 1] > 0 &&
+                keycmp(p.last[k - 1], p.last_len[k - 1], p.first[k], p.first_len[k]) >= 0) {
+                fprintf(stderr, "[error] ranges of parallel iteration overlap\n");
+            }
+        }
+
+        total = 0;
+        i = hattrie_iter_begin(tries[j], false);
+        while (!hattrie_iter_finished(i)) {
+            total += *hattrie_iter_val(i);
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        if (count != hattrie_size(tries[j]) || sum != total) {
+            fprintf(stderr, "[error] parallel iteration visited %zu keys, should be %zu\n",
+                    count, hattrie_size(tries[j]));
+        }
+        for (k = 0; k < parts; ++k) {
+            free(p.first[k]);
+            free(p.last[k]);
+        }
+    }
+
+    hattrie_free(U);
+    hattrie_free(V);
+    hattrie_free(W);
+    hattrie_arena_free(A);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_save_load()
+{
+    fprintf(stderr, "saving hattrie ... \n");
+
+    FILE* fd_w = fopen("test.hat", "w");
+    if (hattrie_save(T, fd_w) != 0) {
+        fprintf(stderr, "[error] failed to save hattrie\n");
+    }
+    fclose(fd_w);
+
+    fprintf(stderr, "loading hattrie ... \n");
+
+    FILE* fd_r = fopen("test.hat", "r");
+    hattrie_t* U = hattrie_load(fd_r);
+    fclose(fd_r);
+
+    fprintf(stderr, "mapping hattrie ... \n");
+
+    hattrie_t* V = hattrie_mmap_open("test.hat");
 
+    if (U == NULL || V == NULL) {
+        fprintf(stderr, "[error] failed to load hattrie\n");
+        hattrie_free(U);
+        hattrie_free(V);
+        return;
+    }
+
+    fprintf(stderr, "comparing hattrie ... \n");
+
+    if (hattrie_size(U) != hattrie_size(T) || hattrie_size(V) != hattrie_size(T)) {
+        fprintf(stderr, "[error] loaded sizes don't match (%zu, %zu, %zu)\n",
+                hattrie_size(T), hattrie_size(U), hattrie_size(V));
+    }
+
+    size_t j;
     value_t* u;
-    hattrie_t* T = hattrie_create();
-    char* txt = "\x81\x70";
+    value_t* v;
+    for (j = 0; j < n; ++j) {
+        u = hattrie_tryget(U, xs[j], strlen(xs[j]));
+        v = hattrie_tryget(V, xs[j], strlen(xs[j]));
+        if ((u == NULL) != (str_map_get(M, xs[j], strlen(xs[j])) == 0) ||
+            (v == NULL) != (u == NULL) || (u && *u != *v)) {
+            fprintf(stderr, "[error] loaded tries don't match\n");
+        }
+    }
 
-    u = hattrie_get(T, txt, strlen(txt));
-    *u = 10;
+    /* sorted iteration of the mapped trie must match the original */
+    hattrie_iter_t* i = hattrie_iter_begin(T, true);
+    hattrie_iter_t* k = hattrie_iter_begin(V, true);
+    const char* k1;
+    const char* k2;
+    size_t len1, len2;
+    char* key_copy = malloc(m_high + 1);
+    while (!hattrie_iter_finished(i) && !hattrie_iter_finished(k)) {
+        k1 = hattrie_iter_key(i, &len1);
+        memcpy(key_copy, k1, len1);
+        k2 = hattrie_iter_key(k, &len2);
+
+        if (len1 != len2 || memcmp(key_copy, k2, len1) != 0 ||
+            *hattrie_iter_val(i) != *hattrie_iter_val(k)) {
+            fprintf(stderr, "[error] mapped iteration doesn't match\n");
+        }
 
-    u = hattrie_tryget(T, txt, strlen(txt));
-    if (*u != 10){
-        fprintf(stderr, "can't store non-ascii strings\n");
+        hattrie_iter_next(i);
+        hattrie_iter_next(k);
+    }
+    if (!hattrie_iter_finished(i) || !hattrie_iter_finished(k)) {
+        fprintf(stderr, "[error] mapped iteration has the wrong length\n");
+    }
+    hattrie_iter_free(i);
+    hattrie_iter_free(k);
+    free(key_copy);
+
+    if (hattrie_get(V, "x", 1) != NULL || hattrie_del(V, xs[0], strlen(xs[0])) != -1) {
+        fprintf(stderr, "[error] mapped trie is not read-only\n");
+    }
+
+    hattrie_free(U);
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Check prefix iteration over X against filtering a full iteration. */
+void check_prefix(hattrie_t* X, bool sorted, const char* prefix, size_t plen)
+{
+    size_t expected = 0, count = 0;
+    size_t prev_len = 0, len;
+    const char* key;
+    value_t* u;
+
+    hattrie_iter_t* i = hattrie_iter_begin(X, false);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        if (len >= plen && memcmp(key, prefix, plen) == 0) ++expected;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    char* prev_key = malloc(m_high + 1);
+
+    i = hattrie_iter_with_prefix(X, sorted, prefix, plen);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        u   = hattrie_iter_val(i);
+
+        if (len < plen || memcmp(key, prefix, plen) != 0) {
+            fprintf(stderr, "[error] key without the prefix was iterated over\n");
+        }
+        else if (*u != str_map_get(M, key, len)) {
+            fprintf(stderr, "[error] incorrect prefix iteration tally\n");
+        }
+
+        if (sorted && count > 0 && cmpkey(prev_key, prev_len, key, len) > 0) {
+            fprintf(stderr, "[error] prefix iteration is not correctly ordered.\n");
+        }
+        memcpy(prev_key, key, len);
+        prev_len = len;
+
+        ++count;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+    free(prev_key);
+
+    if (count != expected) {
+        fprintf(stderr, "[error] iterated through %zu keys with prefix, expected %zu\n",
+                count, expected);
+    }
+}
+
+
+/* Check that two tries hold the same keys and values, in the same order. */
+void same_check(hattrie_t* A, hattrie_t* B, const char* name)
+{
+    hattrie_iter_t* i = hattrie_iter_begin(A, true);
+    hattrie_iter_t* k = hattrie_iter_begin(B, true);
+    const char* k1;
+    const char* k2;
+    size_t len1, len2;
+    while (!hattrie_iter_finished(i) && !hattrie_iter_finished(k)) {
+        k1 = hattrie_iter_key(i, &len1);
+        k2 = hattrie_iter_key(k, &len2);
+        if (len1 != len2 || memcmp(k1, k2, len1) != 0 ||
+            *hattrie_iter_val(i) != *hattrie_iter_val(k) ||
+            hattrie_tryget(B, k1, len1) == NULL ||
+            *hattrie_tryget(B, k1, len1) != *hattrie_iter_val(i)) {
+            fprintf(stderr, "[error] %s trie does not match\n", name);
+            break;
+        }
+        hattrie_iter_next(i);
+        hattrie_iter_next(k);
+    }
+    if (!hattrie_iter_finished(i) || !hattrie_iter_finished(k) ||
+        hattrie_size(A) != hattrie_size(B)) {
+        fprintf(stderr, "[error] %s trie has the wrong number of keys\n", name);
+    }
+    hattrie_iter_free(i);
+    hattrie_iter_free(k);
+}
+
+
+void test_hattrie_freeze()
+{
+    fprintf(stderr, "freezing hattrie ... \n");
+
+    /* a copy of T, and a trie of small buckets with prefixes shared by many keys */
+    hattrie_t* U = hattrie_create();
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    const char* key;
+    size_t len;
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(i);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 64;
+    hattrie_t* V = hattrie_create_ex(&opts);
+    hattrie_t* W = hattrie_create_ex(&opts);
+    char url[64];
+    size_t j;
+    for (j = 0; j < d; ++j) {
+        len = (size_t) sprintf(url, "http://example.com/%zu/%zu", j % 7, j);
+        *hattrie_get(V, url, len) = j;
+        *hattrie_get(W, url, len) = j;
+    }
+    *hattrie_get(V, "http://example.com/", 19) = 1;
+    *hattrie_get(W, "http://example.com/", 19) = 1;
+
+    size_t before = hattrie_sizeof(U), before_small = hattrie_sizeof(W);
+    if (hattrie_freeze(U) != 0 || hattrie_freeze(W) != 0 || hattrie_freeze(W) != 0) {
+        fprintf(stderr, "[error] failed to freeze hattrie\n");
+    }
+    fprintf(stderr, "sizeof: %zu frozen: %zu, small buckets %zu frozen: %zu\n",
+            before, hattrie_sizeof(U), before_small, hattrie_sizeof(W));
+    if (hattrie_sizeof(U) >= before || 4 * hattrie_sizeof(W) > before_small) {
+        fprintf(stderr, "[error] frozen tries are not smaller\n");
+    }
+
+    same_check(T, U, "frozen");
+    same_check(V, W, "frozen small bucket");
+
+    /* keys missing from the frozen trie, lookups by prefix, and no inserts */
+    for (j = 0; j < n; ++j) {
+        if ((hattrie_tryget(U, xs[j], strlen(xs[j])) == NULL) !=
+            (hattrie_tryget(T, xs[j], strlen(xs[j])) == NULL)) {
+            fprintf(stderr, "[error] frozen trie finds a key it should not\n");
+            break;
+        }
+    }
+
+    size_t count = 0, matchlen = 0;
+    i = hattrie_iter_with_prefix(W, true, "http://example.com/3/", 21);
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) ++count;
+    hattrie_iter_free(i);
+    if (count != (d + 3) / 7) {
+        fprintf(stderr, "[error] frozen prefix iteration found %zu keys, should be %zu\n",
+                count, (d + 3) / 7);
+    }
+    value_t* u = hattrie_longest_prefix(W, "http://example.com/x", 20, &matchlen);
+    if (u == NULL || *u != 1 || matchlen != 19) {
+        fprintf(stderr, "[error] wrong longest prefix in frozen trie\n");
+    }
+    if (hattrie_get(W, "new", 3) != NULL || hattrie_del(W, url, len) != -1) {
+        fprintf(stderr, "[error] frozen trie was modified\n");
     }
-    hattrie_free(T);
+
+    /* the image is written as it is, and reads back */
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(W, fd_w);
+    fclose(fd_w);
+    hattrie_t* X = hattrie_mmap_open("test.hat");
+    FILE* fd_r = fopen("test.hat", "r");
+    hattrie_t* Y = hattrie_load(fd_r);
+    fclose(fd_r);
+    if (X == NULL || Y == NULL) {
+        fprintf(stderr, "[error] failed to load frozen trie\n");
+    }
+    else {
+        same_check(V, X, "mapped frozen");
+        same_check(V, Y, "loaded frozen");
+    }
+    hattrie_free(X);
+    hattrie_free(Y);
+
+    /* readers of a concurrent trie may be in its nodes */
+    opts.concurrent = true;
+    X = hattrie_create_ex(&opts);
+    if (hattrie_freeze(X) != -1) {
+        fprintf(stderr, "[error] froze a concurrent trie\n");
+    }
+    hattrie_free(X);
+
+    hattrie_free(U);
+    hattrie_free(V);
+    hattrie_free(W);
 
     fprintf(stderr, "done.\n");
 }
 
 
+void test_hattrie_prefix_iteration()
+{
+    fprintf(stderr, "iterating over prefixes ... \n");
+
+    /* make some keys share a long prefix, so their prefix ends on trie nodes */
+    size_t j;
+    value_t v;
+    for (j = 0; j < n / 2; ++j) {
+        memcpy(xs[j], "shared/prefix/", 14);
+        v = 1 + str_map_get(M, xs[j], strlen(xs[j]));
+        str_map_set(M, xs[j], strlen(xs[j]), v);
+        *hattrie_get(T, xs[j], strlen(xs[j])) = v;
+    }
 
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
 
-int main()
+    const char* prefixes[] = { "", "shared/", "shared/prefix/", "shared/prefix/a",
+                               xs[n - 1], "q", "q1", "no such prefix" };
+    size_t lens[] = { 0, 7, 14, 15, 3, 1, 2, 14 };
+
+    size_t k;
+    for (k = 0; k < sizeof(lens) / sizeof(size_t); ++k) {
+        check_prefix(T, false, prefixes[k], lens[k]);
+        check_prefix(T, true,  prefixes[k], lens[k]);
+        check_prefix(V, true,  prefixes[k], lens[k]);
+    }
+
+    /* a whole key is a prefix of itself */
+    check_prefix(T, true, xs[n - 1], strlen(xs[n - 1]));
+
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* number of keys left to iterate over */
+static size_t iter_count(hattrie_iter_t* i)
 {
-    test_trie_non_ascii();
+    size_t count = 0;
+    while (!hattrie_iter_finished(i)) {
+        ++count;
+        hattrie_iter_next(i);
+    }
+    return count;
+}
 
-    setup();
-    test_hattrie_insert();
-    test_hattrie_iteration();
-    teardown();
 
-    setup();
-    test_hattrie_insert();
-    test_hattrie_sorted_iteration();
+void test_hattrie_iter_reset()
+{
+    fprintf(stderr, "reusing an iterator ... \n");
+
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+
+    /* one iterator, reset over tries, images, orders and prefixes, agreeing with
+     * fresh ones */
+    const char* prefixes[] = { "", xs[0], "q", "no such prefix" };
+    size_t lens[] = { 0, 2, 1, 14 };
+    hattrie_t* tries[] = { T, V };
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    hattrie_iter_t* u;
+    size_t x, y, z, expected;
+    for (x = 0; x < 2; ++x) {
+        for (y = 0; y < 2; ++y) {
+            for (z = 0; z < sizeof(lens) / sizeof(size_t); ++z) {
+                u = hattrie_iter_with_prefix(tries[x], y == 1, prefixes[z], lens[z]);
+                expected = iter_count(u);
+                hattrie_iter_free(u);
+
+                hattrie_iter_reset(i, tries[x], y == 1, prefixes[z], lens[z]);
+                if (iter_count(i) != expected) {
+                    fprintf(stderr, "[error] reset iterator visited the wrong keys\n");
+                }
+            }
+        }
+    }
+
+    /* reset midway through */
+    hattrie_iter_reset(i, T, true, NULL, 0);
+    hattrie_iter_next(i);
+    hattrie_iter_reset(i, T, true, NULL, 0);
+    if (iter_count(i) != hattrie_size(T)) {
+        fprintf(stderr, "[error] iterator reset midway visited the wrong keys\n");
+    }
+
+    hattrie_iter_free(i);
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_batch()
+{
+    fprintf(stderr, "batched lookups ... \n");
+
+    /* present and missing keys, repeats, and keys ending on trie nodes */
+    const size_t b = 1000;
+    const char** keys = malloc(b * sizeof(char*));
+    size_t* lens = malloc(b * sizeof(size_t));
+    value_t** vals = malloc(b * sizeof(value_t*));
+    char missing[] = "no such key";
+    size_t j;
+    for (j = 0; j < b; ++j) {
+        if (j % 7 == 0) keys[j] = missing;
+        else keys[j] = xs[rand() % n];
+        lens[j] = strlen(keys[j]);
+        if (j % 11 == 0) lens[j] = 1 + rand() % 3;
+    }
+
+    hattrie_tryget_batch(T, keys, lens, b, vals);
+    for (j = 0; j < b; ++j) {
+        if (vals[j] != hattrie_tryget(T, keys[j], lens[j])) {
+            fprintf(stderr, "[error] batched lookup of '%s' disagrees\n", keys[j]);
+        }
+    }
+
+    /* the same through an image */
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+    hattrie_tryget_batch(V, keys, lens, b, vals);
+    for (j = 0; j < b; ++j) {
+        if (vals[j] != hattrie_tryget(V, keys[j], lens[j])) {
+            fprintf(stderr, "[error] batched lookup in an image disagrees\n");
+        }
+    }
+    hattrie_free(V);
+
+    /* inserting missing keys, every pointer staying valid */
+    size_t m = hattrie_size(T);
+    hattrie_get_batch(T, keys, lens, b, vals);
+    for (j = 0; j < b; ++j) {
+        if (vals[j] == NULL || vals[j] != hattrie_tryget(T, keys[j], lens[j])) {
+            fprintf(stderr, "[error] batched insertion of '%s' failed\n", keys[j]);
+        }
+    }
+    for (j = 0; j < b; ++j) ++*vals[j];
+    if (hattrie_size(T) <= m) {
+        fprintf(stderr, "[error] batched insertion added no keys\n");
+    }
+
+    free(keys);
+    free(lens);
+    free(vals);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* hattrie_longest_prefix the slow way, trying every prefix */
+static value_t* longest_prefix_naive(hattrie_t* X, const char* key, size_t len,
+                                     size_t* matchlen)
+{
+    value_t* u;
+    size_t l;
+    for (l = len; l > 0; --l) {
+        u = hattrie_tryget(X, key, l);
+        if (u) {
+            *matchlen = l;
+            return u;
+        }
+    }
+    return NULL;
+}
+
+
+void test_hattrie_upsert()
+{
+    fprintf(stderr, "upserting into hattrie ... \n");
+
+    /* with small buckets, upserts burst them as well */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 128;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    size_t j, len;
+    bool inserted;
+    value_t* u;
+    for (j = 0; j < 2 * d; ++j) {
+        len = strlen(xs[j % d]);
+        u = hattrie_upsert(U, xs[j % d], len, &inserted);
+        if (inserted != (j < d) || (inserted && *u != 0)) {
+            fprintf(stderr, "[error] upsert misreported an insertion\n");
+        }
+        *u += 1;
+    }
+
+    for (j = 0; j < d; ++j) {
+        u = hattrie_tryget(U, xs[j], strlen(xs[j]));
+        if (u == NULL || *u != 2) {
+            fprintf(stderr, "[error] upserted key has the wrong value\n");
+        }
+    }
+    if (hattrie_size(U) != d) {
+        fprintf(stderr, "[error] upserted trie has the wrong size\n");
+    }
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_stats()
+{
+    fprintf(stderr, "checking hattrie statistics ... \n");
+
+    /* small buckets, so that some split, grow and sit below dense nodes */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 64;
+    opts.bucket_slots = 8;
+    opts.load_factor  = 2.0;
+    opts.node_fanout  = 3;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    size_t j;
+    for (j = 0; j < d; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = 1;
+
+    hattrie_stats_t stats;
+    if (hattrie_stats(U, &stats) != 0) {
+        fprintf(stderr, "[error] hattrie_stats failed\n");
+    }
+
+    size_t depths = 0, bucket_keys = 0, slot_bytes = 0;
+    for (j = 0; j < HATTRIE_STATS_DEPTHS; ++j) depths += stats.depths[j];
+    for (j = 0; j < HATTRIE_STATS_BINS; ++j) {
+        bucket_keys += stats.bucket_keys[j];
+        slot_bytes  += stats.slot_bytes[j];
+    }
+
+    if (stats.keys != hattrie_size(U) || stats.allocated != hattrie_sizeof(U) ||
+        stats.used > stats.allocated) {
+        fprintf(stderr, "[error] statistics disagree with hattrie_size or hattrie_sizeof\n");
+    }
+    if (stats.buckets != stats.pure_buckets + stats.hybrid_buckets ||
+        depths != stats.buckets || bucket_keys != stats.buckets ||
+        slot_bytes != stats.slots || stats.empty_slots > stats.slots) {
+        fprintf(stderr, "[error] statistics histograms do not add up\n");
+    }
+    if (stats.nodes < 2 || stats.dense_nodes == 0 || stats.max_depth == 0 ||
+        stats.splits == 0 || stats.expansions == 0) {
+        fprintf(stderr, "[error] statistics missed splits, expansions or trie nodes\n");
+    }
+    if (stats.avg_chain < 1.0 || (double) stats.max_chain < stats.avg_chain) {
+        fprintf(stderr, "[error] statistics have a wrong chain length (%f, at most %zu)\n",
+                stats.avg_chain, stats.max_chain);
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_incremental()
+{
+    fprintf(stderr, "splitting and resizing hattrie buckets incrementally ... \n");
+
+    /* small buckets that split and grow often, moving few keys at a time, so
+     * that most operations run while a bucket is being moved */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size       = 256;
+    opts.bucket_slots     = 16;
+    opts.load_factor      = 2.0;
+    opts.incremental_step = 4;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    const char* keys[16];
+    size_t      lens[16];
+    value_t*    vals[16];
+    size_t i, j, r, len, matchlen;
+    value_t* u;
+    for (j = 0; j < k; ++j) {
+        i   = rand() % n;
+        len = strlen(xs[i]);
+        if (rand() % 8 == 0) {
+            if ((hattrie_del(U, xs[i], len) == 0) != (str_map_get(M, xs[i], len) != 0)) {
+                fprintf(stderr, "[error] incremental trie deleted the wrong key\n");
+            }
+            str_map_del(M, xs[i], len);
+        }
+        else {
+            u = hattrie_get(U, xs[i], len);
+            if (*u != str_map_get(M, xs[i], len)) {
+                fprintf(stderr, "[error] incremental trie lost a value\n");
+            }
+            *u += 1;
+            str_map_set(M, xs[i], len, *u);
+        }
+
+        r   = rand() % n;
+        len = strlen(xs[r]);
+        u   = hattrie_tryget(U, xs[r], len);
+        if ((u ? *u : 0) != str_map_get(M, xs[r], len)) {
+            fprintf(stderr, "[error] incremental trie lookup is wrong\n");
+        }
+        if (u && (hattrie_longest_prefix(U, xs[r], len, &matchlen) != u || matchlen != len)) {
+            fprintf(stderr, "[error] incremental trie longest prefix is wrong\n");
+        }
+
+        if (j % 64 == 0) {
+            for (r = 0; r < 16; ++r) {
+                keys[r] = xs[rand() % n];
+                lens[r] = strlen(keys[r]);
+            }
+            hattrie_tryget_batch(U, keys, lens, 16, vals);
+            for (r = 0; r < 16; ++r) {
+                if ((vals[r] ? *vals[r] : 0) != str_map_get(M, keys[r], lens[r])) {
+                    fprintf(stderr, "[error] incremental trie batch lookup is wrong\n");
+                }
+            }
+        }
+    }
+
+    hattrie_stats_t stats;
+    hattrie_stats(U, &stats);
+    if (stats.splits == 0 || stats.expansions == 0) {
+        fprintf(stderr, "[error] incremental trie never split or grew a bucket\n");
+    }
+
+    /* with every move finished, the trie saves and iterates every key */
+    hattrie_finish_moves(U);
+    FILE* fd_w = fopen("test.hat", "w");
+    if (hattrie_save(U, fd_w) != 0) {
+        fprintf(stderr, "[error] incremental trie could not be saved\n");
+    }
+    fclose(fd_w);
+
+    size_t count = 0;
+    const char* key;
+    hattrie_iter_t* it = hattrie_iter_begin(U, true);
+    while (!hattrie_iter_finished(it)) {
+        key = hattrie_iter_key(it, &len);
+        if (*hattrie_iter_val(it) != str_map_get(M, key, len)) {
+            fprintf(stderr, "[error] incremental trie iterates a wrong value\n");
+        }
+        ++count;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    if (count != M->m || hattrie_size(U) != M->m) {
+        fprintf(stderr, "[error] incremental trie has %zu keys, iterating %zu, should be %zu\n",
+                hattrie_size(U), count, M->m);
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+static int walk_never(const char* prefix, size_t prefix_len,
+                      const char* suffix, size_t suffix_len, value_t* val, void* ctx)
+{
+    (void) prefix;
+    (void) prefix_len;
+    (void) suffix;
+    (void) suffix_len;
+    (void) val;
+    (void) ctx;
+    fprintf(stderr, "[error] walk visited a key while keys were being moved\n");
+    return 1;
+}
+
+
+void test_hattrie_incremental_pending()
+{
+    fprintf(stderr, "iterating and counting while hattrie buckets are being moved ... \n");
+
+    /* one key moved per insertion, so a split stays pending for hundreds */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size       = 1000;
+    opts.incremental_step = 1;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    size_t i, count, parts, pending = 0;
+    hattrie_iter_t* it;
+    hattrie_iter_t** is;
+    for (i = 0; i < 5000; ++i) {
+        *hattrie_get(U, xs[i], strlen(xs[i])) = 1;
+
+        /* either every key is counted and visited, or none is */
+        count = hattrie_count_prefix(U, NULL, 0);
+        if (count == (size_t) -1) {
+            ++pending;
+            it = hattrie_iter_begin(U, true);
+            is = hattrie_iter_split(U, 4, &parts);
+            if (it != NULL || is != NULL || parts != 0 || hattrie_select(U, 0) != NULL ||
+                hattrie_rank(U, xs[i], strlen(xs[i])) != (size_t) -1 ||
+                hattrie_walk(U, false, walk_never, NULL) != -1) {
+                fprintf(stderr, "[error] keys being moved were not reported\n");
+            }
+            continue;
+        }
+        if (count != hattrie_size(U)) {
+            fprintf(stderr, "[error] counted %zu keys, should be %zu\n", count, hattrie_size(U));
+        }
+        if (i % 100 != 0) continue;
+
+        count = 0;
+        it = hattrie_iter_begin(U, i % 200 == 0);
+        while (!hattrie_iter_finished(it)) {
+            ++count;
+            hattrie_iter_next(it);
+        }
+        hattrie_iter_free(it);
+        if (count != hattrie_size(U)) {
+            fprintf(stderr, "[error] iterated over %zu keys, should be %zu\n",
+                    count, hattrie_size(U));
+        }
+    }
+    if (pending == 0) {
+        fprintf(stderr, "[error] no keys were ever being moved\n");
+    }
+
+    hattrie_finish_moves(U);
+    count = 0;
+    it = hattrie_iter_begin(U, true);
+    while (!hattrie_iter_finished(it)) {
+        ++count;
+        hattrie_iter_next(it);
+    }
+    hattrie_iter_free(it);
+    if (count != hattrie_size(U) || hattrie_count_prefix(U, NULL, 0) != count) {
+        fprintf(stderr, "[error] iterated over %zu keys once moved, should be %zu\n",
+                count, hattrie_size(U));
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_longest_prefix()
+{
+    fprintf(stderr, "longest prefix matching ... \n");
+
+    /* prefixes of the keys, nested deep enough to burst buckets */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 256;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    size_t j, l;
+    for (j = 0; j < d; ++j) {
+        for (l = 1 + rand() % 8; l < strlen(xs[j]); l += 1 + rand() % 32) {
+            *hattrie_get(U, xs[j], l) = j * 1000 + l;
+        }
+    }
+
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(U, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+
+    hattrie_t* tries[] = { U, V };
+    const char* key;
+    size_t x, len, ml, ml_naive;
+    value_t *u, *v;
+    for (x = 0; x < 2; ++x) {
+        for (j = 0; j < 2 * d; ++j) {
+            key = xs[rand() % n];
+            len = strlen(key);
+            ml = ml_naive = (size_t) -1;
+            u = hattrie_longest_prefix(tries[x], key, len, &ml);
+            v = longest_prefix_naive(tries[x], key, len, &ml_naive);
+            if (u != v || (u && ml != ml_naive)) {
+                fprintf(stderr, "[error] wrong longest prefix of '%s'\n", key);
+            }
+        }
+    }
+
+    if (hattrie_longest_prefix(U, "", 0, NULL) != NULL) {
+        fprintf(stderr, "[error] longest prefix of the empty key found\n");
+    }
+
+    hattrie_free(U);
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Number of the m sorted keys less than the given one. */
+static size_t lower_bound(char** keys, size_t* lens, size_t m, const char* key, size_t len)
+{
+    size_t lo = 0, hi = m, mid;
+    int c;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        c = memcmp(keys[mid], key, lens[mid] < len ? lens[mid] : len);
+        if (c < 0 || (c == 0 && lens[mid] < len)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+void test_hattrie_seek()
+{
+    fprintf(stderr, "seeking and range scans ... \n");
+
+    /* every key, in sorted order */
+    size_t m = hattrie_size(T), j = 0, len;
+    char**  keys = malloc(m * sizeof(char*));
+    size_t* lens = malloc(m * sizeof(size_t));
+    const char* key;
+    hattrie_iter_t* i = hattrie_iter_begin(T, true);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        keys[j] = malloc(len + 1);
+        memcpy(keys[j], key, len + 1);
+        lens[j] = len;
+        ++j;
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(T, fd_w);
+    fclose(fd_w);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+
+    /* and a deep trie of small buckets */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 64;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    for (j = 0; j < m; ++j) *hattrie_get(U, keys[j], lens[j]) = j;
+
+    /* stored keys, cut short, bumped, and past everything */
+    char probe[600], end[600];
+    size_t x, r, plen, elen, lo, hi, count;
+    hattrie_t* tries[] = { T, V, U };
+    for (x = 0; x < 3; ++x) {
+        i = hattrie_iter_begin(tries[x], false);
+        for (r = 0; r < 2000; ++r) {
+            j = rand() % m;
+            plen = lens[j];
+            memcpy(probe, keys[j], plen);
+            if (r % 4 == 1) plen = rand() % (plen + 1);
+            if (r % 4 == 2 && plen > 0) probe[plen - 1] += 1;
+            if (r % 4 == 3) {
+                plen /= 2;
+                probe[plen++] = '\xff';
+            }
+
+            hattrie_iter_seek(i, probe, plen);
+            lo = lower_bound(keys, lens, m, probe, plen);
+            if (lo == m ? !hattrie_iter_finished(i)
+                        : hattrie_iter_finished(i) ||
+                          (key = hattrie_iter_key(i, &len), len != lens[lo] ||
+                           memcmp(key, keys[lo], len) != 0)) {
+                fprintf(stderr, "[error] seek did not land on the first key after it\n");
+                continue;
+            }
+
+            /* scan up to a later key */
+            j = lo + rand() % 50;
+            if (j >= m) j = m - 1;
+            elen = lens[j];
+            memcpy(end, keys[j], elen);
+            hi = lower_bound(keys, lens, m, end, elen);
+            hattrie_iter_set_end(i, end, elen);
+            for (count = 0; !hattrie_iter_finished(i); ++count) hattrie_iter_next(i);
+            if (count != (hi > lo ? hi - lo : 0)) {
+                fprintf(stderr, "[error] range scan visited %zu keys, should be %zu\n",
+                        count, hi > lo ? hi - lo : 0);
+            }
+        }
+        hattrie_iter_free(i);
+    }
+
+    /* the whole range, from the empty key up to no bound */
+    i = hattrie_iter_range(T, "", 0, NULL, 0);
+    for (count = 0; !hattrie_iter_finished(i); ++count) hattrie_iter_next(i);
+    if (count != m) {
+        fprintf(stderr, "[error] unbounded range scan visited the wrong keys\n");
+    }
+    hattrie_iter_free(i);
+
+    hattrie_free(U);
+    hattrie_free(V);
+    for (j = 0; j < m; ++j) free(keys[j]);
+    free(keys);
+    free(lens);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+static int cmpstr(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+
+void test_hattrie_path_compression()
+{
+    fprintf(stderr, "compressing long shared prefixes ... \n");
+
+    /* URLs under a few long prefixes, in small buckets that burst often */
+    const char* hosts[] = { "https://www.example.com/api/v2/users/",
+                            "https://www.example.com/api/v2/groups/",
+                            "https://www.example.org/static/images/" };
+    const size_t nkeys = 20000;
+    char**  keys = malloc(2 * nkeys * sizeof(char*));
+    size_t* lens = malloc(2 * nkeys * sizeof(size_t));
+    char buf[256];
+    size_t i, j, m = 0, len, matchlen;
+
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 64;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    for (i = 0; i < nkeys; ++i) {
+        len = (size_t) snprintf(buf, sizeof(buf), "%s%d/items/%d", hosts[rand() % 3],
+                                rand() % 2000, rand() % 50);
+        if (str_map_get(M, buf, len) != 0) continue;
+        str_map_set(M, buf, len, i + 1);
+        *hattrie_get(U, buf, len) = i + 1;
+        keys[m] = strdup(buf);
+        lens[m++] = len;
+    }
+
+    hattrie_stats_t stats;
+    hattrie_stats(U, &stats);
+    if (stats.prefixed_nodes == 0 || stats.prefix_bytes < stats.prefixed_nodes) {
+        fprintf(stderr, "[error] shared prefixes were not compressed\n");
+    }
+
+    /* keys ending inside prefixes, and leaving them, split the prefixes */
+    for (i = 0; i < 3; ++i) {
+        for (len = 1; len <= strlen(hosts[i]); len += 3) {
+            memcpy(buf, hosts[i], len);
+            buf[len - 1] ^= 0x01;
+            for (j = 0; j < 2; ++j) {
+                if (str_map_get(M, buf, len) == 0) {
+                    str_map_set(M, buf, len, nkeys + m + 1);
+                    *hattrie_get(U, buf, len) = nkeys + m + 1;
+                    keys[m] = malloc(len + 1);
+                    memcpy(keys[m], buf, len);
+                    keys[m][len] = '\0';
+                    lens[m++] = len;
+                }
+                memcpy(buf, hosts[i], len);
+            }
+        }
+    }
+
+    /* lookups of every key, and of keys cut short or bumped */
+    value_t* u;
+    for (i = 0; i < m; ++i) {
+        u = hattrie_tryget(U, keys[i], lens[i]);
+        if (u == NULL || *u != str_map_get(M, keys[i], lens[i])) {
+            fprintf(stderr, "[error] compressed trie lost a key\n");
+        }
+
+        len = rand() % (lens[i] + 1);
+        memcpy(buf, keys[i], len);
+        if (len > 0 && rand() % 2) buf[len - 1] += 1;
+        u = hattrie_tryget(U, buf, len);
+        if ((u ? *u : 0) != str_map_get(M, buf, len)) {
+            fprintf(stderr, "[error] compressed trie found a wrong key\n");
+        }
+        if (hattrie_longest_prefix(U, buf, len, &matchlen) !=
+            longest_prefix_naive(U, buf, len, &matchlen)) {
+            fprintf(stderr, "[error] compressed trie longest prefix is wrong\n");
+        }
+    }
+
+    /* sorted iteration, prefix iteration, and seeking */
+    qsort(keys, m, sizeof(char*), cmpstr);
+    for (i = 0; i < m; ++i) lens[i] = strlen(keys[i]);
+
+    hattrie_iter_t* it = hattrie_iter_begin(U, true);
+    const char* key;
+    for (i = 0; !hattrie_iter_finished(it); ++i, hattrie_iter_next(it)) {
+        key = hattrie_iter_key(it, &len);
+        if (i >= m || len != lens[i] || memcmp(key, keys[i], len) != 0) {
+            fprintf(stderr, "[error] compressed trie iterates out of order\n");
+            break;
+        }
+    }
+    if (i != m) fprintf(stderr, "[error] compressed trie iterates the wrong keys\n");
+
+    const char* prefixes[] = { "https://www.exa", "https://www.example.com/api/v2/u",
+                               "https://www.example.com/api/v2/users/1",
+                               "https://www.example.con", "https://www.example.org/static/images/" };
+    for (i = 0; i < 5; ++i) {
+        check_prefix(U, true, prefixes[i], strlen(prefixes[i]));
+        check_prefix(U, false, prefixes[i], strlen(prefixes[i]));
+    }
+
+    size_t lo;
+    for (i = 0; i < 2000; ++i) {
+        j   = rand() % m;
+        len = rand() % (lens[j] + 1);
+        memcpy(buf, keys[j], len);
+        if (len > 0 && i % 2) buf[len - 1] += i % 4 == 1 ? 1 : -1;
+        hattrie_iter_seek(it, buf, len);
+        lo = lower_bound(keys, lens, m, buf, len);
+        if (lo == m ? !hattrie_iter_finished(it)
+                    : hattrie_iter_finished(it) ||
+                      (key = hattrie_iter_key(it, &len), len != lens[lo] ||
+                       memcmp(key, keys[lo], len) != 0)) {
+            fprintf(stderr, "[error] seek in compressed trie landed on the wrong key\n");
+        }
+    }
+    hattrie_iter_free(it);
+
+    /* images keep the prefixes */
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(U, fd_w);
+    fclose(fd_w);
+    FILE* fd_r = fopen("test.hat", "r");
+    hattrie_t* L = hattrie_load(fd_r);
+    fclose(fd_r);
+    hattrie_t* V = hattrie_mmap_open("test.hat");
+    if (L == NULL || V == NULL) {
+        fprintf(stderr, "[error] failed to load compressed trie\n");
+    }
+    else {
+        for (i = 0; i < m; ++i) {
+            u = hattrie_tryget(L, keys[i], lens[i]);
+            if (u == NULL || *u != str_map_get(M, keys[i], lens[i]) ||
+                hattrie_tryget(V, keys[i], lens[i]) == NULL ||
+                *hattrie_tryget(V, keys[i], lens[i]) != *u) {
+                fprintf(stderr, "[error] loaded compressed trie lost a key\n");
+            }
+        }
+        it = hattrie_iter_begin(V, true);
+        for (i = 0; !hattrie_iter_finished(it); ++i, hattrie_iter_next(it)) {
+            key = hattrie_iter_key(it, &len);
+            if (i >= m || len != lens[i] || memcmp(key, keys[i], len) != 0) break;
+        }
+        if (i != m) fprintf(stderr, "[error] mapped compressed trie iterates wrongly\n");
+        hattrie_iter_free(it);
+        check_prefix(V, true, prefixes[1], strlen(prefixes[1]));
+    }
+    hattrie_free(L);
+    hattrie_free(V);
+
+    /* deleting most keys folds the nodes back into buckets */
+    for (i = 0; i < m; ++i) {
+        if (i % 8 == 0) continue;
+        if (hattrie_del(U, keys[i], lens[i]) != 0) {
+            fprintf(stderr, "[error] compressed trie could not delete a key\n");
+        }
+        str_map_del(M, keys[i], lens[i]);
+    }
+    for (i = 0; i < m; ++i) {
+        u = hattrie_tryget(U, keys[i], lens[i]);
+        if ((u ? *u : 0) != str_map_get(M, keys[i], lens[i])) {
+            fprintf(stderr, "[error] compressed trie is wrong after deletions\n");
+        }
+    }
+    check_prefix(U, true, "", 0);
+
+    hattrie_free(U);
+    for (i = 0; i < m; ++i) free(keys[i]);
+    free(keys);
+    free(lens);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_build_sorted()
+{
+    fprintf(stderr, "building hattrie from sorted keys ... \n");
+
+    /* give many keys a shared prefix, so the built trie gets deep */
+    size_t j;
+    value_t v;
+    for (j = 0; j < n / 2; ++j) {
+        memcpy(xs[j], "shared/prefix/", 14);
+        v = 1 + str_map_get(M, xs[j], strlen(xs[j]));
+        str_map_set(M, xs[j], strlen(xs[j]), v);
+        *hattrie_get(T, xs[j], strlen(xs[j])) = v;
+    }
+
+    size_t m = hattrie_size(T);
+    char** keys = malloc(m * sizeof(char*));
+    size_t* lens = malloc(m * sizeof(size_t));
+    value_t* vals = malloc(m * sizeof(value_t));
+
+    const char* key;
+    hattrie_iter_t* i = hattrie_iter_begin(T, true);
+    for (j = 0; !hattrie_iter_finished(i); ++j) {
+        key = hattrie_iter_key(i, &lens[j]);
+        keys[j] = malloc(lens[j]);
+        memcpy(keys[j], key, lens[j]);
+        vals[j] = *hattrie_iter_val(i);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    hattrie_t* U = hattrie_build_sorted((const char**) keys, lens, vals, m);
+
+    hattrie_builder_t* b = hattrie_builder_create();
+    for (j = 0; j < m; ++j) {
+        if (hattrie_builder_add(b, keys[j], lens[j], vals[j]) != 0) {
+            fprintf(stderr, "[error] sorted key rejected by builder\n");
+        }
+    }
+    if (m > 1 && hattrie_builder_add(b, keys[0], lens[0], 0) == 0) {
+        fprintf(stderr, "[error] unsorted key accepted by builder\n");
+    }
+    hattrie_t* W = hattrie_builder_finish(b);
+
+    if (hattrie_size(U) != m || hattrie_size(W) != m) {
+        fprintf(stderr, "[error] built tries have the wrong size (%zu, %zu, %zu)\n",
+                m, hattrie_size(U), hattrie_size(W));
+    }
+
+    value_t* u;
+    value_t* w;
+    for (j = 0; j < m; ++j) {
+        u = hattrie_tryget(U, keys[j], lens[j]);
+        w = hattrie_tryget(W, keys[j], lens[j]);
+        if (u == NULL || w == NULL || *u != vals[j] || *w != vals[j]) {
+            fprintf(stderr, "[error] built trie is missing a key\n");
+        }
+    }
+
+    /* sorted iteration gives back the input */
+    size_t len;
+    i = hattrie_iter_begin(U, true);
+    for (j = 0; !hattrie_iter_finished(i); ++j) {
+        key = hattrie_iter_key(i, &len);
+        if (j >= m || len != lens[j] || memcmp(key, keys[j], len) != 0) {
+            fprintf(stderr, "[error] built trie iterates in the wrong order\n");
+            break;
+        }
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    /* the built trie is updated like any other */
+    for (j = 0; j < m; ++j) *hattrie_get(U, keys[j], lens[j]) += 1;
+    for (j = 0; j < m; ++j) {
+        if (*hattrie_tryget(U, keys[j], lens[j]) != vals[j] + 1) {
+            fprintf(stderr, "[error] built trie was not updated\n");
+        }
+    }
+    if (hattrie_size(U) != m) {
+        fprintf(stderr, "[error] updating built trie changed its size\n");
+    }
+
+    /* out of order keys are rejected */
+    if (m > 1) {
+        const char* swapped[] = { keys[1], keys[0] };
+        size_t swapped_lens[] = { lens[1], lens[0] };
+        if (hattrie_build_sorted(swapped, swapped_lens, NULL, 2) != NULL) {
+            fprintf(stderr, "[error] unsorted keys accepted\n");
+        }
+    }
+
+    for (j = 0; j < m; ++j) free(keys[j]);
+    free(keys);
+    free(lens);
+    free(vals);
+    hattrie_free(U);
+    hattrie_free(W);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_arena()
+{
+    fprintf(stderr, "copying hattrie into an arena ... \n");
+
+    hattrie_arena_t* A = hattrie_arena_create();
+    hattrie_allocator_t alloc = hattrie_arena_allocator(A);
+    hattrie_t* U = hattrie_create_with_allocator(&alloc);
+
+    size_t len, j;
+    const char* key;
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(i);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    /* deleting goes through the arena's free lists */
+    for (j = 0; j < d; ++j) {
+        hattrie_del(T, xs[j], strlen(xs[j]));
+        hattrie_del(U, xs[j], strlen(xs[j]));
+    }
+
+    if (hattrie_size(U) != hattrie_size(T)) {
+        fprintf(stderr, "[error] arena trie has the wrong size (%zu, should be %zu)\n",
+                hattrie_size(U), hattrie_size(T));
+    }
+
+    value_t* u;
+    i = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        u = hattrie_tryget(U, key, len);
+        if (u == NULL || *u != *hattrie_iter_val(i)) {
+            fprintf(stderr, "[error] arena trie is missing a key\n");
+        }
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    /* clearing releases the arena, which is reused afterwards */
+    hattrie_clear(U);
+    for (j = 0; j < d; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = j;
+    for (j = 0; j < d; ++j) {
+        u = hattrie_tryget(U, xs[j], strlen(xs[j]));
+        if (u == NULL) {
+            fprintf(stderr, "[error] key missing after clearing arena trie\n");
+        }
+    }
+
+    fprintf(stderr, "arena sizeof: %zu\n", hattrie_arena_sizeof(A));
+
+    hattrie_free(U);
+    hattrie_arena_free(A);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_opts()
+{
+    fprintf(stderr, "copying hattrie into small buckets ... \n");
+
+    /* tiny buckets that grow, and nodes that turn dense early */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 64;
+    opts.bucket_slots = 8;
+    opts.load_factor  = 2.0;
+    opts.node_fanout  = 3;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    size_t len, ulen;
+    const char* key;
+    const char* ukey;
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    while (!hattrie_iter_finished(i)) {
+        key = hattrie_iter_key(i, &len);
+        *hattrie_get(U, key, len) = *hattrie_iter_val(i);
+        hattrie_iter_next(i);
+    }
+    hattrie_iter_free(i);
+
+    if (hattrie_size(U) != hattrie_size(T)) {
+        fprintf(stderr, "[error] small bucket trie has the wrong size (%zu, should be %zu)\n",
+                hattrie_size(U), hattrie_size(T));
+    }
+
+    /* both tries iterate the same keys in the same order */
+    i = hattrie_iter_begin(T, true);
+    hattrie_iter_t* j = hattrie_iter_begin(U, true);
+    while (!hattrie_iter_finished(i) && !hattrie_iter_finished(j)) {
+        key  = hattrie_iter_key(i, &len);
+        ukey = hattrie_iter_key(j, &ulen);
+        if (len != ulen || memcmp(key, ukey, len) != 0 ||
+            *hattrie_iter_val(i) != *hattrie_iter_val(j)) {
+            fprintf(stderr, "[error] small bucket trie iterates a different key\n");
+            break;
+        }
+        hattrie_iter_next(i);
+        hattrie_iter_next(j);
+    }
+    if (hattrie_iter_finished(i) != hattrie_iter_finished(j)) {
+        fprintf(stderr, "[error] small bucket trie iterates a different number of keys\n");
+    }
+    hattrie_iter_free(i);
+    hattrie_iter_free(j);
+
+    size_t k;
+    for (k = 0; k < d; ++k) hattrie_del(U, ds[k], strlen(ds[k]));
+    for (k = 0; k < d; ++k) {
+        if (hattrie_tryget(U, ds[k], strlen(ds[k])) != NULL) {
+            fprintf(stderr, "[error] deleted key found in small bucket trie\n");
+            break;
+        }
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_hash()
+{
+    fprintf(stderr, "copying hattrie with other hashes ... \n");
+
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 1024;
+
+    hattrie_hash_t hashes[] = { HATTRIE_HASH_WYHASH, HATTRIE_HASH_MURMUR3 };
+    size_t x, j, len;
+    const char* key;
+    value_t* u;
+    hattrie_iter_t* i;
+    for (x = 0; x < 2; ++x) {
+        opts.hash      = hashes[x];
+        opts.hash_seed = 0x9e3779b97f4a7c15ULL * (x + 1);
+        hattrie_t* U = hattrie_create_ex(&opts);
+
+        i = hattrie_iter_begin(T, false);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            *hattrie_get(U, key, len) = *hattrie_iter_val(i);
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        /* the hash and seed survive saving, for lookups in the image and for
+         * buckets created after loading it */
+        FILE* fd = fopen("test.hat", "w");
+        hattrie_save(U, fd);
+        fclose(fd);
+        fd = fopen("test.hat", "r");
+        hattrie_t* L = hattrie_load(fd);
+        fclose(fd);
+        hattrie_t* V = hattrie_mmap_open("test.hat");
+        if (L == NULL || V == NULL) {
+            fprintf(stderr, "[error] could not reopen a trie with another hash\n");
+            hattrie_free(U);
+            hattrie_free(L);
+            hattrie_free(V);
+            continue;
+        }
+
+        if (hattrie_size(L) != hattrie_size(U)) {
+            fprintf(stderr, "[error] loaded trie with another hash has the wrong size\n");
+        }
+        for (j = 0; j < d; ++j) *hattrie_get(L, ds[j], strlen(ds[j])) += 1;
+
+        i = hattrie_iter_begin(T, false);
+        while (!hattrie_iter_finished(i)) {
+            key = hattrie_iter_key(i, &len);
+            u = hattrie_tryget(U, key, len);
+            if (u == NULL || *u != *hattrie_iter_val(i)) {
+                fprintf(stderr, "[error] trie with another hash is missing a key\n");
+            }
+            u = hattrie_tryget(V, key, len);
+            if (u == NULL || *u != *hattrie_iter_val(i)) {
+                fprintf(stderr, "[error] image with another hash is missing a key\n");
+            }
+            hattrie_iter_next(i);
+        }
+        hattrie_iter_free(i);
+
+        for (j = 0; j < d; ++j) {
+            u = hattrie_tryget(L, ds[j], strlen(ds[j]));
+            if (u == NULL || *u == 0) {
+                fprintf(stderr, "[error] loaded trie with another hash is missing a key\n");
+            }
+        }
+
+        hattrie_free(U);
+        hattrie_free(L);
+        hattrie_free(V);
+    }
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_del_coalesce()
+{
+    fprintf(stderr, "deleting everything from a hattrie ... \n");
+
+    /* small buckets, so that there is a deep trie to take apart */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 256;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    size_t empty_size = hattrie_sizeof(U);
+
+    size_t j;
+    for (j = 0; j < n; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = j + 1;
+
+    /* keys ending on trie nodes */
+    for (j = 0; j < n; j += 100) {
+        *hattrie_get(U, xs[j], strlen(xs[j]) / 4 + 1) = j + 1;
+    }
+    size_t full_size = hattrie_sizeof(U);
+
+    /* delete all but the last of the full keys, checking what remains */
+    for (j = 0; j < n; j += 100) hattrie_del(U, xs[j], strlen(xs[j]) / 4 + 1);
+    for (j = 0; j + 1 < n; ++j) {
+        hattrie_del(U, xs[j], strlen(xs[j]));
+        if (j % 1000 == 0) {
+            value_t* u = hattrie_tryget(U, xs[n - 1], strlen(xs[n - 1]));
+            if (u == NULL || *u != n) {
+                fprintf(stderr, "[error] key lost while deleting others\n");
+                break;
+            }
+        }
+    }
+
+    if (hattrie_size(U) != 1) {
+        fprintf(stderr, "[error] wrong size after deleting (%zu, should be 1)\n",
+                hattrie_size(U));
+    }
+
+    fprintf(stderr, "sizeof: %zu full, %zu after deleting, %zu empty\n",
+            full_size, hattrie_sizeof(U), empty_size);
+    if (hattrie_sizeof(U) > 2 * empty_size) {
+        fprintf(stderr, "[error] deleting did not give back memory\n");
+    }
+
+    /* the trie is still usable */
+    for (j = 0; j < n; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = j + 1;
+    for (j = 0; j < n; ++j) {
+        value_t* u = hattrie_tryget(U, xs[j], strlen(xs[j]));
+        if (u == NULL || *u != j + 1) {
+            fprintf(stderr, "[error] key missing after reinserting\n");
+            break;
+        }
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+#ifdef HAVE_PTHREAD_H
+typedef struct reader_arg_t_
+{
+    hattrie_t* U;
+    volatile bool* done;
+    unsigned int seed;
+    size_t lookups;
+    size_t errors;
+} reader_arg_t;
+
+
+/* Look up the first half of xs, which the writer leaves alone, until done. */
+static void* concurrent_reader(void* arg)
+{
+    reader_arg_t* a = arg;
+    hattrie_reader_t* r = hattrie_reader_register(a->U);
+    size_t j, len;
+    value_t* u;
+
+    while (!*a->done) {
+        hattrie_read_lock(r);
+        j = (size_t) rand_r(&a->seed) % (n / 2);
+        u = hattrie_tryget(a->U, xs[j], strlen(xs[j]));
+        if (u == NULL || *u != j + 1) ++a->errors;
+
+        /* now and then, iterate over the bucket holding the key */
+        if (a->lookups % 64 == 0) {
+            len = strlen(xs[j]);
+            hattrie_iter_t* i = hattrie_iter_with_prefix(a->U, false, xs[j], len);
+            bool found = false;
+            while (!hattrie_iter_finished(i)) {
+                hattrie_iter_key(i, &len);
+                if (len == strlen(xs[j])) found = true;
+                hattrie_iter_next(i);
+            }
+            hattrie_iter_free(i);
+            if (!found) ++a->errors;
+        }
+        hattrie_read_unlock(r);
+        ++a->lookups;
+    }
+
+    hattrie_reader_unregister(r);
+    return NULL;
+}
+#endif
+
+
+value_t merge_sum(value_t dst, value_t src, void* ctx)
+{
+    (void) ctx;
+    return dst + src;
+}
+
+
+/* Key j of a merge, random for even j and sharing prefixes for odd j. */
+size_t merge_key(size_t j, char* key)
+{
+    if (j % 2 == 0) {
+        size_t len = strlen(xs[j]);
+        memcpy(key, xs[j], len);
+        return len;
+    }
+    return (size_t) sprintf(key, "http://example.com/%zu/%zu", j % 5, j);
+}
+
+
+/* Merge a trie holding keys [s0, s1) into one holding keys [d0, d1), emptied
+ * first, with values of key j being j + 1 in dst and 2 * (j + 1) in src, and
+ * check the result. */
+void merge_check(const char* name, hattrie_t* dst, size_t d0, size_t d1,
+                 hattrie_t* src, size_t s0, size_t s1, bool sum)
+{
+    char* key = malloc(m_high + 64);
+    size_t j, len, count = 0;
+    hattrie_clear(dst);
+    hattrie_clear(src);
+    for (j = d0; j < d1; ++j) {
+        len = merge_key(j, key);
+        *hattrie_get(dst, key, len) = j + 1;
+    }
+    for (j = s0; j < s1; ++j) {
+        len = merge_key(j, key);
+        *hattrie_get(src, key, len) = 2 * (j + 1);
+    }
+
+    if (hattrie_merge(dst, src, sum ? merge_sum : NULL, NULL) != 0) {
+        fprintf(stderr, "[error] failed to merge %s tries\n", name);
+    }
+
+    value_t* u;
+    value_t  v;
+    for (j = 0; j < n; ++j) {
+        bool in_dst = j >= d0 && j < d1, in_src = j >= s0 && j < s1;
+        if (!in_dst && !in_src) continue;
+        ++count;
+        if (in_src) v = 2 * (j + 1) + (in_dst && sum ? j + 1 : 0);
+        else        v = j + 1;
+
+        len = merge_key(j, key);
+        u = hattrie_tryget(dst, key, len);
+        if (u == NULL || *u != v) {
+            fprintf(stderr, "[error] wrong value of key merging %s tries\n", name);
+            break;
+        }
+    }
+
+    size_t iterated = 0;
+    hattrie_iter_t* i = hattrie_iter_begin(dst, true);
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) ++iterated;
+    hattrie_iter_free(i);
+
+    if (hattrie_size(dst) != count || iterated != count) {
+        fprintf(stderr, "[error] merged %s trie has %zu keys (%zu iterated), should have %zu\n",
+                name, hattrie_size(dst), iterated, count);
+    }
+    if (hattrie_size(src) != 0) {
+        fprintf(stderr, "[error] %s trie merged from is not empty\n", name);
+    }
+
+    free(key);
+}
+
+
+void test_hattrie_merge()
+{
+    fprintf(stderr, "merging hattries ... \n");
+
+    /* small buckets, for deep tries with buckets to merge and subtrees to move */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size = 64;
+
+    hattrie_t* U = hattrie_create_ex(&opts);
+    hattrie_t* V = hattrie_create_ex(&opts);
+    merge_check("overlapping", U, 0, 2 * n / 3, V, n / 3, n, true);
+
+    /* src keys replacing dst's, and moving into an empty trie */
+    merge_check("replacing", U, 0, n / 2, V, n / 4, n, false);
+    hattrie_t* W = hattrie_create_ex(&opts);
+    merge_check("moved", W, 0, 0, U, 0, n, true);
+    hattrie_free(W);
+
+    /* a few keys merged into many, and many into a few */
+    merge_check("small src", U, 0, n, V, n / 2, n / 2 + 100, true);
+    merge_check("small dst", U, n / 2, n / 2 + 100, V, 0, n, true);
+    merge_check("empty src", U, 0, n, V, 0, 0, true);
+
+    /* subtrees of src under characters dst has no or few keys for move over,
+     * and buckets for the same characters may burst */
+    const char* firsts = "abc";
+    const size_t dst_counts[] = { 2000, 50, 50 };
+    const size_t src_counts[] = { 0, 1000, 40 };
+    char key[32];
+    size_t j, x, len, count = 0;
+    value_t* u;
+    value_t expected;
+    hattrie_clear(U);
+    hattrie_clear(V);
+    for (x = 0; x < 3; ++x) {
+        for (j = 0; j < dst_counts[x]; ++j) {
+            len = (size_t) sprintf(key, "%c%zu", firsts[x], j);
+            *hattrie_get(U, key, len) = 1;
+        }
+        for (j = 0; j < src_counts[x]; ++j) {
+            len = (size_t) sprintf(key, "%c%zu", firsts[x], j);
+            *hattrie_get(V, key, len) = 2;
+        }
+    }
+    hattrie_merge(U, V, merge_sum, NULL);
+    for (x = 0; x < 3; ++x) {
+        for (j = 0; j < dst_counts[x] || j < src_counts[x]; ++j) {
+            len = (size_t) sprintf(key, "%c%zu", firsts[x], j);
+            u = hattrie_tryget(U, key, len);
+            expected = (j < dst_counts[x] ? 1 : 0) + (j < src_counts[x] ? 2 : 0);
+            if (u == NULL || *u != expected) {
+                fprintf(stderr, "[error] wrong value merging disjoint tries\n");
+                break;
+            }
+            ++count;
+        }
+    }
+    if (hattrie_size(U) != count) {
+        fprintf(stderr, "[error] merged disjoint trie has %zu keys, should have %zu\n",
+                hattrie_size(U), count);
+    }
+
+    /* buckets merged past the burst size split, down to new trie nodes */
+    hattrie_clear(U);
+    hattrie_clear(V);
+    for (j = 0; j < 50; ++j) {
+        len = (size_t) sprintf(key, "c%zu", j);
+        *hattrie_get(U, key, len) = 1;
+        len = (size_t) sprintf(key, "c%zu", j + 25);
+        *hattrie_get(V, key, len) = 2;
+    }
+    hattrie_merge(U, V, merge_sum, NULL);
+    for (j = 0; j < 75; ++j) {
+        len = (size_t) sprintf(key, "c%zu", j);
+        u = hattrie_tryget(U, key, len);
+        if (u == NULL || *u != (value_t) ((j < 50 ? 1 : 0) + (j >= 25 ? 2 : 0))) {
+            fprintf(stderr, "[error] wrong value merging into a full bucket\n");
+            break;
+        }
+    }
+    hattrie_stats_t stats;
+    hattrie_stats(U, &stats);
+    if (hattrie_size(U) != 75 || stats.max_depth < 2) {
+        fprintf(stderr, "[error] bucket merged past the burst size was not split\n");
+    }
+
+    /* tries with allocators of their own cannot share nodes */
+    hattrie_arena_t* A = hattrie_arena_create();
+    hattrie_arena_t* B = hattrie_arena_create();
+    hattrie_allocator_t alloc_a = hattrie_arena_allocator(A);
+    hattrie_allocator_t alloc_b = hattrie_arena_allocator(B);
+    opts.alloc = &alloc_a;
+    hattrie_t* X = hattrie_create_ex(&opts);
+    opts.alloc = &alloc_b;
+    hattrie_t* Y = hattrie_create_ex(&opts);
+    merge_check("arena", X, 0, 2 * n / 3, Y, n / 3, n, true);
+    hattrie_free(X);
+    hattrie_free(Y);
+    hattrie_arena_free(A);
+    hattrie_arena_free(B);
+
+    /* nor can concurrent tries */
+    opts.alloc      = NULL;
+    opts.concurrent = true;
+    X = hattrie_create_ex(&opts);
+    merge_check("concurrent", X, 0, 2 * n / 3, V, n / 3, n, true);
+    hattrie_free(X);
+
+    /* images cannot be merged into */
+    FILE* fd_w = fopen("test.hat", "w");
+    hattrie_save(U, fd_w);
+    fclose(fd_w);
+    X = hattrie_mmap_open("test.hat");
+    if (hattrie_merge(X, V, NULL, NULL) != -1 || hattrie_merge(U, U, NULL, NULL) != -1) {
+        fprintf(stderr, "[error] merged into an image or a trie into itself\n");
+    }
+    hattrie_free(X);
+
+    hattrie_free(U);
+    hattrie_free(V);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Check that U holds the keys "%zu" of j < d with values j * 2654435761, cut
+ * to its value size, and, if merged, the keys "x%zu" of j < d / 2 with j + 1. */
+void value_size_check(hattrie_t* U, bool merged, const char* name)
+{
+    size_t w = hattrie_value_size(U);
+    value_t mask = w == sizeof(value_t) ? ~(value_t) 0 : ((value_t) 1 << (8 * w)) - 1;
+
+    char key[32];
+    size_t j, len;
+    value_t* u;
+    for (j = 0; j < d + (merged ? d / 2 : 0); ++j) {
+        if (j < d) len = (size_t) sprintf(key, "%zu", j);
+        else       len = (size_t) sprintf(key, "x%zu", j - d);
+        u = hattrie_tryget(U, key, len);
+        if (u == NULL) {
+            fprintf(stderr, "[error] %s trie of %zu byte values is missing %s\n",
+                    name, w, key);
+            return;
+        }
+        if (w > 0 && hattrie_value_load(U, u) !=
+                     ((j < d ? (value_t) j * 2654435761u : j - d + 1) & mask)) {
+            fprintf(stderr, "[error] %s trie of %zu byte values has the wrong value "
+                    "for %s\n", name, w, key);
+            return;
+        }
+    }
+
+    size_t count = 0;
+    hattrie_iter_t* i = hattrie_iter_begin(U, true);
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+        hattrie_iter_key(i, &len);
+        if (len > 0 && hattrie_iter_val(i) == NULL) break;
+        ++count;
+    }
+    hattrie_iter_free(i);
+    if (count != d + (merged ? d / 2 : 0)) {
+        fprintf(stderr, "[error] %s trie of %zu byte values iterates %zu keys\n",
+                name, w, count);
+    }
+}
+
+
+void test_hattrie_value_size()
+{
+    fprintf(stderr, "storing values of fewer bytes ... \n");
+
+    const size_t sizes[] = {HATTRIE_VALUE_SET, 1, 4, 0};
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 256;
+    opts.bucket_slots = 32;
+
+    char key[32];
+    size_t s, j, len, size, prev = 0;
+    value_t* u;
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        opts.value_size = sizes[s];
+        hattrie_t* U = hattrie_create_ex(&opts);
+        hattrie_t* V = hattrie_create_ex(&opts);
+
+        /* short keys, some ending on trie nodes, and the empty key */
+        for (j = 0; j < d; ++j) {
+            len = (size_t) sprintf(key, "%zu", j);
+            hattrie_value_store(U, hattrie_get(U, key, len), (value_t) j * 2654435761u);
+        }
+        hattrie_value_store(U, hattrie_get(U, "", 0), 1);
+        size = hattrie_sizeof(U);
+        fprintf(stderr, "%zu byte values: sizeof %zu\n", hattrie_value_size(U), size);
+        if (size <= prev) {
+            fprintf(stderr, "[error] trie of %zu byte values is not larger than the "
+                    "one before\n", hattrie_value_size(U));
+        }
+        prev = size;
+        value_size_check(U, false, "filled");
+
+        /* deleting and reinserting keys moves values between buckets and nodes */
+        for (j = 0; j < d; j += 2) {
+            len = (size_t) sprintf(key, "%zu", j);
+            hattrie_del(U, key, len);
+        }
+        for (j = 0; j < d; j += 2) {
+            len = (size_t) sprintf(key, "%zu", j);
+            hattrie_value_store(U, hattrie_get(U, key, len), (value_t) j * 2654435761u);
+        }
+        value_size_check(U, false, "refilled");
+
+        for (j = 0; j < d / 2; ++j) {
+            len = (size_t) sprintf(key, "x%zu", j);
+            hattrie_value_store(V, hattrie_get(V, key, len), j);
+        }
+        hattrie_value_store(V, hattrie_get(V, "", 0), 1);
+        hattrie_merge(U, V, NULL, NULL);
+        for (j = 0; j < d / 2; ++j) {
+            len = (size_t) sprintf(key, "x%zu", j);
+            u = hattrie_get(U, key, len);
+            hattrie_value_store(U, u, hattrie_value_load(U, u) + 1);
+        }
+        value_size_check(U, true, "merged");
+
+        /* images keep the value size */
+        FILE* fd_w = fopen("test.hat", "w");
+        hattrie_save(U, fd_w);
+        fclose(fd_w);
+        hattrie_t* X = hattrie_mmap_open("test.hat");
+        FILE* fd_r = fopen("test.hat", "r");
+        hattrie_t* Y = hattrie_load(fd_r);
+        fclose(fd_r);
+        if (X == NULL || Y == NULL || hattrie_value_size(X) != hattrie_value_size(U) ||
+            hattrie_value_size(Y) != hattrie_value_size(U)) {
+            fprintf(stderr, "[error] failed to load trie of %zu byte values\n",
+                    hattrie_value_size(U));
+        }
+        else {
+            value_size_check(X, true, "mapped");
+            value_size_check(Y, true, "loaded");
+        }
+        hattrie_free(X);
+        hattrie_free(Y);
+
+        if (hattrie_freeze(U) != 0) {
+            fprintf(stderr, "[error] failed to freeze trie of %zu byte values\n",
+                    hattrie_value_size(U));
+        }
+        value_size_check(U, true, "frozen");
+
+        hattrie_free(U);
+        hattrie_free(V);
+    }
+
+    /* tries of different value sizes merge key by key, truncating values */
+    opts.value_size = 1;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    hattrie_t* V = hattrie_create();
+    hattrie_value_store(U, hattrie_get(U, "a", 1), 1);
+    *hattrie_get(V, "a", 1) = 0x102;
+    *hattrie_get(V, "b", 1) = 0x203;
+    hattrie_merge(U, V, merge_sum, NULL);
+    if (hattrie_value_load(U, hattrie_tryget(U, "a", 1)) != 3 ||
+        hattrie_value_load(U, hattrie_tryget(U, "b", 1)) != 3) {
+        fprintf(stderr, "[error] wrong values merging into a trie of 1 byte values\n");
+    }
+    hattrie_free(U);
+    hattrie_free(V);
+
+    opts.value_size = sizeof(value_t) + 1;
+    if (hattrie_create_ex(&opts) != NULL) {
+        fprintf(stderr, "[error] created a trie of too large values\n");
+    }
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Look the first m keys of xs up in U, with its cache, and X, without,
+ * checking they agree. */
+static void cache_check(hattrie_t* U, hattrie_t* X, size_t m, const char* name)
+{
+    size_t i;
+    value_t *u, *x;
+    for (i = 0; i < m; ++i) {
+        u = hattrie_tryget(U, xs[i], strlen(xs[i]));
+        x = hattrie_tryget(X, xs[i], strlen(xs[i]));
+        if ((u == NULL) != (x == NULL) || (u && *u != *x)) {
+            fprintf(stderr, "[error] %s: cached lookup of key %zu disagrees\n", name, i);
+            return;
+        }
+    }
+}
+
+
+void test_hattrie_cache()
+{
+    fprintf(stderr, "caching lookups ... \n");
+
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 256;
+    opts.bucket_slots = 32;
+    opts.cache_keys   = 1000;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    opts.cache_keys   = 0;
+    hattrie_t* X = hattrie_create_ex(&opts);
+
+    const size_t m = 20000;
+    size_t i, j;
+    for (i = 0; i < m; ++i) {
+        *hattrie_get(U, xs[i], strlen(xs[i])) = i;
+        *hattrie_get(X, xs[i], strlen(xs[i])) = i;
+    }
+
+    /* a few keys looked up over and over hit; values written through cached
+     * pointers are seen */
+    hattrie_stats_t stats;
+    for (j = 0; j < 100; ++j) {
+        for (i = 0; i < 50; ++i) ++*hattrie_tryget(U, xs[i], strlen(xs[i]));
+    }
+    hattrie_stats(U, &stats);
+    if (stats.cache_hits < 4900 || stats.cache_hits + stats.cache_misses != 5000) {
+        fprintf(stderr, "[error] %zu hits and %zu misses looking 50 keys up 100 "
+                "times\n", stats.cache_hits, stats.cache_misses);
+    }
+    for (i = 0; i < 50; ++i) *hattrie_get(X, xs[i], strlen(xs[i])) += 100;
+    cache_check(U, X, m, "repeated");
+
+    /* inserting a key forgets only the keys of its bucket, so most of the few
+     * looked up keep hitting */
+    size_t hits = stats.cache_hits;
+    for (j = 0; j < 50; ++j) {
+        *hattrie_get(U, xs[m + j], strlen(xs[m + j])) = m + j;
+        hattrie_del(U, xs[m + j], strlen(xs[m + j]));
+        for (i = 0; i < 50; ++i) hattrie_tryget(U, xs[i], strlen(xs[i]));
+    }
+    hattrie_stats(U, &stats);
+    if (stats.cache_hits - hits < 2000) {
+        fprintf(stderr, "[error] %zu of 2500 lookups hit the cache between "
+                "writes\n", stats.cache_hits - hits);
+    }
+
+    /* deleting moves the entries after a key in its slot, and inserting
+     * splits buckets, moving everything in them */
+    for (i = 0; i < m; i += 3) {
+        hattrie_del(U, xs[i], strlen(xs[i]));
+        hattrie_del(X, xs[i], strlen(xs[i]));
+        if (hattrie_tryget(U, xs[i], strlen(xs[i])) != NULL) {
+            fprintf(stderr, "[error] deleted key %zu still cached\n", i);
+            break;
+        }
+    }
+    cache_check(U, X, m, "deleted");
+    for (i = m; i < 2 * m; ++i) {
+        *hattrie_get(U, xs[i], strlen(xs[i])) = i;
+        *hattrie_get(X, xs[i], strlen(xs[i])) = i;
+        if (i % 16 == 0) cache_check(U, X, 64, "inserting");
+    }
+    cache_check(U, X, 2 * m, "inserted");
+
+    /* the empty key lives in the root */
+    *hattrie_get(U, "", 0) = 7;
+    if (hattrie_tryget(U, "", 0) == NULL || *hattrie_tryget(U, "", 0) != 7) {
+        fprintf(stderr, "[error] cached empty key lost\n");
+    }
+    hattrie_del(U, "", 0);
+    *hattrie_get(X, "", 0) = 7;
+    hattrie_del(X, "", 0);
+    cache_check(U, X, 2 * m, "empty key");
+
+    /* frozen tries keep their cache, and images may be given one */
+    hattrie_freeze(U);
+    hattrie_freeze(X);
+    cache_check(U, X, 2 * m, "frozen");
+    cache_check(U, X, 2 * m, "frozen, warm");
+
+    FILE* fd = fopen("test.hat", "w");
+    hattrie_save(X, fd);
+    fclose(fd);
+    hattrie_t* W = hattrie_mmap_open("test.hat");
+    if (W == NULL) {
+        fprintf(stderr, "[error] could not map the saved trie\n");
+    }
+    else {
+        if (hattrie_set_cache(W, 64) != 0) {
+            fprintf(stderr, "[error] could not give a mapped trie a cache\n");
+        }
+        cache_check(W, X, 2 * m, "mapped");
+        cache_check(W, X, 16, "mapped, warm");
+        cache_check(W, X, 16, "mapped, warm");
+        hattrie_stats(W, &stats);
+        if (stats.cache_hits == 0) {
+            fprintf(stderr, "[error] mapped trie never hit its cache\n");
+        }
+        hattrie_free(W);
+    }
+    remove("test.hat");
+
+    /* removing the cache, and concurrent tries have none */
+    hattrie_set_cache(U, 0);
+    cache_check(U, X, 2 * m, "uncached");
+    hattrie_stats(U, &stats);
+    if (stats.cache_hits != 0 || stats.cache_misses != 0) {
+        fprintf(stderr, "[error] trie without a cache counts lookups\n");
+    }
+
+    opts.concurrent = true;
+    hattrie_t* C = hattrie_create_ex(&opts);
+    if (hattrie_set_cache(C, 64) != -1) {
+        fprintf(stderr, "[error] concurrent trie accepted a cache\n");
+    }
+    hattrie_free(C);
+
+    hattrie_free(U);
+    hattrie_free(X);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+/* Check the counting queries of U against the keys of X, in sorted order, for
+ * probes around some of the keys. A trie without counts walks the subtrees
+ * it counts, so few probes are asked of it. */
+static void counts_check(hattrie_t* U, hattrie_t* X, size_t probes, const char* name)
+{
+    hattrie_finish_moves(U);
+
+    size_t m = hattrie_size(X), j, r, len, klen, expected;
+    char** keys = malloc(m * sizeof(char*));
+    size_t* lens = malloc(m * sizeof(size_t));
+    const char* key;
+    hattrie_iter_t* i = hattrie_iter_begin(X, true);
+    for (j = 0; j < m && !hattrie_iter_finished(i); ++j, hattrie_iter_next(i)) {
+        key = hattrie_iter_key(i, &lens[j]);
+        keys[j] = malloc(lens[j] + 2);
+        memcpy(keys[j], key, lens[j]);
+    }
+    hattrie_iter_free(i);
+
+    if (hattrie_size(U) != m || hattrie_count_prefix(U, "", 0) != m) {
+        fprintf(stderr, "[error] %s: %zu keys, %zu counted, expected %zu\n", name,
+                hattrie_size(U), hattrie_count_prefix(U, "", 0), m);
+    }
+
+    /* each key, a longer one, and its prefixes */
+    char* probe;
+    size_t p;
+    for (p = 0; p < probes && m > 0; ++p) {
+        r = (p * 7919) % m;
+        probe = keys[r];
+        probe[lens[r]] = '!';
+        for (len = lens[r] + 1; ; len = len > 3 ? len / 2 : len - 1) {
+            expected = lower_bound(keys, lens, m, probe, len);
+            if (hattrie_rank(U, probe, len) != expected) {
+                fprintf(stderr, "[error] %s: rank %zu of a key of %zu bytes, "
+                        "expected %zu\n", name, hattrie_rank(U, probe, len), len,
+                        expected);
+            }
+            for (j = expected; j < m && lens[j] >= len &&
+                               memcmp(keys[j], probe, len) == 0; ++j);
+            if (hattrie_count_prefix(U, probe, len) != j - expected) {
+                fprintf(stderr, "[error] %s: %zu keys with a prefix of %zu bytes, "
+                        "expected %zu\n", name, hattrie_count_prefix(U, probe, len),
+                        len, j - expected);
+            }
+            if (len == 0) break;
+        }
+
+        i = hattrie_select(U, r);
+        key = i ? hattrie_iter_key(i, &klen) : NULL;
+        if (key == NULL || klen != lens[r] || memcmp(key, keys[r], klen) != 0) {
+            fprintf(stderr, "[error] %s: wrong key of rank %zu\n", name, r);
+        }
+        else {
+            hattrie_iter_next(i);
+            key = hattrie_iter_key(i, &klen);
+            if (r + 1 < m && (key == NULL || klen != lens[r + 1] ||
+                              memcmp(key, keys[r + 1], klen) != 0)) {
+                fprintf(stderr, "[error] %s: wrong key after rank %zu\n", name, r);
+            }
+        }
+        hattrie_iter_free(i);
+    }
+    if (hattrie_select(U, m) != NULL) {
+        fprintf(stderr, "[error] %s: selected a key past the last\n", name);
+    }
+
+    for (j = 0; j < m; ++j) free(keys[j]);
+    free(keys);
+    free(lens);
+}
+
+
+void test_hattrie_counts()
+{
+    fprintf(stderr, "counting and ranking keys ... \n");
+
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 256;
+    opts.bucket_slots = 32;
+    hattrie_t* X = hattrie_create_ex(&opts);
+    opts.counts = true;
+    hattrie_t* U = hattrie_create_ex(&opts);
+    opts.incremental_step = 16;
+    hattrie_t* V = hattrie_create_ex(&opts);
+
+    /* short keys splitting buckets into deep tries and ending on trie nodes,
+     * and long ones */
+    char key[32];
+    size_t j, len;
+    for (j = 0; j < d; ++j) {
+        len = (size_t) sprintf(key, "%zu", j * 7);
+        hattrie_get(X, key, len);
+        hattrie_get(U, key, len);
+        hattrie_get(V, key, len);
+    }
+    for (j = 0; j < 5000; ++j) {
+        hattrie_get(X, xs[j], strlen(xs[j]));
+        hattrie_get(U, xs[j], strlen(xs[j]));
+        hattrie_get(V, xs[j], strlen(xs[j]));
+    }
+    counts_check(U, X, 2000, "inserted");
+    counts_check(V, X, 2000, "inserted incrementally");
+    counts_check(X, X, 100, "without counts");
+
+    /* deleting merges buckets and folds trie nodes */
+    for (j = 0; j < d; j += 3) {
+        len = (size_t) sprintf(key, "%zu", j * 7);
+        hattrie_del(X, key, len);
+        hattrie_del(U, key, len);
+        hattrie_del(V, key, len);
+    }
+    counts_check(U, X, 2000, "deleted");
+    counts_check(V, X, 2000, "deleted incrementally");
+
+    /* merging recounts the result */
+    hattrie_t* W = hattrie_create_ex(&opts);
+    for (j = 0; j < d / 2; ++j) {
+        len = (size_t) sprintf(key, "%zu", j * 5);
+        hattrie_get(X, key, len);
+        hattrie_get(W, key, len);
+    }
+    hattrie_merge(U, W, NULL, NULL);
+    counts_check(U, X, 2000, "merged");
+
+    /* images have no counts */
+    hattrie_freeze(U);
+    counts_check(U, X, 100, "frozen");
+
+    hattrie_free(U);
+    hattrie_free(V);
+    hattrie_free(W);
+    hattrie_free(X);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_hattrie_concurrent()
+{
+#ifdef HAVE_PTHREAD_H
+    fprintf(stderr, "reading a hattrie while modifying it ... \n");
+
+    /* small buckets with few slots, so that they are split, grown, shrunk and
+     * merged while being read */
+    hattrie_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.burst_size   = 256;
+    opts.bucket_slots = 16;
+    opts.load_factor  = 4.0;
+    opts.concurrent   = true;
+    hattrie_t* U = hattrie_create_ex(&opts);
+
+    size_t j;
+    for (j = 0; j < n / 2; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = j + 1;
+
+    const size_t num_readers = 4;
+    pthread_t threads[num_readers];
+    reader_arg_t args[num_readers];
+    volatile bool done = false;
+    size_t t;
+    for (t = 0; t < num_readers; ++t) {
+        args[t].U       = U;
+        args[t].done    = &done;
+        args[t].seed    = (unsigned int) t + 1;
+        args[t].lookups = 0;
+        args[t].errors  = 0;
+        pthread_create(&threads[t], NULL, concurrent_reader, &args[t]);
+    }
+
+    /* insert and delete the other half, and prefixes of the first half ending
+     * on trie nodes */
+    size_t round;
+    for (round = 0; round < 3; ++round) {
+        for (j = n / 2; j < n; ++j) *hattrie_get(U, xs[j], strlen(xs[j])) = j + 1;
+        for (j = 0; j < n / 2; j += 100) {
+            *hattrie_get(U, xs[j], strlen(xs[j]) / 4 + 1) = 1;
+        }
+        for (j = n / 2; j < n; ++j) hattrie_del(U, xs[j], strlen(xs[j]));
+        for (j = 0; j < n / 2; j += 100) hattrie_del(U, xs[j], strlen(xs[j]) / 4 + 1);
+    }
+
+    done = true;
+    size_t lookups = 0, errors = 0;
+    for (t = 0; t < num_readers; ++t) {
+        pthread_join(threads[t], NULL);
+        lookups += args[t].lookups;
+        errors  += args[t].errors;
+    }
+    hattrie_synchronize(U);
+
+    fprintf(stderr, "%zu lookups.\n", lookups);
+    if (errors) {
+        fprintf(stderr, "[error] %zu lookups failed while the trie was modified\n",
+                errors);
+    }
+
+    if (hattrie_size(U) != n / 2) {
+        fprintf(stderr, "[error] wrong size after modifying (%zu)\n", hattrie_size(U));
+    }
+
+    for (j = 0; j < n / 2; ++j) {
+        value_t* u = hattrie_tryget(U, xs[j], strlen(xs[j]));
+        if (u == NULL || *u != j + 1) {
+            fprintf(stderr, "[error] key missing after modifying\n");
+            break;
+        }
+    }
+
+    if (hattrie_reader_register(T) != NULL) {
+        fprintf(stderr, "[error] registered a reader of a trie that is not concurrent\n");
+    }
+
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+#endif
+}
+
+
+#ifdef HAVE_PTHREAD_H
+typedef struct producer_arg_t_
+{
+    hattrie_sharded_t* S;
+    size_t start;
+} producer_arg_t;
+
+
+/* Count every key once, starting at a different one in each thread. */
+static void* sharded_producer(void* arg)
+{
+    producer_arg_t* a = arg;
+    size_t j, x;
+    for (j = 0; j < n; ++j) {
+        x = (a->start + j) % n;
+        hattrie_sharded_add(a->S, xs[x], strlen(xs[x]), 1);
+    }
+    return NULL;
+}
+#endif
+
+
+void test_hattrie_sharded()
+{
+    fprintf(stderr, "counting keys in a sharded hattrie ... \n");
+
+    const size_t num_producers = 4;
+    hattrie_sharded_t* S = hattrie_sharded_create(16, NULL);
+    size_t j, t;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_t threads[num_producers];
+    producer_arg_t args[num_producers];
+    for (t = 0; t < num_producers; ++t) {
+        args[t].S     = S;
+        args[t].start = t * (n / num_producers);
+        pthread_create(&threads[t], NULL, sharded_producer, &args[t]);
+    }
+    for (t = 0; t < num_producers; ++t) pthread_join(threads[t], NULL);
+#else
+    for (t = 0; t < num_producers; ++t) {
+        for (j = 0; j < n; ++j) hattrie_sharded_add(S, xs[j], strlen(xs[j]), 1);
+    }
+#endif
+    if (hattrie_sharded_size(S) != n) {
+        fprintf(stderr, "[error] wrong size of sharded trie (%zu, should be %zu)\n",
+                hattrie_sharded_size(S), n);
+    }
+
+    value_t v;
+    for (j = 0; j < n; ++j) {
+        if (!hattrie_sharded_tryget(S, xs[j], strlen(xs[j]), &v) || v != num_producers) {
+            fprintf(stderr, "[error] wrong count in sharded trie\n");
+            break;
+        }
+    }
+
+    /* sorted iteration merges the shards */
+    hattrie_sharded_iter_t* i = hattrie_sharded_iter_begin(S, true);
+    char*  prev = NULL;
+    size_t prev_len = 0, count = 0, len;
+    const char* key;
+    while (!hattrie_sharded_iter_finished(i)) {
+        key = hattrie_sharded_iter_key(i, &len);
+        if (*hattrie_sharded_iter_val(i) != num_producers) {
+            fprintf(stderr, "[error] wrong value iterating over sharded trie\n");
+            break;
+        }
+        if (prev) {
+            int c = memcmp(prev, key, len < prev_len ? len : prev_len);
+            if (c > 0 || (c == 0 && prev_len >= len)) {
+                fprintf(stderr, "[error] sharded iteration out of order\n");
+                break;
+            }
+        }
+        prev = realloc(prev, len + 1);
+        memcpy(prev, key, len);
+        prev_len = len;
+        ++count;
+        hattrie_sharded_iter_next(i);
+    }
+    hattrie_sharded_iter_free(i);
+    free(prev);
+
+    if (count != n) {
+        fprintf(stderr, "[error] sharded iteration visited %zu keys, should be %zu\n",
+                count, n);
+    }
+
+    size_t size = 0;
+    for (t = 0; t < hattrie_sharded_count(S); ++t) {
+        size += hattrie_sizeof(hattrie_sharded_trie(S, t));
+    }
+    if (hattrie_sharded_sizeof(S) < size) {
+        fprintf(stderr, "[error] sharded sizeof less than that of its shards\n");
+    }
+
+    hattrie_sharded_set(S, xs[0], strlen(xs[0]), 1);
+    for (j = 1; j < n; ++j) hattrie_sharded_del(S, xs[j], strlen(xs[j]));
+    if (hattrie_sharded_size(S) != 1) {
+        fprintf(stderr, "[error] wrong size of sharded trie after deleting\n");
+    }
+
+    hattrie_sharded_free(S);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_trie_node_keys()
+{
+    fprintf(stderr, "checking keys ending on trie nodes... \n");
+
+    /* enough keys under "ab\0" to burst buckets for 'a', 'b' and '\0' */
+    hattrie_t* T = hattrie_create();
+    char key[16] = "ab";
+    size_t i;
+    for (i = 0; i < 100000; ++i) {
+        sprintf(key + 3, "%zu", i);
+        *hattrie_get(T, key, 3 + strlen(key + 3)) = 1;
+    }
+    *hattrie_get(T, key, 3) = 3;
+
+    value_t* u = hattrie_get(T, key, 2);
+    if (*u != 0) {
+        fprintf(stderr, "[error] new key ending on a trie node has a value\n");
+    }
+    *u = 2;
+
+    u = hattrie_tryget(T, key, 3);
+    if (u == NULL || *u != 3) {
+        fprintf(stderr, "[error] wrong value for key ending on a trie node\n");
+    }
+    u = hattrie_tryget(T, key, 2);
+    if (u == NULL || *u != 2) {
+        fprintf(stderr, "[error] wrong value for key ending on a trie node\n");
+    }
+    if (hattrie_size(T) != 100002) {
+        fprintf(stderr, "[error] wrong size with keys ending on trie nodes\n");
+    }
+    hattrie_free(T);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_trie_dense_nodes()
+{
+    fprintf(stderr, "checking tries with dense nodes... \n");
+
+    /* spread binary keys over enough buckets to fill the root */
+    const size_t count = 3000000;
+    hattrie_t* T = hattrie_create();
+    unsigned char key[8];
+    size_t i, j;
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < sizeof(key); ++j) key[j] = (unsigned char) (i >> (8 * j));
+        key[0] = (unsigned char) (i * 167);
+        *hattrie_get(T, (char*) key, sizeof(key)) = i + 1;
+    }
+
+    FILE* fd = fopen("test.hat", "w");
+    hattrie_save(T, fd);
+    fclose(fd);
+    fd = fopen("test.hat", "r");
+    hattrie_t* U = hattrie_load(fd);
+    fclose(fd);
+
+    value_t* u;
+    value_t* v;
+    for (i = 0; i < count; ++i) {
+        for (j = 0; j < sizeof(key); ++j) key[j] = (unsigned char) (i >> (8 * j));
+        key[0] = (unsigned char) (i * 167);
+        u = hattrie_tryget(T, (char*) key, sizeof(key));
+        v = U ? hattrie_tryget(U, (char*) key, sizeof(key)) : NULL;
+        if (u == NULL || v == NULL || *u != i + 1 || *v != i + 1) {
+            fprintf(stderr, "[error] key missing from trie with dense nodes\n");
+            break;
+        }
+    }
+
+    if (U == NULL || hattrie_size(U) != count) {
+        fprintf(stderr, "[error] loaded trie has the wrong size\n");
+    }
+
+    hattrie_free(T);
+    hattrie_free(U);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+void test_trie_non_ascii()
+{
+    fprintf(stderr, "checking non-ascii... \n");
+
+    value_t* u;
+    hattrie_t* T = hattrie_create();
+    char* txt = "\x81\x70";
+
+    u = hattrie_get(T, txt, strlen(txt));
+    *u = 10;
+
+    u = hattrie_tryget(T, txt, strlen(txt));
+    if (*u != 10){
+        fprintf(stderr, "can't store non-ascii strings\n");
+    }
+    hattrie_free(T);
+
+    fprintf(stderr, "done.\n");
+}
+
+
+
+
+int main()
+{
+    test_trie_non_ascii();
+    test_trie_node_keys();
+    test_trie_dense_nodes();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_iteration();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_sorted_iteration();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_key_parts();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_iter_split();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_save_load();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_freeze();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_prefix_iteration();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_iter_reset();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_batch();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_seek();
+    teardown();
+
+    setup();
+    test_hattrie_path_compression();
+    teardown();
+
+    setup();
+    test_hattrie_upsert();
+    teardown();
+
+    setup();
+    test_hattrie_longest_prefix();
+    teardown();
+
+    setup();
+    test_hattrie_stats();
+    teardown();
+
+    setup();
+    test_hattrie_incremental();
+    teardown();
+
+    setup();
+    test_hattrie_incremental_pending();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_build_sorted();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_arena();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_opts();
+    teardown();
+
+    setup();
+    test_hattrie_insert();
+    test_hattrie_hash();
+    teardown();
+
+    setup();
+    test_hattrie_del_coalesce();
+    teardown();
+
+    setup();
+    test_hattrie_merge();
+    teardown();
+
+    setup();
+    test_hattrie_value_size();
+    teardown();
+
+    setup();
+    test_hattrie_cache();
+    teardown();
+
+    setup();
+    test_hattrie_counts();
+    teardown();
+
+    setup();
+    test_hattrie_concurrent();
+    teardown();
+
+    setup();
+    test_hattrie_sharded();
     teardown();
 
     return 0;